@@ -1,10 +1,15 @@
 #include "cloud.h"
 
+#include <algorithm>
 #include <fstream>
 #include <memory>
 #include <stack>
 #include <thread>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "bvh.h"
 #include "cloud/manager.h"
 #include "cloud/pimage.h"
@@ -14,6 +19,7 @@
 #include "imageio.h"
 #include "lights/diffuse.h"
 #include "materials/matte.h"
+#include "messages/blocked.h"
 #include "messages/compressed.h"
 #include "messages/lite.h"
 #include "messages/serdes.h"
@@ -32,6 +38,11 @@ static auto &_manager = global::manager;
 STAT_COUNTER("BVH/Total nodes", nNodes);
 STAT_COUNTER("BVH/Visited nodes", nNodesVisited);
 STAT_COUNTER("BVH/Visited primitives", nPrimitivesVisited);
+STAT_COUNTER("BVH/Treelet cache hits", nTreeletCacheHits);
+STAT_COUNTER("BVH/Treelet cache misses", nTreeletCacheMisses);
+STAT_COUNTER("BVH/Treelet cache evictions", nTreeletCacheEvictions);
+STAT_COUNTER("BVH/Treelets prefetched", nTreeletsPrefetched);
+STAT_MEMORY_COUNTER("Memory/Treelet cache", treeletCacheBytes);
 
 struct membuf : streambuf {
     membuf(char *begin, char *end) { this->setg(begin, begin, end); }
@@ -114,6 +125,18 @@ CloudBVH::CloudBVH(const uint32_t bvh_root, const bool preload_all,
 }
 
 CloudBVH::~CloudBVH() {
+    for (auto &kv : hit_pins_) {
+        for (const uint32_t root_id : kv.second) unpinTreelet(root_id);
+    }
+
+    {
+        unique_lock<mutex> lock{cache_mutex_};
+        prefetch_stop_ = true;
+    }
+
+    prefetch_cv_.notify_all();
+    for (auto &t : prefetch_threads_) t.join();
+
     ParallelFor([&](int64_t treelet_id) { treelets_[treelet_id] = nullptr; },
                 treelets_.size());
 }
@@ -131,16 +154,282 @@ const Material *CloudBVH::GetMaterial(const uint32_t material_id) const {
     return treelets_.at(bvh_root_)->included_material.at(material_id).get();
 }
 
+const Material *CloudBVH::GetMaterial(const MaterialKey &key) const {
+    checkIfTreeletIsLoaded(key.treelet);
+    return treelets_[key.treelet]->included_material.at(key.id).get();
+}
+
+void CloudBVH::SetCacheBudget(const size_t bytes) {
+    if (preloading_done_) {
+        throw runtime_error("a preloaded CloudBVH has no treelet cache");
+    }
+
+    unique_lock<mutex> lock{cache_mutex_};
+
+    /* the table of treelets doesn't change size from now on, so it can be
+     * read without holding the lock */
+    if (treelets_.size() < _manager.treeletCount()) {
+        treelets_.resize(_manager.treeletCount());
+    }
+
+    cache_entries_.resize(treelets_.size());
+    cache_budget_ = bytes;
+
+    /* with a cache, treelets are loaded off the lock, so their textures
+     * and image partitions are added while other threads read them */
+    _manager.setSyncTextureReads(true);
+
+    /* the treelets that were loaded beforehand are now cached too */
+    for (size_t i = 0; i < treelets_.size(); i++) {
+        auto &entry = cache_entries_[i];
+        if (not treelets_[i] or entry.cached) continue;
+
+        cache_lru_.push_front(i);
+        entry.lru_position = cache_lru_.begin();
+        entry.cached = true;
+        cache_footprint_ += treelets_[i]->footprint;
+        treeletCacheBytes += treelets_[i]->footprint;
+    }
+
+    evictTreelets();
+}
+
+void CloudBVH::SetPrefetchThreads(const size_t count) {
+    if (not cache_budget_) {
+        throw runtime_error("prefetching needs a treelet cache budget");
+    }
+
+    if (not prefetch_threads_.empty()) {
+        throw runtime_error("the prefetch threads are already running");
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        prefetch_threads_.emplace_back(&CloudBVH::prefetchWorker, this);
+    }
+}
+
+void CloudBVH::Prefetch(const uint32_t root_id) const {
+    if (prefetch_threads_.empty()) return;
+
+    {
+        unique_lock<mutex> lock{cache_mutex_};
+
+        if (root_id >= treelets_.size() or treelets_[root_id]) return;
+
+        auto &entry = cache_entries_[root_id];
+        if (entry.loading or entry.queued) return;
+
+        /* hints that can't be served soon are dropped, rather than have the
+         * queue fall further and further behind the rays */
+        if (prefetch_queue_.size() >= 4 * prefetch_threads_.size()) return;
+
+        entry.queued = true;
+        prefetch_queue_.push_back(root_id);
+    }
+
+    prefetch_cv_.notify_one();
+}
+
+void CloudBVH::prefetchWorker() {
+    unique_lock<mutex> lock{cache_mutex_};
+
+    while (true) {
+        prefetch_cv_.wait(lock, [this] {
+            return prefetch_stop_ or not prefetch_queue_.empty();
+        });
+
+        if (prefetch_stop_) return;
+
+        const uint32_t root_id = prefetch_queue_.front();
+        prefetch_queue_.pop_front();
+        cache_entries_[root_id].queued = false;
+
+        if (treelets_[root_id] or cache_entries_[root_id].loading) continue;
+
+        /* a failed prefetch is not fatal; the ray that needs the treelet
+         * will try again and report the error */
+        try {
+            loadCachedTreelet(root_id, nullptr, 0, lock);
+            nTreeletsPrefetched++;
+            evictTreelets();
+        } catch (const exception &e) {
+            LOG(WARNING) << "Prefetching treelet " << root_id
+                         << " failed: " << e.what();
+        }
+    }
+}
+
+size_t CloudBVH::CacheFootprint() const {
+    unique_lock<mutex> lock{cache_mutex_};
+    return cache_footprint_;
+}
+
+bool CloudBVH::IsLoaded(const uint32_t root_id) const {
+    unique_lock<mutex> lock{cache_mutex_};
+    return preloading_done_ or
+           (root_id < treelets_.size() and treelets_[root_id] != nullptr);
+}
+
+void CloudBVH::loadCachedTreelet(const uint32_t root_id, const char *buffer,
+                                 const size_t length,
+                                 unique_lock<mutex> &lock) {
+    if (root_id >= treelets_.size()) {
+        throw runtime_error("treelet " + to_string(root_id) +
+                            " is out of range");
+    }
+
+    auto &entry = cache_entries_[root_id];
+
+    /* if another thread is already loading the treelet, wait for it */
+    while (not treelets_[root_id] and entry.loading) {
+        cache_cv_.wait(lock);
+    }
+
+    if (treelets_[root_id]) {
+        cache_lru_.splice(cache_lru_.begin(), cache_lru_, entry.lru_position);
+        return;
+    }
+
+    /* reading and decoding the treelet is the slow part, and it's done
+     * without the lock, so that the other threads can keep tracing rays
+     * through the treelets that are already loaded */
+    entry.loading = true;
+    lock.unlock();
+
+    unique_ptr<Treelet> treelet;
+
+    try {
+        treelet = readTreelet(root_id, buffer, length);
+    } catch (...) {
+        lock.lock();
+        entry.loading = false;
+        cache_cv_.notify_all();
+        throw;
+    }
+
+    lock.lock();
+    treelets_[root_id] = move(treelet);
+    setupTreelet(root_id);
+    entry.loading = false;
+    cache_cv_.notify_all();
+
+    cache_lru_.push_front(root_id);
+    entry.lru_position = cache_lru_.begin();
+    entry.cached = true;
+    cache_footprint_ += treelets_[root_id]->footprint;
+    treeletCacheBytes += treelets_[root_id]->footprint;
+}
+
+void CloudBVH::evictTreelets() {
+    /* starting from the least recently used treelet */
+    auto it = cache_lru_.end();
+
+    while (cache_footprint_ > cache_budget_ and it != cache_lru_.begin()) {
+        --it;
+
+        const uint32_t root_id = *it;
+        auto &entry = cache_entries_[root_id];
+        if (entry.pins) continue;
+
+        const size_t footprint = treelets_[root_id]->footprint;
+        cache_footprint_ -= footprint;
+        treeletCacheBytes -= footprint;
+        nTreeletCacheEvictions++;
+
+        LOG(INFO) << "Evicting treelet " << root_id << " from the cache";
+
+        /* the manager's copies of the treelet's partitions and textures
+         * hold on to its memory (or its mapping) too */
+        const auto &treelet = *treelets_[root_id];
+        for (const auto pid : treelet.image_partitions) {
+            _manager.removeInMemoryImagePartition(root_id, pid);
+        }
+
+        for (const auto &path : treelet.textures) {
+            _manager.removeInMemoryTexture(root_id, path);
+        }
+
+        treelets_[root_id] = nullptr;
+        entry.cached = false;
+        it = cache_lru_.erase(it);
+    }
+}
+
+const CloudBVH::Treelet &CloudBVH::pinTreelet(const uint32_t root_id) const {
+    if (not cache_budget_) {
+        checkIfTreeletIsLoaded(root_id);
+        return *treelets_[root_id];
+    }
+
+    unique_lock<mutex> lock{cache_mutex_};
+
+    if (root_id < treelets_.size() and treelets_[root_id]) {
+        nTreeletCacheHits++;
+    } else {
+        nTreeletCacheMisses++;
+    }
+
+    /* tracing is const, but the cache is not part of what the BVH looks
+     * like from the outside */
+    auto &self = const_cast<CloudBVH &>(*this);
+    self.loadCachedTreelet(root_id, nullptr, 0, lock);
+    cache_entries_[root_id].pins++;
+    self.evictTreelets();
+
+    return *treelets_[root_id];
+}
+
+void CloudBVH::unpinTreelet(const uint32_t root_id) const {
+    if (not cache_budget_) return;
+
+    unique_lock<mutex> lock{cache_mutex_};
+
+    /* treelets that were kept over the budget can go now */
+    if (--cache_entries_[root_id].pins == 0) {
+        const_cast<CloudBVH &>(*this).evictTreelets();
+    }
+}
+
+CloudBVH::TreeletPin::TreeletPin(const CloudBVH &bvh, const uint32_t root_id) {
+    Reset(bvh, root_id);
+}
+
+void CloudBVH::TreeletPin::Reset(const CloudBVH &bvh, const uint32_t root_id) {
+    if (treelet_ and bvh_ == &bvh and root_id_ == root_id) return;
+
+    /* the new treelet is pinned first, so loading it can't evict the one
+     * we're leaving */
+    const Treelet &treelet = bvh.pinTreelet(root_id);
+    Reset();
+
+    bvh_ = &bvh;
+    treelet_ = &treelet;
+    root_id_ = root_id;
+}
+
+void CloudBVH::TreeletPin::Reset() {
+    if (bvh_) bvh_->unpinTreelet(root_id_);
+    bvh_ = nullptr;
+    treelet_ = nullptr;
+}
+
 Bounds3f CloudBVH::WorldBound() const {
     // The correctness of this function is only guaranteed for the root treelet
     CHECK_EQ(bvh_root_, 0);
 
-    checkIfTreeletIsLoaded(bvh_root_);
-    return treelets_[bvh_root_]->nodes[0].bounds;
+    TreeletPin pin{*this, bvh_root_};
+    return nodeBounds(*pin.treelet_, 0);
 }
 
 void CloudBVH::LoadTreelet(const uint32_t root_id, const char *buffer,
                            const size_t length) {
+    if (cache_budget_) {
+        unique_lock<mutex> lock{cache_mutex_};
+        loadCachedTreelet(root_id, buffer, length, lock);
+        evictTreelets();
+        return;
+    }
+
     if (preloading_done_ or
         (treelets_.size() > root_id && treelets_[root_id] != nullptr)) {
         return; /* this tree is already loaded */
@@ -150,8 +439,17 @@ void CloudBVH::LoadTreelet(const uint32_t root_id, const char *buffer,
         treelets_.resize(root_id + 1);
     }
 
+    loadAndFinalizeTreelet(root_id, buffer, length);
+}
+
+void CloudBVH::loadAndFinalizeTreelet(const uint32_t root_id,
+                                      const char *buffer,
+                                      const size_t length) {
     loadTreeletBase(root_id, buffer, length);
+    setupTreelet(root_id);
+}
 
+void CloudBVH::setupTreelet(const uint32_t root_id) {
     auto &treelet = *treelets_[root_id];
 
     /* create the placeholder materials */
@@ -173,33 +471,42 @@ void CloudBVH::finalizeTreeletLoad(const uint32_t root_id) {
     auto &treelet = *treelets_[root_id];
 
     /* fill in unfinished primitives */
+    treelet.external_instances.resize(treelet.primitives.size(), nullptr);
+
     for (auto &u : treelet.unfinished_transformed) {
+        auto &instance = bvh_instances_.at(u->instance_group);
+
         treelet.primitives[u->primitive_index] =
-            make_unique<TransformedPrimitive>(
-                bvh_instances_.at(u->instance_group),
-                move(u->primitive_to_world));
+            make_unique<TransformedPrimitive>(instance,
+                                              move(u->primitive_to_world));
+
+        treelet.external_instances[u->primitive_index] =
+            static_cast<const ExternalInstance *>(instance.get());
     }
 
     MediumInterface medium_interface{};
 
-    for (auto &ug : treelet.unfinished_geometric) {
-        auto &u = *ug;
-        shared_ptr<Shape> shape{move(u.shape)};
+    for (size_t m = 0; m < treelet.meshes.size(); m++) {
+        /* any triangle of the mesh will do as the primitive's shape */
+        shared_ptr<Shape> shape = make_shared<Triangle>(
+            &identity_transform_, &identity_transform_, false,
+            treelet.meshes[m], 0);
 
         /* do we need to make an area light for this guy? */
+        const uint32_t area_light_id = treelet.mesh_area_lights[m];
         shared_ptr<AreaLight> area_light;
 
-        if (u.area_light_id) {
+        if (area_light_id) {
             if (scene_lights_.empty()) {
-                auto &light_data = area_light_params_.at(u.area_light_id);
+                auto &light_data = area_light_params_.at(area_light_id);
                 area_light = CreateDiffuseAreaLight(light_data.second,
                                                     medium_interface.outside,
                                                     light_data.first, shape);
-                area_light->SetID(u.area_light_id + u.triangle_idx);
+                area_light->SetID(area_light_id);
             } else {
                 area_light = shared_ptr<AreaLight>(
                     dynamic_cast<AreaLight *>(
-                        scene_lights_.at(u.area_light_id - 1)),
+                        scene_lights_.at(area_light_id - 1)),
                     [](auto p) {});
 
                 if (area_light == nullptr) {
@@ -208,44 +515,142 @@ void CloudBVH::finalizeTreeletLoad(const uint32_t root_id) {
             }
         }
 
-        treelet.primitives[u.primitive_index] = make_unique<GeometricPrimitive>(
-            shape, materials_.at(u.material_key.id), area_light,
-            medium_interface);
+        treelet.mesh_primitives.push_back(make_unique<GeometricPrimitive>(
+            shape, materials_.at(treelet.mesh_materials[m].id), area_light,
+            medium_interface));
+    }
+
+    /* with the scene's lights at hand, every triangle of an emissive mesh
+     * reports the mesh's light */
+    if (not scene_lights_.empty()) {
+        for (size_t i = 0; i < treelet.area_light_ids.size(); i++) {
+            const auto &tri = treelet.triangles[i];
+            if (tri.IsInstance() or not treelet.area_light_ids[i]) continue;
+
+            treelet.area_light_ids[i] = treelet.mesh_primitives[tri.mesh_index]
+                                            ->GetAreaLight()
+                                            ->GetID();
+        }
     }
 
     treelet.required_instances.clear();
     treelet.required_materials.clear();
-    treelet.unfinished_geometric.clear();
     treelet.unfinished_transformed.clear();
+
+    treelet.footprint +=
+        treelet.triangles.size() * sizeof(TreeletTriangle) +
+        treelet.area_light_ids.size() * sizeof(uint32_t) +
+        treelet.primitives.size() * sizeof(TransformedPrimitive) +
+        treelet.mesh_primitives.size() * sizeof(GeometricPrimitive);
 }
 
 void CloudBVH::loadTreeletBase(const uint32_t root_id, const char *buffer,
                                size_t length) {
+    treelets_[root_id] = readTreelet(root_id, buffer, length);
+}
+
+unique_ptr<CloudBVH::Treelet> CloudBVH::readTreelet(const uint32_t root_id,
+                                                    const char *buffer,
+                                                    size_t length) const {
     ProfilePhase _(Prof::LoadTreelet);
 
     LOG(INFO) << "Starting loading the base for treelet " << root_id;
 
-    treelets_[root_id] = make_unique<Treelet>();
+    auto treelet_ptr = make_unique<Treelet>();
 
-    auto &treelet = *treelets_[root_id];
-    auto &nodes = treelet.nodes;
+    auto &treelet = *treelet_ptr;
+    auto &tree_meshes = treelet.meshes;
+    auto &tree_triangles = treelet.triangles;
     auto &tree_primitives = treelet.primitives;
     auto &tree_transforms = treelet.transforms;
     auto &tree_instances = treelet.instances;
 
-    string treelet_buffer;
+    shared_ptr<MappedFile> file;
     if (!buffer) {
         const string treelet_path =
             _manager.getScenePath() + "/" +
             _manager.getFileName(ObjectType::Treelet, root_id);
 
-        treelet_buffer = roost::read_file(treelet_path);
-        buffer = treelet_buffer.data();
-        length = treelet_buffer.length();
+        file = make_shared<MappedFile>(treelet_path);
+        buffer = file->data();
+        length = file->size();
     }
 
+    treelet.footprint = length;
+
     auto reader = RecordReader::get(buffer, length);
 
+    /* if the records can be used in place, the treelet keeps what they are
+     * in alive and everything that can be a view into it is one: the
+     * mapping, or the decompressed stream, which is all that's kept of a
+     * compressed treelet */
+    if (auto *blocked = dynamic_cast<BlockedReader *>(reader.get())) {
+        treelet.backing = blocked->raw_stream();
+        treelet.footprint = blocked->raw_size();
+    } else if (file && dynamic_cast<LiteRecordReader *>(reader.get())) {
+        treelet.backing = file;
+    }
+
+    auto view = [&](const size_t len) -> const char * {
+        return treelet.backing ? reader->view(len) : nullptr;
+    };
+
+    /* node arrays are used in place only if they are suitably aligned */
+    auto read_array = [&](const size_t len,
+                          const size_t alignment) -> const char * {
+        const char *data = view(len);
+        if (data && reinterpret_cast<uintptr_t>(data) % alignment == 0) {
+            return data;
+        }
+
+        treelet.node_storage.push_back(make_unique<char[]>(len));
+        treelet.footprint += len;
+        char *copy = treelet.node_storage.back().get();
+
+        if (data) {
+            memcpy(copy, data, len);
+        } else {
+            reader->read(copy, len);
+        }
+
+        return copy;
+    };
+
+    /* the same goes for records that are read through typed pointers; a
+     * record that can't be used in place is copied into `storage` */
+    auto view_aligned = [&](const size_t len, const size_t alignment,
+                            unique_ptr<char[]> &storage) -> const char * {
+        const char *data = view(len);
+        if (data && reinterpret_cast<uintptr_t>(data) % alignment == 0) {
+            return data;
+        }
+
+        storage = make_unique<char[]>(len);
+
+        if (data) {
+            memcpy(storage.get(), data, len);
+        } else {
+            reader->read(storage.get(), len);
+        }
+
+        return nullptr;
+    };
+
+    /* treelets with wide nodes start with a header */
+    if (reader->next_record_size() == sizeof(TreeletHeader)) {
+        TreeletHeader header;
+        reader->read(&header);
+
+        if (header.magic != TreeletHeader::MAGIC ||
+            header.version != TreeletHeader::VERSION ||
+            (header.node_width != 4 && header.node_width != 8)) {
+            throw runtime_error("treelet " + to_string(root_id) +
+                                ": unsupported format");
+        }
+
+        treelet.node_width = header.node_width;
+    }
+
     /* read in the textures & materials included in this treelet */
 
     // IMAGE PARTITIONS
@@ -253,12 +658,22 @@ void CloudBVH::loadTreeletBase(const uint32_t root_id, const char *buffer,
     for (size_t i = 0; i < included_image_partitions; i++) {
         const uint32_t id = reader->read<uint32_t>();
         const size_t len = reader->next_record_size();
+        unique_ptr<char[]> storage;
+
+        if (const char *data =
+                view_aligned(len, alignof(RGBSpectrum), storage)) {
+            /* the mapping is private (and the decompressed stream is the
+             * treelet's own), so the partition may write to it */
+            ImagePartition partition{const_cast<char *>(data),
+                                     treelet.backing};
+            _manager.addInMemoryImagePartition(root_id, id, move(partition));
+        } else {
+            ImagePartition partition{move(storage)};
+            _manager.addInMemoryImagePartition(root_id, id, move(partition));
+            treelet.footprint += len;
+        }
 
-        unique_ptr<char[]> storage{make_unique<char[]>(len)};
-        reader->read(storage.get(), len);
-
-        ImagePartition partition{move(storage)};
-        _manager.addInMemoryImagePartition(id, move(partition));
+        treelet.image_partitions.push_back(id);
     }
 
     // PTEX TEXTURES
@@ -266,24 +681,55 @@ void CloudBVH::loadTreeletBase(const uint32_t root_id, const char *buffer,
     for (size_t i = 0; i < included_texture_count; i++) {
         const uint32_t id = reader->read<uint32_t>();
         const size_t len = reader->next_record_size();
+        const string path = _manager.getFileName(ObjectType::Texture, id);
 
-        unique_ptr<char[]> storage{make_unique<char[]>(len)};
-        reader->read(storage.get(), len);
+        if (const char *data = view(len)) {
+            _manager.addInMemoryTexture(root_id, path, data, len,
+                                        treelet.backing);
+        } else {
+            unique_ptr<char[]> storage{make_unique<char[]>(len)};
+            reader->read(storage.get(), len);
 
-        _manager.addInMemoryTexture(
-            _manager.getFileName(ObjectType::Texture, id), move(storage), len);
+            _manager.addInMemoryTexture(root_id, path, move(storage), len);
+            treelet.footprint += len;
+        }
+
+        treelet.textures.push_back(path);
     }
 
     std::map<uint64_t, std::shared_ptr<Texture<Float>>> ftexes;
     std::map<uint64_t, std::shared_ptr<Texture<Spectrum>>> stexes;
 
+    /* materials and textures are in the flat form, unless the treelet
+     * predates it and they are protobufs */
+    string record;
+    auto read_record = [&](const char *&data, size_t &len) {
+        len = reader->next_record_size();
+        data = view(len);
+        if (data) return;
+
+        record.resize(len);
+        reader->read(&record[0], len);
+        data = record.data();
+    };
+
+    const char *data;
+    size_t len;
+
     // SPECTRUM TEXTURES
     const uint32_t included_spectrum_count = reader->read<uint32_t>();
     for (size_t i = 0; i < included_spectrum_count; i++) {
         const uint32_t id = reader->read<uint32_t>();
-        const string data = reader->read<string>();
+        read_record(data, len);
+
+        if (serdes::flat::is_flat(data, len)) {
+            stexes.emplace(id,
+                           serdes::spectrum_texture::deserialize(data, len));
+            continue;
+        }
+
         protobuf::SpectrumTexture stex_proto;
-        stex_proto.ParseFromString(data);
+        stex_proto.ParseFromArray(data, len);
         stexes.emplace(id, move(spectrum_texture::from_protobuf(stex_proto)));
     }
 
@@ -291,9 +737,15 @@ void CloudBVH::loadTreeletBase(const uint32_t root_id, const char *buffer,
     const uint32_t included_float_count = reader->read<uint32_t>();
     for (size_t i = 0; i < included_float_count; i++) {
         const uint32_t id = reader->read<uint32_t>();
-        const string data = reader->read<string>();
+        read_record(data, len);
+
+        if (serdes::flat::is_flat(data, len)) {
+            ftexes.emplace(id, serdes::float_texture::deserialize(data, len));
+            continue;
+        }
+
         protobuf::FloatTexture ftex_proto;
-        ftex_proto.ParseFromString(data);
+        ftex_proto.ParseFromArray(data, len);
         ftexes.emplace(id, move(float_texture::from_protobuf(ftex_proto)));
     }
 
@@ -301,16 +753,21 @@ void CloudBVH::loadTreeletBase(const uint32_t root_id, const char *buffer,
     const uint32_t included_material_count = reader->read<uint32_t>();
     for (size_t i = 0; i < included_material_count; i++) {
         const uint32_t id = reader->read<uint32_t>();
-        const string data = reader->read<string>();
+        read_record(data, len);
+
+        if (serdes::flat::is_flat(data, len)) {
+            treelet.included_material.emplace(
+                id, serdes::material::deserialize(data, len, ftexes, stexes));
+            continue;
+        }
+
         protobuf::Material material;
-        material.ParseFromString(data);
+        material.ParseFromArray(data, len);
         treelet.included_material.emplace(
             id, move(material::from_protobuf(material, ftexes, stexes)));
     }
 
-    map<uint32_t, shared_ptr<TriangleMesh>> tree_meshes;
-    map<uint32_t, MaterialKey> mesh_material_ids;
-    map<uint32_t, uint32_t> mesh_area_light_id;
+    map<uint64_t, uint32_t> mesh_indices;
 
     /* read in the triangle meshes for this treelet */
     const uint32_t num_triangle_meshes = reader->read<uint32_t>();
@@ -331,15 +788,24 @@ void CloudBVH::loadTreeletBase(const uint32_t root_id, const char *buffer,
         const uint32_t area_light_id = reader->read<uint32_t>();
 
         const size_t len = reader->next_record_size();
-        unique_ptr<char[]> storage{make_unique<char[]>(len)};
-        reader->read(storage.get(), len);
+        unique_ptr<char[]> storage;
+
+        /* the mesh starts with its counts and indices, then the positions */
+        if (const char *data = view_aligned(len, alignof(Point3f), storage)) {
+            tree_meshes.push_back(
+                make_shared<TriangleMesh>(data, treelet.backing));
+        } else {
+            tree_meshes.push_back(make_shared<TriangleMesh>(move(storage), 0));
+            treelet.footprint += len;
+        }
 
-        tree_meshes[tm_id] = make_shared<TriangleMesh>(move(storage), 0);
-        mesh_material_ids[tm_id] = material_key;
+        mesh_indices[tm_id] = tree_meshes.size() - 1;
+        treelet.mesh_materials.push_back(material_key);
+        treelet.mesh_area_lights.push_back(area_light_id);
+        treelet.required_materials.insert(material_key);
 
         if (area_light_id) {
-            tree_meshes.at(tm_id)->alphaMask = zero_alpha_texture_;
-            mesh_area_light_id[tm_id] = area_light_id;
+            tree_meshes.back()->alphaMask = zero_alpha_texture_;
         }
     }
 
@@ -347,16 +813,46 @@ void CloudBVH::loadTreeletBase(const uint32_t root_id, const char *buffer,
     const uint32_t primitive_count = reader->read<uint32_t>();
 
     if (node_count == 0) {
-        return;
+        return treelet_ptr;
     }
 
-    nodes.resize(node_count);
-    tree_primitives.reserve(primitive_count);
+    tree_triangles.reserve(primitive_count);
 
-    reader->read(reinterpret_cast<char *>(&nodes[0]),
-                 node_count * sizeof(TreeletNode));
+    const bool has_area_lights =
+        any_of(treelet.mesh_area_lights.begin(), treelet.mesh_area_lights.end(),
+               [](const uint32_t id) { return id != 0; });
+
+    if (has_area_lights) {
+        treelet.area_light_ids.reserve(primitive_count);
+    }
+
+    /* primitives are stored in groups, one per node of the original binary
+     * tree; leaves refer to them by their offset */
+    uint32_t group_count = node_count;
+
+    if (treelet.node_width == 2) {
+        treelet.nodes = reinterpret_cast<const TreeletNode *>(read_array(
+            node_count * sizeof(TreeletNode), alignof(TreeletNode)));
+    } else {
+        const uint32_t leaf_count = reader->read<uint32_t>();
 
-    for (auto &node : nodes) {
+        if (treelet.node_width == 4) {
+            treelet.nodes4 = reinterpret_cast<const WideTreeletNode<4> *>(
+                read_array(node_count * sizeof(WideTreeletNode<4>),
+                           alignof(WideTreeletNode<4>)));
+        } else {
+            treelet.nodes8 = reinterpret_cast<const WideTreeletNode<8> *>(
+                read_array(node_count * sizeof(WideTreeletNode<8>),
+                           alignof(WideTreeletNode<8>)));
+        }
+
+        treelet.leaves = reinterpret_cast<const TreeletLeaf *>(read_array(
+            leaf_count * sizeof(TreeletLeaf), alignof(TreeletLeaf)));
+
+        group_count = reader->read<uint32_t>();
+    }
+
+    for (uint32_t group = 0; group < group_count; group++) {
         serdes::cloudbvh::TransformedPrimitive serdes_primitive;
         serdes::cloudbvh::Triangle serdes_triangle;
 
@@ -383,6 +879,14 @@ void CloudBVH::loadTreeletBase(const uint32_t root_id, const char *buffer,
                 start, serdes_primitive.start_time, end,
                 serdes_primitive.end_time};
 
+            TreeletTriangle slot;
+            slot.index = tree_primitives.size();
+            tree_triangles.push_back(slot);
+
+            if (has_area_lights) {
+                treelet.area_light_ids.push_back(0);
+            }
+
             const uint64_t instance_ref = serdes_primitive.root_ref;
             const uint16_t instance_group = (uint16_t)(instance_ref >> 32);
             const uint32_t instance_node = (uint32_t)instance_ref;
@@ -411,199 +915,723 @@ void CloudBVH::loadTreeletBase(const uint32_t root_id, const char *buffer,
         for (int i = 0; i < triangles_count; i++) {
             reader->read(&serdes_triangle);
 
-            const auto mesh_id = serdes_triangle.mesh_id;
-            const auto tri_number = serdes_triangle.tri_number;
-            const auto material_key = mesh_material_ids.at(mesh_id);
-            const auto area_light_id = mesh_area_light_id.count(mesh_id)
-                                           ? mesh_area_light_id.at(mesh_id)
-                                           : 0;
+            const uint32_t tri_number = serdes_triangle.tri_number;
+            const uint32_t mesh_index =
+                mesh_indices.at(serdes_triangle.mesh_id);
+            const auto &mesh = *tree_meshes[mesh_index];
+            const int *v = &mesh.vertexIndices[3 * tri_number];
+
+            TreeletTriangle triangle;
+            triangle.p0 = mesh.p[v[0]];
+            triangle.p1 = mesh.p[v[1]];
+            triangle.p2 = mesh.p[v[2]];
+            triangle.mesh_index = mesh_index;
+            triangle.index = tri_number;
+            tree_triangles.push_back(triangle);
+
+            /* finalizeTreeletLoad() replaces these if the scene's lights are
+             * known */
+            if (has_area_lights) {
+                const uint32_t area_light_id =
+                    treelet.mesh_area_lights[mesh_index];
+                treelet.area_light_ids.push_back(
+                    area_light_id ? area_light_id + i : 0);
+            }
+        }
+
+        nNodes++;
+    }
 
-            treelet.required_materials.insert(material_key);
+    LOG(INFO) << "Finished loading base for treelet " << root_id;
+    return treelet_ptr;
+}
 
-            auto shape = make_unique<Triangle>(
-                &identity_transform_, &identity_transform_, false,
-                tree_meshes.at(mesh_id), tri_number);
+void CloudBVH::TraceState::Reset(const RayState &rayState) {
+    ray = rayState.ray;
+    invDir = Vector3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+    dirIsNeg[0] = invDir.x < 0;
+    dirIsNeg[1] = invDir.y < 0;
+    dirIsNeg[2] = invDir.z < 0;
+    hasTransform = false;
+    hasInverse = false;
+}
 
-            treelet.unfinished_geometric.push_back(
-                make_unique<UnfinishedGeometricPrimitive>(
-                    tree_primitives.size(), material_key, area_light_id,
-                    move(shape), i));
+void CloudBVH::TraceState::Prepare(const RayState &rayState,
+                                   const bool transformed) {
+    if (transformed == hasTransform) return;
 
-            tree_primitives.push_back(nullptr);
+    if (transformed) {
+        /* rayTransform can only change when the ray leaves the treelet */
+        if (not hasInverse) {
+            inverseTransform = Inverse(*rayState.rayTransform);
+            hasInverse = true;
         }
 
-        nNodes++;
+        ray = inverseTransform(rayState.ray);
+    } else {
+        ray = rayState.ray;
     }
 
-    LOG(INFO) << "Finished loading base for treelet " << root_id;
+    invDir = Vector3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+    dirIsNeg[0] = invDir.x < 0;
+    dirIsNeg[1] = invDir.y < 0;
+    dirIsNeg[2] = invDir.z < 0;
+    hasTransform = transformed;
 }
 
-void CloudBVH::Trace(RayState &rayState) const {
+namespace {
+
+/* Slab test of a ray against every child of a wide node. Returns a mask of
+ * the children that are hit, and their entry distances in `tNear`. */
+template <int N>
+uint32_t IntersectChildren(const CloudBVH::WideTreeletNode<N> &node,
+                           const Ray &ray, const Vector3f &invDir,
+                           const int dirIsNeg[3], Float tNear[N]) {
+    const Float robust = 1 + 2 * gamma(3);
+    uint32_t mask = 0;
+
+#if defined(__SSE2__) && !defined(PBRT_FLOAT_AS_DOUBLE)
+    for (int g = 0; g < N && g < node.child_count; g += 4) {
+        __m128 tMin = _mm_setzero_ps();
+        __m128 tMax = _mm_set1_ps(ray.tMax);
+
+        for (int a = 0; a < 3; a++) {
+            auto load = [&](const uint8_t *q) {
+                int32_t packed;
+                memcpy(&packed, q + g, sizeof(packed));
+                __m128i v = _mm_cvtsi32_si128(packed);
+                v = _mm_unpacklo_epi8(v, _mm_setzero_si128());
+                v = _mm_unpacklo_epi16(v, _mm_setzero_si128());
+                return _mm_add_ps(_mm_set1_ps(node.origin[a]),
+                                  _mm_mul_ps(_mm_cvtepi32_ps(v),
+                                             _mm_set1_ps(node.scale[a])));
+            };
+
+            const __m128 bMin = load(node.lo[a]);
+            const __m128 bMax = load(node.hi[a]);
+            const __m128 o = _mm_set1_ps(ray.o[a]);
+            const __m128 d = _mm_set1_ps(invDir[a]);
+
+            const __m128 t0 =
+                _mm_mul_ps(_mm_sub_ps(dirIsNeg[a] ? bMax : bMin, o), d);
+            const __m128 t1 = _mm_mul_ps(
+                _mm_mul_ps(_mm_sub_ps(dirIsNeg[a] ? bMin : bMax, o), d),
+                _mm_set1_ps(robust));
+
+            tMin = _mm_max_ps(t0, tMin);
+            tMax = _mm_min_ps(t1, tMax);
+        }
+
+        alignas(16) float near[4];
+        _mm_store_ps(near, tMin);
+
+        uint32_t hits = _mm_movemask_ps(_mm_cmple_ps(tMin, tMax));
+        for (int i = 0; i < 4 && g + i < node.child_count; i++) {
+            if (hits & (1u << i)) {
+                mask |= 1u << (g + i);
+                tNear[g + i] = near[i];
+            }
+        }
+    }
+#else
+    for (int i = 0; i < node.child_count; i++) {
+        Float tMin = 0, tMax = ray.tMax;
+
+        for (int a = 0; a < 3; a++) {
+            const Float bMin = node.Dequantize(a, node.lo[a][i]);
+            const Float bMax = node.Dequantize(a, node.hi[a][i]);
+            Float t0 = ((dirIsNeg[a] ? bMax : bMin) - ray.o[a]) * invDir[a];
+            Float t1 = ((dirIsNeg[a] ? bMin : bMax) - ray.o[a]) * invDir[a];
+            t1 *= robust;
+
+            tMin = t0 > tMin ? t0 : tMin;
+            tMax = t1 < tMax ? t1 : tMax;
+        }
+
+        if (tMin <= tMax) {
+            mask |= 1u << i;
+            tNear[i] = tMin;
+        }
+    }
+#endif
+
+    return mask;
+}
+
+template <int N>
+void ExpandWideNode(const CloudBVH::WideTreeletNode<N> &node, const Ray &ray,
+                    const Vector3f &invDir, const int dirIsNeg[3],
+                    uint8_t &count, pair<uint32_t, uint32_t> *children) {
+    Float tNear[N];
+    const uint32_t mask = IntersectChildren(node, ray, invDir, dirIsNeg, tNear);
+
+    /* sorted far to near, so the nearest child ends up on top of the stack */
+    int order[N];
+    count = 0;
+
+    for (int i = 0; i < node.child_count; i++) {
+        if (not(mask & (1u << i))) continue;
+
+        int j = count++;
+        for (; j > 0 && tNear[order[j - 1]] < tNear[i]; j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+
+    for (int j = 0; j < count; j++) {
+        children[j] = {node.child_treelet[order[j]], node.child_node[order[j]]};
+    }
+}
+
+}  // namespace
+
+bool CloudBVH::expandNode(const Treelet &treelet, const uint32_t nodeIdx,
+                          const Ray &ray, const Vector3f &invDir,
+                          const int dirIsNeg[3], NodeExpansion &expansion,
+                          const bool testBounds) {
+    expansion.primitive_offset = 0;
+    expansion.primitive_count = 0;
+    expansion.child_count = 0;
+
+    if (treelet.node_width == 2) {
+        const auto &node = treelet.nodes[nodeIdx];
+
+        if (testBounds && !node.bounds.IntersectP(ray, invDir, dirIsNeg)) {
+            return false;
+        }
+
+        if (node.is_leaf()) {
+            expansion.primitive_offset = node.primitive_offset;
+            expansion.primitive_count = node.primitive_count;
+        } else {
+            const int first = dirIsNeg[node.axis] ? LEFT : RIGHT;
+            const int second = 1 - first;
+
+            expansion.child_count = 2;
+            expansion.children[0] = {node.child_treelet[first],
+                                     node.child_node[first]};
+            expansion.children[1] = {node.child_treelet[second],
+                                     node.child_node[second]};
+        }
+
+        return true;
+    }
+
+    /* wide layouts test the children's bounds from the parent */
+    if (nodeIdx & LEAF_FLAG) {
+        const auto &leaf = treelet.leaves[nodeIdx & ~LEAF_FLAG];
+        expansion.primitive_offset = leaf.primitive_offset;
+        expansion.primitive_count = leaf.primitive_count;
+    } else if (treelet.node_width == 4) {
+        ExpandWideNode(treelet.nodes4[nodeIdx], ray, invDir, dirIsNeg,
+                       expansion.child_count, expansion.children);
+    } else {
+        ExpandWideNode(treelet.nodes8[nodeIdx], ray, invDir, dirIsNeg,
+                       expansion.child_count, expansion.children);
+    }
+
+    return true;
+}
+
+Bounds3f CloudBVH::nodeBounds(const Treelet &treelet, const uint32_t nodeIdx) {
+    if (treelet.node_width == 2) {
+        return treelet.nodes[nodeIdx].bounds;
+    }
+
+    auto childUnion = [](const auto &node) {
+        Bounds3f b;
+        for (int i = 0; i < node.child_count; i++) {
+            b = Union(b, node.ChildBounds(i));
+        }
+        return b;
+    };
+
+    return treelet.node_width == 4 ? childUnion(treelet.nodes4[nodeIdx])
+                                   : childUnion(treelet.nodes8[nodeIdx]);
+}
+
+bool CloudBVH::TreeletTriangle::Intersect(const Ray &ray) const {
+    /* same operations, in the same order, as Triangle::Intersect(), so that
+     * both agree on every ray */
+    Point3f p0t = p0 - Vector3f(ray.o);
+    Point3f p1t = p1 - Vector3f(ray.o);
+    Point3f p2t = p2 - Vector3f(ray.o);
+
+    int kz = MaxDimension(Abs(ray.d));
+    int kx = kz + 1;
+    if (kx == 3) kx = 0;
+    int ky = kx + 1;
+    if (ky == 3) ky = 0;
+    Vector3f d = Permute(ray.d, kx, ky, kz);
+    p0t = Permute(p0t, kx, ky, kz);
+    p1t = Permute(p1t, kx, ky, kz);
+    p2t = Permute(p2t, kx, ky, kz);
+
+    Float Sx = -d.x / d.z;
+    Float Sy = -d.y / d.z;
+    Float Sz = 1.f / d.z;
+    p0t.x += Sx * p0t.z;
+    p0t.y += Sy * p0t.z;
+    p1t.x += Sx * p1t.z;
+    p1t.y += Sy * p1t.z;
+    p2t.x += Sx * p2t.z;
+    p2t.y += Sy * p2t.z;
+
+    Float e0 = p1t.x * p2t.y - p1t.y * p2t.x;
+    Float e1 = p2t.x * p0t.y - p2t.y * p0t.x;
+    Float e2 = p0t.x * p1t.y - p0t.y * p1t.x;
+
+    if (sizeof(Float) == sizeof(float) &&
+        (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f)) {
+        double p2txp1ty = (double)p2t.x * (double)p1t.y;
+        double p2typ1tx = (double)p2t.y * (double)p1t.x;
+        e0 = (float)(p2typ1tx - p2txp1ty);
+        double p0txp2ty = (double)p0t.x * (double)p2t.y;
+        double p0typ2tx = (double)p0t.y * (double)p2t.x;
+        e1 = (float)(p0typ2tx - p0txp2ty);
+        double p1txp0ty = (double)p1t.x * (double)p0t.y;
+        double p1typ0tx = (double)p1t.y * (double)p0t.x;
+        e2 = (float)(p1typ0tx - p1txp0ty);
+    }
+
+    if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
+        return false;
+    Float det = e0 + e1 + e2;
+    if (det == 0) return false;
+
+    p0t.z *= Sz;
+    p1t.z *= Sz;
+    p2t.z *= Sz;
+    Float tScaled = e0 * p0t.z + e1 * p1t.z + e2 * p2t.z;
+    if (det < 0 && (tScaled >= 0 || tScaled < ray.tMax * det))
+        return false;
+    else if (det > 0 && (tScaled <= 0 || tScaled > ray.tMax * det))
+        return false;
+
+    Float invDet = 1 / det;
+    Float t = tScaled * invDet;
+
+    Float maxZt = MaxComponent(Abs(Vector3f(p0t.z, p1t.z, p2t.z)));
+    Float deltaZ = gamma(3) * maxZt;
+
+    Float maxXt = MaxComponent(Abs(Vector3f(p0t.x, p1t.x, p2t.x)));
+    Float maxYt = MaxComponent(Abs(Vector3f(p0t.y, p1t.y, p2t.y)));
+    Float deltaX = gamma(5) * (maxXt + maxZt);
+    Float deltaY = gamma(5) * (maxYt + maxZt);
+
+    Float deltaE =
+        2 * (gamma(2) * maxXt * maxYt + deltaY * maxXt + deltaX * maxYt);
+
+    Float maxE = MaxComponent(Abs(Vector3f(e0, e1, e2)));
+    Float deltaT = 3 *
+                   (gamma(3) * maxE * maxZt + deltaE * maxZt + deltaZ * maxE) *
+                   std::abs(invDet);
+    return t > deltaT;
+}
+
+Triangle CloudBVH::triangleShape(const Treelet &treelet, const uint32_t slot) {
+    const auto &tri = treelet.triangles[slot];
+    const auto &mesh = *treelet.meshes[tri.mesh_index];
+    const auto &primitive = *treelet.mesh_primitives[tri.mesh_index];
+
+    /* the mesh primitive's shape, pointed at this triangle */
+    Triangle shape = *static_cast<const Triangle *>(primitive.GetShape());
+    shape.v = &mesh.vertexIndices[3 * tri.index];
+    shape.faceIndex = mesh.faceIndices ? mesh.faceIndices[tri.index] : 0;
+    return shape;
+}
+
+bool CloudBVH::intersectTriangle(const Treelet &treelet, const uint32_t slot,
+                                 const Ray &ray, SurfaceInteraction *isect) {
+    const auto &primitive =
+        *treelet.mesh_primitives[treelet.triangles[slot].mesh_index];
+
+    Float tHit;
+    if (!triangleShape(treelet, slot).Intersect(ray, &tHit, isect)) {
+        return false;
+    }
+
+    ray.tMax = tHit;
+    isect->primitive = &primitive;
+    isect->shape = primitive.GetShape(); /* `shape` is about to go away */
+    isect->mediumInterface = MediumInterface(ray.medium);
+    return true;
+}
+
+bool CloudBVH::intersectPrimitives(const Treelet &treelet,
+                                   const uint32_t offset, const uint32_t count,
+                                   const Ray &ray, SurfaceInteraction *isect) {
+    bool hit = false;
+
+    for (uint32_t i = offset; i < offset + count; i++) {
+        const auto &tri = treelet.triangles[i];
+
+        if (tri.IsInstance()) {
+            if (treelet.primitives[tri.index]->Intersect(ray, isect)) {
+                hit = true;
+            }
+        } else if (tri.Intersect(ray) &&
+                   intersectTriangle(treelet, i, ray, isect)) {
+            hit = true;
+        }
+    }
+
+    return hit;
+}
+
+bool CloudBVH::intersectPrimitivesP(const Treelet &treelet,
+                                    const uint32_t offset,
+                                    const uint32_t count, const Ray &ray) {
+    for (uint32_t i = offset; i < offset + count; i++) {
+        const auto &tri = treelet.triangles[i];
+
+        if (tri.IsInstance()) {
+            if (treelet.primitives[tri.index]->IntersectP(ray)) return true;
+            continue;
+        }
+
+        if (not tri.Intersect(ray)) continue;
+
+        /* alpha-masked triangles go through the full test */
+        const auto &mesh = *treelet.meshes[tri.mesh_index];
+        if (not mesh.alphaMask and not mesh.shadowAlphaMask) return true;
+        if (triangleShape(treelet, i).IntersectP(ray)) return true;
+    }
+
+    return false;
+}
+
+void CloudBVH::traceNode(RayState &rayState, TraceState &state,
+                         RayState::TreeletNode &current,
+                         const Treelet &treelet,
+                         const NodeExpansion &expansion) const {
+    const RayDifferential &ray = state.ray;
+
+    for (int i = 0; i < expansion.child_count; i++) {
+        RayState::TreeletNode child;
+        child.treelet = expansion.children[i].first;
+        child.node = expansion.children[i].second;
+        child.transformed = current.transformed;
+        rayState.toVisitPush(move(child));
+    }
+
+    if (expansion.primitive_count == 0) return;
+
     SurfaceInteraction isect;
+    auto &primitives = treelet.primitives;
+
+    for (int i = expansion.primitive_offset + current.primitive;
+         i < expansion.primitive_offset + expansion.primitive_count; i++) {
+        nPrimitivesVisited++;
+
+        const auto &tri = treelet.triangles[i];
+
+        if (not tri.IsInstance()) {
+            if (tri.Intersect(ray) &&
+                intersectTriangle(treelet, i, ray, &isect)) {
+                rayState.ray.tMax = ray.tMax;
+                rayState.SetHit(current, isect,
+                                treelet.mesh_materials[tri.mesh_index],
+                                treelet.area_light_ids.empty()
+                                    ? 0
+                                    : treelet.area_light_ids[i]);
+            }
 
-    RayDifferential ray = rayState.ray;
-    Vector3f invDir{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
-    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+            current.primitive++;
+            continue;
+        }
 
-    const uint32_t currentTreelet = rayState.toVisitTop().treelet;
-    checkIfTreeletIsLoaded(
-        currentTreelet); /* we don't load any other treelets */
+        const ExternalInstance *cbvh = treelet.external_instances[tri.index];
 
-    bool hasTransform = false;
-    bool transformChanged = false;
+        if (cbvh) {
+            if (current.primitive + 1 < expansion.primitive_count) {
+                RayState::TreeletNode next_primitive = current;
+                next_primitive.primitive++;
+                rayState.toVisitPush(move(next_primitive));
+            }
 
-    while (true) {
-        auto &top = rayState.toVisitTop();
-        if (currentTreelet != top.treelet) {
+            const auto *tp = static_cast<const TransformedPrimitive *>(
+                primitives[tri.index].get());
+
+            Transform txfm;
+            tp->GetTransform().Interpolate(ray.time, &txfm);
+
+            RayState::TreeletNode next;
+            next.treelet = cbvh->RootID();
+            next.node = 0;
+
+            if (txfm.IsIdentity()) {
+                next.transformed = false;
+            } else {
+                rayState.EnsureRayTransform() = txfm;
+                next.transformed = true;
+            }
+
+            rayState.toVisitPush(move(next));
             break;
         }
 
-        RayState::TreeletNode current = move(top);
+        /* instances included in this treelet */
+        if (primitives[tri.index]->Intersect(ray, &isect)) {
+            const Material *material = isect.primitive->GetMaterial();
+
+            if (material->GetType() != MaterialType::Placeholder) {
+                throw runtime_error(
+                    "Trace() only works with placeholder material");
+            }
+
+            const auto mat_key =
+                static_cast<const PlaceholderMaterial *>(material)
+                    ->GetMaterialKey();
+
+            const auto arealight =
+                isect.primitive->GetAreaLight()
+                    ? isect.primitive->GetAreaLight()->GetID()
+                    : 0;
+
+            rayState.ray.tMax = ray.tMax;
+            rayState.SetHit(current, isect, mat_key, arealight);
+        }
+
+        current.primitive++;
+    }
+}
+
+void CloudBVH::Trace(RayState &rayState) const {
+    const uint32_t currentTreelet = rayState.toVisitTop().treelet;
+    TreeletPin pin{*this, currentTreelet}; /* we don't visit other treelets */
+    auto &treelet = *pin.treelet_;
+
+    TraceState state;
+    state.Reset(rayState);
+
+    while (not rayState.toVisitEmpty() and
+           rayState.toVisitTop().treelet == currentTreelet) {
+        RayState::TreeletNode current = move(rayState.toVisitTop());
         rayState.toVisitPop();
         nNodesVisited++;
 
-        auto &treelet = *treelets_[current.treelet];
-        auto &node = treelet.nodes[current.node];
+        state.Prepare(rayState, current.transformed);
 
-        /* prepare the ray */
-        if (current.transformed != hasTransform || transformChanged) {
-            transformChanged = false;
+        NodeExpansion expansion;
+        if (expandNode(treelet, current.node, state.ray, state.invDir,
+                       state.dirIsNeg, expansion)) {
+            traceNode(rayState, state, current, treelet, expansion);
+        }
+    }
+}
+
+namespace {
+
+/* Tests one node's bounds against up to four rays at once. The arithmetic
+ * mirrors Bounds3f::IntersectP() operation by operation, so the result for
+ * every lane is bit-for-bit what the scalar test would return. */
+uint32_t IntersectBoundsBatch(const Bounds3f &bounds, const Ray *const *rays,
+                              const Vector3f *const *invDirs,
+                              const int (*const *dirIsNeg)[3],
+                              const size_t count) {
+    const Float robust = 1 + 2 * gamma(3);
+
+#if defined(__SSE2__) && !defined(PBRT_FLOAT_AS_DOUBLE)
+    alignas(16) float near[3][4], far[3][4], org[3][4], inv[3][4], tRay[4];
+
+    for (size_t i = 0; i < 4; i++) {
+        /* unused lanes repeat the first ray; their result is masked off */
+        const size_t r = i < count ? i : 0;
+        const int *neg = *dirIsNeg[r];
+
+        for (int a = 0; a < 3; a++) {
+            near[a][i] = bounds[neg[a]][a];
+            far[a][i] = bounds[1 - neg[a]][a];
+            org[a][i] = rays[r]->o[a];
+            inv[a][i] = (*invDirs[r])[a];
+        }
 
-            ray = current.transformed
-                      ? Inverse(rayState.rayTransform)(rayState.ray)
-                      : rayState.ray;
+        tRay[i] = rays[r]->tMax;
+    }
 
-            invDir = Vector3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
-            dirIsNeg[0] = invDir.x < 0;
-            dirIsNeg[1] = invDir.y < 0;
-            dirIsNeg[2] = invDir.z < 0;
+    auto slab = [&](const int a, __m128 &tNear, __m128 &tFar) {
+        const __m128 o = _mm_load_ps(org[a]);
+        const __m128 d = _mm_load_ps(inv[a]);
+        tNear = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near[a]), o), d);
+        tFar = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far[a]), o), d);
+        tFar = _mm_mul_ps(tFar, _mm_set1_ps(robust));
+    };
+
+    __m128 tMin, tMax, tyMin, tyMax, tzMin, tzMax;
+    slab(0, tMin, tMax);
+    slab(1, tyMin, tyMax);
+
+    __m128 miss =
+        _mm_or_ps(_mm_cmpgt_ps(tMin, tyMax), _mm_cmpgt_ps(tyMin, tMax));
+
+    /* _mm_max_ps(a, b) is (a > b ? a : b), same as the scalar update */
+    tMin = _mm_max_ps(tyMin, tMin);
+    tMax = _mm_min_ps(tyMax, tMax);
+
+    slab(2, tzMin, tzMax);
+    miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmpgt_ps(tMin, tzMax),
+                                     _mm_cmpgt_ps(tzMin, tMax)));
+
+    tMin = _mm_max_ps(tzMin, tMin);
+    tMax = _mm_min_ps(tzMax, tMax);
+
+    const __m128 hit =
+        _mm_and_ps(_mm_cmplt_ps(tMin, _mm_load_ps(tRay)),
+                   _mm_cmpgt_ps(tMax, _mm_setzero_ps()));
+
+    const uint32_t mask = _mm_movemask_ps(_mm_andnot_ps(miss, hit));
+    return mask & ((1u << count) - 1);
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (bounds.IntersectP(*rays[i], *invDirs[i], *dirIsNeg[i])) {
+            mask |= 1u << i;
         }
+    }
+    return mask;
+#endif
+}
 
-        hasTransform = current.transformed;
+}  // namespace
 
-        // Check ray against BVH node
-        if (node.bounds.IntersectP(ray, invDir, dirIsNeg)) {
-            if (node.is_leaf()) {
-                auto &primitives = treelet.primitives;
-
-                for (int i = node.primitive_offset + current.primitive;
-                     i < node.primitive_offset + node.primitive_count; i++) {
-                    nPrimitivesVisited++;
-
-                    if (primitives[i]->GetType() ==
-                        PrimitiveType::Transformed) {
-                        TransformedPrimitive *tp =
-                            dynamic_cast<TransformedPrimitive *>(
-                                primitives[i].get());
-
-                        ExternalInstance *cbvh =
-                            dynamic_cast<ExternalInstance *>(
-                                tp->GetPrimitive().get());
-
-                        if (cbvh) {
-                            if (current.primitive + 1 < node.primitive_count) {
-                                RayState::TreeletNode next_primitive = current;
-                                next_primitive.primitive++;
-                                rayState.toVisitPush(move(next_primitive));
-                            }
-
-                            Transform txfm;
-                            tp->GetTransform().Interpolate(ray.time, &txfm);
-
-                            RayState::TreeletNode next;
-                            next.treelet = cbvh->RootID();
-                            next.node = 0;
-
-                            if (txfm.IsIdentity()) {
-                                next.transformed = false;
-                            } else {
-                                rayState.rayTransform = txfm;
-                                next.transformed = true;
-                            }
-                            rayState.toVisitPush(move(next));
-                            break;
-                        }
-
-                        IncludedInstance *included =
-                            dynamic_cast<IncludedInstance *>(
-                                tp->GetPrimitive().get());
-                        if (included) {
-                            if (tp->Intersect(ray, &isect)) {
-                                if (isect.primitive->GetMaterial()->GetType() !=
-                                    MaterialType::Placeholder) {
-                                    throw runtime_error(
-                                        "Trace() only works with placeholder "
-                                        "material");
-                                }
-
-                                const auto mat_key =
-                                    dynamic_cast<const PlaceholderMaterial *>(
-                                        isect.primitive->GetMaterial())
-                                        ->GetMaterialKey();
-
-                                const auto arealight =
-                                    isect.primitive->GetAreaLight()
-                                        ? isect.primitive->GetAreaLight()
-                                              ->GetID()
-                                        : 0;
-
-                                rayState.ray.tMax = ray.tMax;
-                                rayState.SetHit(current, isect, mat_key,
-                                                arealight);
-                            }
-                        }
-                    } else if (primitives[i]->Intersect(ray, &isect)) {
-                        if (isect.primitive->GetMaterial()->GetType() !=
-                            MaterialType::Placeholder) {
-                            throw runtime_error(
-                                "Trace() only works with placeholder "
-                                "material");
-                        }
-
-                        const auto mat_key =
-                            dynamic_cast<const PlaceholderMaterial *>(
-                                isect.primitive->GetMaterial())
-                                ->GetMaterialKey();
-
-                        const auto arealight =
-                            isect.primitive->GetAreaLight()
-                                ? isect.primitive->GetAreaLight()->GetID()
-                                : 0;
-
-                        rayState.ray.tMax = ray.tMax;
-                        rayState.SetHit(current, isect, mat_key, arealight);
-                    }
+void CloudBVH::TraceBatch(vector<RayStatePtr> &rays) const {
+    if (rays.empty()) return;
 
-                    current.primitive++;
-                }
+    const uint32_t currentTreelet = rays[0]->toVisitTop().treelet;
+    TreeletPin pin{*this, currentTreelet};
 
-                if (rayState.toVisitEmpty()) break;
-            } else {
-                RayState::TreeletNode children[2];
-                for (int i = 0; i < 2; i++) {
-                    children[i].treelet = node.child_treelet[i];
-                    children[i].node = node.child_node[i];
-                    children[i].transformed = current.transformed;
-                }
+    for (const auto &r : rays) {
+        if (r->toVisitEmpty() or r->toVisitTop().treelet != currentTreelet) {
+            throw runtime_error("TraceBatch: all rays must be in treelet " +
+                                to_string(currentTreelet));
+        }
+    }
+
+    auto &treelet = *pin.treelet_;
+
+    vector<TraceState> states(rays.size());
+    for (size_t i = 0; i < rays.size(); i++) {
+        states[i].Reset(*rays[i]);
+    }
+
+    /* (node, ray index) for every ray still inside this treelet */
+    vector<pair<uint32_t, uint32_t>> active;
+    active.reserve(rays.size());
+
+    for (uint32_t i = 0; i < rays.size(); i++) {
+        active.emplace_back(rays[i]->toVisitTop().node, i);
+    }
+
+    vector<RayState::TreeletNode> current;
+    vector<const Ray *> groupRays;
+    vector<const Vector3f *> groupInvDirs;
+    vector<const int(*)[3]> groupDirIsNeg;
+
+    while (not active.empty()) {
+        /* every ray takes exactly one step per round; grouping the rays by
+         * the node they are about to visit keeps that node hot in cache */
+        sort(active.begin(), active.end());
+
+        for (size_t start = 0; start < active.size();) {
+            const uint32_t nodeIdx = active[start].first;
+            size_t end = start;
+            while (end < active.size() and active[end].first == nodeIdx) end++;
 
-                if (dirIsNeg[node.axis]) {
-                    rayState.toVisitPush(move(children[LEFT]));
-                    rayState.toVisitPush(move(children[RIGHT]));
-                } else {
-                    rayState.toVisitPush(move(children[RIGHT]));
-                    rayState.toVisitPush(move(children[LEFT]));
+            const size_t groupSize = end - start;
+
+            current.clear();
+            groupRays.clear();
+            groupInvDirs.clear();
+            groupDirIsNeg.clear();
+
+            for (size_t i = start; i < end; i++) {
+                auto &rayState = *rays[active[i].second];
+                auto &state = states[active[i].second];
+
+                current.push_back(move(rayState.toVisitTop()));
+                rayState.toVisitPop();
+                nNodesVisited++;
+
+                state.Prepare(rayState, current.back().transformed);
+                groupRays.push_back(&state.ray);
+                groupInvDirs.push_back(&state.invDir);
+                groupDirIsNeg.push_back(&state.dirIsNeg);
+            }
+
+            for (size_t i = 0; i < groupSize; i += 4) {
+                const size_t count = min<size_t>(4, groupSize - i);
+
+                /* wide nodes test their children, one ray at a time */
+                const uint32_t mask =
+                    treelet.node_width == 2
+                        ? IntersectBoundsBatch(
+                              treelet.nodes[nodeIdx].bounds, &groupRays[i],
+                              &groupInvDirs[i], &groupDirIsNeg[i], count)
+                        : (1u << count) - 1;
+
+                for (size_t j = 0; j < count; j++) {
+                    if (mask & (1u << j)) {
+                        const uint32_t r = active[start + i + j].second;
+                        auto &state = states[r];
+
+                        NodeExpansion expansion;
+                        expandNode(treelet, nodeIdx, state.ray, state.invDir,
+                                   state.dirIsNeg, expansion, false);
+                        traceNode(*rays[r], state, current[i + j], treelet,
+                                  expansion);
+                    }
                 }
             }
-        } else {
-            if (rayState.toVisitEmpty()) break;
+
+            start = end;
         }
+
+        /* drop the rays that are done or have moved on to another treelet */
+        size_t kept = 0;
+        for (size_t i = 0; i < active.size(); i++) {
+            const auto &rayState = *rays[active[i].second];
+            if (rayState.toVisitEmpty() or
+                rayState.toVisitTop().treelet != currentTreelet) {
+                continue;
+            }
+
+            active[kept].first = rayState.toVisitTop().node;
+            active[kept].second = active[i].second;
+            kept++;
+        }
+
+        active.resize(kept);
     }
 }
 
 bool CloudBVH::Intersect(const Ray &ray, SurfaceInteraction *isect) const {
+    /* the caller is done with the previous intersection */
+    if (cache_budget_) releaseHits();
     return Intersect(ray, isect, bvh_root_);
 }
 
+void CloudBVH::holdHit(const uint32_t root_id) const {
+    pinTreelet(root_id);
+
+    unique_lock<mutex> lock{hit_pins_mutex_};
+    hit_pins_[this_thread::get_id()].push_back(root_id);
+}
+
+void CloudBVH::releaseHits() const {
+    vector<uint32_t> held;
+
+    {
+        unique_lock<mutex> lock{hit_pins_mutex_};
+        auto it = hit_pins_.find(this_thread::get_id());
+        if (it == hit_pins_.end()) return;
+        held.swap(it->second);
+    }
+
+    for (const uint32_t root_id : held) unpinTreelet(root_id);
+}
+
 bool CloudBVH::Intersect(const Ray &ray, SurfaceInteraction *isect,
                          const uint32_t bvh_root) const {
     ProfilePhase _(Prof::AccelIntersect);
@@ -613,8 +1641,7 @@ bool CloudBVH::Intersect(const Ray &ray, SurfaceInteraction *isect,
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
 
     // Follow ray through BVH nodes to find primitive intersections
-    pair<uint32_t, uint32_t> toVisit[64];
-    uint8_t toVisitOffset = 0;
+    TraversalStack<pair<uint32_t, uint32_t>> toVisit;
 
     uint32_t startTreelet = bvh_root;
     if (bvh_root == 0) {
@@ -622,45 +1649,29 @@ bool CloudBVH::Intersect(const Ray &ray, SurfaceInteraction *isect,
     }
 
     pair<uint32_t, uint32_t> current(startTreelet, 0);
+    NodeExpansion expansion;
+    TreeletPin pin;
 
-    uint32_t prevTreelet = startTreelet;
     while (true) {
-        checkIfTreeletIsLoaded(current.first);
-        auto &treelet = *treelets_[current.first];
-        auto &node = treelet.nodes[current.second];
+        pin.Reset(*this, current.first);
+        auto &treelet = *pin.treelet_;
 
         // Check ray against BVH node
-        if (node.bounds.IntersectP(ray, invDir, dirIsNeg)) {
-            if (node.is_leaf()) {
-                auto &primitives = treelet.primitives;
-                for (int i = node.primitive_offset;
-                     i < node.primitive_offset + node.primitive_count; i++) {
-                    if (primitives[i]->Intersect(ray, isect)) hit = true;
-                }
-
-                if (toVisitOffset == 0) break;
-                current = toVisit[--toVisitOffset];
-            } else {
-                pair<uint32_t, uint32_t> children[2];
-                for (int i = 0; i < 2; i++) {
-                    children[i].first = node.child_treelet[i];
-                    children[i].second = node.child_node[i];
-                }
+        if (expandNode(treelet, current.second, ray, invDir, dirIsNeg,
+                       expansion)) {
+            if (intersectPrimitives(treelet, expansion.primitive_offset,
+                                    expansion.primitive_count, ray, isect)) {
+                hit = true;
+                if (cache_budget_) holdHit(current.first);
+            }
 
-                if (dirIsNeg[node.axis]) {
-                    toVisit[toVisitOffset++] = children[LEFT];
-                    current = children[RIGHT];
-                } else {
-                    toVisit[toVisitOffset++] = children[RIGHT];
-                    current = children[LEFT];
-                }
+            for (int i = 0; i < expansion.child_count; i++) {
+                toVisit.push(expansion.children[i]);
             }
-        } else {
-            if (toVisitOffset == 0) break;
-            current = toVisit[--toVisitOffset];
         }
 
-        prevTreelet = current.first;
+        if (toVisit.empty()) break;
+        current = toVisit.pop();
     }
 
     return hit;
@@ -677,8 +1688,7 @@ bool CloudBVH::IntersectP(const Ray &ray, const uint32_t bvh_root) const {
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
 
     // Follow ray through BVH nodes to find primitive intersections
-    uint8_t toVisitOffset = 0;
-    pair<uint32_t, uint32_t> toVisit[64];
+    TraversalStack<pair<uint32_t, uint32_t>> toVisit;
 
     uint32_t startTreelet = bvh_root;
     if (bvh_root == 0) {
@@ -686,45 +1696,28 @@ bool CloudBVH::IntersectP(const Ray &ray, const uint32_t bvh_root) const {
     }
 
     pair<uint32_t, uint32_t> current(startTreelet, 0);
+    NodeExpansion expansion;
+    TreeletPin pin;
 
-    uint32_t prevTreelet = startTreelet;
     while (true) {
-        checkIfTreeletIsLoaded(current.first);
-        auto &treelet = *treelets_[current.first];
-        auto &node = treelet.nodes[current.second];
+        pin.Reset(*this, current.first);
+        auto &treelet = *pin.treelet_;
 
         // Check ray against BVH node
-        if (node.bounds.IntersectP(ray, invDir, dirIsNeg)) {
-            if (node.is_leaf()) {
-                auto &primitives = treelet.primitives;
-                for (int i = node.primitive_offset;
-                     i < node.primitive_offset + node.primitive_count; i++) {
-                    if (primitives[i]->IntersectP(ray)) return true;
-                }
-
-                if (toVisitOffset == 0) break;
-                current = toVisit[--toVisitOffset];
-            } else {
-                pair<uint32_t, uint32_t> children[2];
-                for (int i = 0; i < 2; i++) {
-                    children[i].first = node.child_treelet[i];
-                    children[i].second = node.child_node[i];
-                }
+        if (expandNode(treelet, current.second, ray, invDir, dirIsNeg,
+                       expansion)) {
+            if (intersectPrimitivesP(treelet, expansion.primitive_offset,
+                                     expansion.primitive_count, ray)) {
+                return true;
+            }
 
-                if (dirIsNeg[node.axis]) {
-                    toVisit[toVisitOffset++] = children[LEFT];
-                    current = children[RIGHT];
-                } else {
-                    toVisit[toVisitOffset++] = children[RIGHT];
-                    current = children[LEFT];
-                }
+            for (int i = 0; i < expansion.child_count; i++) {
+                toVisit.push(expansion.children[i]);
             }
-        } else {
-            if (toVisitOffset == 0) break;
-            current = toVisit[--toVisitOffset];
         }
 
-        prevTreelet = current.first;
+        if (toVisit.empty()) break;
+        current = toVisit.pop();
     }
 
     return false;
@@ -740,7 +1733,7 @@ shared_ptr<CloudBVH> CreateCloudBVH(
 }
 
 Bounds3f CloudBVH::IncludedInstance::WorldBound() const {
-    return treelet_->nodes[nodeIdx_].bounds;
+    return nodeBounds(*treelet_, nodeIdx_);
 }
 
 bool CloudBVH::IncludedInstance::Intersect(const Ray &ray,
@@ -750,73 +1743,55 @@ bool CloudBVH::IncludedInstance::Intersect(const Ray &ray,
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
 
     // Follow ray through BVH nodes to find primitive intersections
-    int toVisitOffset = 0, currentNodeIndex = nodeIdx_;
-    int nodesToVisit[64];
+    uint32_t currentNodeIndex = nodeIdx_;
+    TraversalStack<uint32_t> nodesToVisit;
+    NodeExpansion expansion;
+
     while (true) {
-        const CloudBVH::TreeletNode *node = &treelet_->nodes[currentNodeIndex];
-        // Check ray against BVH node
-        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
-            if (node->is_leaf()) {
-                // Intersect ray with primitives in leaf BVH node
-                for (int i = 0; i < node->primitive_count; ++i)
-                    if (treelet_->primitives[node->primitive_offset + i]
-                            ->Intersect(ray, isect))
-                        hit = true;
-                if (toVisitOffset == 0) break;
-                currentNodeIndex = nodesToVisit[--toVisitOffset];
-            } else {
-                // Put far BVH node on _nodesToVisit_ stack, advance to near
-                // node
-                if (dirIsNeg[node->axis]) {
-                    nodesToVisit[toVisitOffset++] = node->child_node[LEFT];
-                    currentNodeIndex = node->child_node[RIGHT];
-                } else {
-                    nodesToVisit[toVisitOffset++] = node->child_node[RIGHT];
-                    currentNodeIndex = node->child_node[LEFT];
-                }
+        if (expandNode(*treelet_, currentNodeIndex, ray, invDir, dirIsNeg,
+                       expansion)) {
+            // Intersect ray with primitives in leaf BVH node
+            if (intersectPrimitives(*treelet_, expansion.primitive_offset,
+                                    expansion.primitive_count, ray, isect)) {
+                hit = true;
+            }
+
+            // all the nodes of an included instance are in this treelet
+            for (int i = 0; i < expansion.child_count; i++) {
+                nodesToVisit.push(expansion.children[i].second);
             }
-        } else {
-            if (toVisitOffset == 0) break;
-            currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
+
+        if (nodesToVisit.empty()) break;
+        currentNodeIndex = nodesToVisit.pop();
     }
+
     return hit;
 }
 
 bool CloudBVH::IncludedInstance::IntersectP(const Ray &ray) const {
     Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
     int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
-    int toVisitOffset = 0, currentNodeIndex = nodeIdx_;
-    int nodesToVisit[64];
+    uint32_t currentNodeIndex = nodeIdx_;
+    TraversalStack<uint32_t> nodesToVisit;
+    NodeExpansion expansion;
 
     while (true) {
-        const CloudBVH::TreeletNode *node = &treelet_->nodes[currentNodeIndex];
-        // Check ray against BVH node
-        if (node->bounds.IntersectP(ray, invDir, dirIsNeg)) {
-            if (node->is_leaf()) {
-                // Intersect ray with primitives in leaf BVH node
-                for (int i = 0; i < node->primitive_count; ++i)
-                    if (treelet_->primitives[node->primitive_offset + i]
-                            ->IntersectP(ray)) {
-                        return true;
-                    }
-                if (toVisitOffset == 0) break;
-                currentNodeIndex = nodesToVisit[--toVisitOffset];
-            } else {
-                // Put far BVH node on _nodesToVisit_ stack, advance to near
-                // node
-                if (dirIsNeg[node->axis]) {
-                    nodesToVisit[toVisitOffset++] = node->child_node[LEFT];
-                    currentNodeIndex = node->child_node[RIGHT];
-                } else {
-                    nodesToVisit[toVisitOffset++] = node->child_node[RIGHT];
-                    currentNodeIndex = node->child_node[LEFT];
-                }
+        if (expandNode(*treelet_, currentNodeIndex, ray, invDir, dirIsNeg,
+                       expansion)) {
+            // Intersect ray with primitives in leaf BVH node
+            if (intersectPrimitivesP(*treelet_, expansion.primitive_offset,
+                                     expansion.primitive_count, ray)) {
+                return true;
+            }
+
+            for (int i = 0; i < expansion.child_count; i++) {
+                nodesToVisit.push(expansion.children[i].second);
             }
-        } else {
-            if (toVisitOffset == 0) break;
-            currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
+
+        if (nodesToVisit.empty()) break;
+        currentNodeIndex = nodesToVisit.pop();
     }
 
     return false;
@@ -830,10 +1805,14 @@ Vector3f ComputeRayDir(unsigned idx) {
     return Vector3f(x ? 1 : -1, y ? 1 : -1, z ? 1 : -1);
 }
 
+unsigned RayOctant(const Vector3f &dir) {
+    return (signbit(dir.x) ? 0 : 1) + ((signbit(dir.y) ? 0 : 1) << 1) +
+           ((signbit(dir.z) ? 0 : 1) << 2);
+}
+
 unsigned ComputeIdx(const Vector3f &dir) {
     if (PbrtOptions.directionalTreelets) {
-        return (dir.x >= 0 ? 1 : 0) + ((dir.y >= 0 ? 1 : 0) << 1) +
-               ((dir.z >= 0 ? 1 : 0) << 2);
+        return RayOctant(dir);
     } else {
         return 0;
     }
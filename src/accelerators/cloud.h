@@ -1,14 +1,18 @@
 #ifndef PBRT_ACCELERATORS_CLOUD_BVH_H
 #define PBRT_ACCELERATORS_CLOUD_BVH_H
 
+#include <cmath>
+#include <condition_variable>
 #include <deque>
 #include <istream>
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <stack>
 #include <stdexcept>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -19,11 +23,14 @@
 #include "primitive.h"
 #include "texture.h"
 #include "transform.h"
+#include "util/mmap.h"
+#include "util/small_stack.h"
 
 namespace pbrt {
 
 struct TreeletNode;
 class TriangleMesh;
+class Triangle;
 
 class PlaceholderMaterial : public Material {
   public:
@@ -44,6 +51,9 @@ class PlaceholderMaterial : public Material {
 };
 
 class CloudBVH : public Aggregate {
+  private:
+    struct Treelet;
+
   public:
     CloudBVH(const uint32_t bvh_root, const bool preload_all,
              const std::vector<std::shared_ptr<pbrt::Light>> *lights = nullptr);
@@ -55,6 +65,9 @@ class CloudBVH : public Aggregate {
 
     Bounds3f WorldBound() const;
 
+    /* the primitive and shape of a hit point into the treelet that holds
+     * it. With a cache budget, that treelet stays pinned until the same
+     * thread calls Intersect() again, so the intersection can be shaded. */
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
 
@@ -63,11 +76,62 @@ class CloudBVH : public Aggregate {
 
     void Trace(RayState &rayState) const;
 
+    /* Traces a batch of rays that are all currently in the same treelet.
+     * Rays waiting on the same node are tested against it together, and the
+     * per-ray results match calling Trace() on each ray. */
+    void TraceBatch(std::vector<RayStatePtr> &rays) const;
+
     void LoadTreelet(const uint32_t root_id, const char *buffer = nullptr,
                      const size_t length = 0);
 
     const Material *GetMaterial(const uint32_t material_id) const;
 
+    /* the material with the given key; its treelet must be pinned for as
+     * long as the material is in use */
+    const Material *GetMaterial(const MaterialKey &key) const;
+
+    /* Without preloading, a CloudBVH can serve as a cache of treelets. With
+     * a budget set, treelets that rays need are loaded on demand, and once
+     * the treelets' total footprint goes over the budget, the least
+     * recently used ones that are not pinned are evicted. Treelets are
+     * pinned while rays are being traced through them. */
+    void SetCacheBudget(const size_t bytes);
+    size_t CacheBudget() const { return cache_budget_; }
+    size_t CacheFootprint() const;
+
+    /* whether the treelet is loaded right now, i.e. whether pinning it
+     * wouldn't have to read it */
+    bool IsLoaded(const uint32_t root_id) const;
+
+    /* With a cache, treelets can also be loaded ahead of time by a pool of
+     * threads. Prefetch() is a hint that a treelet will be needed soon and
+     * returns right away; a ray that needs a treelet that is still being
+     * loaded waits for it instead of loading it again. */
+    void SetPrefetchThreads(const size_t count);
+    void Prefetch(const uint32_t root_id) const;
+
+    /* keeps a treelet loaded for as long as it's alive */
+    class TreeletPin {
+      public:
+        TreeletPin() = default;
+        TreeletPin(const CloudBVH &bvh, const uint32_t root_id);
+        ~TreeletPin() { Reset(); }
+
+        TreeletPin(const TreeletPin &) = delete;
+        TreeletPin &operator=(const TreeletPin &) = delete;
+
+        /* pins `root_id` instead, unless it is the treelet already pinned */
+        void Reset(const CloudBVH &bvh, const uint32_t root_id);
+        void Reset();
+
+      private:
+        friend class CloudBVH;
+
+        const CloudBVH *bvh_{nullptr};
+        const Treelet *treelet_{nullptr};
+        uint32_t root_id_{0};
+    };
+
     struct TreeletNode {
         Bounds3f bounds{};
         uint8_t axis{};
@@ -92,6 +156,107 @@ class CloudBVH : public Aggregate {
         bool is_leaf() const { return leaf_tag == ~0; }
     };
 
+    /* Wide nodes: the bounds of up to N children are quantized to 8 bits per
+     * axis relative to the node's own bounds and stored SoA, so a ray can be
+     * tested against all of them at once. A child is either another wide node
+     * (maybe in another treelet) or a leaf of this treelet; leaves have
+     * LEAF_FLAG set in `child_node` and index the treelet's leaf array. */
+    static constexpr uint32_t LEAF_FLAG = 1u << 31;
+
+    struct TreeletLeaf {
+        uint32_t primitive_offset{0};
+        uint32_t primitive_count{0};
+    };
+
+    /* Leaves index a flat array with one entry per primitive: the vertices
+     * of a triangle, in world space, and the mesh it comes from. Instances
+     * are marked with INSTANCE and refer to the treelet's primitives. */
+    struct TreeletTriangle {
+        static constexpr uint32_t INSTANCE = UINT32_MAX;
+
+        Point3f p0{}, p1{}, p2{};
+        uint32_t mesh_index{INSTANCE};
+        uint32_t index{0}; /* triangle number in the mesh, or the instance */
+
+        bool IsInstance() const { return mesh_index == INSTANCE; }
+
+        /* the watertight test of Triangle::Intersect(), up to and including
+         * the check on t; does not look at alpha masks */
+        bool Intersect(const Ray &ray) const;
+    };
+
+    template <int N>
+    struct WideTreeletNode {
+        float origin[3]{};
+        float scale[3]{};
+        uint8_t child_count{0};
+        uint8_t lo[3][N]{};
+        uint8_t hi[3][N]{};
+        uint16_t child_treelet[N]{};
+        uint32_t child_node[N]{};
+
+        void SetBounds(const Bounds3f &bounds) {
+            for (int a = 0; a < 3; a++) {
+                origin[a] = bounds.pMin[a];
+
+                /* 254 steps, so that the last one leaves room for rounding */
+                const float extent = bounds.pMax[a] - bounds.pMin[a];
+                int exponent = 0;
+                if (extent > 0) std::frexp(extent / 254, &exponent);
+                scale[a] = std::ldexp(1.f, exponent);
+            }
+        }
+
+        void AddChild(const Bounds3f &bounds, const uint16_t treelet,
+                      const uint32_t node) {
+            CHECK_LT(child_count, N);
+            const int i = child_count++;
+
+            for (int a = 0; a < 3; a++) {
+                const float l = (bounds.pMin[a] - origin[a]) / scale[a];
+                const float h = (bounds.pMax[a] - origin[a]) / scale[a];
+                int ql = Clamp((int)std::floor(l), 0, 255);
+                int qh = Clamp((int)std::ceil(h), 0, 255);
+
+                /* the quantized box must enclose the real one */
+                while (ql > 0 && Dequantize(a, ql) > bounds.pMin[a]) ql--;
+                while (qh < 255 && Dequantize(a, qh) < bounds.pMax[a]) qh++;
+                CHECK_LE(Dequantize(a, ql), bounds.pMin[a]);
+                CHECK_GE(Dequantize(a, qh), bounds.pMax[a]);
+
+                lo[a][i] = ql;
+                hi[a][i] = qh;
+            }
+
+            child_treelet[i] = treelet;
+            child_node[i] = node;
+        }
+
+        float Dequantize(const int axis, const int q) const {
+            return origin[axis] + q * scale[axis];
+        }
+
+        Bounds3f ChildBounds(const int i) const {
+            Bounds3f b;
+            for (int a = 0; a < 3; a++) {
+                b.pMin[a] = Dequantize(a, lo[a][i]);
+                b.pMax[a] = Dequantize(a, hi[a][i]);
+            }
+            return b;
+        }
+    };
+
+    /* Treelets that use wide nodes start with this record; treelets without
+     * it use the binary TreeletNode layout. */
+    struct TreeletHeader {
+        static constexpr uint32_t MAGIC = 0x54524c54;  // "TLRT"
+        static constexpr uint32_t VERSION = 2;
+
+        uint32_t magic{MAGIC};
+        uint32_t version{VERSION};
+        uint32_t node_width{2};
+    };
+
   private:
     enum Child { LEFT = 0, RIGHT = 1 };
 
@@ -108,30 +273,45 @@ class CloudBVH : public Aggregate {
               primitive_to_world(std::move(primitive_to_world)) {}
     };
 
-    struct UnfinishedGeometricPrimitive {
-        size_t primitive_index;
-        MaterialKey material_key;
-        uint32_t area_light_id;
-        std::unique_ptr<Shape> shape;
-        size_t triangle_idx;
-
-        UnfinishedGeometricPrimitive(const size_t primitive_index,
-                                     const MaterialKey &material_key,
-                                     const uint32_t area_light_id,
-                                     std::unique_ptr<Shape> &&shape,
-                                     const size_t triangle_idx)
-            : primitive_index(primitive_index),
-              material_key(material_key),
-              area_light_id(area_light_id),
-              shape(std::move(shape)),
-              triangle_idx(triangle_idx) {}
-    };
+    class ExternalInstance;
 
     struct Treelet {
         std::map<uint32_t, std::shared_ptr<Material>> included_material{};
 
-        std::vector<TreeletNode> nodes{};
+        /* what the records are used from in place: the mapped treelet
+         * file, or the decompressed stream of a compressed treelet. Meshes,
+         * textures and nodes below are views into it. */
+        std::shared_ptr<void> backing{};
+
+        /* 2 for binary nodes, or the width of the wide nodes. The arrays
+         * point into `backing`, or into `node_storage` when the data had to
+         * be copied out (misaligned or caller-provided buffers). */
+        uint32_t node_width{2};
+        const TreeletNode *nodes{nullptr};
+        const WideTreeletNode<4> *nodes4{nullptr};
+        const WideTreeletNode<8> *nodes8{nullptr};
+        const TreeletLeaf *leaves{nullptr};
+        std::vector<std::unique_ptr<char[]>> node_storage{};
+
+        /* one entry per primitive; see TreeletTriangle */
+        std::vector<TreeletTriangle> triangles{};
+
+        /* side table with the area light of each primitive, only present if
+         * some mesh in the treelet is emissive */
+        std::vector<uint32_t> area_light_ids{};
+
+        std::vector<std::shared_ptr<TriangleMesh>> meshes{};
+        std::vector<MaterialKey> mesh_materials{};
+        std::vector<uint32_t> mesh_area_lights{};
+
+        /* a single primitive per mesh, which is what a SurfaceInteraction
+         * for any of its triangles refers to */
+        std::vector<std::unique_ptr<GeometricPrimitive>> mesh_primitives{};
+
+        /* the instances, and the external instance each points to (if any) */
         std::vector<std::unique_ptr<Primitive>> primitives{};
+        std::vector<const ExternalInstance *> external_instances{};
+
         std::vector<std::unique_ptr<Transform>> transforms{};
         std::map<uint32_t, std::shared_ptr<Primitive>> instances{};
 
@@ -140,8 +320,14 @@ class CloudBVH : public Aggregate {
 
         std::vector<std::unique_ptr<UnfinishedTransformedPrimitive>>
             unfinished_transformed{};
-        std::vector<std::unique_ptr<UnfinishedGeometricPrimitive>>
-            unfinished_geometric{};
+
+        /* the image partitions and textures the treelet added to the
+         * manager, which it removes when it's evicted */
+        std::vector<uint32_t> image_partitions{};
+        std::vector<std::string> textures{};
+
+        /* approximate number of bytes the treelet takes in memory */
+        size_t footprint{0};
     };
 
     class IncludedInstance : public Aggregate {
@@ -173,13 +359,61 @@ class CloudBVH : public Aggregate {
             return bvh_.IntersectP(ray, root_id_);
         }
 
-        uint32_t RootID() { return root_id_; }
+        uint32_t RootID() const { return root_id_; }
 
       private:
         uint32_t root_id_;
         const CloudBVH &bvh_;
     };
 
+    /* what visiting a node amounts to: a range of primitives to intersect
+     * and/or the children to visit, ordered far to near (push order) */
+    struct NodeExpansion {
+        uint32_t primitive_offset{0};
+        uint32_t primitive_count{0};
+        uint8_t child_count{0};
+        std::pair<uint32_t, uint32_t> children[8];
+    };
+
+    /* the nodes left to visit in a single Intersect() or IntersectP();
+     * wide nodes leave up to width - 1 of them per level of the tree, and
+     * deep trees spill over onto the heap */
+    template <typename T>
+    using TraversalStack = SmallStack<T, 64>;
+
+    static bool expandNode(const Treelet &treelet, const uint32_t node,
+                           const Ray &ray, const Vector3f &invDir,
+                           const int dirIsNeg[3], NodeExpansion &expansion,
+                           const bool testBounds = true);
+    static Bounds3f nodeBounds(const Treelet &treelet, const uint32_t node);
+
+    /* the triangle in `slot` as a Shape, and the full intersection with it,
+     * filling in `isect` as GeometricPrimitive::Intersect() would */
+    static Triangle triangleShape(const Treelet &treelet, const uint32_t slot);
+    static bool intersectTriangle(const Treelet &treelet, const uint32_t slot,
+                                  const Ray &ray, SurfaceInteraction *isect);
+
+    static bool intersectPrimitives(const Treelet &treelet,
+                                    const uint32_t offset,
+                                    const uint32_t count, const Ray &ray,
+                                    SurfaceInteraction *isect);
+    static bool intersectPrimitivesP(const Treelet &treelet,
+                                     const uint32_t offset,
+                                     const uint32_t count, const Ray &ray);
+
+    /* the state of a ray while it walks the nodes of a single treelet */
+    struct TraceState {
+        RayDifferential ray{};
+        Vector3f invDir{};
+        int dirIsNeg[3]{};
+        bool hasTransform{false};
+        bool hasInverse{false};
+        Transform inverseTransform{};
+
+        void Reset(const RayState &rayState);
+        void Prepare(const RayState &rayState, const bool transformed);
+    };
+
     const uint32_t bvh_root_;
     bool preloading_done_{false};
 
@@ -193,15 +427,74 @@ class CloudBVH : public Aggregate {
     std::vector<pbrt::Light *> scene_lights_{};
 
     void finalizeTreeletLoad(const uint32_t root_id);
+    void loadAndFinalizeTreelet(const uint32_t root_id, const char *buffer,
+                                const size_t length);
     void loadTreeletBase(const uint32_t root_id, const char *buffer = nullptr,
                          size_t length = 0);
+
+    /* reads and decodes a treelet without touching the BVH, and so can be
+     * called without holding any locks; setupTreelet() then links it to
+     * the rest of the BVH */
+    std::unique_ptr<Treelet> readTreelet(const uint32_t root_id,
+                                         const char *buffer,
+                                         size_t length) const;
+    void setupTreelet(const uint32_t root_id);
     void checkIfTreeletIsLoaded(const uint32_t root_id) const;
+
+    /* the treelet cache, which is only used if a budget is set; all of it
+     * is guarded by cache_mutex_ */
+    struct CacheEntry {
+        bool cached{false};
+        bool loading{false}; /* being read by a thread, without the lock */
+        bool queued{false};  /* waiting for a prefetch thread */
+        uint32_t pins{0};
+        std::list<uint32_t>::iterator lru_position{};
+    };
+
+    size_t cache_budget_{0};
+    mutable std::mutex cache_mutex_{};
+    mutable std::vector<CacheEntry> cache_entries_{};
+    mutable std::list<uint32_t> cache_lru_{}; /* most recently used first */
+    mutable size_t cache_footprint_{0};
+    mutable std::condition_variable cache_cv_{}; /* a load has finished */
+
+    mutable std::deque<uint32_t> prefetch_queue_{};
+    mutable std::condition_variable prefetch_cv_{};
+    std::vector<std::thread> prefetch_threads_{};
+    bool prefetch_stop_{false};
+
+    /* the treelets each thread's last Intersect() found hits in */
+    mutable std::mutex hit_pins_mutex_{};
+    mutable std::unordered_map<std::thread::id, std::vector<uint32_t>>
+        hit_pins_{};
+
+    void holdHit(const uint32_t root_id) const;
+    void releaseHits() const;
+
+    const Treelet &pinTreelet(const uint32_t root_id) const;
+    void unpinTreelet(const uint32_t root_id) const;
+    void loadCachedTreelet(const uint32_t root_id, const char *buffer,
+                           const size_t length,
+                           std::unique_lock<std::mutex> &lock);
+    void evictTreelets();
+    void prefetchWorker();
+
+    void traceNode(RayState &rayState, TraceState &state,
+                   RayState::TreeletNode &current, const Treelet &treelet,
+                   const NodeExpansion &expansion) const;
 };
 
 std::shared_ptr<CloudBVH> CreateCloudBVH(
     const ParamSet &ps, const std::vector<std::shared_ptr<Light>> &lights);
 
 Vector3f ComputeRayDir(unsigned idx);
+
+/* the octant of a direction, from the signs of its components; the inverse
+ * of a direction is in the same octant, signed zeros included */
+unsigned RayOctant(const Vector3f &dir);
+
+/* the octant of the treelets a ray starts in, or 0 if the treelets are not
+ * directional */
 unsigned ComputeIdx(const Vector3f &dir);
 
 }  // namespace pbrt
@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cloud/accumulator.h"
+#include "core/film.h"
+#include "pbrt/main.h"
+#include "util/exception.h"
+
+using namespace std;
+using namespace pbrt;
+
+void usage(const char *argv0) {
+    cerr << argv0 << " SCENE-DATA OUTPUT SAMPLES... [--threads N]" << endl
+         << "       [--plan SAMPLE-PLAN --threshold T [--min-samples N]"
+         << " [--budget SPP]]" << endl;
+}
+
+int main(int argc, char const *argv[]) {
+    try {
+        if (argc <= 0) {
+            abort();
+        }
+
+        if (argc < 4) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        size_t threadCount = max(1u, thread::hardware_concurrency());
+        vector<string> samplePaths;
+        string planPath;
+        AdaptiveSampling adaptive;
+        adaptive.minSamples = 0;
+        adaptive.samplesPerPixel = 0;
+
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--threads") == 0 and i + 1 < argc) {
+                threadCount = stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--plan") == 0 and i + 1 < argc) {
+                planPath = argv[++i];
+            } else if (strcmp(argv[i], "--threshold") == 0 and i + 1 < argc) {
+                adaptive.threshold = stof(argv[++i]);
+            } else if (strcmp(argv[i], "--min-samples") == 0 and
+                       i + 1 < argc) {
+                adaptive.minSamples = stoll(argv[++i]);
+            } else if (strcmp(argv[i], "--budget") == 0 and i + 1 < argc) {
+                adaptive.samplesPerPixel = stoll(argv[++i]);
+            } else {
+                samplePaths.emplace_back(argv[i]);
+            }
+        }
+
+        if (threadCount == 0 or samplePaths.empty() or
+            (not planPath.empty() and not adaptive.Enabled())) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        FLAGS_log_prefix = false;
+        google::InitGoogleLogging(argv[0]);
+
+        const string scenePath{argv[1]};
+        const string outputPath{argv[2]};
+
+        pbrt::SceneBase scene = pbrt::LoadSceneBase(scenePath, 0);
+
+        /* the files are read in parallel, all into the same film */
+        atomic<size_t> nextFile{0};
+        atomic<size_t> totalSamples{0};
+        exception_ptr error;
+        mutex errorMutex;
+
+        auto worker = [&] {
+            try {
+                for (size_t i = nextFile++; i < samplePaths.size();
+                     i = nextFile++) {
+                    totalSamples += scene.AccumulateSampleFile(samplePaths[i]);
+                }
+            } catch (...) {
+                unique_lock<mutex> lock{errorMutex};
+                if (not error) error = current_exception();
+            }
+        };
+
+        vector<thread> threads;
+        for (size_t i = 0; i < min(threadCount, samplePaths.size()); i++) {
+            threads.emplace_back(worker);
+        }
+
+        for (auto &t : threads) t.join();
+
+        if (error) rethrow_exception(error);
+
+        cerr << totalSamples << " sample(s) from " << samplePaths.size()
+             << " file(s)." << endl;
+
+        scene.WriteImage(outputPath);
+
+        if (not planPath.empty()) {
+            /* the next pass of an adaptive render; by default the budget is
+             * the scene's samples per pixel, and no pixel goes past it */
+            const int64_t spp = scene.SamplesPerPixel();
+            adaptive.maxSamples = spp;
+            adaptive.minSamples = Clamp(adaptive.minSamples, 1, spp);
+            adaptive.samplesPerPixel =
+                adaptive.samplesPerPixel
+                    ? Clamp(adaptive.samplesPerPixel, 1, spp)
+                    : spp;
+
+            const auto plan = scene.PlanSamples(adaptive);
+            size_t planned = 0;
+            for (const auto &range : plan) planned += range.count;
+
+            WriteSamplePlan(planPath, plan);
+            cerr << planned << " more sample(s) planned for " << plan.size()
+                 << " pixel(s)." << endl;
+        }
+    } catch (const exception &e) {
+        print_exception(argv[0], e);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,214 @@
+#include "accumulator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+
+#include "core/filter.h"
+#include "core/stats.h"
+#include "messages/serialization.h"
+
+using namespace std;
+
+namespace pbrt {
+
+STAT_COUNTER("Film/Samples accumulated", nAccumulatedSamples);
+
+FilmAccumulator::FilmAccumulator(Film &film)
+    : film(film),
+      pixelBounds(film.croppedPixelBounds),
+      sampleBounds(film.GetSampleBounds()),
+      filterRadius(film.filter->radius),
+      invFilterRadius(1 / filterRadius.x, 1 / filterRadius.y),
+      maxSampleLuminance(film.MaxSampleLuminance()),
+      pixels(new Pixel[max(0, pixelBounds.Area())]),
+      pixelStats(new PixelStats[max(0, sampleBounds.Area())]) {
+    /* the same table the film uses for its tiles */
+    int offset = 0;
+    for (int y = 0; y < filterTableWidth; ++y) {
+        for (int x = 0; x < filterTableWidth; ++x, ++offset) {
+            Point2f p;
+            p.x = (x + 0.5f) * filterRadius.x / filterTableWidth;
+            p.y = (y + 0.5f) * filterRadius.y / filterTableWidth;
+            filterTable[offset] = film.filter->Evaluate(p);
+        }
+    }
+}
+
+void FilmAccumulator::AddSample(const Point2f &pFilm, Spectrum L,
+                                const Float weight) {
+    if (L.y() > maxSampleLuminance) L *= maxSampleLuminance / L.y();
+
+    /* the variance of the pixel the sample was taken in */
+    const Point2i pPixel = (Point2i)Floor(pFilm);
+    if (InsideExclusive(pPixel, sampleBounds)) {
+        const Float y = L.y() * weight;
+        PixelStats &stats = pixelStats[StatsOffset(pPixel)];
+        stats.sum.Add(y);
+        stats.sumSq.Add(y * y);
+        stats.n++;
+    }
+
+    /* the pixels within the filter's reach; this follows
+     * FilmTile::AddSample */
+    const Point2f pFilmDiscrete = pFilm - Vector2f(0.5f, 0.5f);
+    Point2i p0 = (Point2i)Ceil(pFilmDiscrete - filterRadius);
+    Point2i p1 = (Point2i)Floor(pFilmDiscrete + filterRadius) + Point2i(1, 1);
+    p0 = Max(p0, pixelBounds.pMin);
+    p1 = Min(p1, pixelBounds.pMax);
+
+    int *ifx = ALLOCA(int, max(0, p1.x - p0.x));
+    for (int x = p0.x; x < p1.x; ++x) {
+        const Float fx = abs((x - pFilmDiscrete.x) * invFilterRadius.x *
+                             filterTableWidth);
+        ifx[x - p0.x] = min((int)floor(fx), filterTableWidth - 1);
+    }
+
+    int *ify = ALLOCA(int, max(0, p1.y - p0.y));
+    for (int y = p0.y; y < p1.y; ++y) {
+        const Float fy = abs((y - pFilmDiscrete.y) * invFilterRadius.y *
+                             filterTableWidth);
+        ify[y - p0.y] = min((int)floor(fy), filterTableWidth - 1);
+    }
+
+    const int width = pixelBounds.pMax.x - pixelBounds.pMin.x;
+
+    for (int y = p0.y; y < p1.y; ++y) {
+        for (int x = p0.x; x < p1.x; ++x) {
+            const Float filterWeight =
+                filterTable[ify[y - p0.y] * filterTableWidth + ifx[x - p0.x]];
+            const Spectrum contrib = L * weight * filterWeight;
+
+            Pixel &pixel = pixels[(x - pixelBounds.pMin.x) +
+                                  (y - pixelBounds.pMin.y) * width];
+
+            for (int c = 0; c < Spectrum::nSamples; ++c) {
+                pixel.contribSum[c].Add(contrib[c]);
+            }
+
+            pixel.filterWeightSum.Add(filterWeight);
+        }
+    }
+
+    sampleCount++;
+    nAccumulatedSamples++;
+}
+
+void FilmAccumulator::AddSamples(const vector<Sample> &samples) {
+    for (const auto &sample : samples) {
+        AddSample(sample.pFilm, sample.L, sample.weight);
+    }
+}
+
+size_t FilmAccumulator::AddSampleFile(const string &path) {
+    protobuf::RecordReader reader{path};
+    Sample sample;
+    size_t count = 0;
+
+    while (!reader.eof()) {
+        string sampleStr;
+        if (!reader.read(&sampleStr)) continue;
+
+        sample.Deserialize(sampleStr.data(), sampleStr.length());
+        AddSample(sample.pFilm, sample.L, sample.weight);
+        count++;
+    }
+
+    return count;
+}
+
+vector<SampleRange> FilmAccumulator::PlanSamples(
+    const AdaptiveSampling &adaptive) const {
+    vector<Point2i> pixels;
+    vector<PixelVariance> variances;
+    int64_t budget = adaptive.samplesPerPixel * sampleBounds.Area();
+
+    for (Point2i p : sampleBounds) {
+        const PixelStats &stats = pixelStats[StatsOffset(p)];
+        PixelVariance v;
+        v.sum = stats.sum;
+        v.sumSq = stats.sumSq;
+        v.n = stats.n;
+        budget -= v.n;
+
+        pixels.push_back(p);
+        variances.push_back(v);
+    }
+
+    vector<SampleRange> plan;
+    if (budget <= 0) return plan;
+
+    const vector<int64_t> extra = adaptive.Allocate(variances, budget);
+    for (size_t i = 0; i < pixels.size(); i++) {
+        if (extra[i] == 0) continue;
+        plan.push_back({pixels[i], static_cast<uint32_t>(variances[i].n),
+                        static_cast<uint32_t>(extra[i])});
+    }
+
+    return plan;
+}
+
+void FilmAccumulator::WriteImage(const string &filename) {
+    unique_lock<mutex> lock{writeMutex};
+
+    /* the sums are copied into a tile as they are; samples added while the
+     * copy is made may or may not make it into this image */
+    unique_ptr<FilmTile> tile = film.GetFilmTile(film.GetSampleBounds());
+    const int width = pixelBounds.pMax.x - pixelBounds.pMin.x;
+
+    for (Point2i p : tile->GetPixelBounds()) {
+        const Pixel &pixel = pixels[(p.x - pixelBounds.pMin.x) +
+                                    (p.y - pixelBounds.pMin.y) * width];
+        FilmTilePixel &tilePixel = tile->GetPixel(p);
+
+        for (int c = 0; c < Spectrum::nSamples; ++c) {
+            tilePixel.contribSum[c] = pixel.contribSum[c];
+        }
+
+        tilePixel.filterWeightSum = pixel.filterWeightSum;
+    }
+
+    film.Clear();
+    film.MergeFilmTile(move(tile));
+
+    if (not filename.empty()) {
+        film.SetFilename(filename);
+    }
+
+    film.WriteImage();
+}
+
+void WriteSamplePlan(const string &path, const vector<SampleRange> &plan) {
+    ofstream fout{path};
+    for (const auto &range : plan) {
+        fout << range.pixel.x << ' ' << range.pixel.y << ' ' << range.first
+             << ' ' << range.count << '\n';
+    }
+
+    if (not fout.good()) {
+        throw runtime_error("could not write sample plan: " + path);
+    }
+}
+
+vector<SampleRange> ReadSamplePlan(const string &path) {
+    ifstream fin{path};
+    if (not fin.good()) {
+        throw runtime_error("could not open sample plan: " + path);
+    }
+
+    vector<SampleRange> plan;
+    SampleRange range;
+    while (fin >> range.pixel.x >> range.pixel.y >> range.first >>
+           range.count) {
+        plan.push_back(range);
+    }
+
+    if (not fin.eof()) {
+        throw runtime_error("malformed sample plan: " + path);
+    }
+
+    return plan;
+}
+
+}  // namespace pbrt
@@ -0,0 +1,97 @@
+#ifndef PBRT_CLOUD_ACCUMULATOR_H
+#define PBRT_CLOUD_ACCUMULATOR_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "core/film.h"
+#include "core/parallel.h"
+#include "pbrt/raystate.h"
+
+namespace pbrt {
+
+/* a run of samples to take in one pixel, in a later pass of an adaptive
+ * render */
+struct SampleRange {
+    Point2i pixel;
+    uint32_t first;
+    uint32_t count;
+};
+
+/* sample plans are text files, with one "x y first count" line per range */
+void WriteSamplePlan(const std::string &path,
+                     const std::vector<SampleRange> &plan);
+std::vector<SampleRange> ReadSamplePlan(const std::string &path);
+
+/* FilmAccumulator collects the samples of a render into a Film. Any number
+ * of threads can add samples at the same time: each sample is splatted
+ * straight into per-pixel atomic sums, so adding never takes a lock and
+ * there is no per-batch tile to allocate and merge. The sums can be written
+ * out as an image at any point, even while samples are still coming in. */
+class FilmAccumulator {
+  public:
+    FilmAccumulator(Film &film);
+
+    void AddSample(const Point2f &pFilm, Spectrum L, const Float weight);
+    void AddSamples(const std::vector<Sample> &samples);
+
+    /* adds the samples in a record file of serialized Samples, one per
+     * record, as ray files hold RayStates; returns the number of samples */
+    size_t AddSampleFile(const std::string &path);
+
+    /* writes the image with everything accumulated so far */
+    void WriteImage(const std::string &filename = {});
+
+    uint64_t SampleCount() const { return sampleCount; }
+
+    /* the samples that the next pass of an adaptive render should take,
+     * based on the variance of each pixel so far; pixels are assumed to
+     * have taken their samples in order, starting from zero */
+    std::vector<SampleRange> PlanSamples(
+        const AdaptiveSampling &adaptive) const;
+
+  private:
+    struct Pixel {
+        AtomicFloat contribSum[Spectrum::nSamples];
+        AtomicFloat filterWeightSum;
+    };
+
+    /* the luminance of the samples taken in each pixel of the sample
+     * bounds, as PixelVariance tracks it for film tiles */
+    struct PixelStats {
+        AtomicFloat sum;
+        AtomicFloat sumSq;
+        std::atomic<uint32_t> n{0};
+    };
+
+    static constexpr int filterTableWidth = 16;
+
+    size_t StatsOffset(const Point2i &p) const {
+        return (p.x - sampleBounds.pMin.x) +
+               (p.y - sampleBounds.pMin.y) *
+                   (sampleBounds.pMax.x - sampleBounds.pMin.x);
+    }
+
+    Film &film;
+    const Bounds2i pixelBounds;
+    const Bounds2i sampleBounds;
+    const Vector2f filterRadius;
+    const Vector2f invFilterRadius;
+    const Float maxSampleLuminance;
+    Float filterTable[filterTableWidth * filterTableWidth];
+
+    std::unique_ptr<Pixel[]> pixels;
+    std::unique_ptr<PixelStats[]> pixelStats;
+    std::atomic<uint64_t> sampleCount{0};
+
+    /* writing the image goes through the film, one writer at a time */
+    std::mutex writeMutex{};
+};
+
+}  // namespace pbrt
+
+#endif /* PBRT_CLOUD_ACCUMULATOR_H */
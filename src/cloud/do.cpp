@@ -1,10 +1,13 @@
+#include <cstring>
 #include <iostream>
-#include <queue>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "accelerators/cloud.h"
+#include "cloud/localengine.h"
 #include "cloud/manager.h"
+#include "cloud/raypacket.h"
 #include "messages/serialization.h"
 #include "messages/utils.h"
 #include "pbrt/main.h"
@@ -15,7 +18,11 @@ using namespace std;
 using namespace pbrt;
 
 void usage(const char *argv0) {
-    cerr << argv0 << " SCENE-DATA CAMERA-RAYS" << endl;
+    cerr << argv0
+         << " SCENE-DATA CAMERA-RAYS [--threads N] [--batch-size N]"
+            " [--benchmark] [--cache-budget MB] [--prefetch-threads N]"
+            " [--write-interval SECONDS]"
+         << endl;
 }
 
 int main(int argc, char const *argv[]) {
@@ -24,11 +31,38 @@ int main(int argc, char const *argv[]) {
             abort();
         }
 
-        if (argc != 3) {
+        if (argc < 3) {
             usage(argv[0]);
             return EXIT_FAILURE;
         }
 
+        LocalEngine::Config config;
+        config.threadCount = max(1u, thread::hardware_concurrency());
+        size_t cacheBudget = 0;
+        size_t prefetchThreads = 2;
+
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--threads") == 0 and i + 1 < argc) {
+                config.threadCount = stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--batch-size") == 0 and i + 1 < argc) {
+                config.batchSize = stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--benchmark") == 0) {
+                config.benchmark = true;
+            } else if (strcmp(argv[i], "--cache-budget") == 0 and
+                       i + 1 < argc) {
+                cacheBudget = stoul(argv[++i]) * 1024 * 1024;
+            } else if (strcmp(argv[i], "--prefetch-threads") == 0 and
+                       i + 1 < argc) {
+                prefetchThreads = stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--write-interval") == 0 and
+                       i + 1 < argc) {
+                config.writeInterval = stod(argv[++i]);
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+
         FLAGS_log_prefix = false;
         google::InitGoogleLogging(argv[0]);
 
@@ -38,64 +72,76 @@ int main(int argc, char const *argv[]) {
         pbrt::SceneBase scene = pbrt::LoadSceneBase(scenePath, 0);
 
         /* prepare the scene */
-        MemoryArena arena;
         vector<shared_ptr<CloudBVH>> treelets;
 
-        /* let's load all the treelets */
-        for (size_t i = 0; i < scene.TreeletCount(); i++) {
-            cerr << "Loading treelet " << i << "... ";
-            treelets.push_back(pbrt::LoadTreelet(scenePath, i));
-            cerr << "done." << endl;
+        if (cacheBudget) {
+            /* a single cache serves all the treelets, loading them as rays
+             * reach them */
+            auto cache = make_shared<CloudBVH>(0, false);
+            cache->SetCacheBudget(cacheBudget);
+            cache->SetPrefetchThreads(prefetchThreads);
+            treelets.assign(scene.TreeletCount(), cache);
+        } else {
+            /* let's load all the treelets */
+            for (size_t i = 0; i < scene.TreeletCount(); i++) {
+                cerr << "Loading treelet " << i << "... ";
+                treelets.push_back(pbrt::LoadTreelet(scenePath, i));
+                cerr << "done." << endl;
+            }
         }
 
-        queue<RayStatePtr> rayList;
-        vector<Sample> samples;
+        LocalEngine engine{scene, treelets, config};
 
-        /* loading all the rays */
+        /* loading all the rays; files of compact rays or ray packets start
+         * with a header record */
         {
             protobuf::RecordReader reader{raysPath};
+            auto format = RayState::Format::Packed;
+            bool packets = false;
+            bool first = true;
+
             while (!reader.eof()) {
                 string rayStr;
 
                 if (reader.read(&rayStr)) {
+                    if (first && rayStr == RayState::CompactStreamHeader) {
+                        format = RayState::Format::Compact;
+                        first = false;
+                        continue;
+                    } else if (first && rayStr == RayPacket::StreamHeader) {
+                        packets = true;
+                        first = false;
+                        continue;
+                    }
+
+                    first = false;
+
+                    if (packets) {
+                        RayPacket::Reader packet{rayStr};
+                        for (size_t i = 0; i < packet.Count(); i++) {
+                            auto rayStatePtr = RayState::Create();
+                            packet.Next(*rayStatePtr);
+                            engine.Enqueue(move(rayStatePtr));
+                        }
+
+                        continue;
+                    }
+
                     auto rayStatePtr = RayState::Create();
-                    rayStatePtr->Deserialize(rayStr.data(), rayStr.length());
-                    rayList.push(move(rayStatePtr));
+                    rayStatePtr->Deserialize(rayStr.data(), rayStr.length(),
+                                             format);
+                    engine.Enqueue(move(rayStatePtr));
                 }
             }
         }
 
-        cerr << rayList.size() << " RayState(s) loaded." << endl;
+        cerr << engine.PendingRays() << " RayState(s) loaded." << endl;
 
-        if (!rayList.size()) {
+        if (!engine.PendingRays()) {
             return EXIT_SUCCESS;
         }
 
-        while (!rayList.empty()) {
-            RayStatePtr theRayPtr = move(rayList.front());
-            rayList.pop();
-
-            ProcessRayOutput processOutput;
-            auto &treelet = *treelets[theRayPtr->CurrentTreelet()];
-            scene.ProcessRay(move(theRayPtr), treelet, arena, processOutput);
-
-            for (auto &r : processOutput.rays) {
-                if (r) rayList.push(move(r));
-            }
-
-            if (processOutput.sample) {
-                samples.emplace_back(*processOutput.sample);
-            }
-
-            if (samples.size() > 1000) {
-                scene.AccumulateImage(samples);
-                samples.clear();
-            }
-        }
-
-        if (not samples.empty()) {
-            scene.AccumulateImage(samples);
-        }
+        engine.Run();
 
         scene.WriteImage();
     } catch (const exception &e) {
@@ -1,8 +1,12 @@
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include "cloud/accumulator.h"
+#include "cloud/raypacket.h"
 #include "core/camera.h"
 #include "core/geometry.h"
 #include "core/transform.h"
@@ -14,7 +18,8 @@ using namespace std;
 using namespace pbrt;
 
 void usage(const char *argv0) {
-    cerr << argv0 << " SCENE-DATA OUTPUT [SPP]" << endl;
+    cerr << argv0 << " SCENE-DATA OUTPUT [SPP] [--compact | --packet-size N]"
+         << " [--samples N | --plan SAMPLE-PLAN]" << endl;
 }
 
 int main(int argc, char const *argv[]) {
@@ -34,9 +39,27 @@ int main(int argc, char const *argv[]) {
         const string scenePath{argv[1]};
         const string outputPath{argv[2]};
         int spp = 0;
+        auto format = RayState::Format::Packed;
+        size_t packetSize = 0;
+        size_t samples = 0;
+        string planPath;
 
-        if (argc == 4) {
-            spp = stoi(argv[3]);
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--compact") == 0) {
+                format = RayState::Format::Compact;
+            } else if (strcmp(argv[i], "--packet-size") == 0 and
+                       i + 1 < argc) {
+                packetSize = stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--samples") == 0 and i + 1 < argc) {
+                samples = stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--plan") == 0 and i + 1 < argc) {
+                planPath = argv[++i];
+            } else if (i == 3) {
+                spp = stoi(argv[i]);
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
         }
 
         pbrt::SceneBase scene = pbrt::LoadSceneBase(scenePath, spp);
@@ -46,15 +69,60 @@ int main(int argc, char const *argv[]) {
         protobuf::RecordWriter rayWriter{outputPath};
         size_t rayCount = 0;
 
-        char rayBuffer[sizeof(RayState)];
+        if (packetSize) {
+            rayWriter.write(RayPacket::StreamHeader);
+        } else if (format == RayState::Format::Compact) {
+            rayWriter.write(RayState::CompactStreamHeader);
+        }
+
+        vector<char> rayBuffer;
+        RayPacket::Writer packetWriter;
+
+        auto writeRay = [&](const Point2i &pixel, const uint32_t sample) {
+            auto ray = scene.GenerateCameraRay(pixel, sample);
+            if (not ray) return;
+            rayCount++;
+
+            if (packetSize) {
+                packetWriter.Add(*ray);
+                if (packetWriter.Count() == packetSize) {
+                    rayWriter.write(packetWriter.Finish());
+                }
+
+                return;
+            }
+
+            rayBuffer.resize(ray->MaxCompressedSize(format));
+            const auto len = ray->Serialize(rayBuffer.data(), format);
+            rayWriter.write(rayBuffer.data() + 4, len - 4);
+        };
+
+        const size_t samplesPerPixel = scene.SamplesPerPixel();
 
-        for (size_t sample = 0; sample < scene.SamplesPerPixel(); sample++) {
-            for (Point2i pixel : scene.SampleBounds()) {
-                auto ray = scene.GenerateCameraRay(pixel, sample);
-                const auto len = ray->Serialize(rayBuffer);
-                rayWriter.write(rayBuffer + 4, len - 4);
-                rayCount++;
+        if (not planPath.empty()) {
+            /* a later pass of an adaptive render: only the samples in the
+             * plan, which never go past the scene's samples per pixel */
+            for (const auto &range : ReadSamplePlan(planPath)) {
+                const size_t end =
+                    min<size_t>(range.first + range.count, samplesPerPixel);
+                for (size_t sample = range.first; sample < end; sample++) {
+                    writeRay(range.pixel, sample);
+                }
             }
+        } else {
+            /* --samples takes only the first samples of every pixel, as the
+             * first pass of an adaptive render */
+            const size_t count =
+                samples ? min(samples, samplesPerPixel) : samplesPerPixel;
+            for (size_t sample = 0; sample < count; sample++) {
+                for (Point2i pixel : scene.SampleBounds()) {
+                    writeRay(pixel, sample);
+                }
+            }
+        }
+
+        if (not packetWriter.Empty()) {
+            rayWriter.write(packetWriter.Finish());
         }
 
         cerr << rayCount << " rays(s) were generated and written to "
@@ -1,4 +1,5 @@
 #include "accelerators/cloud.h"
+#include "cloud/accumulator.h"
 #include "cloud/manager.h"
 #include "core/camera.h"
 #include "core/geometry.h"
@@ -101,6 +102,9 @@ string GetObjectName(const ObjectType type, const uint32_t id) {
 SceneBase::SceneBase(const std::string &path, const int samplesPerPixel) {
     using namespace pbrt::global;
 
+    /* this only keeps pbrt's ParallelFor from expecting a thread pool while
+     * the scene objects are loaded; rays can still be generated and
+     * processed on any number of threads, as the sampler is stateless */
     PbrtOptions.nThreads = 1;
     manager.init(path);
 
@@ -108,6 +112,7 @@ SceneBase::SceneBase(const std::string &path, const int samplesPerPixel) {
     protobuf::Camera proto_camera;
     reader->read(&proto_camera);
     camera = camera::from_protobuf(proto_camera, transformCache);
+    accumulator = make_shared<FilmAccumulator>(*camera->film);
 
     reader = manager.GetReader(ObjectType::Sampler);
     protobuf::Sampler proto_sampler;
@@ -213,6 +218,31 @@ shared_ptr<CloudBVH> LoadTreelet(const string &path, const TreeletId treeletId,
     return treelet;
 }
 
+static void ResetOutput(const RayState &r, ProcessRayOutput &output) {
+    output.pathId = r.PathID();
+    output.pathFinished = false;
+    output.rays[0] = nullptr;
+    output.rays[1] = nullptr;
+    output.rays[2] = nullptr;
+    output.sample = nullptr;
+}
+
+static void ProcessShadedRay(
+    tuple<RayStatePtr, RayStatePtr, RayStatePtr> &&shaded,
+    ProcessRayOutput &output) {
+    RayStatePtr bounceRay, shadowRay, lightRay;
+    tie(bounceRay, shadowRay, lightRay) = move(shaded);
+
+    if (!bounceRay and !shadowRay) {
+        output.pathFinished = true;
+        return;
+    }
+
+    if (bounceRay) output.rays[0] = move(bounceRay);
+    if (shadowRay) output.rays[1] = move(shadowRay);
+    if (lightRay) output.rays[2] = move(lightRay);
+}
+
 set<ObjectKey> &SceneBase::TreeletDependencies(const TreeletId treeletId) {
     return treeletDependencies.at(treeletId);
 }
@@ -228,37 +258,23 @@ void SceneBase::ProcessRay(RayStatePtr &&rayStatePtr, const CloudBVH &treelet,
 
     nProcessRayCalls++;
     auto &r = *rayStatePtr;
-
-    output.pathId = r.PathID();
-    output.pathFinished = false;
-    output.rays[0] = nullptr;
-    output.rays[1] = nullptr;
-    output.rays[2] = nullptr;
-    output.sample = nullptr;
-
-    RayStatePtr tracedRay;
+    ResetOutput(r, output);
 
     if (!r.toVisitEmpty()) {
-        tracedRay = CloudIntegrator::Trace(move(rayStatePtr), treelet);
+        ProcessTracedRay(CloudIntegrator::Trace(move(rayStatePtr), treelet),
+                         output);
+        return;
     } else if (r.HasHit()) {
-        RayStatePtr bounceRay, shadowRay, lightRay;
-
-        tie(bounceRay, shadowRay, lightRay) =
+        ProcessShadedRay(
             CloudIntegrator::Shade(move(rayStatePtr), treelet, *fakeScene,
-                                   sampleExtent, sampler, maxPathDepth, arena);
-
-        if (!bounceRay and !shadowRay) {
-            output.pathFinished = true;
-            return;
-        }
-
-        if (bounceRay) output.rays[0] = move(bounceRay);
-        if (shadowRay) output.rays[1] = move(shadowRay);
-        if (lightRay) output.rays[2] = move(lightRay);
+                                   sampleExtent, *sampler,
+                                   maxPathDepth, arena),
+            output);
         return;
     } else if (r.needsImageSampling) {
-        auto &p = _manager.getInMemoryImagePartition(r.imageSampleInfo.imageId);
-        const auto Li = p.Lookup(r.imageSampleInfo.uv);
+        const auto p =
+            _manager.getInMemoryImagePartition(r.imageSampleInfo.imageId);
+        const auto Li = p->Lookup(r.imageSampleInfo.uv);
         r.Ld *= Li;
 
         if ((r.IsShadowRay() and r.remainingBounces == 0) ||
@@ -272,7 +288,80 @@ void SceneBase::ProcessRay(RayStatePtr &&rayStatePtr, const CloudBVH &treelet,
     } else {
         throw runtime_error("ProcessRay: invalid ray");
     }
+}
+
+void SceneBase::ProcessRays(vector<RayStatePtr> &rays, const CloudBVH &treelet,
+                            MemoryArena &arena,
+                            vector<ProcessRayOutput> &outputs) {
+    outputs.resize(rays.size());
+
+    vector<RayStatePtr> toTrace;
+    vector<size_t> traceIndices;
+
+    for (size_t i = 0; i < rays.size(); i++) {
+        if (!rays[i]->toVisitEmpty()) {
+            traceIndices.push_back(i);
+            toTrace.push_back(move(rays[i]));
+        }
+    }
+
+    if (!toTrace.empty()) {
+        const auto start_time = chrono::steady_clock::now();
+        CloudIntegrator::TraceBatch(toTrace, treelet);
+
+        for (size_t i = 0; i < toTrace.size(); i++) {
+            nProcessRayCalls++;
+            ResetOutput(*toTrace[i], outputs[traceIndices[i]]);
+            ProcessTracedRay(move(toTrace[i]), outputs[traceIndices[i]]);
+        }
+
+        totalProcessTime += chrono::duration_cast<chrono::nanoseconds>(
+                                chrono::steady_clock::now() - start_time)
+                                .count();
+    }
+
+    /* the hits are shaded as one batch, grouped by material */
+    vector<RayStatePtr> toShade;
+    vector<size_t> shadeIndices;
+
+    for (size_t i = 0; i < rays.size(); i++) {
+        if (rays[i] && rays[i]->HasHit()) {
+            shadeIndices.push_back(i);
+            toShade.push_back(move(rays[i]));
+        }
+    }
+
+    if (!toShade.empty()) {
+        const auto start_time = chrono::steady_clock::now();
+
+        for (size_t i = 0; i < toShade.size(); i++) {
+            nProcessRayCalls++;
+            ResetOutput(*toShade[i], outputs[shadeIndices[i]]);
+        }
+
+        vector<tuple<RayStatePtr, RayStatePtr, RayStatePtr>> shaded;
+        CloudIntegrator::ShadeBatch(toShade, treelet, *fakeScene,
+                                    sampleExtent, *sampler,
+                                    maxPathDepth, arena, shaded);
 
+        for (size_t i = 0; i < shaded.size(); i++) {
+            ProcessShadedRay(move(shaded[i]), outputs[shadeIndices[i]]);
+        }
+
+        totalProcessTime += chrono::duration_cast<chrono::nanoseconds>(
+                                chrono::steady_clock::now() - start_time)
+                                .count();
+    }
+
+    for (size_t i = 0; i < rays.size(); i++) {
+        if (rays[i]) {
+            ProcessRay(move(rays[i]), treelet, arena, outputs[i]);
+        }
+    }
+}
+
+void SceneBase::ProcessTracedRay(RayStatePtr &&tracedRay,
+                                 ProcessRayOutput &output) {
     if (!tracedRay) {
         throw runtime_error("traced ray cannot be null");
     }
@@ -305,12 +394,12 @@ void SceneBase::ProcessRay(RayStatePtr &&rayStatePtr, const CloudBVH &treelet,
             const auto sLight = ray.lightRayInfo.sampledLightId;
 
             if (hit) {
-                const auto aLight = ray.hitInfo.arealight;
+                const auto aLight = ray.hitInfo->arealight;
 
                 if (aLight == sLight) {
                     Li = dynamic_cast<AreaLight *>(
                              fakeScene->lights[aLight - 1].get())
-                             ->L(ray.hitInfo.isect,
+                             ->L(ray.hitInfo->isect,
                                  -ray.lightRayInfo.sampledDirection);
                 }
             } else {
@@ -390,18 +479,15 @@ RayStatePtr SceneBase::GenerateCameraRay(const Point2i &pixel,
     }
 
     const Float rayScale = 1 / sqrt((Float)samplesPerPixel);
-
-    sampler->StartPixel(pixel);
-    sampler->SetSampleNumber(sample);
-
-    CameraSample cameraSample = sampler->GetCameraSample(pixel);
+    GlobalSampler::Stream samples{*sampler, pixel, sample};
+    CameraSample cameraSample = samples.GetCameraSample(pixel);
 
     RayStatePtr statePtr = RayState::Create();
     RayState &state = *statePtr;
 
     state.sample.id =
         (pixel.x + pixel.y * sampleExtent.x) * samplesPerPixel + sample;
-    state.sample.dim = sampler->GetCurrentDimension();
+    state.sample.dim = samples.GetCurrentDimension();
     state.sample.pFilm = cameraSample.pFilm;
     state.sample.weight =
         camera->GenerateRayDifferential(cameraSample, &state.ray);
@@ -417,22 +503,19 @@ RayStatePtr SceneBase::GenerateCameraRay(const Point2i &pixel,
 }
 
 void SceneBase::AccumulateImage(const vector<Sample> &rays) {
-    const Bounds2i sampleBounds = camera->film->GetSampleBounds();
-    unique_ptr<FilmTile> filmTile = camera->film->GetFilmTile(sampleBounds);
+    accumulator->AddSamples(rays);
+}
 
-    for (const auto &ray : rays) {
-        filmTile->AddSample(ray.pFilm, ray.L, ray.weight, true);
-    }
+size_t SceneBase::AccumulateSampleFile(const string &path) {
+    return accumulator->AddSampleFile(path);
+}
 
-    camera->film->MergeFilmTile(move(filmTile));
+vector<SampleRange> SceneBase::PlanSamples(const AdaptiveSampling &adaptive) {
+    return accumulator->PlanSamples(adaptive);
 }
 
 void SceneBase::WriteImage(const string &filename) {
-    if (not filename.empty()) {
-        camera->film->SetFilename(filename);
-    }
-
-    camera->film->WriteImage();
+    accumulator->WriteImage(filename);
 }
 
 }  // namespace pbrt
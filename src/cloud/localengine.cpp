@@ -0,0 +1,313 @@
+#include "localengine.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+#include "core/stats.h"
+#include "util/exception.h"
+
+using namespace std;
+
+namespace pbrt {
+
+STAT_COUNTER("LocalEngine/Batches processed", nBatches);
+STAT_COUNTER("LocalEngine/Batches stolen", nStolenBatches);
+
+LocalEngine::LocalEngine(SceneBase &scene,
+                         vector<shared_ptr<CloudBVH>> &treelets,
+                         const Config &config)
+    : scene(scene), treelets(treelets), config(config) {
+    if (config.threadCount == 0 or config.batchSize == 0) {
+        throw runtime_error("LocalEngine: invalid configuration");
+    }
+
+    for (size_t i = 0; i < treelets.size(); i++) {
+        queues.emplace_back(make_unique<Queue>());
+    }
+}
+
+void LocalEngine::Enqueue(RayStatePtr &&ray) {
+    const TreeletId treeletId = ray->CurrentTreelet();
+    if (treeletId >= queues.size()) {
+        throw runtime_error("LocalEngine: ray for unknown treelet " +
+                            to_string(treeletId));
+    }
+
+    pendingRays++;
+
+    auto &queue = *queues[treeletId];
+    size_t depth;
+
+    {
+        unique_lock<mutex> lock{queue.mutex};
+        queue.rays.push_back(move(ray));
+        depth = queue.size = queue.rays.size();
+        queuedRays++;
+    }
+
+    WakeWorkers(false);
+
+    /* a treelet is about to be needed when its queue gets its first ray,
+     * and more so once it has a full batch; with a treelet cache, it can
+     * be loaded while the workers are busy with other treelets */
+    if (depth == 1 or depth == config.batchSize) {
+        treelets[treeletId]->Prefetch(treeletId);
+    }
+}
+
+bool LocalEngine::PopBatch(const size_t workerId, vector<RayStatePtr> &batch,
+                           TreeletId &treeletId) {
+    /* first, look for the fullest queue owned by this worker; if there is
+     * none, steal from the fullest queue overall */
+    const size_t threadCount = config.threadCount;
+
+    for (const bool steal : {false, true}) {
+        size_t best = queues.size();
+        size_t bestSize = 0;
+
+        for (size_t i = 0; i < queues.size(); i++) {
+            const bool owned = (i % threadCount) == workerId;
+            if (owned == steal) continue;
+
+            const size_t size = queues[i]->size;
+            if (size > bestSize) {
+                best = i;
+                bestSize = size;
+            }
+        }
+
+        if (best == queues.size()) continue;
+
+        auto &queue = *queues[best];
+        unique_lock<mutex> lock{queue.mutex};
+        if (queue.rays.empty()) continue;
+
+        const size_t depth = queue.rays.size();
+        const size_t count = min(depth, config.batchSize);
+
+        for (size_t i = 0; i < count; i++) {
+            batch.push_back(move(queue.rays.front()));
+            queue.rays.pop_front();
+        }
+
+        queue.size = queue.rays.size();
+        queuedRays -= count;
+
+        auto &stats = queue.stats;
+        stats.rays += count;
+        stats.batches++;
+        stats.stolenBatches += steal ? 1 : 0;
+        stats.depthHistogram[min<size_t>(Log2Int(int64_t(depth)),
+                                         DEPTH_BUCKETS - 1)]++;
+
+        nBatches++;
+        if (steal) nStolenBatches++;
+
+        treeletId = best;
+        return true;
+    }
+
+    return false;
+}
+
+void LocalEngine::WaitForWork() {
+    unique_lock<mutex> lock{idleMutex};
+    idleWorkers++;
+    workAvailable.wait(lock, [this] {
+        return queuedRays > 0 or pendingRays == 0 or aborted;
+    });
+    idleWorkers--;
+}
+
+/* idleWorkers is incremented before a worker checks for work, and the
+ * state it checks is changed before this reads idleWorkers, so either the
+ * worker sees the change or it is counted here and gets notified */
+void LocalEngine::WakeWorkers(const bool all) {
+    if (idleWorkers == 0) return;
+
+    unique_lock<mutex> lock{idleMutex};
+    if (all) {
+        workAvailable.notify_all();
+    } else {
+        workAvailable.notify_one();
+    }
+}
+
+void LocalEngine::Worker(const size_t workerId) {
+    MemoryArena arena;
+    vector<RayStatePtr> batch;
+    vector<ProcessRayOutput> outputs;
+    vector<Sample> samples;
+    uint64_t samplesProduced = 0;
+
+    batch.reserve(config.batchSize);
+
+    auto flushSamples = [&] {
+        if (samples.empty()) return;
+        scene.AccumulateImage(samples);
+        samplesProduced += samples.size();
+        samples.clear();
+    };
+
+    try {
+        while (pendingRays > 0 and not aborted) {
+            TreeletId treeletId;
+            batch.clear();
+
+            if (not PopBatch(workerId, batch, treeletId)) {
+                WaitForWork();
+                continue;
+            }
+
+            const auto start = chrono::steady_clock::now();
+            const CloudBVH &treelet = *treelets[treeletId];
+
+            /* with a treelet cache, the treelet stays loaded until the whole
+             * batch is done, shading included */
+            CloudBVH::TreeletPin pin{treelet, treeletId};
+            scene.ProcessRays(batch, treelet, arena, outputs);
+
+            for (auto &output : outputs) {
+                for (auto &r : output.rays) {
+                    if (r) Enqueue(move(r));
+                }
+
+                if (output.sample) {
+                    samples.emplace_back(*output.sample);
+                }
+
+                /* only retire the ray once its children are queued, so
+                 * pendingRays never drops to zero while work remains */
+                if (--pendingRays == 0) WakeWorkers(true);
+            }
+
+            arena.Reset();
+
+            if (samples.size() >= config.samplesPerFlush) {
+                flushSamples();
+            }
+
+            const auto elapsed = chrono::duration_cast<chrono::nanoseconds>(
+                                     chrono::steady_clock::now() - start)
+                                     .count();
+
+            auto &queue = *queues[treeletId];
+            unique_lock<mutex> lock{queue.mutex};
+            queue.stats.busyNanos += elapsed;
+        }
+
+        flushSamples();
+    } catch (...) {
+        {
+            unique_lock<mutex> lock{errorMutex};
+            if (not error) error = current_exception();
+        }
+
+        aborted = true;
+        WakeWorkers(true);
+    }
+
+    {
+        unique_lock<mutex> lock{samplesMutex};
+        totalSamples += samplesProduced;
+    }
+
+    ReportThreadStats();
+    runningWorkers--;
+}
+
+void LocalEngine::Run() {
+    const auto start = chrono::steady_clock::now();
+
+    vector<thread> workers;
+    runningWorkers = config.threadCount;
+    for (size_t i = 0; i < config.threadCount; i++) {
+        workers.emplace_back(&LocalEngine::Worker, this, i);
+    }
+
+    /* the workers keep adding samples while the partial image is written */
+    if (config.writeInterval > 0) {
+        const auto interval = chrono::duration_cast<chrono::nanoseconds>(
+            chrono::duration<double>(config.writeInterval));
+        auto nextWrite = start + interval;
+
+        while (runningWorkers > 0) {
+            this_thread::sleep_for(chrono::milliseconds(50));
+
+            if (chrono::steady_clock::now() >= nextWrite and
+                runningWorkers > 0) {
+                scene.WriteImage();
+                nextWrite = chrono::steady_clock::now() + interval;
+            }
+        }
+    }
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    wallNanos = chrono::duration_cast<chrono::nanoseconds>(
+                    chrono::steady_clock::now() - start)
+                    .count();
+
+    if (error) {
+        rethrow_exception(error);
+    }
+
+    if (config.benchmark) {
+        PrintBenchmark(cerr);
+    }
+}
+
+void LocalEngine::PrintBenchmark(ostream &out) const {
+    uint64_t totalRays = 0;
+    uint64_t totalBatches = 0;
+    uint64_t totalStolen = 0;
+
+    out << "treelet,rays,batches,stolen_batches,busy_ms,rays_per_sec,"
+           "queue_depth_log2_histogram"
+        << endl;
+
+    for (size_t i = 0; i < queues.size(); i++) {
+        const auto &stats = queues[i]->stats;
+        if (stats.rays == 0) continue;
+
+        totalRays += stats.rays;
+        totalBatches += stats.batches;
+        totalStolen += stats.stolenBatches;
+
+        const double busySeconds = stats.busyNanos / 1e9;
+
+        out << i << ',' << stats.rays << ',' << stats.batches << ','
+            << stats.stolenBatches << ',' << fixed << setprecision(3)
+            << stats.busyNanos / 1e6 << ',' << setprecision(0)
+            << (busySeconds > 0 ? stats.rays / busySeconds : 0.0) << ',';
+
+        /* trailing empty buckets are omitted */
+        size_t last = 0;
+        for (size_t b = 0; b < DEPTH_BUCKETS; b++) {
+            if (stats.depthHistogram[b]) last = b;
+        }
+
+        for (size_t b = 0; b <= last; b++) {
+            out << (b ? " " : "") << stats.depthHistogram[b];
+        }
+
+        out << endl;
+    }
+
+    const double wallSeconds = wallNanos / 1e9;
+
+    out << defaultfloat << setprecision(6) << "threads: " << config.threadCount
+        << ", batch size: " << config.batchSize << endl
+        << "rays processed: " << totalRays << " in " << wallSeconds << " s ("
+        << (wallSeconds > 0 ? totalRays / wallSeconds : 0.0) << " rays/s)"
+        << endl
+        << "batches: " << totalBatches << " (" << totalStolen << " stolen)"
+        << endl
+        << "samples: " << totalSamples << endl;
+}
+
+}  // namespace pbrt
@@ -0,0 +1,101 @@
+#ifndef PBRT_CLOUD_LOCALENGINE_H
+#define PBRT_CLOUD_LOCALENGINE_H
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "accelerators/cloud.h"
+#include "pbrt/main.h"
+#include "pbrt/raystate.h"
+
+namespace pbrt {
+
+/* LocalEngine processes a set of rays against treelets on a single machine,
+ * either fully loaded or behind a CloudBVH treelet cache. Rays are sharded
+ * into one queue per treelet; each worker thread owns a subset of the queues
+ * and drains them in batches, so a batch of rays touches one treelet at a
+ * time. A worker with nothing to do steals a batch from the fullest queue it
+ * does not own, and sleeps if every queue is empty. */
+class LocalEngine {
+  public:
+    struct Config {
+        size_t threadCount{1};
+        size_t batchSize{64};
+        size_t samplesPerFlush{1000};
+        bool benchmark{false};
+
+        /* if set, the image is written this often while rendering */
+        double writeInterval{0};
+    };
+
+    LocalEngine(SceneBase &scene,
+                std::vector<std::shared_ptr<CloudBVH>> &treelets,
+                const Config &config);
+
+    void Enqueue(RayStatePtr &&ray);
+    void Run();
+
+    size_t PendingRays() const { return pendingRays; }
+    void PrintBenchmark(std::ostream &out) const;
+
+  private:
+    /* queue depths are recorded in power-of-two buckets */
+    static constexpr size_t DEPTH_BUCKETS = 24;
+
+    struct QueueStats {
+        uint64_t rays{0};
+        uint64_t batches{0};
+        uint64_t stolenBatches{0};
+        uint64_t busyNanos{0};
+        std::array<uint64_t, DEPTH_BUCKETS> depthHistogram{};
+    };
+
+    struct Queue {
+        std::mutex mutex{};
+        std::deque<RayStatePtr> rays{};
+        std::atomic<size_t> size{0};
+        QueueStats stats{};
+    };
+
+    void Worker(const size_t workerId);
+    bool PopBatch(const size_t workerId, std::vector<RayStatePtr> &batch,
+                  TreeletId &treeletId);
+    void WaitForWork();
+    void WakeWorkers(const bool all);
+
+    SceneBase &scene;
+    std::vector<std::shared_ptr<CloudBVH>> &treelets;
+    const Config config;
+
+    std::vector<std::unique_ptr<Queue>> queues{};
+    std::atomic<size_t> pendingRays{0};
+    std::atomic<size_t> runningWorkers{0};
+
+    /* pendingRays also counts the rays being processed; queuedRays only
+     * the ones in the queues. Idle workers sleep on workAvailable until
+     * there are queued rays again, or until all the work is done. */
+    std::atomic<size_t> queuedRays{0};
+    std::atomic<size_t> idleWorkers{0};
+    std::mutex idleMutex{};
+    std::condition_variable workAvailable{};
+
+    std::mutex errorMutex{};
+    std::exception_ptr error{};
+    std::atomic<bool> aborted{false};
+
+    uint64_t wallNanos{0};
+    uint64_t totalSamples{0};
+    std::mutex samplesMutex{};
+};
+
+}  // namespace pbrt
+
+#endif /* PBRT_CLOUD_LOCALENGINE_H */
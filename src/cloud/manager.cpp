@@ -2,11 +2,13 @@
 
 #include <fcntl.h>
 
+#include <cstring>
 #include <fstream>
 #include <functional>
 
 #include "messages/utils.h"
 #include "util/exception.h"
+#include "util/mmap.h"
 
 using namespace std;
 
@@ -216,6 +218,12 @@ uint32_t SceneManager::getNextId(const ObjectType type, const void* ptr) {
     return id;
 }
 
+uint32_t SceneManager::getNextIds(const ObjectType type, const uint32_t count) {
+    const uint32_t first = autoIds[to_underlying(type)];
+    autoIds[to_underlying(type)] += count;
+    return first;
+}
+
 uint32_t SceneManager::getTextureFileId(const std::string& path) {
     if (textureNameToId.count(path)) {
         return textureNameToId[path];
@@ -242,10 +250,28 @@ protobuf::Manifest SceneManager::makeManifest() const {
              id < total_ids; ++id) {
             ObjectKey type_id{type, id};
 
-            size_t size = 0;
+            const string path = getFilePath(type, id);
+            const size_t size =
+                roost::exists(path) ? roost::file_size(path) : 0;
+
+            uint64_t hash = 0;
+            uint64_t inputHash = 0;
+            {
+                lock_guard<mutex> lock{mutex_};
+                auto it = objectHashes.find(type_id);
+                if (it != objectHashes.end()) hash = it->second;
+                it = objectInputHashes.find(type_id);
+                if (it != objectInputHashes.end()) inputHash = it->second;
+            }
+
+            if (!hash && size) {
+                hash = hashFile(path);
+            }
 
             protobuf::Manifest::Object* obj = manifest.add_objects();
             obj->set_size(size);
+            obj->set_hash(hash);
+            obj->set_input_hash(inputHash);
             (*obj->mutable_id()) = to_protobuf(type_id);
             if (dependencies.count(type_id) > 0) {
                 for (const ObjectKey& dep : dependencies.at(type_id)) {
@@ -262,9 +288,153 @@ protobuf::Manifest SceneManager::makeManifest() const {
     add_to_manifest(ObjectType::SpectrumTexture);
     add_to_manifest(ObjectType::Texture);
 
+    if (!previousHashes.empty()) {
+        LOG(INFO) << "Reused " << reusedObjects << " unchanged "
+                  << pluralize("object", reusedObjects)
+                  << " from the previous dump";
+    }
+
     return manifest;
 }
 
+namespace {
+
+/* word-at-a-time hashing (murmur-style mixing); it only needs to tell apart
+ * two versions of the same object */
+uint64_t mix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+uint64_t hashBytes(uint64_t hash, const char* data, const size_t size) {
+    const char* end = data + (size & ~size_t{7});
+
+    for (; data < end; data += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        hash = (hash ^ mix(word)) * 0x87c37b91114253d5ULL;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, data, size & 7);
+    return hash ^ mix(tail);
+}
+
+}  // namespace
+
+void SceneManager::InputHash::add(const void* data, const size_t length) {
+    hash_ = hashBytes(hash_ ^ length, static_cast<const char*>(data), length);
+}
+
+uint64_t SceneManager::InputHash::value() const { return mix(hash_) | 1; }
+
+uint64_t SceneManager::hashFile(const string& path) {
+    const size_t size = roost::file_size(path);
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ size;
+
+    if (size == 0) {
+        return mix(hash);
+    }
+
+    MappedFile file{path};
+    hash = hashBytes(hash, file.data(), size);
+
+    /* zero means 'no hash' in the manifest */
+    return mix(hash) | 1;
+}
+
+void SceneManager::loadPreviousHashes() {
+    if (!roost::exists(getFilePath(ObjectType::Manifest, 0))) {
+        return;
+    }
+
+    protobuf::Manifest manifest;
+    GetReader(ObjectType::Manifest)->read(&manifest);
+
+    for (const protobuf::Manifest::Object& obj : manifest.objects()) {
+        const ObjectKey key = from_protobuf(obj.id());
+        previousObjects.insert(key);
+
+        if (obj.hash()) {
+            previousHashes[key] = obj.hash();
+        }
+
+        if (obj.hash() && obj.input_hash()) {
+            previousInputHashes[key] = obj.input_hash();
+        }
+    }
+}
+
+bool SceneManager::reuseObject(const ObjectKey& key, const uint64_t hash) {
+    lock_guard<mutex> lock{mutex_};
+    objectHashes[key] = hash;
+
+    auto it = previousHashes.find(key);
+    if (it == previousHashes.end() || it->second != hash ||
+        !roost::exists(getFilePath(key.type, key.id))) {
+        return false;
+    }
+
+    reusedObjects++;
+    return true;
+}
+
+bool SceneManager::reuseBuiltObject(const ObjectKey& key,
+                                    const uint64_t inputHash) {
+    lock_guard<mutex> lock{mutex_};
+
+    auto it = previousInputHashes.find(key);
+    if (it == previousInputHashes.end() || it->second != inputHash ||
+        !roost::exists(getFilePath(key.type, key.id))) {
+        return false;
+    }
+
+    objectHashes[key] = previousHashes.at(key);
+    objectInputHashes[key] = inputHash;
+    reusedObjects++;
+    return true;
+}
+
+void SceneManager::commitObject(const ObjectType type, const uint32_t id,
+                                const string& newPath,
+                                const uint64_t inputHash) {
+    if (reuseObject({type, id}, hashFile(newPath))) {
+        roost::remove(newPath);
+    } else {
+        roost::rename(newPath, getFilePath(type, id));
+    }
+
+    if (inputHash) {
+        lock_guard<mutex> lock{mutex_};
+        objectInputHashes[{type, id}] = inputHash;
+    }
+}
+
+/* an earlier dump of a bigger scene (or one cut into more treelets) leaves
+ * behind files that the new manifest doesn't list */
+void SceneManager::removeStaleObjects() const {
+    size_t removed = 0;
+
+    for (const ObjectKey& key : previousObjects) {
+        if (key.id < autoIds[to_underlying(key.type)]) continue;
+
+        const string path = getFilePath(key.type, key.id);
+        if (roost::exists(path)) {
+            roost::remove(path);
+            removed++;
+        }
+    }
+
+    if (removed) {
+        LOG(INFO) << "Removed " << removed << " stale "
+                  << pluralize("object", removed) << " from the previous dump";
+    }
+}
+
 set<ObjectKey> SceneManager::getRecursiveDependencies(const ObjectKey& object) {
     set<ObjectKey> allDeps;
 
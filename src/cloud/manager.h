@@ -1,6 +1,8 @@
 #ifndef PBRT_CLOUD_MANAGER_H
 #define PBRT_CLOUD_MANAGER_H
 
+#include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <tuple>
@@ -63,11 +65,50 @@ class SceneManager {
     /* used during dumping */
     uint32_t getId(const void* ptr) const { return ptrIds.at(ptr); }
     uint32_t getNextId(const ObjectType type, const void* ptr = nullptr);
+    uint32_t getNextIds(const ObjectType type, const uint32_t count);
     uint32_t getTextureFileId(const std::string& path);
     bool hasId(const void* ptr) const { return ptrIds.count(ptr) > 0; }
     void recordDependency(const ObjectKey& from, const ObjectKey& to);
     protobuf::Manifest makeManifest() const;
 
+    /* Incremental dumping. When a scene is dumped into a directory that
+     * already holds one, the hashes from the old manifest are loaded first.
+     * Each object can carry two hashes: one of its file, and one of the
+     * inputs it was built from. An object whose inputs hash the same as
+     * before isn't built at all (reuseBuiltObject()); one whose new content
+     * hashes the same keeps its old file (reuseObject()). Either way only
+     * the objects that changed get rewritten and need to be synced again.
+     * Files of objects that the new dump no longer has are removed by
+     * removeStaleObjects(). */
+    class InputHash {
+      public:
+        void add(const void* data, const size_t length);
+
+        /* hashes the bytes of `value`, so T shouldn't have padding */
+        template <class T>
+        void add(const T& value) {
+            static_assert(std::is_standard_layout<T>::value &&
+                              !std::is_pointer<T>::value,
+                          "only plain values can be hashed bytewise");
+            add(&value, sizeof(T));
+        }
+
+        /* never zero, which means 'no hash' in the manifest */
+        uint64_t value() const;
+
+      private:
+        uint64_t hash_{0x9e3779b97f4a7c15ULL};
+    };
+
+    static uint64_t hashFile(const std::string& path);
+    void loadPreviousHashes();
+    bool reuseObject(const ObjectKey& key, const uint64_t hash);
+    bool reuseBuiltObject(const ObjectKey& key, const uint64_t inputHash);
+    void commitObject(const ObjectType type, const uint32_t id,
+                      const std::string& newPath,
+                      const uint64_t inputHash = 0);
+    void removeStaleObjects() const;
+
     static std::string getFileName(const ObjectType type, const uint32_t id);
     const std::string& getScenePath() const { return scenePath; }
 
@@ -153,22 +194,46 @@ class SceneManager {
 
     size_t treeletCount();
 
-    void addInMemoryTexture(const std::string& path,
+    /* Textures and image partitions come with the treelets that include
+     * them, and more than one treelet can include the same one. Each
+     * treelet's copy is kept until the treelet removes it, e.g. when it's
+     * evicted from a cache. A lookup returns any of the copies, and the
+     * pointer it returns keeps that copy alive for as long as it's used. */
+    void addInMemoryTexture(const uint32_t treeletId, const std::string& path,
                             std::unique_ptr<char[]>&& data,
                             const size_t length) {
         std::lock_guard<std::mutex> lock{mutex_};
-        inMemoryTextures.emplace(
-            std::piecewise_construct, std::forward_as_tuple(path),
-            std::forward_as_tuple(std::move(data), length));
+        std::shared_ptr<const char> ptr{data.release(),
+                                        std::default_delete<char[]>()};
+        inMemoryTextures[path][treeletId] =
+            InMemoryTexture{std::move(ptr), length};
+    }
+
+    /* the texture stays a view into `backing` (e.g. a mapped treelet) */
+    void addInMemoryTexture(const uint32_t treeletId, const std::string& path,
+                            const char* data, const size_t length,
+                            const std::shared_ptr<void>& backing) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        inMemoryTextures[path][treeletId] =
+            InMemoryTexture{std::shared_ptr<const char>(backing, data), length};
+    }
+
+    void removeInMemoryTexture(const uint32_t treeletId,
+                               const std::string& path) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto it = inMemoryTextures.find(path);
+        if (it == inMemoryTextures.end()) return;
+        it->second.erase(treeletId);
+        if (it->second.empty()) inMemoryTextures.erase(it);
     }
 
-    std::pair<const char*, size_t> getInMemoryTexture(
+    std::pair<std::shared_ptr<const char>, size_t> getInMemoryTexture(
         const std::string& path) const {
         auto lock = syncTextureReads_ ? std::unique_lock<std::mutex>(mutex_)
                                       : std::unique_lock<std::mutex>();
 
-        const auto& tex = inMemoryTextures.at(path);
-        return {tex.first.get(), tex.second};
+        const auto& tex = inMemoryTextures.at(path).begin()->second;
+        return {tex.data, tex.length};
     }
 
     bool hasInMemoryTextures() const {
@@ -177,15 +242,31 @@ class SceneManager {
         return not inMemoryTextures.empty();
     }
 
-    void addInMemoryImagePartition(const uint32_t pid, ImagePartition&& data) {
+    void addInMemoryImagePartition(const uint32_t treeletId,
+                                   const uint32_t pid, ImagePartition&& data) {
         std::lock_guard<std::mutex> lock{mutex_};
-        inMemoryImagePartitions.emplace(pid, std::move(data));
+        inMemoryImagePartitions[pid][treeletId] =
+            std::make_shared<ImagePartition>(std::move(data));
     }
 
-    ImagePartition& getInMemoryImagePartition(const uint32_t pid) {
-        return inMemoryImagePartitions.at(pid);
+    void removeInMemoryImagePartition(const uint32_t treeletId,
+                                      const uint32_t pid) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto it = inMemoryImagePartitions.find(pid);
+        if (it == inMemoryImagePartitions.end()) return;
+        it->second.erase(treeletId);
+        if (it->second.empty()) inMemoryImagePartitions.erase(it);
+    }
+
+    std::shared_ptr<ImagePartition> getInMemoryImagePartition(
+        const uint32_t pid) const {
+        auto lock = syncTextureReads_ ? std::unique_lock<std::mutex>(mutex_)
+                                      : std::unique_lock<std::mutex>();
+        return inMemoryImagePartitions.at(pid).begin()->second;
     }
 
+    /* set when treelets (and with them, textures and image partitions) are
+     * loaded while other threads look them up */
     void setSyncTextureReads(const bool val) { syncTextureReads_ = val; }
 
   private:
@@ -202,10 +283,17 @@ class SceneManager {
     std::map<ObjectKey, uint64_t> objectSizes{};
     std::map<ObjectKey, std::set<ObjectKey>> dependencies{};
 
-    std::unordered_map<std::string, std::pair<std::unique_ptr<char[]>, size_t>>
+    struct InMemoryTexture {
+        std::shared_ptr<const char> data;
+        size_t length;
+    };
+
+    /* keyed by path (or partition id), then by the treelet that added it */
+    std::unordered_map<std::string, std::map<uint32_t, InMemoryTexture>>
         inMemoryTextures{};
 
-    std::map<uint32_t, ImagePartition> inMemoryImagePartitions{};
+    std::map<uint32_t, std::map<uint32_t, std::shared_ptr<ImagePartition>>>
+        inMemoryImagePartitions{};
 
     // Dumping treelets
     std::map<const TriangleMesh*, uint32_t> tmMaterialIds{};
@@ -226,6 +314,13 @@ class SceneManager {
 
     std::map<ObjectID, std::set<ObjectKey>> treeletDependencies{};
 
+    std::map<ObjectKey, uint64_t> previousHashes{};
+    std::map<ObjectKey, uint64_t> objectHashes{};
+    std::set<ObjectKey> previousObjects{};
+    std::map<ObjectKey, uint64_t> previousInputHashes{};
+    std::map<ObjectKey, uint64_t> objectInputHashes{};
+    size_t reusedObjects{0};
+
     bool syncTextureReads_{false};
     mutable std::mutex mutex_{};
 };
@@ -227,13 +227,18 @@ ImagePartition::ImagePartition(const Point2i &resolution,
 }
 
 ImagePartition::ImagePartition(unique_ptr<char[]> &&partition_data)
-    : storage(move(partition_data)) {
-    int *ptr = reinterpret_cast<int *>(storage.get());
+    : ImagePartition(partition_data.get(), nullptr) {
+    storage = move(partition_data);
+}
+
+ImagePartition::ImagePartition(char *partition_data, shared_ptr<void> backing)
+    : backing(move(backing)) {
+    int *ptr = reinterpret_cast<int *>(partition_data);
     resolution.x = ptr[0];
     resolution.y = ptr[1];
     partition_idx = ptr[2];
     partition_count = ptr[3];
-    data = reinterpret_cast<RGBSpectrum *>(storage.get() + sizeof(int) * 4);
+    data = reinterpret_cast<RGBSpectrum *>(partition_data + sizeof(int) * 4);
 
     if (not IsPowerOf2(resolution.x) or not IsPowerOf2(resolution.y)) {
         throw runtime_error("image dimensions have to be powers of two");
@@ -19,6 +19,7 @@ class ImagePartition {
     int W{0}, H{0};
 
     std::unique_ptr<char[]> storage{};
+    std::shared_ptr<void> backing{};
     RGBSpectrum *data{};
 
     const RGBSpectrum &Texel(int s, int t) const;
@@ -30,6 +31,9 @@ class ImagePartition {
 
     ImagePartition(std::unique_ptr<char[]> &&partition_data);
 
+    /* a view of serialized partition data owned by `backing` */
+    ImagePartition(char *partition_data, std::shared_ptr<void> backing);
+
     RGBSpectrum Lookup(const Point2f &st) const;
     void WriteImage(const std::string &filename) const;
 };
@@ -31,7 +31,8 @@ class : public PtexInputHandler {
   public:
     Handle open(const char *path) override {
         auto t = global::manager.getInMemoryTexture(path);
-        return reinterpret_cast<Handle>(new OpenedTexture(t.first, t.second));
+        return reinterpret_cast<Handle>(
+            new OpenedTexture(move(t.first), t.second));
     }
 
     void seek(Handle handle, int64_t pos) override {
@@ -40,7 +41,7 @@ class : public PtexInputHandler {
 
     size_t read(void *buffer, size_t size, Handle handle) override {
         auto h = reinterpret_cast<OpenedTexture *>(handle);
-        const auto ptr = h->data + h->pos;
+        const auto ptr = h->data.get() + h->pos;
         const size_t len =
             (h->pos + size > h->length) ? (h->length - h->pos) : size;
         if (len > 0) {
@@ -64,10 +65,12 @@ class : public PtexInputHandler {
 
   private:
     struct OpenedTexture {
-        OpenedTexture(const char *data, const size_t length)
-            : data(data), length(length) {}
+        OpenedTexture(shared_ptr<const char> data, const size_t length)
+            : data(move(data)), length(length) {}
 
-        const char *data;
+        /* keeps the texture alive even if its treelet is evicted while the
+         * file is open */
+        shared_ptr<const char> data;
         size_t length;
         int64_t pos{0};
     };
@@ -94,8 +97,10 @@ void load_all_textures(const string &treelet_path,
     treelet_buffer.resize(size);
     fin.read(treelet_buffer.data(), size);
 
-    auto reader =
-        RecordReader::get(treelet_buffer.data(), treelet_buffer.size());
+    /* only the textures are read, so the blocks holding the rest of the
+     * treelet are left compressed */
+    auto reader = RecordReader::get(treelet_buffer.data(),
+                                    treelet_buffer.size(), false);
 
     reader->skip(reader->read<uint32_t>());
 
@@ -107,7 +112,7 @@ void load_all_textures(const string &treelet_path,
         texture_buffer = make_unique<char[]>(l);
         reader->read(texture_buffer.get(), l);
 
-        pbrt::global::manager.addInMemoryTexture("TEX" + to_string(i),
+        pbrt::global::manager.addInMemoryTexture(0, "TEX" + to_string(i),
                                                  move(texture_buffer), l);
 
         texture_sizes.push_back(l);
@@ -0,0 +1,287 @@
+#include <lz4.h>
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cloud/raypacket.h"
+#include "core/rng.h"
+#include "messages/serialization.h"
+#include "pbrt/main.h"
+#include "pbrt/raystate.h"
+#include "util/exception.h"
+
+using namespace std;
+using namespace chrono;
+using namespace pbrt;
+
+void usage(const char *argv0) {
+    cerr << argv0
+         << " [--rays FILE] [--count N] [--iterations N] [--packet-size N]"
+         << endl;
+}
+
+Vector3f randomVector(RNG &rng, const Float scale) {
+    return scale * Vector3f(rng.UniformFloat() - .5f, rng.UniformFloat() - .5f,
+                            rng.UniformFloat() - .5f);
+}
+
+/* a mix of the kinds of rays that go over the wire during a render: camera
+ * rays with differentials, shadow rays, rays that have found a hit, and rays
+ * that are deep into an instanced treelet */
+RayStatePtr syntheticRay(RNG &rng, const size_t i) {
+    auto statePtr = RayState::Create();
+    auto &state = *statePtr;
+
+    const size_t kind = i % 4;
+
+    state.trackRay = false;
+    state.isShadowRay = (kind == 1);
+    state.hit = (kind == 2);
+    state.remainingBounces = 5 - (i % 3);
+    state.hop = i % 8;
+    state.pathHop = i % 3;
+    state.beta = (kind == 0) ? Spectrum(1.f) : Spectrum(rng.UniformFloat());
+    state.Ld = (kind == 1) ? Spectrum(rng.UniformFloat()) : Spectrum(0.f);
+
+    state.sample.id = i;
+    state.sample.dim = 5 + 3 * (i % 3);
+    state.sample.pFilm = Point2f(1920 * rng.UniformFloat(),
+                                 1080 * rng.UniformFloat());
+    state.sample.weight = 1;
+
+    const Point3f o = Point3f(0, 0, 0) + randomVector(rng, 100);
+    Vector3f d = Normalize(randomVector(rng, 1));
+    if (state.isShadowRay) d *= 50 * rng.UniformFloat();
+
+    state.ray = RayDifferential(o, d, state.isShadowRay ? 1 - ShadowEpsilon
+                                                        : Infinity);
+
+    if (kind == 0) {
+        state.ray.hasDifferentials = true;
+        state.ray.rxOrigin = state.ray.ryOrigin = o;
+        state.ray.rxDirection = Normalize(d + randomVector(rng, 1e-3));
+        state.ray.ryDirection = Normalize(d + randomVector(rng, 1e-3));
+    }
+
+    if (state.hit) {
+        auto &isect = state.EnsureHitInfo().isect;
+        state.hitInfo->material = {static_cast<uint32_t>(i % 50), 1};
+        isect.p = o + d * 10;
+        isect.n = isect.shading.n = Normal3f(Normalize(randomVector(rng, 1)));
+        isect.wo = -d;
+        isect.uv = Point2f(rng.UniformFloat(), rng.UniformFloat());
+        isect.dpdu = isect.shading.dpdu = randomVector(rng, 1);
+        isect.dpdv = isect.shading.dpdv = randomVector(rng, 1);
+        isect.faceIndex = i;
+    }
+
+    const uint32_t treelet = rng.UniformUInt32(200);
+    const uint32_t depth = (kind == 3) ? 24 : 1 + rng.UniformUInt32(8);
+    uint32_t node = rng.UniformUInt32(1 << 16);
+
+    for (uint32_t j = 0; j < depth; j++) {
+        RayState::TreeletNode entry;
+        entry.treelet = treelet;
+        entry.node = node;
+        entry.primitive = 0;
+        entry.transformed = (kind == 3) && (j + 1 == depth);
+        state.toVisitPush(move(entry));
+        node += 1 + rng.UniformUInt32(16);
+    }
+
+    if (kind == 3) {
+        state.EnsureRayTransform() = Translate(randomVector(rng, 10)) *
+                                     RotateY(360 * rng.UniformFloat());
+    }
+
+    return statePtr;
+}
+
+struct Result {
+    double bytesPerRay{0};
+    double encodeNanos{0};
+    double decodeNanos{0};
+};
+
+Result benchmark(const vector<RayStatePtr> &rays, const RayState::Format format,
+                 const size_t iterations) {
+    Result result;
+
+    const size_t bufferSize = LZ4_COMPRESSBOUND(RayState::MaxBufferSize) + 4;
+    vector<char> buffer(bufferSize * rays.size());
+    vector<size_t> lengths(rays.size());
+
+    size_t totalBytes = 0;
+    nanoseconds encodeTime{0};
+    nanoseconds decodeTime{0};
+
+    for (size_t it = 0; it < iterations; it++) {
+        auto start = steady_clock::now();
+        for (size_t i = 0; i < rays.size(); i++) {
+            lengths[i] = rays[i]->Serialize(&buffer[i * bufferSize], format);
+        }
+        encodeTime += steady_clock::now() - start;
+
+        RayState state;
+        start = steady_clock::now();
+        for (size_t i = 0; i < rays.size(); i++) {
+            state.Deserialize(&buffer[i * bufferSize + 4], lengths[i] - 4,
+                              format);
+        }
+        decodeTime += steady_clock::now() - start;
+    }
+
+    for (const auto len : lengths) totalBytes += len - 4;
+
+    const double n = rays.size();
+    result.bytesPerRay = totalBytes / n;
+    result.encodeNanos = encodeTime.count() / (n * iterations);
+    result.decodeNanos = decodeTime.count() / (n * iterations);
+    return result;
+}
+
+Result benchmarkPackets(const vector<RayStatePtr> &rays,
+                        const size_t packetSize, const size_t iterations) {
+    Result result;
+
+    vector<string> packets;
+    size_t totalBytes = 0;
+    nanoseconds encodeTime{0};
+    nanoseconds decodeTime{0};
+
+    for (size_t it = 0; it < iterations; it++) {
+        packets.clear();
+        RayPacket::Writer writer;
+
+        auto start = steady_clock::now();
+        for (const auto &ray : rays) {
+            writer.Add(*ray);
+            if (writer.Count() == packetSize) {
+                packets.push_back(writer.Finish());
+            }
+        }
+
+        if (not writer.Empty()) packets.push_back(writer.Finish());
+        encodeTime += steady_clock::now() - start;
+
+        RayState state;
+        start = steady_clock::now();
+        for (const auto &packet : packets) {
+            RayPacket::Reader reader{packet};
+            while (reader.Next(state)) {
+            }
+        }
+        decodeTime += steady_clock::now() - start;
+    }
+
+    for (const auto &packet : packets) totalBytes += packet.length();
+
+    const double n = rays.size();
+    result.bytesPerRay = totalBytes / n;
+    result.encodeNanos = encodeTime.count() / (n * iterations);
+    result.decodeNanos = decodeTime.count() / (n * iterations);
+    return result;
+}
+
+int main(int argc, char const *argv[]) {
+    try {
+        if (argc <= 0) {
+            abort();
+        }
+
+        string raysPath;
+        size_t count = 100'000;
+        size_t iterations = 10;
+        size_t packetSize = 256;
+
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "--rays") == 0 and i + 1 < argc) {
+                raysPath = argv[++i];
+            } else if (strcmp(argv[i], "--count") == 0 and i + 1 < argc) {
+                count = stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--iterations") == 0 and
+                       i + 1 < argc) {
+                iterations = stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--packet-size") == 0 and
+                       i + 1 < argc) {
+                packetSize = stoul(argv[++i]);
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (count == 0 or iterations == 0 or packetSize == 0) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        vector<RayStatePtr> rays;
+
+        if (raysPath.empty()) {
+            RNG rng;
+            for (size_t i = 0; i < count; i++) {
+                rays.push_back(syntheticRay(rng, i));
+            }
+        } else {
+            protobuf::RecordReader reader{raysPath};
+            auto format = RayState::Format::Packed;
+
+            while (!reader.eof() and rays.size() < count) {
+                string rayStr;
+                if (!reader.read(&rayStr)) continue;
+
+                if (rays.empty() and rayStr == RayState::CompactStreamHeader) {
+                    format = RayState::Format::Compact;
+                    continue;
+                }
+
+                auto ray = RayState::Create();
+                ray->Deserialize(rayStr.data(), rayStr.length(), format);
+                rays.push_back(move(ray));
+            }
+        }
+
+        if (rays.empty()) {
+            throw runtime_error("no rays to benchmark");
+        }
+
+        cout << "rays: " << rays.size() << ", iterations: " << iterations
+             << endl
+             << "format,lz4,bytes_per_ray,encode_ns_per_ray,decode_ns_per_ray"
+             << endl;
+
+        for (const bool compress : {false, true}) {
+            PbrtOptions.compressRays = compress;
+
+            for (const auto format :
+                 {RayState::Format::Packed, RayState::Format::Compact}) {
+                const auto result = benchmark(rays, format, iterations);
+
+                cout << (format == RayState::Format::Packed ? "packed"
+                                                             : "compact")
+                     << ',' << (compress ? "yes" : "no") << ',' << fixed
+                     << setprecision(1) << result.bytesPerRay << ','
+                     << result.encodeNanos << ',' << result.decodeNanos
+                     << endl;
+            }
+
+            const auto result = benchmarkPackets(rays, packetSize, iterations);
+
+            cout << "packet-" << packetSize << ',' << (compress ? "yes" : "no")
+                 << ',' << fixed << setprecision(1) << result.bytesPerRay
+                 << ',' << result.encodeNanos << ',' << result.decodeNanos
+                 << endl;
+        }
+    } catch (const exception &e) {
+        print_exception(argv[0], e);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
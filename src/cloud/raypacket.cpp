@@ -0,0 +1,123 @@
+#include "raypacket.h"
+
+#include <lz4.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "pbrt/main.h"
+
+using namespace std;
+
+namespace pbrt {
+
+namespace RayPacket {
+
+const string StreamHeader{"PBRT-RAY-PACKETS-V1"};
+
+void Writer::Add(const RayState &ray) {
+    if (count == 0) {
+        base.sampleId = ray.sample.id;
+        base.treelet = ray.CurrentTreelet();
+    }
+
+    if (size + RayState::MaxCompactSize > capacity) {
+        capacity = max(2 * capacity, size + RayState::MaxCompactSize);
+        unique_ptr<char[]> newBody{new char[capacity]};
+        if (size) memcpy(newBody.get(), body.get(), size);
+        body = move(newBody);
+    }
+
+    size += ray.PackCompact(body.get() + size, base);
+    count++;
+}
+
+string Writer::Finish() {
+    Header header;
+    header.version = VERSION;
+    header.compressed = PbrtOptions.compressRays;
+    header.count = count;
+    header.rawSize = size;
+    header.sampleId = base.sampleId;
+    header.treelet = base.treelet;
+
+    string packet;
+
+    if (header.compressed) {
+        const size_t upperBound = LZ4_COMPRESSBOUND(size);
+        packet.resize(sizeof(Header) + upperBound);
+
+        const int len = LZ4_compress_default(
+            body.get(), &packet[sizeof(Header)], size, upperBound);
+
+        if (len <= 0 and size > 0) {
+            throw runtime_error("ray packet compression failed");
+        }
+
+        packet.resize(sizeof(Header) + len);
+    } else {
+        packet.resize(sizeof(Header) + size);
+        if (size) memcpy(&packet[sizeof(Header)], body.get(), size);
+    }
+
+    memcpy(&packet[0], &header, sizeof(Header));
+
+    size = 0;
+    count = 0;
+    base = {};
+
+    return packet;
+}
+
+Reader::Reader(const char *data, const size_t len) {
+    if (len < sizeof(Header)) {
+        throw runtime_error("ray packet is truncated");
+    }
+
+    Header header;
+    memcpy(&header, data, sizeof(Header));
+
+    if (header.version != VERSION) {
+        throw runtime_error("unsupported ray packet version: " +
+                            to_string(header.version));
+    }
+
+    count = header.count;
+    base.sampleId = header.sampleId;
+    base.treelet = header.treelet;
+
+    data += sizeof(Header);
+    const size_t dataLen = len - sizeof(Header);
+
+    if (header.compressed) {
+        buffer = make_unique<char[]>(header.rawSize);
+        if (LZ4_decompress_safe(data, buffer.get(), dataLen,
+                                header.rawSize) != int(header.rawSize)) {
+            throw runtime_error("ray packet decompression failed");
+        }
+
+        ptr = buffer.get();
+    } else {
+        if (dataLen != header.rawSize) {
+            throw runtime_error("ray packet is truncated");
+        }
+
+        ptr = data;
+    }
+
+    end = ptr + header.rawSize;
+}
+
+bool Reader::Next(RayState &ray) {
+    if (read == count) return false;
+
+    ptr += ray.UnPackCompact(ptr, end - ptr, base);
+    read++;
+
+    return true;
+}
+
+}  // namespace RayPacket
+
+}  // namespace pbrt
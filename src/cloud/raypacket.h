@@ -0,0 +1,83 @@
+#ifndef PBRT_CLOUD_RAYPACKET_H
+#define PBRT_CLOUD_RAYPACKET_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "pbrt/raystate.h"
+
+namespace pbrt {
+
+/* A RayPacket is a batch of rays serialized into one buffer and compressed
+ * as a unit. The rays are in the compact format, relative to a base that is
+ * stored once in the packet header: the treelet and the sample id of the
+ * first ray. Rays that are sent together usually go to the same treelet and
+ * come from nearby samples, so the per-ray deltas are small. */
+namespace RayPacket {
+
+struct __attribute__((packed, aligned(1))) Header {
+    uint8_t version;
+    uint8_t compressed;
+    uint32_t count;
+    uint32_t rawSize;
+    uint64_t sampleId;
+    uint32_t treelet;
+};
+
+constexpr uint8_t VERSION = 1;
+
+/* the first record of a file of ray packets */
+extern const std::string StreamHeader;
+
+class Writer {
+  public:
+    void Add(const RayState &ray);
+
+    size_t Count() const { return count; }
+    bool Empty() const { return count == 0; }
+
+    /* size of the rays added so far, before compression */
+    size_t RawSize() const { return size; }
+
+    /* returns the packet and gets the writer ready for the next one */
+    std::string Finish();
+
+  private:
+    RayState::CompactBase base{};
+
+    /* not a vector, so that the space reserved for the next ray is not
+     * zeroed every time */
+    std::unique_ptr<char[]> body{};
+    size_t size{0};
+    size_t capacity{0};
+    size_t count{0};
+};
+
+/* the reader decodes the rays one by one into a caller-provided RayState,
+ * and doesn't copy the packet unless it has to decompress it */
+class Reader {
+  public:
+    Reader(const char *data, const size_t len);
+    Reader(const std::string &packet)
+        : Reader(packet.data(), packet.length()) {}
+
+    size_t Count() const { return count; }
+    uint32_t Treelet() const { return base.treelet; }
+
+    bool Next(RayState &ray);
+
+  private:
+    RayState::CompactBase base{};
+    std::unique_ptr<char[]> buffer{};
+    const char *ptr{nullptr};
+    const char *end{nullptr};
+    size_t count{0};
+    size_t read{0};
+};
+
+}  // namespace RayPacket
+
+}  // namespace pbrt
+
+#endif /* PBRT_CLOUD_RAYPACKET_H */
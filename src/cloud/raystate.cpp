@@ -4,8 +4,11 @@
 
 #include <cstring>
 #include <limits>
+#include <new>
 
 #include "accelerators/cloud.h"
+#include "core/stats.h"
+#include "shapes/fake.h"
 
 using namespace std;
 using namespace pbrt;
@@ -18,7 +21,125 @@ constexpr int offset_of(T const &t, U T::*a) {
 // sample.id =
 //  (pixel.x + pixel.y * sampleExtent.x) * config.samplesPerPixel + sample;
 
-RayStatePtr RayState::Create() { return make_unique<RayState>(); }
+STAT_COUNTER("RayState/Pool hits", nPoolHits);
+STAT_COUNTER("RayState/Pool misses", nPoolMisses);
+STAT_COUNTER("RayState/Hit info pool hits", nHitInfoPoolHits);
+STAT_COUNTER("RayState/Hit info pool misses", nHitInfoPoolMisses);
+STAT_COUNTER("RayState/Transform pool hits", nTransformPoolHits);
+STAT_COUNTER("RayState/Transform pool misses", nTransformPoolMisses);
+
+const size_t RayState::PoolCapacity = 4096;
+
+namespace {
+
+class FreeList {
+  public:
+    ~FreeList() {
+        for (void *p : free_) ::operator delete(p);
+    }
+
+    void *Allocate(const size_t size, int64_t &hits, int64_t &misses) {
+        if (free_.empty()) {
+            misses++;
+            return ::operator new(size);
+        }
+
+        hits++;
+        void *memory = free_.back();
+        free_.pop_back();
+        return memory;
+    }
+
+    void Release(void *memory) {
+        if (free_.size() < RayState::PoolCapacity) {
+            free_.push_back(memory);
+        } else {
+            ::operator delete(memory);
+        }
+    }
+
+  private:
+    vector<void *> free_{};
+};
+
+/* Each thread has its own pools, which are destroyed when the thread exits.
+ * RayStates held by other thread_local or static objects may be freed after
+ * that, so from then on memory goes straight to and from the heap.
+ * poolsDestroyed has no destructor, and can be read until the thread is
+ * gone. */
+thread_local bool poolsDestroyed{false};
+
+struct Pools {
+    FreeList rayStates{};
+    FreeList hitInfos{};
+    FreeList transforms{};
+
+    ~Pools() { poolsDestroyed = true; }
+};
+
+thread_local Pools pools;
+
+void *PoolAllocate(FreeList Pools::*pool, const size_t size, int64_t &hits,
+                   int64_t &misses) {
+    if (poolsDestroyed) {
+        misses++;
+        return ::operator new(size);
+    }
+
+    return (pools.*pool).Allocate(size, hits, misses);
+}
+
+void PoolRelease(FreeList Pools::*pool, void *memory) {
+    if (poolsDestroyed) {
+        ::operator delete(memory);
+    } else {
+        (pools.*pool).Release(memory);
+    }
+}
+
+}  // namespace
+
+RayStatePtr RayState::Create() {
+    void *memory = PoolAllocate(&Pools::rayStates, sizeof(RayState),
+                                nPoolHits, nPoolMisses);
+    return RayStatePtr{new (memory) RayState()};
+}
+
+void RayStateDeleter::operator()(RayState *state) const {
+    state->~RayState();
+    PoolRelease(&Pools::rayStates, state);
+}
+
+void RayState::HitInfoDeleter::operator()(HitInfo *hitInfo) const {
+    hitInfo->~HitInfo();
+    PoolRelease(&Pools::hitInfos, hitInfo);
+}
+
+RayState::HitInfo &RayState::EnsureHitInfo() {
+    if (!hitInfo) {
+        void *memory = PoolAllocate(&Pools::hitInfos, sizeof(HitInfo),
+                                    nHitInfoPoolHits, nHitInfoPoolMisses);
+        hitInfo = HitInfoPtr{new (memory) HitInfo()};
+    }
+
+    return *hitInfo;
+}
+
+void RayState::TransformDeleter::operator()(Transform *transform) const {
+    transform->~Transform();
+    PoolRelease(&Pools::transforms, transform);
+}
+
+Transform &RayState::EnsureRayTransform() {
+    if (!rayTransform) {
+        void *memory =
+            PoolAllocate(&Pools::transforms, sizeof(Transform),
+                         nTransformPoolHits, nTransformPoolMisses);
+        rayTransform = TransformPtr{new (memory) Transform()};
+    }
+
+    return *rayTransform;
+}
 
 int64_t SampleNum(const uint64_t sampleId, const uint32_t spp) {
     return sampleId % spp;
@@ -40,8 +161,12 @@ Point2i RayState::SamplePixel(const Vector2i &extent,
 }
 
 void RayState::StartTrace() {
+    /* the previous hit (if any) is no longer needed once the ray has been
+     * respawned */
     hit = false;
-    toVisitHead = 0;
+    hitInfo.reset();
+    hop = 0;
+    toVisit.clear();
     TreeletNode head{};
     head.treelet = ComputeIdx(ray.d);
     toVisitPush(move(head));
@@ -51,7 +176,7 @@ uint32_t RayState::CurrentTreelet() const {
     if (!toVisitEmpty()) {  // needs tracing
         return toVisitTop().treelet;
     } else if (hit) {  // needs shading
-        return hitInfo.material.treelet;
+        return hitInfo ? hitInfo->material.treelet : 0;
     } else if (needsImageSampling) { // needs image sampling
         return imageSampleInfo.treelet;
     }
@@ -63,15 +188,31 @@ void RayState::SetHit(const TreeletNode &node,
                       const pbrt::SurfaceInteraction &isect,
                       const MaterialKey &material, const uint32_t arealight) {
     hit = true;
-    hitInfo.material = material;
-    hitInfo.arealight = arealight;
-    hitInfo.isect = isect;
+
+    auto &info = EnsureHitInfo();
+    info.material = material;
+    info.arealight = arealight;
+    info.isect = isect;
+    info.isect.primitive = nullptr;
+    info.isect.shape = OrientationShape(
+        isect.shape && (isect.shape->reverseOrientation ^
+                        isect.shape->transformSwapsHandedness));
 
     if (node.transformed) {
-        memcpy(&hitTransform, &rayTransform, sizeof(Transform));
+        info.transform = *rayTransform;
     }
 }
 
+const Shape *RayState::OrientationShape(const bool flip) {
+    static const FakeShape shapes[2] = {FakeShape{Bounds3f{}, false},
+                                        FakeShape{Bounds3f{}, true}};
+    return &shapes[flip];
+}
+
+static bool FlipsNormals(const SurfaceInteraction &isect) {
+    return isect.shape && isect.shape->reverseOrientation;
+}
+
 /*******************************************************************************
  * SERIALIZATION                                                               *
  ******************************************************************************/
@@ -201,8 +342,8 @@ struct __attribute__((packed, aligned(1))) PackedRayFixedHdr {
     PackedSampleID sample;
     Packed3f beta;
     Packed3f Ld;
-    uint8_t toVisitHead : 7;
-    bool hasDifferentials : 1;
+    uint16_t toVisitHead : 15;
+    uint16_t hasDifferentials : 1;
     PackedRay ray;
 
     PackedRayFixedHdr(const RayState &r)
@@ -217,7 +358,7 @@ struct __attribute__((packed, aligned(1))) PackedRayFixedHdr {
           sample(r.sample),
           beta(r.beta),
           Ld(r.Ld),
-          toVisitHead(r.toVisitHead),
+          toVisitHead(r.toVisit.size()),
           hasDifferentials(r.ray.hasDifferentials),
           ray(r.ray) {}
 };
@@ -305,15 +446,21 @@ struct __attribute__((packed, aligned(1))) PackedSurfaceInteraction {
 struct __attribute__((packed, aligned(1))) PackedHitInfo {
     MaterialKey material;
     uint32_t arealight{};
+    uint8_t flipNormals{};
     PackedSurfaceInteraction isect;
 
     PackedHitInfo(const RayState::HitInfo &hi)
-        : material(hi.material), arealight(hi.arealight), isect(hi.isect) {}
+        : material(hi.material),
+          arealight(hi.arealight),
+          flipNormals(FlipsNormals(hi.isect)),
+          isect(hi.isect) {}
 
     void ToHitInfo(RayState::HitInfo &hitInfo) {
         hitInfo.material = material;
         hitInfo.arealight = arealight;
         isect.ToSurfaceInteraction(&hitInfo.isect);
+        hitInfo.isect.primitive = nullptr;
+        hitInfo.isect.shape = RayState::OrientationShape(flipNormals);
     }
 };
 
@@ -347,6 +494,10 @@ struct __attribute__((packed, aligned(1))) PackedImageSampleInfo {
 };
 
 size_t PackRay(char *bufferStart, const RayState &state) {
+    if (state.toVisit.size() > RayState::MaxToVisit) {
+        throw runtime_error("ray stack is too deep to serialize");
+    }
+
     char *buffer = bufferStart;
     PackedRayFixedHdr *hdr = new (buffer) PackedRayFixedHdr(state);
     buffer += sizeof(PackedRayFixedHdr);
@@ -366,17 +517,17 @@ size_t PackRay(char *bufferStart, const RayState &state) {
     }
 
     if (hdr->hit && !hdr->isShadowRay) {
-        new (buffer) PackedHitInfo(state.hitInfo);
+        new (buffer) PackedHitInfo(*state.hitInfo);
         buffer += sizeof(PackedHitInfo);
     }
 
-    for (int i = 0; i < state.toVisitHead; i++) {
+    for (size_t i = 0; i < state.toVisit.size(); i++) {
         new (buffer) PackedTreeletNode(state.toVisit[i]);
         buffer += sizeof(PackedTreeletNode);
     }
 
     if (!state.toVisitEmpty() && state.toVisitTop().transformed) {
-        new (buffer) PackedTransform(state.rayTransform);
+        new (buffer) PackedTransform(*state.rayTransform);
         buffer += sizeof(PackedTransform);
     }
 
@@ -407,7 +558,11 @@ void UnPackRay(char *buffer, RayState &state) {
     state.isLightRay = hdr->isLightRay;
     state.needsImageSampling = hdr->needsImageSampling;
     state.hit = hdr->hit;
-    state.toVisitHead = hdr->toVisitHead;
+    if (hdr->toVisitHead > RayState::MaxToVisit) {
+        throw runtime_error("ray stack is too deep");
+    }
+
+    state.toVisit.resize(hdr->toVisitHead);
     buffer += sizeof(PackedRayFixedHdr);
 
     if (state.ray.hasDifferentials) {
@@ -440,10 +595,12 @@ void UnPackRay(char *buffer, RayState &state) {
         PackedHitInfo *hitInfo = reinterpret_cast<PackedHitInfo *>(buffer);
         buffer += sizeof(PackedHitInfo);
 
-        hitInfo->ToHitInfo(state.hitInfo);
+        hitInfo->ToHitInfo(state.EnsureHitInfo());
+    } else {
+        state.hitInfo.reset();
     }
 
-    for (int i = 0; i < state.toVisitHead; i++) {
+    for (size_t i = 0; i < state.toVisit.size(); i++) {
         PackedTreeletNode *stackNode =
             reinterpret_cast<PackedTreeletNode *>(buffer);
         buffer += sizeof(PackedTreeletNode);
@@ -454,22 +611,478 @@ void UnPackRay(char *buffer, RayState &state) {
     if (!state.toVisitEmpty() && state.toVisitTop().transformed) {
         PackedTransform *txfm = reinterpret_cast<PackedTransform *>(buffer);
 
-        state.rayTransform = txfm->ToTransform();
+        state.EnsureRayTransform() = txfm->ToTransform();
+    }
+}
+
+/* Compact format (version 2). Everything is written byte by byte:
+ *
+ *   version, flags, [beta], [Ld], sample, ray, [differentials],
+ *   [light ray info], [image sample info], [hit info], stack, [transform]
+ *
+ * Integers are varints; unit vectors are octahedral-encoded into two 32-bit
+ * integers, with the lowest bit of the first one set if the vector's length
+ * follows as a float; the stack is delta-encoded from its bottom; and the
+ * ray transform is a 3x4 matrix unless it is projective. */
+
+namespace {
+
+constexpr uint8_t COMPACT_VERSION = 2;
+
+enum CompactFlags : uint16_t {
+    TRACK_RAY = 1 << 0,
+    SHADOW_RAY = 1 << 1,
+    LIGHT_RAY = 1 << 2,
+    NEEDS_IMAGE_SAMPLING = 1 << 3,
+    HIT = 1 << 4,
+    HAS_DIFFERENTIALS = 1 << 5,
+    HAS_BETA = 1 << 6,
+    HAS_LD = 1 << 7,
+    PROJECTIVE_TRANSFORM = 1 << 8,
+    FLIP_NORMALS = 1 << 9,
+};
+
+class CompactWriter {
+  public:
+    CompactWriter(char *buffer) : start_(buffer), ptr_(buffer) {}
+
+    template <class T>
+    void Put(const T &value) {
+        memcpy(ptr_, &value, sizeof(T));
+        ptr_ += sizeof(T);
+    }
+
+    void PutVarint(uint64_t value) {
+        while (value >= 0x80) {
+            *ptr_++ = static_cast<char>(value | 0x80);
+            value >>= 7;
+        }
+        *ptr_++ = static_cast<char>(value);
+    }
+
+    void PutSignedVarint(const int64_t value) {
+        PutVarint((static_cast<uint64_t>(value) << 1) ^ (value >> 63));
+    }
+
+    void Put(const Point2f &p) { Put<Float>(p.x), Put<Float>(p.y); }
+
+    template <class V>
+    void PutVector(const V &v) {
+        Put<Float>(v.x), Put<Float>(v.y), Put<Float>(v.z);
+    }
+
+    template <class V>
+    void PutDirection(const V &v) {
+        const double x = v.x, y = v.y, z = v.z;
+        const double length = std::sqrt(x * x + y * y + z * z);
+        const double l1 = std::abs(x) + std::abs(y) + std::abs(z);
+
+        double u = 0, w = 0;
+        if (l1 > 0) {
+            u = x / l1;
+            w = y / l1;
+            if (z < 0) {
+                const double fu = (1 - std::abs(w)) * (u < 0 ? -1 : 1);
+                const double fw = (1 - std::abs(u)) * (w < 0 ? -1 : 1);
+                u = fu;
+                w = fw;
+            }
+        }
+
+        /* the vector's length is only sent if it is not (almost) one */
+        const bool scaled = std::abs(length - 1) > 1e-6;
+        const int32_t qu = (Quantize(u) & ~1) | (scaled ? 1 : 0);
+        Put(qu);
+        Put(Quantize(w));
+
+        if (scaled) Put<Float>(length);
+    }
+
+    size_t Size() const { return ptr_ - start_; }
+
+  private:
+    static int32_t Quantize(const double v) {
+        return static_cast<int32_t>(std::round(
+            Clamp(v, -1.0, 1.0) * std::numeric_limits<int32_t>::max()));
+    }
+
+    char *start_;
+    char *ptr_;
+};
+
+/* reads within [buffer, end); a record that is truncated or malformed throws
+ * rather than reading past the end */
+class CompactReader {
+  public:
+    CompactReader(const char *buffer, const char *end)
+        : ptr_(buffer), end_(end) {}
+
+    template <class T>
+    T Get() {
+        check(sizeof(T));
+        T value;
+        memcpy(&value, ptr_, sizeof(T));
+        ptr_ += sizeof(T);
+        return value;
+    }
+
+    uint64_t GetVarint() {
+        uint64_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            if (shift >= 64) {
+                throw runtime_error("compact ray record has a bad varint");
+            }
+
+            check(1);
+            const uint8_t byte = static_cast<uint8_t>(*ptr_++);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (not(byte & 0x80)) break;
+        }
+        return value;
+    }
+
+    int64_t GetSignedVarint() {
+        const uint64_t value = GetVarint();
+        return static_cast<int64_t>(value >> 1) ^
+               -static_cast<int64_t>(value & 1);
+    }
+
+    Point2f GetPoint2f() {
+        const Float x = Get<Float>();
+        return {x, Get<Float>()};
+    }
+
+    template <class V>
+    V GetVector() {
+        const Float x = Get<Float>();
+        const Float y = Get<Float>();
+        return V(x, y, Get<Float>());
+    }
+
+    template <class V>
+    V GetDirection() {
+        const int32_t qu = Get<int32_t>();
+        const int32_t qw = Get<int32_t>();
+        const double max = std::numeric_limits<int32_t>::max();
+
+        double u = (qu & ~1) / max;
+        double w = qw / max;
+        const double z = 1 - std::abs(u) - std::abs(w);
+
+        if (z < 0) {
+            const double fu = (1 - std::abs(w)) * (u < 0 ? -1 : 1);
+            const double fw = (1 - std::abs(u)) * (w < 0 ? -1 : 1);
+            u = fu;
+            w = fw;
+        }
+
+        double length = std::sqrt(u * u + w * w + z * z);
+        if (length > 0) {
+            length = ((qu & 1) ? Get<Float>() : 1.0) / length;
+        }
+
+        return V(u * length, w * length, z * length);
+    }
+
+    size_t Size(const char *start) const { return ptr_ - start; }
+
+  private:
+    void check(const size_t len) const {
+        if (len > static_cast<size_t>(end_ - ptr_)) {
+            throw runtime_error("compact ray record is truncated");
+        }
+    }
+
+    const char *ptr_;
+    const char *end_;
+};
+
+/* the hit information that's only relevant to shading */
+void PutSurfaceInteraction(CompactWriter &out,
+                           const SurfaceInteraction &isect) {
+    out.PutVector(isect.p);
+    out.Put<Float>(isect.time);
+    out.PutVector(isect.pError);
+    out.PutVector(isect.wo);
+    out.PutDirection(isect.n);
+    out.Put(isect.uv);
+    out.PutVector(isect.dpdu);
+    out.PutVector(isect.dpdv);
+    out.PutVector(isect.dndu);
+    out.PutVector(isect.dndv);
+    out.PutDirection(isect.shading.n);
+    out.PutVector(isect.shading.dpdu);
+    out.PutVector(isect.shading.dpdv);
+    out.PutVector(isect.shading.dndu);
+    out.PutVector(isect.shading.dndv);
+    out.PutVector(isect.dpdx);
+    out.PutVector(isect.dpdy);
+    out.Put<Float>(isect.dudx);
+    out.Put<Float>(isect.dvdx);
+    out.Put<Float>(isect.dudy);
+    out.Put<Float>(isect.dvdy);
+    out.PutSignedVarint(isect.faceIndex);
+}
+
+void GetSurfaceInteraction(CompactReader &in, SurfaceInteraction &isect) {
+    isect.p = in.GetVector<Point3f>();
+    isect.time = in.Get<Float>();
+    isect.pError = in.GetVector<Vector3f>();
+    isect.wo = in.GetVector<Vector3f>();
+    isect.n = in.GetDirection<Normal3f>();
+    isect.uv = in.GetPoint2f();
+    isect.dpdu = in.GetVector<Vector3f>();
+    isect.dpdv = in.GetVector<Vector3f>();
+    isect.dndu = in.GetVector<Normal3f>();
+    isect.dndv = in.GetVector<Normal3f>();
+    isect.shading.n = in.GetDirection<Normal3f>();
+    isect.shading.dpdu = in.GetVector<Vector3f>();
+    isect.shading.dpdv = in.GetVector<Vector3f>();
+    isect.shading.dndu = in.GetVector<Normal3f>();
+    isect.shading.dndv = in.GetVector<Normal3f>();
+    isect.dpdx = in.GetVector<Vector3f>();
+    isect.dpdy = in.GetVector<Vector3f>();
+    isect.dudx = in.Get<Float>();
+    isect.dvdx = in.Get<Float>();
+    isect.dudy = in.Get<Float>();
+    isect.dvdy = in.Get<Float>();
+    isect.faceIndex = in.GetSignedVarint();
+}
+
+size_t PackRayCompact(char *buffer, const RayState &state,
+                      const RayState::CompactBase &base) {
+    if (state.toVisit.size() > RayState::MaxToVisit) {
+        throw runtime_error("ray stack is too deep to serialize");
+    }
+
+    CompactWriter out{buffer};
+
+    const bool transformed =
+        !state.toVisitEmpty() && state.toVisitTop().transformed;
+    const Matrix4x4 &m =
+        transformed ? state.rayTransform->GetMatrix() : Matrix4x4{};
+    const bool projective = transformed && (m.m[3][0] != 0 || m.m[3][1] != 0 ||
+                                            m.m[3][2] != 0 || m.m[3][3] != 1);
+
+    uint16_t flags = 0;
+    flags |= state.trackRay ? TRACK_RAY : 0;
+    flags |= state.isShadowRay ? SHADOW_RAY : 0;
+    flags |= state.isLightRay ? LIGHT_RAY : 0;
+    flags |= state.needsImageSampling ? NEEDS_IMAGE_SAMPLING : 0;
+    flags |= state.hit ? HIT : 0;
+    flags |= state.ray.hasDifferentials ? HAS_DIFFERENTIALS : 0;
+    flags |= state.beta != Spectrum(1.f) ? HAS_BETA : 0;
+    flags |= !state.Ld.IsBlack() ? HAS_LD : 0;
+    flags |= projective ? PROJECTIVE_TRANSFORM : 0;
+    flags |= state.hit && !state.isShadowRay &&
+                     FlipsNormals(state.hitInfo->isect)
+                 ? FLIP_NORMALS
+                 : 0;
+
+    out.PutVarint(flags);
+    out.PutVarint(state.remainingBounces);
+    out.PutVarint(state.hop);
+    out.PutVarint(state.pathHop);
+
+    if (flags & HAS_BETA) out.PutVector(Packed3f(state.beta).ToVector3f());
+    if (flags & HAS_LD) out.PutVector(Packed3f(state.Ld).ToVector3f());
+
+    out.PutSignedVarint(int64_t(state.sample.id - base.sampleId));
+    out.Put(state.sample.pFilm);
+    out.Put<Float>(state.sample.weight);
+    out.PutSignedVarint(state.sample.dim);
+
+    const RayDifferential &ray = state.ray;
+    out.PutVector(ray.o);
+    out.PutDirection(ray.d);
+    out.Put<Float>(ray.tMax);
+    out.Put<Float>(ray.time);
+
+    if (ray.hasDifferentials) {
+        out.PutVector(ray.rxOrigin);
+        out.PutVector(ray.ryOrigin);
+        out.PutVector(ray.rxDirection);
+        out.PutVector(ray.ryDirection);
+    }
+
+    if (state.isLightRay) {
+        out.PutVarint(state.lightRayInfo.sampledLightId);
+        out.PutDirection(state.lightRayInfo.sampledDirection);
+    }
+
+    if (state.needsImageSampling) {
+        out.PutVarint(state.imageSampleInfo.treelet);
+        out.PutVarint(state.imageSampleInfo.imageId);
+        out.Put(state.imageSampleInfo.uv);
+    }
+
+    if (state.hit && !state.isShadowRay) {
+        out.PutVarint(state.hitInfo->material.treelet);
+        out.PutVarint(state.hitInfo->material.id);
+        out.PutVarint(state.hitInfo->arealight);
+        PutSurfaceInteraction(out, state.hitInfo->isect);
+    }
+
+    /* consecutive stack entries tend to be in the same treelet, and nodes
+     * close to each other */
+    out.PutVarint(state.toVisit.size());
+
+    RayState::TreeletNode previous{};
+    previous.treelet = base.treelet;
+
+    for (size_t i = 0; i < state.toVisit.size(); i++) {
+        const auto &node = state.toVisit[i];
+        out.PutSignedVarint(int64_t(node.treelet) - int64_t(previous.treelet));
+        out.PutSignedVarint(int64_t(node.node) - int64_t(previous.node));
+        out.PutVarint((uint32_t(node.primitive) << 1) | node.transformed);
+        previous = node;
+    }
+
+    if (transformed) {
+        const int rows = projective ? 4 : 3;
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < 4; j++) out.Put<Float>(m.m[i][j]);
+        }
     }
+
+    return out.Size();
 }
 
+size_t UnPackRayCompact(const char *buffer, const size_t len,
+                        RayState &state, const RayState::CompactBase &base) {
+    CompactReader in{buffer, buffer + len};
+
+    const uint64_t flags = in.GetVarint();
+    state.trackRay = flags & TRACK_RAY;
+    state.isShadowRay = flags & SHADOW_RAY;
+    state.isLightRay = flags & LIGHT_RAY;
+    state.needsImageSampling = flags & NEEDS_IMAGE_SAMPLING;
+    state.hit = flags & HIT;
+    state.remainingBounces = in.GetVarint();
+    state.hop = in.GetVarint();
+    state.pathHop = in.GetVarint();
+
+    state.beta = Spectrum(1.f);
+    state.Ld = Spectrum(0.f);
+
+    if (flags & HAS_BETA) {
+        state.beta = Packed3f(in.GetVector<Vector3f>()).ToSpectrum();
+    }
+
+    if (flags & HAS_LD) {
+        state.Ld = Packed3f(in.GetVector<Vector3f>()).ToSpectrum();
+    }
+
+    state.sample.id = base.sampleId + in.GetSignedVarint();
+    state.sample.pFilm = in.GetPoint2f();
+    state.sample.weight = in.Get<Float>();
+    state.sample.dim = in.GetSignedVarint();
+
+    RayDifferential &ray = state.ray;
+    ray.o = in.GetVector<Point3f>();
+    ray.d = in.GetDirection<Vector3f>();
+    ray.tMax = in.Get<Float>();
+    ray.time = in.Get<Float>();
+    ray.hasDifferentials = flags & HAS_DIFFERENTIALS;
+
+    if (ray.hasDifferentials) {
+        ray.rxOrigin = in.GetVector<Point3f>();
+        ray.ryOrigin = in.GetVector<Point3f>();
+        ray.rxDirection = in.GetVector<Vector3f>();
+        ray.ryDirection = in.GetVector<Vector3f>();
+    }
+
+    if (state.isLightRay) {
+        state.lightRayInfo.sampledLightId = in.GetVarint();
+        state.lightRayInfo.sampledDirection = in.GetDirection<Vector3f>();
+    }
+
+    if (state.needsImageSampling) {
+        state.imageSampleInfo.treelet = in.GetVarint();
+        state.imageSampleInfo.imageId = in.GetVarint();
+        state.imageSampleInfo.uv = in.GetPoint2f();
+    }
+
+    if (state.hit && !state.isShadowRay) {
+        auto &hitInfo = state.EnsureHitInfo();
+        hitInfo.material.treelet = in.GetVarint();
+        hitInfo.material.id = in.GetVarint();
+        hitInfo.arealight = in.GetVarint();
+        GetSurfaceInteraction(in, hitInfo.isect);
+        hitInfo.isect.primitive = nullptr;
+        hitInfo.isect.shape = RayState::OrientationShape(flags & FLIP_NORMALS);
+    } else {
+        state.hitInfo.reset();
+    }
+
+    const uint64_t toVisitHead = in.GetVarint();
+    if (toVisitHead > RayState::MaxToVisit) {
+        throw runtime_error("ray stack is too deep");
+    }
+
+    state.toVisit.resize(toVisitHead);
+
+    RayState::TreeletNode previous{};
+    previous.treelet = base.treelet;
+
+    for (size_t i = 0; i < state.toVisit.size(); i++) {
+        auto &node = state.toVisit[i];
+        node.treelet = previous.treelet + in.GetSignedVarint();
+        node.node = previous.node + in.GetSignedVarint();
+
+        const uint64_t primitive = in.GetVarint();
+        node.primitive = primitive >> 1;
+        node.transformed = primitive & 1;
+        previous = node;
+    }
+
+    if (!state.toVisitEmpty() && state.toVisitTop().transformed) {
+        Float m[4][4] = {
+            {1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1}};
+        const int rows = (flags & PROJECTIVE_TRANSFORM) ? 4 : 3;
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < 4; j++) m[i][j] = in.Get<Float>();
+        }
+
+        state.EnsureRayTransform() = Transform(m);
+    }
+
+    return in.Size(buffer);
+}
+
+}  // namespace
+
+const size_t RayState::MaxToVisit = 256;
+
 const size_t RayState::MaxPackedSize =
-    sizeof(PackedRayFixedHdr) + 64 * sizeof(PackedTreeletNode) +
+    sizeof(PackedRayFixedHdr) + MaxToVisit * sizeof(PackedTreeletNode) +
     sizeof(PackedTreeletNode) + sizeof(PackedDifferentials) +
     sizeof(PackedTransform) + sizeof(PackedHitInfo) +
     sizeof(PackedLightRayInfo) + sizeof(PackedImageSampleInfo) + 4;
 
-size_t RayState::Serialize(char *data) {
-    static thread_local char packedBuffer[RayState::MaxPackedSize];
+/* varints may take a few more bytes than the fixed-size fields they replace;
+ * a stack entry, at worst, takes 5 + 5 + 2 bytes instead of 8 */
+const size_t RayState::MaxCompactSize =
+    RayState::MaxPackedSize + RayState::MaxToVisit * 4 + 32;
+
+const size_t RayState::MaxBufferSize =
+    max(RayState::MaxPackedSize, RayState::MaxCompactSize);
 
-    size_t packedBytes = PackRay(packedBuffer, *this);
+const string RayState::CompactStreamHeader{"PBRT-RAYS-V2"};
 
-    const size_t upperBound = LZ4_COMPRESSBOUND(RayState::MaxPackedSize);
+size_t RayState::Serialize(char *data, const Format format) {
+    static thread_local char packedBuffer[RayState::MaxBufferSize];
+
+    size_t packedBytes = 0;
+
+    if (format == Format::Compact) {
+        packedBuffer[0] = COMPACT_VERSION;
+        packedBytes = 1 + PackCompact(packedBuffer + 1, {});
+    } else {
+        packedBytes = PackRay(packedBuffer, *this);
+    }
+
+    const size_t upperBound = LZ4_COMPRESSBOUND(RayState::MaxBufferSize);
     uint32_t len = packedBytes;
 
     if (PbrtOptions.compressRays) {
@@ -489,24 +1102,58 @@ size_t RayState::Serialize(char *data) {
     return len;
 }
 
-void RayState::Deserialize(const char *data, const size_t len) {
-    static thread_local char packedBuffer[RayState::MaxPackedSize];
+void RayState::Deserialize(const char *data, const size_t len,
+                           const Format format) {
+    static thread_local char packedBuffer[RayState::MaxBufferSize];
+    size_t packedBytes = min(RayState::MaxBufferSize, len);
 
     if (PbrtOptions.compressRays) {
-        if (LZ4_decompress_safe(data, packedBuffer, len,
-                                RayState::MaxPackedSize) < 0) {
+        const int decompressed = LZ4_decompress_safe(
+            data, packedBuffer, len, RayState::MaxBufferSize);
+
+        if (decompressed < 0) {
             throw runtime_error("ray decompression failed");
         }
+
+        packedBytes = decompressed;
+    } else {
+        memcpy(packedBuffer, data, packedBytes);
+    }
+
+    if (format == Format::Compact) {
+        if (packedBytes == 0) {
+            throw runtime_error("compact ray record is truncated");
+        }
+
+        if (packedBuffer[0] != COMPACT_VERSION) {
+            throw runtime_error("unsupported ray format version: " +
+                                to_string(packedBuffer[0]));
+        }
+
+        UnPackCompact(packedBuffer + 1, packedBytes - 1, {});
     } else {
-        memcpy(packedBuffer, data, min(RayState::MaxPackedSize, len));
+        UnPackRay(packedBuffer, *this);
     }
+}
+
+size_t RayState::PackCompact(char *data, const CompactBase &base) const {
+    return PackRayCompact(data, *this, base);
+}
 
-    UnPackRay(packedBuffer, *this);
+size_t RayState::UnPackCompact(const char *data, const size_t len,
+                               const CompactBase &base) {
+    return UnPackRayCompact(data, len, *this, base);
 }
 
-size_t RayState::MaxSize() const {
+size_t RayState::MaxSize(const Format format) const {
+    if (format == Format::Compact) {
+        /* not tight, but cheaper than packing the ray */
+        return 4 + MaxCompactSize;
+    }
+
     size_t size =
-        4 + sizeof(PackedRayFixedHdr) + toVisitHead * sizeof(PackedTreeletNode);
+        4 + sizeof(PackedRayFixedHdr) +
+        toVisit.size() * sizeof(PackedTreeletNode);
 
     if (hit) {
         size += sizeof(PackedHitInfo);
@@ -531,11 +1178,11 @@ size_t RayState::MaxSize() const {
     return size;
 }
 
-size_t RayState::MaxCompressedSize() const {
+size_t RayState::MaxCompressedSize(const Format format) const {
     if (PbrtOptions.compressRays) {
-        return LZ4_COMPRESSBOUND(MaxSize());
+        return LZ4_COMPRESSBOUND(MaxSize(format));
     } else {
-        return MaxSize();
+        return MaxSize(format);
     }
 }
 
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <memory>
 
+#include "accelerators/cloud.h"
 #include "cloud/manager.h"
 #include "include/pbrt/common.h"
 #include "messages/compressed.h"
@@ -29,6 +30,13 @@ void print_treelet_info(const uint32_t treelet_id) {
     auto reader =
         RecordReader::get(treelet_buffer.data(), treelet_buffer.size());
 
+    uint32_t node_width = 2;
+    if (reader->next_record_size() == sizeof(CloudBVH::TreeletHeader)) {
+        CloudBVH::TreeletHeader header;
+        reader->read(&header);
+        node_width = header.node_width;
+    }
+
     size_t total_image_partition_size = 0;
     const uint32_t included_image_partitions = reader->read<uint32_t>();
     for (size_t i = 0; i < included_image_partitions; i++) {
@@ -86,7 +94,8 @@ void print_treelet_info(const uint32_t treelet_id) {
          << format_bytes(total_float_size) << "\033[0m" << endl
          << "\u21b3 MAT:  " << included_material_count << "  \033[38;5;242m"
          << format_bytes(total_material_size) << "\033[0m" << endl
-         << "\u21b3 MESH: " << included_mesh_count << endl;
+         << "\u21b3 MESH: " << included_mesh_count << endl
+         << "\u21b3 NODE: " << node_width << "-wide" << endl;
 }
 
 int main(int argc, char const *argv[]) {
@@ -0,0 +1,253 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "accelerators/cloud.h"
+#include "cloud/manager.h"
+#include "core/memory.h"
+#include "messages/utils.h"
+#include "pbrt.pb.h"
+#include "pbrt/main.h"
+#include "pbrt/raystate.h"
+#include "util/exception.h"
+#include "util/path.h"
+
+using namespace std;
+using namespace chrono;
+using namespace pbrt;
+
+auto &_manager = global::manager;
+
+void usage(const char *argv0) {
+    cerr << argv0
+         << " SCENE-DATA [--spp N] [--rays N] [--depth N] [--cache-budget MB]"
+         << endl;
+}
+
+void summarize(vector<double> values,
+               protobuf::TreeletReport::Distribution &dist) {
+    if (values.empty()) return;
+
+    sort(values.begin(), values.end());
+
+    double sum = 0;
+    for (const double v : values) sum += v;
+
+    auto percentile = [&values](const double p) {
+        return values[min(values.size() - 1, size_t(p * values.size()))];
+    };
+
+    dist.set_min(values.front());
+    dist.set_max(values.back());
+    dist.set_mean(sum / values.size());
+    dist.set_p50(percentile(.5));
+    dist.set_p90(percentile(.9));
+    dist.set_p99(percentile(.99));
+}
+
+int main(int argc, char const *argv[]) {
+    try {
+        if (argc <= 0) {
+            abort();
+        }
+
+        if (argc < 2) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        int spp = 1;
+        size_t maxRays = 100'000;
+        size_t depth = 5;
+        size_t cacheBudget = 0;
+
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--spp") == 0 and i + 1 < argc) {
+                spp = stoi(argv[++i]);
+            } else if (strcmp(argv[i], "--rays") == 0 and i + 1 < argc) {
+                maxRays = stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--depth") == 0 and i + 1 < argc) {
+                depth = stoul(argv[++i]);
+            } else if (strcmp(argv[i], "--cache-budget") == 0 and
+                       i + 1 < argc) {
+                cacheBudget = stoul(argv[++i]) * 1024 * 1024;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (spp <= 0 or maxRays == 0) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        FLAGS_log_prefix = false;
+        google::InitGoogleLogging(argv[0]);
+
+        const string scenePath{argv[1]};
+
+        pbrt::SceneBase scene = pbrt::LoadSceneBase(scenePath, spp);
+        scene.SetPathDepth(depth);
+
+        protobuf::TreeletReport report;
+
+        /* the size of a treelet is the size of its file, which is what a
+         * worker has to fetch to trace rays through it */
+        const size_t treeletCount = scene.TreeletCount();
+        vector<uint64_t> treeletBytes(treeletCount);
+        vector<uint64_t> treeletVisits(treeletCount, 0);
+
+        for (size_t i = 0; i < treeletCount; i++) {
+            treeletBytes[i] = roost::file_size(
+                _manager.getFilePath(ObjectType::Treelet, i));
+            report.set_total_bytes(report.total_bytes() + treeletBytes[i]);
+        }
+
+        report.set_treelet_count(treeletCount);
+        summarize({treeletBytes.begin(), treeletBytes.end()},
+                  *report.mutable_treelet_bytes());
+
+        /* the probability of a ray entering each treelet, as estimated by
+         * the partitioner; they add up to the expected number of treelets
+         * a ray visits */
+        vector<double> treeletProbs;
+        if (roost::exists(
+                _manager.getFilePath(ObjectType::TreeletInfo, 0))) {
+            treeletProbs = _manager.getTreeletProbs();
+            treeletProbs.resize(treeletCount, 0);
+
+            double expectedEntries = 0;
+            for (const double p : treeletProbs) expectedEntries += p;
+
+            report.set_has_expected_hops(true);
+            report.set_expected_hops_per_ray(max(0.0, expectedEntries - 1));
+        }
+
+        /* a single CloudBVH loads the treelets as the rays reach them; with
+         * no budget, they are kept once loaded */
+        auto bvh = make_shared<CloudBVH>(0, false);
+        bvh->SetCacheBudget(cacheBudget ? cacheBudget
+                                        : numeric_limits<size_t>::max());
+
+        /* the camera rays are spread evenly over the image and the samples,
+         * so that a small budget still covers the whole frame */
+        const Bounds2i &bounds = scene.SampleBounds();
+        const Vector2i extent = bounds.Diagonal();
+        const size_t area = bounds.Area();
+        const size_t totalSamples = area * spp;
+        const size_t stride = max<size_t>(1, totalSamples / maxRays);
+
+        /* a ray's `hop` counts the treelets it has been traced through since
+         * StartTrace() reset it, so a ray with a stack and a nonzero `hop` is
+         * in the middle of a traversal, i.e. it left a treelet for another
+         * one */
+        deque<RayStatePtr> queue;
+
+        for (size_t i = 0; i < totalSamples; i += stride) {
+            const size_t index = i % area;
+            const Point2i pixel{bounds.pMin.x + int(index % extent.x),
+                                bounds.pMin.y + int(index / extent.x)};
+
+            queue.push_back(scene.GenerateCameraRay(pixel, i / area));
+        }
+
+        report.set_camera_rays(queue.size());
+
+        uint64_t tracedRays = 0;
+        uint64_t hops = 0;
+        uint64_t loads = 0;
+        uint64_t bytesLoaded = 0;
+
+        MemoryArena arena;
+        ProcessRayOutput output;
+        CloudBVH::TreeletPin pin;
+
+        const auto start = steady_clock::now();
+
+        while (not queue.empty()) {
+            RayStatePtr ray = move(queue.front());
+            queue.pop_front();
+
+            const TreeletId treeletId = ray->CurrentTreelet();
+            if (treeletId >= treeletCount) {
+                throw runtime_error("ray for unknown treelet " +
+                                    to_string(treeletId));
+            }
+
+            treeletVisits[treeletId]++;
+
+            if (not ray->toVisitEmpty()) {
+                if (ray->hop++ > 0) {
+                    hops++;
+                } else {
+                    tracedRays++;
+                }
+            }
+
+            /* what a worker would have to fetch: the treelet's file, if it
+             * isn't loaded already (or anymore) */
+            if (not bvh->IsLoaded(treeletId)) {
+                loads++;
+                bytesLoaded += treeletBytes[treeletId];
+            }
+
+            pin.Reset(*bvh, treeletId);
+            scene.ProcessRay(move(ray), *bvh, arena, output);
+
+            for (auto &r : output.rays) {
+                if (r) queue.push_back(move(r));
+            }
+
+            /* the samples are not accumulated; nothing is rendered */
+            output.sample.reset();
+            arena.Reset();
+        }
+
+        pin.Reset();
+
+        report.set_trace_seconds(
+            duration_cast<duration<double>>(steady_clock::now() - start)
+                .count());
+
+        report.set_traced_rays(tracedRays);
+        report.set_hops(hops);
+        report.set_treelet_loads(loads);
+
+        if (tracedRays) {
+            report.set_measured_hops_per_ray(double(hops) / tracedRays);
+            report.set_bytes_per_ray(double(bytesLoaded) / tracedRays);
+        }
+
+        summarize({treeletVisits.begin(), treeletVisits.end()},
+                  *report.mutable_treelet_visits());
+
+        if (report.treelet_visits().mean() > 0) {
+            report.set_load_imbalance(report.treelet_visits().max() /
+                                      report.treelet_visits().mean());
+        }
+
+        for (size_t i = 0; i < treeletCount; i++) {
+            auto &treelet = *report.add_treelets();
+            treelet.set_id(i);
+            treelet.set_bytes(treeletBytes[i]);
+            treelet.set_visits(treeletVisits[i]);
+            if (not treeletProbs.empty()) {
+                treelet.set_expected_entries(treeletProbs[i]);
+            }
+        }
+
+        cout << protoutil::to_json(report, true) << endl;
+    } catch (const exception &e) {
+        print_exception(argv[0], e);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
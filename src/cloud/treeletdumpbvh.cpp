@@ -3,6 +3,7 @@
 #include <Ptexture.h>
 
 #include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <queue>
@@ -12,6 +13,7 @@
 #include "messages/serdes.h"
 #include "messages/utils.h"
 #include "paramset.h"
+#include "parallel.h"
 #include "pbrt.pb.h"
 #include "stats.h"
 
@@ -34,6 +36,8 @@ constexpr uint64_t triSize = sizeof(int) + sizeof(int) + sizeof(uintptr_t) +
 constexpr uint64_t instSize = 32 * sizeof(float) + sizeof(int);
 }  // namespace SizeEstimates
 
+static const char profileMagic[] = "PBRT-TRANSITIONS-V1";
+
 int TreeletDumpBVH::numInstances = 0;
 
 TreeletDumpBVH::TreeletDumpBVH(vector<shared_ptr<Primitive>> &&p,
@@ -41,13 +45,22 @@ TreeletDumpBVH::TreeletDumpBVH(vector<shared_ptr<Primitive>> &&p,
                                bool rootBVH, bool writeHeader,
                                TreeletDumpBVH::TraversalAlgorithm travAlgo,
                                TreeletDumpBVH::PartitionAlgorithm partAlgo,
-                               int maxPrimsInNode, SplitMethod splitMethod)
+                               int maxPrimsInNode, SplitMethod splitMethod,
+                               int nodeWidth, const string &profilePath,
+                               const string &recordProfilePath,
+                               blocked::Codec treeletCodec)
     : BVHAccel(p, maxPrimsInNode, splitMethod),
       rootBVH(rootBVH),
       traversalAlgo(travAlgo),
       partitionAlgo(partAlgo),
-      maxTreeletBytes(maxTreeletBytes) {
+      maxTreeletBytes(maxTreeletBytes),
+      nodeWidth(nodeWidth),
+      treeletCodec(treeletCodec) {
     if (rootBVH) {
+        if (!profilePath.empty()) {
+            LoadProfile(profilePath);
+        }
+
         SetNodeInfo(maxTreeletBytes);
         allTreelets = AllocateTreelets(maxTreeletBytes);
 
@@ -71,10 +84,160 @@ TreeletDumpBVH::TreeletDumpBVH(vector<shared_ptr<Primitive>> &&p,
         if (totalBytes < copyableThreshold) {
             copyable = true;
         } else {
+            if (!profilePath.empty()) {
+                LoadProfile(profilePath + "." + to_string(instanceID));
+            }
+
             SetNodeInfo(maxTreeletBytes);
             allTreelets = AllocateTreelets(maxTreeletBytes);
         }
     }
+
+    /* copyable instances are traversed by BVHAccel, and have nothing to
+     * record */
+    if (!recordProfilePath.empty() && (rootBVH || !copyable)) {
+        this->recordProfilePath =
+            rootBVH ? recordProfilePath
+                    : recordProfilePath + "." + to_string(instanceID);
+
+        for (auto &counts : rayCounts) {
+            counts.resize(nodeCount);
+        }
+    }
+}
+
+TreeletDumpBVH::~TreeletDumpBVH() {
+    if (!recordProfilePath.empty()) {
+        WriteProfile(recordProfilePath);
+    }
+}
+
+void TreeletDumpBVH::LoadProfile(const string &path) {
+    ifstream fin(path, ios::binary);
+    if (!fin.good()) {
+        Warning("Couldn't open BVH profile \"%s\". Using surface area "
+                "estimates.",
+                path.c_str());
+        return;
+    }
+
+    auto read = [&fin](uint64_t &value) {
+        fin.read(reinterpret_cast<char *>(&value), sizeof(value));
+    };
+
+    char magic[sizeof(profileMagic)];
+    fin.read(magic, sizeof(magic));
+    uint64_t profileNodeCount = 0;
+    read(profileNodeCount);
+
+    if (!fin.good() || memcmp(magic, profileMagic, sizeof(magic)) != 0 ||
+        profileNodeCount != nodeCount) {
+        Warning("BVH profile \"%s\" doesn't match this BVH. Using surface "
+                "area estimates.",
+                path.c_str());
+        return;
+    }
+
+    TransitionProfile loaded;
+    for (int octant = 0; octant < 8; octant++) {
+        RayCountMap &counts = loaded.counts[octant];
+        vector<uint64_t> &visits = loaded.visits[octant];
+        counts.resize(nodeCount);
+        visits.resize(nodeCount);
+
+        uint64_t numEntries = 0;
+        read(loaded.rays[octant]);
+        read(numEntries);
+        visits[0] = loaded.rays[octant];
+
+        for (uint64_t i = 0; i < numEntries; i++) {
+            uint64_t src = 0, dst = 0, count = 0;
+            read(src);
+            read(dst);
+            read(count);
+
+            if (!fin.good() || src >= profileNodeCount ||
+                dst >= profileNodeCount) {
+                Warning("BVH profile \"%s\" is corrupted. Using surface "
+                        "area estimates.",
+                        path.c_str());
+                return;
+            }
+
+            counts[src][dst] += count;
+            visits[dst] += count;
+        }
+    }
+
+    profile = move(loaded);
+}
+
+void TreeletDumpBVH::WriteProfile(const string &path) const {
+    ofstream fout(path, ios::binary | ios::trunc);
+
+    auto write = [&fout](const uint64_t value) {
+        fout.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    };
+
+    fout.write(profileMagic, sizeof(profileMagic));
+    write(nodeCount);
+
+    for (int octant = 0; octant < 8; octant++) {
+        const RayCountMap &counts = rayCounts[octant];
+
+        uint64_t numEntries = 0;
+        for (const auto &outgoing : counts) {
+            numEntries += outgoing.size();
+        }
+
+        write(recordedRays[octant]);
+        write(numEntries);
+
+        for (uint64_t src = 0; src < counts.size(); src++) {
+            for (const auto &kv : counts[src]) {
+                write(src);
+                write(kv.first);
+                write(kv.second);
+            }
+        }
+    }
+
+    if (!fout.good()) {
+        Warning("Couldn't write BVH profile \"%s\".", path.c_str());
+    }
+}
+
+/* Replaces the estimated probabilities of the graph with the observed ones,
+ * for every node that rays of this octant visited while the profile was
+ * recorded. Nodes that were never visited keep their surface area estimates,
+ * so a short profiling render still yields a complete graph. Both are
+ * probabilities per ray that enters the root, so they can be mixed. */
+void TreeletDumpBVH::ApplyProfile(int octant, TraversalGraph &graph) const {
+    const uint64_t rays = profile.rays[octant];
+    if (rays == 0) return;
+
+    const RayCountMap &counts = profile.counts[octant];
+    const vector<uint64_t> &visits = profile.visits[octant];
+
+    uint64_t profiledNodes = 0;
+    for (uint64_t nodeIdx = 0; nodeIdx < nodeCount; nodeIdx++) {
+        if (visits[nodeIdx] == 0) continue;
+        profiledNodes++;
+
+        graph.incomingProb[nodeIdx] = (double)visits[nodeIdx] / rays;
+
+        auto outgoing = graph.outgoing[nodeIdx];
+        for (Edge *edge = outgoing.first;
+             edge < outgoing.first + outgoing.second; edge++) {
+            auto count = counts[nodeIdx].find(edge->dst);
+            edge->weight = count == counts[nodeIdx].end()
+                               ? 0.f
+                               : (double)count->second / rays;
+        }
+    }
+
+    printf("Profile for octant %d: %lu rays, %lu of %lu nodes visited\n",
+           octant, rays, profiledNodes, nodeCount);
 }
 
 shared_ptr<TreeletDumpBVH> CreateTreeletDumpBVH(
@@ -133,9 +296,37 @@ shared_ptr<TreeletDumpBVH> CreateTreeletDumpBVH(
     }
     int maxPrimsInNode = ps.FindOneInt("maxnodeprims", 4);
 
+    int nodeWidth = ps.FindOneInt("nodewidth", 2);
+    if (nodeWidth != 2 && nodeWidth != 4 && nodeWidth != 8) {
+        Warning("BVH node width %d unsupported. Using 2.", nodeWidth);
+        nodeWidth = 2;
+    }
+
+    /* transition counts to weight the partitioning with, and where to write
+     * the ones observed while rendering with this BVH */
+    string profilePath = ps.FindOneString("profile", "");
+    string recordProfilePath = ps.FindOneString("recordprofile", "");
+
+    string codecName = ps.FindOneString("compression", "none");
+    blocked::Codec treeletCodec = blocked::Codec::None;
+    if (codecName == "lz4")
+        treeletCodec = blocked::Codec::LZ4;
+    else if (codecName == "zstd")
+        treeletCodec = blocked::Codec::Zstd;
+    else if (codecName != "none")
+        Warning("Treelet compression \"%s\" unknown. Using \"none\".",
+                codecName.c_str());
+
+    if (!blocked::codec_available(treeletCodec)) {
+        Warning("Treelet compression \"%s\" was not compiled in. Using "
+                "\"lz4\".", codecName.c_str());
+        treeletCodec = blocked::Codec::LZ4;
+    }
+
     return make_shared<TreeletDumpBVH>(
         move(prims), maxTreeletBytes, copyableThreshold, rootBVH, writeHeader,
-        travAlgo, partAlgo, maxPrimsInNode, splitMethod);
+        travAlgo, partAlgo, maxPrimsInNode, splitMethod, nodeWidth,
+        profilePath, recordProfilePath, treeletCodec);
 }
 
 void TreeletDumpBVH::SetNodeInfo(int maxTreeletBytes) {
@@ -199,6 +390,7 @@ void TreeletDumpBVH::SetNodeInfo(int maxTreeletBytes) {
 }
 
 uint64_t TreeletDumpBVH::GetInstancesBytes(const InstanceMask &mask) const {
+    lock_guard<mutex> lock(instanceSizeCacheMutex);
     auto iter = instanceSizeCache.find(mask);
     if (iter != instanceSizeCache.end()) {
         return iter->second;
@@ -211,8 +403,7 @@ uint64_t TreeletDumpBVH::GetInstancesBytes(const InstanceMask &mask) const {
         }
     }
 
-    const_cast<unordered_map<InstanceMask, uint64_t> *>(&instanceSizeCache)
-        ->emplace(mask, totalInstanceSize);
+    instanceSizeCache.emplace(mask, totalInstanceSize);
 
     return totalInstanceSize;
 }
@@ -506,27 +697,20 @@ vector<TreeletDumpBVH::TreeletInfo> TreeletDumpBVH::AllocateDirectionalTreelets(
     int maxTreeletBytes) {
     array<unordered_map<uint32_t, TreeletInfo>, 8> intermediateTreelets;
 
-    for (int dirIdx = 0; dirIdx < 8; dirIdx++) {
-        Vector3f dir = ComputeRayDir(dirIdx);
-        TraversalGraph graph = CreateTraversalGraph(dir, 0);
-
-        // rayCounts[i].resize(nodeCount);
-        //// Init rayCounts so unordered_map isn't modified during intersection
-        // for (uint64_t srcIdx = 0; srcIdx < nodeCount; srcIdx++) {
-        //    auto outgoing = graph.outgoing[srcIdx];
-        //    for (const Edge *outgoingEdge = outgoing.first;
-        //         outgoingEdge < outgoing.first + outgoing.second;
-        //         outgoingEdge++) {
-        //        uint64_t dstIdx = outgoingEdge->dst;
-        //        auto res = rayCounts[i][srcIdx].emplace(dstIdx, 0);
-        //        CHECK_EQ(res.second, true);
-        //    }
-        //}
-
-        treeletAllocations[dirIdx] = ComputeTreelets(graph, maxTreeletBytes);
-        intermediateTreelets[dirIdx] =
-            MergeDisjointTreelets(dirIdx, maxTreeletBytes, graph);
-    }
+    /* the directions are partitioned independently of each other; each one
+     * only writes its own slot of treeletAllocations, instanceProbabilities
+     * and intermediateTreelets */
+    ParallelFor(
+        [&](int64_t dirIdx) {
+            Vector3f dir = ComputeRayDir(dirIdx);
+            TraversalGraph graph = CreateTraversalGraph(dir, 0);
+
+            treeletAllocations[dirIdx] =
+                ComputeTreelets(graph, maxTreeletBytes);
+            intermediateTreelets[dirIdx] =
+                MergeDisjointTreelets(dirIdx, maxTreeletBytes, graph);
+        },
+        8);
 
     vector<TreeletInfo> finalTreelets;
     // Assign root treelets to IDs 0 to 8
@@ -826,6 +1010,8 @@ TreeletDumpBVH::TraversalGraph TreeletDumpBVH::CreateTraversalGraph(
         intermediate.outgoing.pop_front();
     }
 
+    ApplyProfile(RayOctant(rayDir), graph);
+
     printf("Graph gen complete: %lu verts %lu edges\n", graph.depthFirst.size(),
            graph.edges.size());
 
@@ -1524,11 +1710,18 @@ vector<uint32_t> TreeletDumpBVH::OrigAssignTreelets(
     return labels;
 }
 
-void UpdateRayCount(const TreeletDumpBVH::RayCountMap &rayCounts, uint64_t src,
-                    uint64_t dst) {
-    // atomic_uint64_t &rayCount =
-    //    const_cast<atomic_uint64_t &>(rayCounts[src].find(dst)->second);
-    // rayCount++;
+void TreeletDumpBVH::RecordRay(const Vector3f &invDir) const {
+    if (recordProfilePath.empty()) return;
+    recordedRays[RayOctant(invDir)]++;
+}
+
+/* Rays are counted by octant even when the treelets are not directional, so
+ * that the same profile can be used for any partition algorithm. */
+void TreeletDumpBVH::UpdateRayCount(const Vector3f &invDir, uint64_t src,
+                                    uint64_t dst) const {
+    if (recordProfilePath.empty()) return;
+    lock_guard<mutex> lock(rayCountLocks[src % rayCountLocks.size()]);
+    rayCounts[RayOctant(invDir)][src][dst]++;
 }
 
 bool TreeletDumpBVH::IntersectSendCheck(const Ray &ray,
@@ -1543,6 +1736,7 @@ bool TreeletDumpBVH::IntersectSendCheck(const Ray &ray,
     uint64_t nodesToVisit[64];
 
     int dirIdx = treeletAllocations[7].empty() ? 0 : ComputeIdx(invDir);
+    RecordRay(invDir);
     const auto &labels = treeletAllocations[dirIdx];
     uint32_t prevTreelet = labels[currentNodeIndex];
 
@@ -1591,7 +1785,7 @@ bool TreeletDumpBVH::IntersectSendCheck(const Ray &ray,
             currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
 
-        UpdateRayCount(rayCounts[dirIdx], prevNodeIndex, currentNodeIndex);
+        UpdateRayCount(invDir, prevNodeIndex, currentNodeIndex);
 
         uint32_t curTreelet = labels[currentNodeIndex];
 
@@ -1614,6 +1808,7 @@ bool TreeletDumpBVH::IntersectPSendCheck(const Ray &ray) const {
     uint64_t toVisitOffset = 0, currentNodeIndex = 0;
 
     int dirIdx = treeletAllocations[7].empty() ? 0 : ComputeIdx(invDir);
+    RecordRay(invDir);
     const auto &labels = treeletAllocations[dirIdx];
     uint32_t prevTreelet = labels[currentNodeIndex];
 
@@ -1661,7 +1856,7 @@ bool TreeletDumpBVH::IntersectPSendCheck(const Ray &ray) const {
             currentNodeIndex = nodesToVisit[--toVisitOffset];
         }
 
-        UpdateRayCount(rayCounts[dirIdx], prevNodeIndex, currentNodeIndex);
+        UpdateRayCount(invDir, prevNodeIndex, currentNodeIndex);
 
         uint32_t curTreelet = labels[currentNodeIndex];
 
@@ -1687,6 +1882,7 @@ bool TreeletDumpBVH::IntersectCheckSend(const Ray &ray,
     uint64_t nodesToVisit[64];
 
     int dirIdx = treeletAllocations[7].empty() ? 0 : ComputeIdx(invDir);
+    RecordRay(invDir);
     const auto &labels = treeletAllocations[dirIdx];
 
     uint32_t prevTreelet = labels[currentNodeIndex];
@@ -1734,7 +1930,7 @@ bool TreeletDumpBVH::IntersectCheckSend(const Ray &ray,
 
         if (currentNodeIndex == prevNodeIndex) break;
 
-        UpdateRayCount(rayCounts[dirIdx], prevNodeIndex, currentNodeIndex);
+        UpdateRayCount(invDir, prevNodeIndex, currentNodeIndex);
 
         uint32_t curTreelet = labels[currentNodeIndex];
 
@@ -1759,6 +1955,7 @@ bool TreeletDumpBVH::IntersectPCheckSend(const Ray &ray) const {
     uint64_t toVisitOffset = 0, currentNodeIndex = 0;
 
     int dirIdx = treeletAllocations[7].empty() ? 0 : ComputeIdx(invDir);
+    RecordRay(invDir);
     const auto &labels = treeletAllocations[dirIdx];
 
     uint32_t prevTreelet = labels[currentNodeIndex];
@@ -1800,7 +1997,7 @@ bool TreeletDumpBVH::IntersectPCheckSend(const Ray &ray) const {
 
         if (currentNodeIndex == prevNodeIndex) break;
 
-        UpdateRayCount(rayCounts[dirIdx], prevNodeIndex, currentNodeIndex);
+        UpdateRayCount(invDir, prevNodeIndex, currentNodeIndex);
 
         uint32_t curTreelet = labels[currentNodeIndex];
 
@@ -2652,25 +2849,31 @@ void TreeletDumpBVH::DumpMaterials() const {
 
         writer->write(static_cast<uint32_t>(stexs.size()));
         for (const auto id : stexs) {
+            protobuf::SpectrumTexture stex;
+            _manager.GetReader(ObjectType::SpectrumTexture, id)->read(&stex);
+
             writer->write(id);
-            writer->write_raw(roost::read_file(
-                _manager.getFilePath(ObjectType::SpectrumTexture, id)));
+            writer->write(serdes::spectrum_texture::serialize(stex));
         }
 
         writer->write(static_cast<uint32_t>(ftexs.size()));
         for (const auto id : ftexs) {
+            protobuf::FloatTexture ftex;
+            _manager.GetReader(ObjectType::FloatTexture, id)->read(&ftex);
+
             writer->write(id);
-            writer->write_raw(roost::read_file(
-                _manager.getFilePath(ObjectType::FloatTexture, id)));
+            writer->write(serdes::float_texture::serialize(ftex));
         }
 
         writer->write(static_cast<uint32_t>(t.materials.size()));
         for (const auto id : t.materials) {
             _manager.recordMaterialTreeletId(id, t.id);
 
+            protobuf::Material mtl;
+            _manager.GetReader(ObjectType::Material, id)->read(&mtl);
+
             writer->write(id);
-            writer->write_raw(roost::read_file(
-                _manager.getFilePath(ObjectType::Material, id)));
+            writer->write(serdes::material::serialize(mtl));
         }
 
         writer->write(static_cast<uint32_t>(0));  // triangle meshes
@@ -2758,6 +2961,230 @@ void TreeletDumpBVH::DumpImagePartitions() const {
     }
 }
 
+TreeletDumpBVH::TreeletNodes TreeletDumpBVH::BuildTreeletNodes(
+    const uint32_t treeletID,
+    const vector<unordered_map<uint64_t, uint32_t>> &treeletNodeLocations)
+    const {
+    const TreeletInfo &treelet = allTreelets[treeletID];
+    const uint32_t sTreeletID = _manager.getId(&treelet);
+
+    TreeletNodes result;
+    auto &output_nodes = result.nodes;
+    auto &child_bounds = result.childBounds;
+
+    size_t current_primitive_offset = 0;
+
+    enum Child { LEFT = 0, RIGHT = 1 };
+
+    stack<pair<uint32_t, Child>> q;
+
+    auto add_node = [&](const Bounds3f &bounds, const uint8_t axis) {
+        output_nodes.emplace_back(bounds, axis);
+        child_bounds.emplace_back();
+
+        if (not q.empty()) {
+            auto parent = q.top();
+            q.pop();
+
+            output_nodes[parent.first].child_treelet[parent.second] =
+                sTreeletID;
+            output_nodes[parent.first].child_node[parent.second] =
+                output_nodes.size() - 1;
+        } else {
+            result.roots.push_back(output_nodes.size() - 1);
+        }
+
+        return output_nodes.size() - 1;
+    };
+
+    for (uint64_t nodeIdx : treelet.nodes) {
+        const LinearBVHNode &node = nodes[nodeIdx];
+        const uint32_t out_idx = add_node(node.bounds, node.axis);
+        auto &out_node = output_nodes[out_idx];
+
+        if (node.nPrimitives == 0) {  // it's not a leaf
+            child_bounds[out_idx][LEFT] = nodes[nodeIdx + 1].bounds;
+            child_bounds[out_idx][RIGHT] = nodes[node.secondChildOffset].bounds;
+
+            uint32_t r_tid =
+                treeletAllocations[treelet.dirIdx][node.secondChildOffset];
+            if (r_tid != treeletID) {
+                out_node.child_treelet[RIGHT] =
+                    _manager.getId(&allTreelets[r_tid]);
+                out_node.child_node[RIGHT] =
+                    treeletNodeLocations[r_tid].at(node.secondChildOffset);
+            } else {
+                q.emplace(out_idx, RIGHT);
+            }
+
+            uint32_t l_tid = treeletAllocations[treelet.dirIdx][nodeIdx + 1];
+            if (l_tid != treeletID) {
+                out_node.child_treelet[LEFT] =
+                    _manager.getId(&allTreelets[l_tid]);
+                out_node.child_node[LEFT] =
+                    treeletNodeLocations[l_tid].at(nodeIdx + 1);
+            } else {
+                q.emplace(out_idx, LEFT);
+            }
+        } else {  // it is a leaf
+            out_node.leaf_tag = ~0;
+            out_node.primitive_offset = current_primitive_offset;
+            out_node.primitive_count = node.nPrimitives;
+
+            current_primitive_offset += node.nPrimitives;
+        }
+    }
+
+    for (TreeletDumpBVH *inst : treelet.instances) {
+        CHECK(q.empty());
+
+        for (uint64_t nodeIdx = 0; nodeIdx < inst->nodeCount; nodeIdx++) {
+            const LinearBVHNode &instNode = inst->nodes[nodeIdx];
+            const uint32_t out_idx = add_node(instNode.bounds, instNode.axis);
+            auto &out_node = output_nodes[out_idx];
+
+            if (instNode.nPrimitives == 0) {
+                // every node from the mesh are in the same treelet
+                child_bounds[out_idx][LEFT] = inst->nodes[nodeIdx + 1].bounds;
+                child_bounds[out_idx][RIGHT] =
+                    inst->nodes[instNode.secondChildOffset].bounds;
+
+                q.emplace(out_idx, RIGHT);
+                q.emplace(out_idx, LEFT);
+            } else {
+                out_node.leaf_tag = ~0;
+                out_node.primitive_offset = current_primitive_offset;
+                out_node.primitive_count = instNode.nPrimitives;
+            }
+
+            current_primitive_offset += instNode.nPrimitives;
+        }
+    }
+
+    return result;
+}
+
+template <int N>
+void TreeletDumpBVH::CollapseTreeletNodes(
+    const TreeletNodes &binary, const uint16_t treeletID,
+    const function<uint32_t(uint16_t, uint32_t)> &remoteNode,
+    vector<CloudBVH::WideTreeletNode<N>> &wideNodes,
+    vector<CloudBVH::TreeletLeaf> &leaves,
+    unordered_map<uint32_t, uint32_t> &wideIndex) {
+    struct Slot {
+        uint16_t treelet;
+        uint32_t node;
+        Bounds3f bounds;
+    };
+
+    auto isLocalInterior = [&](const Slot &slot) {
+        return slot.treelet == treeletID &&
+               not binary.nodes[slot.node].is_leaf();
+    };
+
+    function<uint32_t(uint32_t)> collapse = [&](const uint32_t b) {
+        const uint32_t idx = wideNodes.size();
+        wideNodes.emplace_back();
+        wideIndex[b] = idx;
+
+        const auto &node = binary.nodes[b];
+        vector<Slot> slots;
+
+        if (node.is_leaf()) {
+            slots.push_back({treeletID, b, node.bounds});
+        } else {
+            for (int c = 0; c < 2; c++) {
+                slots.push_back({node.child_treelet[c], node.child_node[c],
+                                 binary.childBounds[b][c]});
+            }
+        }
+
+        /* open up the largest local interior child until the node is full */
+        while (slots.size() < N) {
+            int best = -1;
+            for (int i = 0; i < slots.size(); i++) {
+                if (isLocalInterior(slots[i]) &&
+                    (best < 0 || slots[i].bounds.SurfaceArea() >
+                                     slots[best].bounds.SurfaceArea())) {
+                    best = i;
+                }
+            }
+
+            if (best < 0) break;
+
+            const uint32_t opened = slots[best].node;
+            slots.erase(slots.begin() + best);
+
+            const auto &child = binary.nodes[opened];
+            for (int c = 0; c < 2; c++) {
+                slots.push_back({child.child_treelet[c], child.child_node[c],
+                                 binary.childBounds[opened][c]});
+            }
+        }
+
+        Bounds3f bounds;
+        for (const auto &slot : slots) bounds = Union(bounds, slot.bounds);
+
+        CloudBVH::WideTreeletNode<N> wide;
+        wide.SetBounds(bounds);
+
+        for (const auto &slot : slots) {
+            uint32_t ref;
+
+            if (slot.treelet != treeletID) {
+                ref = remoteNode(slot.treelet, slot.node);
+            } else if (binary.nodes[slot.node].is_leaf()) {
+                const auto &leaf = binary.nodes[slot.node];
+                ref = CloudBVH::LEAF_FLAG | leaves.size();
+                leaves.push_back({leaf.primitive_offset, leaf.primitive_count});
+            } else {
+                ref = collapse(slot.node);
+            }
+
+            wide.AddChild(slot.bounds, slot.treelet, ref);
+        }
+
+        wideNodes[idx] = wide;
+        return idx;
+    };
+
+    for (const uint32_t root : binary.roots) {
+        collapse(root);
+    }
+}
+
+void TreeletDumpBVH::DumpTreeletProbs(const int numRoots) const {
+    /* totalProb is the expected number of times a ray that starts at the
+     * root of the treelet's direction enters the treelet; assuming all
+     * directions are equally likely, the probabilities add up to the
+     * expected number of treelets a ray visits. Only the partitioners that
+     * work on the traversal graph compute them, and instanced treelets are
+     * left at zero. */
+    float totalProb = 0;
+    uint32_t count = 0;
+    for (const TreeletInfo &treelet : allTreelets) {
+        totalProb += treelet.totalProb;
+        count = max(count, _manager.getId(&treelet) + 1);
+    }
+
+    if (totalProb == 0) return;
+
+    vector<float> probs(count, 0);
+    for (const TreeletInfo &treelet : allTreelets) {
+        probs[_manager.getId(&treelet)] = treelet.totalProb / numRoots;
+    }
+
+    ofstream fout{_manager.getFilePath(ObjectType::TreeletInfo, 0)};
+    fout << count << endl;
+    for (const float prob : probs) {
+        fout << prob << endl;
+    }
+
+    if (!fout.good()) {
+        throw runtime_error("could not write the treelet probabilities");
+    }
+}
+
 vector<uint32_t> TreeletDumpBVH::DumpTreelets(bool root) const {
     // Assign IDs to each treelet
     for (const TreeletInfo &treelet : allTreelets) {
@@ -2792,38 +3219,105 @@ vector<uint32_t> TreeletDumpBVH::DumpTreelets(bool root) const {
 
     DumpSanityCheck(treeletNodeLocations);
 
+    /* with wide nodes, references into other treelets need to know where
+     * the nodes they point to ended up */
+    unordered_map<uint32_t, unordered_map<uint32_t, uint32_t>>
+        wideNodeLocations;
+
+    if (nodeWidth != 2) {
+        auto noRemote = [](const uint16_t, const uint32_t) { return 0u; };
+
+        for (const TreeletInfo &treelet : allTreelets) {
+            wideNodeLocations[_manager.getId(&treelet)];
+        }
+
+        ParallelFor(
+            [&](int64_t treeletID) {
+                const uint32_t sTreeletID =
+                    _manager.getId(&allTreelets[treeletID]);
+                const TreeletNodes binary =
+                    BuildTreeletNodes(treeletID, treeletNodeLocations);
+                vector<CloudBVH::TreeletLeaf> leaves;
+                auto &wideIndex = wideNodeLocations.at(sTreeletID);
+
+                if (nodeWidth == 4) {
+                    vector<CloudBVH::WideTreeletNode<4>> wide;
+                    CollapseTreeletNodes<4>(binary, sTreeletID, noRemote,
+                                            wide, leaves, wideIndex);
+                } else {
+                    vector<CloudBVH::WideTreeletNode<8>> wide;
+                    CollapseTreeletNodes<8>(binary, sTreeletID, noRemote,
+                                            wide, leaves, wideIndex);
+                }
+            },
+            allTreelets.size());
+    }
+
+    /* Instances that aren't copied into our treelets have treelets of their
+     * own. They are dumped first, so that the treelets of this BVH only need
+     * to look up the root treelets of the instances they reference. */
     unordered_map<TreeletDumpBVH *, vector<uint32_t>>
         nonCopyableInstanceTreelets;
 
-    // keeping a list of instance meshes that are already cut
-    set<TriangleMesh *> meshesWithTexturesAlreadyCut;
+    for (const TreeletInfo &treelet : allTreelets) {
+        for (uint64_t nodeIdx : treelet.nodes) {
+            const LinearBVHNode &node = nodes[nodeIdx];
+            for (int primIdx = 0; primIdx < node.nPrimitives; primIdx++) {
+                auto &prim = primitives[node.primitivesOffset + primIdx];
+                if (prim->GetType() != PrimitiveType::Transformed) continue;
 
-    for (uint32_t treeletID = 0; treeletID < allTreelets.size(); treeletID++) {
+                shared_ptr<TransformedPrimitive> tp =
+                    dynamic_pointer_cast<TransformedPrimitive>(prim);
+                shared_ptr<TreeletDumpBVH> instance =
+                    dynamic_pointer_cast<TreeletDumpBVH>(tp->GetPrimitive());
+                CHECK_NOTNULL(instance.get());
+
+                if (instance->copyable ||
+                    nonCopyableInstanceTreelets.count(instance.get())) {
+                    continue;
+                }
+
+                nonCopyableInstanceTreelets.emplace(
+                    instance.get(), instance->DumpTreelets(false));
+            }
+        }
+    }
+
+    /* Mesh ids are handed out in a fixed order, so that dumping the same
+     * scene again yields byte-identical treelets, which the scene manager
+     * can then keep from the previous dump. Each treelet gets a contiguous
+     * range: one id per mesh it references, and one per part of a compound
+     * material. */
+    vector<vector<TriangleMesh *>> treeletMeshes(allTreelets.size());
+    vector<uint32_t> firstMeshIds(allTreelets.size());
+
+    ParallelFor([&](int64_t treeletID) {
         const TreeletInfo &treelet = allTreelets[treeletID];
-        // Find which triangles / meshes are in treelet
-        unordered_map<TriangleMesh *, vector<size_t>> trianglesInTreelet;
+        auto &meshes = treeletMeshes[treeletID];
+        unordered_set<TriangleMesh *> seen;
+
+        auto addMesh = [&](const shared_ptr<Primitive> &prim) {
+            shared_ptr<GeometricPrimitive> gp =
+                dynamic_pointer_cast<GeometricPrimitive>(prim);
+            const Shape *shape = gp->GetShape();
+            const Triangle *tri = dynamic_cast<const Triangle *>(shape);
+            CHECK_NOTNULL(tri);
+            if (seen.insert(tri->mesh.get()).second) {
+                meshes.push_back(tri->mesh.get());
+            }
+        };
+
         for (uint64_t nodeIdx : treelet.nodes) {
             const LinearBVHNode &node = nodes[nodeIdx];
             for (int primIdx = 0; primIdx < node.nPrimitives; primIdx++) {
                 auto &prim = primitives[node.primitivesOffset + primIdx];
                 if (prim->GetType() == PrimitiveType::Geometric) {
-                    shared_ptr<GeometricPrimitive> gp =
-                        dynamic_pointer_cast<GeometricPrimitive>(prim);
-                    const Shape *shape = gp->GetShape();
-                    const Triangle *tri = dynamic_cast<const Triangle *>(shape);
-                    CHECK_NOTNULL(tri);
-                    TriangleMesh *mesh = tri->mesh.get();
-
-                    uint64_t triNum = (tri->v - tri->mesh->vertexIndices) / 3;
-
-                    CHECK_GE(triNum, 0);
-                    trianglesInTreelet[mesh].push_back(triNum);
+                    addMesh(prim);
                 }
             }
         }
 
         // Get meshes for instances
-        unordered_set<TriangleMesh *> instanceMeshes;
         for (const TreeletDumpBVH *inst : treelet.instances) {
             for (uint64_t nodeIdx = 0; nodeIdx < inst->nodeCount; nodeIdx++) {
                 const LinearBVHNode &node = inst->nodes[nodeIdx];
@@ -2833,20 +3327,262 @@ vector<uint32_t> TreeletDumpBVH::DumpTreelets(bool root) const {
                     if (prim->GetType() != PrimitiveType::Geometric) {
                         throw runtime_error("double nested instancing?");
                     }
+                    addMesh(prim);
+                }
+            }
+        }
+    }, allTreelets.size());
+
+    for (uint32_t treeletID = 0; treeletID < allTreelets.size(); treeletID++) {
+        uint32_t meshIdCount = 0;
+        for (TriangleMesh *mesh : treeletMeshes[treeletID]) {
+            const uint32_t mtlID = _manager.getMeshMaterialId(mesh);
+            meshIdCount++;
+            if (_manager.isCompoundMaterial(mtlID)) {
+                meshIdCount += _manager.getCompoundMaterial(mtlID).size();
+            }
+        }
+
+        firstMeshIds[treeletID] =
+            _manager.getNextIds(ObjectType::TriangleMesh, meshIdCount);
+    }
+
+    /* the scene manager isn't thread-safe; these are the calls the treelets
+     * make into it while they are being written */
+    mutex managerMutex;
+
+    auto getMeshMaterialId = [&managerMutex](const TriangleMesh *mesh) {
+        lock_guard<mutex> lock(managerMutex);
+        return _manager.getMeshMaterialId(mesh);
+    };
+
+    auto recordMeshMaterialId = [&managerMutex](const TriangleMesh *mesh,
+                                                const uint32_t mtlID) {
+        lock_guard<mutex> lock(managerMutex);
+        _manager.recordMeshMaterialId(mesh, mtlID);
+    };
+
+    // keeping a list of instance meshes that are already cut
+    set<TriangleMesh *> meshesWithTexturesAlreadyCut;
+
+    /* Hashes everything that goes into a treelet's file: its nodes and
+     * where their remote children ended up, the triangles it keeps of each
+     * mesh, the materials and area lights they use, and the instances it
+     * refers to. If none of it changed since the previous dump, the file
+     * would come out the same and doesn't have to be built again. */
+    auto hashTreeletInputs =
+        [&](const uint32_t treeletID,
+            const unordered_map<TriangleMesh *, vector<size_t>>
+                &trianglesInTreelet,
+            const TreeletNodes &treeletNodes) {
+            const TreeletInfo &treelet = allTreelets[treeletID];
+            const uint32_t sTreeletID = _manager.getId(&treelet);
+
+            SceneManager::InputHash hash;
+            hash.add(CloudBVH::TreeletHeader::VERSION);
+            hash.add(nodeWidth);
+            hash.add(treeletCodec);
+            hash.add(firstMeshIds[treeletID]);
+
+            for (const CloudBVH::TreeletNode &node : treeletNodes.nodes) {
+                hash.add(node.bounds);
+                hash.add(node.axis);
+
+                if (node.is_leaf()) {
+                    hash.add(node.primitive_offset);
+                    hash.add(node.primitive_count);
+                    continue;
+                }
+
+                for (int c = 0; c < 2; c++) {
+                    hash.add(node.child_treelet[c]);
+                    hash.add(node.child_node[c]);
+
+                    if (nodeWidth != 2 && node.child_treelet[c] != sTreeletID) {
+                        hash.add(wideNodeLocations.at(node.child_treelet[c])
+                                     .at(node.child_node[c]));
+                    }
+                }
+            }
+
+            hash.add(treeletNodes.childBounds.data(),
+                     sizeof(treeletNodes.childBounds[0]) *
+                         treeletNodes.childBounds.size());
+            hash.add(treeletNodes.roots.data(),
+                     sizeof(uint32_t) * treeletNodes.roots.size());
+
+            auto hashTriangle = [&hash](const TriangleMesh &mesh,
+                                        const size_t triNum) {
+                for (int i = 0; i < 3; i++) {
+                    const int v = mesh.vertexIndices[3 * triNum + i];
+                    hash.add(v);
+                    hash.add(mesh.p[v]);
+                    if (mesh.n) hash.add(mesh.n[v]);
+                    if (mesh.s) hash.add(mesh.s[v]);
+                    if (mesh.uv) hash.add(mesh.uv[v]);
+                }
+
+                if (mesh.faceIndices) hash.add(mesh.faceIndices[triNum]);
+            };
+
+            unordered_map<const TriangleMesh *, uint32_t> meshOrdinals;
+
+            for (TriangleMesh *mesh : treeletMeshes[treeletID]) {
+                const uint32_t ordinal = meshOrdinals.size();
+                meshOrdinals.emplace(mesh, ordinal);
+
+                const uint32_t mtlID = getMeshMaterialId(mesh);
+                hash.add(mtlID);
+                hash.add(_manager.getMaterialTreeletId(mtlID));
+                hash.add(_manager.getMeshAreaLightId(mesh));
+
+                if (_manager.isCompoundMaterial(mtlID)) {
+                    for (const auto &part :
+                         _manager.getCompoundMaterial(mtlID)) {
+                        hash.add(part.first);
+                        hash.add(_manager.getMaterialTreeletId(part.first));
+                        for (const auto &face : *part.second) {
+                            hash.add(face.first);
+                            hash.add(face.second);
+                        }
+                    }
+                }
+
+                const uint8_t attributes = (mesh->n ? 1 : 0) |
+                                           (mesh->s ? 2 : 0) |
+                                           (mesh->uv ? 4 : 0) |
+                                           (mesh->faceIndices ? 8 : 0);
+                hash.add(attributes);
+
+                auto triNums = trianglesInTreelet.find(mesh);
+                if (triNums != trianglesInTreelet.end() &&
+                    !triNums->second.empty()) {
+                    hash.add(triNums->second.size());
+                    for (const size_t triNum : triNums->second) {
+                        hashTriangle(*mesh, triNum);
+                    }
+                } else {
+                    hash.add(mesh->nTriangles);
+                    for (int triNum = 0; triNum < mesh->nTriangles; triNum++) {
+                        hashTriangle(*mesh, triNum);
+                    }
+                }
+            }
+
+            auto hashTriangleRef = [&](const shared_ptr<Primitive> &prim) {
+                const Triangle *tri = dynamic_cast<const Triangle *>(
+                    dynamic_pointer_cast<GeometricPrimitive>(prim)->GetShape());
+                CHECK_NOTNULL(tri);
+                const TriangleMesh *mesh = tri->mesh.get();
+                hash.add(meshOrdinals.at(mesh));
+                hash.add(static_cast<uint64_t>(
+                    (tri->v - mesh->vertexIndices) / 3));
+            };
+
+            for (uint64_t nodeIdx : treelet.nodes) {
+                const LinearBVHNode &node = nodes[nodeIdx];
+                for (int primIdx = 0; primIdx < node.nPrimitives; primIdx++) {
+                    auto &prim = primitives[node.primitivesOffset + primIdx];
+                    const PrimitiveType type = prim->GetType();
+                    hash.add(type);
+
+                    if (type != PrimitiveType::Transformed) {
+                        hashTriangleRef(prim);
+                        continue;
+                    }
+
+                    shared_ptr<TransformedPrimitive> tp =
+                        dynamic_pointer_cast<TransformedPrimitive>(prim);
+                    TreeletDumpBVH *instance =
+                        dynamic_cast<TreeletDumpBVH *>(
+                            tp->GetPrimitive().get());
+                    CHECK_NOTNULL(instance);
+
+                    hash.add(instance->copyable);
+                    if (instance->copyable) {
+                        hash.add(treeletInstanceStarts[treeletID].at(instance));
+                    } else {
+                        hash.add(nonCopyableInstanceTreelets.at(
+                            instance)[treelet.dirIdx]);
+                    }
+
+                    auto &t = tp->GetTransform();
+                    hash.add(t.StartTransform()->GetMatrix().m);
+                    hash.add(t.EndTransform()->GetMatrix().m);
+                    hash.add(t.StartTime());
+                    hash.add(t.EndTime());
+                }
+            }
+
+            for (TreeletDumpBVH *inst : treelet.instances) {
+                for (int nodeIdx = 0; nodeIdx < inst->nodeCount; nodeIdx++) {
+                    const LinearBVHNode &node = inst->nodes[nodeIdx];
+                    for (int i = 0; i < node.nPrimitives; i++) {
+                        hashTriangleRef(
+                            inst->primitives[node.primitivesOffset + i]);
+                    }
+                }
+            }
+
+            return hash.value();
+        };
+
+    /* Every treelet goes to its own file, and is streamed to it as it is
+     * built, so the memory in use is bounded by the treelets being written
+     * at the same time, one per thread. */
+    ParallelFor([&](int64_t treeletID) {
+        const TreeletInfo &treelet = allTreelets[treeletID];
+        // Find which triangles / meshes are in treelet
+        unordered_map<TriangleMesh *, vector<size_t>> trianglesInTreelet;
+        for (uint64_t nodeIdx : treelet.nodes) {
+            const LinearBVHNode &node = nodes[nodeIdx];
+            for (int primIdx = 0; primIdx < node.nPrimitives; primIdx++) {
+                auto &prim = primitives[node.primitivesOffset + primIdx];
+                if (prim->GetType() == PrimitiveType::Geometric) {
                     shared_ptr<GeometricPrimitive> gp =
                         dynamic_pointer_cast<GeometricPrimitive>(prim);
                     const Shape *shape = gp->GetShape();
                     const Triangle *tri = dynamic_cast<const Triangle *>(shape);
                     CHECK_NOTNULL(tri);
                     TriangleMesh *mesh = tri->mesh.get();
-                    instanceMeshes.insert(mesh);
+
+                    uint64_t triNum = (tri->v - tri->mesh->vertexIndices) / 3;
+
+                    CHECK_GE(triNum, 0);
+                    trianglesInTreelet[mesh].push_back(triNum);
                 }
             }
         }
 
         unsigned sTreeletID = _manager.getId(&treelet);
-        auto writer = make_unique<LiteRecordWriter>(
-            _manager.getFilePath(ObjectType::Treelet, sTreeletID));
+
+        TreeletNodes treeletNodes =
+            BuildTreeletNodes(treeletID, treeletNodeLocations);
+
+        const uint64_t inputHash =
+            hashTreeletInputs(treeletID, trianglesInTreelet, treeletNodes);
+
+        if (_manager.reuseBuiltObject({ObjectType::Treelet, sTreeletID},
+                                      inputHash)) {
+            LOG(INFO) << "Treelet " << sTreeletID << " (" << treeletID
+                      << ") is unchanged, keeping it from the previous dump";
+            return;
+        }
+
+        /* written next to the old file, which is still kept if it comes out
+         * the same (e.g. when the previous dump has no input hashes) */
+        const string treeletPath =
+            _manager.getFilePath(ObjectType::Treelet, sTreeletID) + ".new";
+        auto writer = make_unique<LiteRecordWriter>(treeletPath);
+
+        if (nodeWidth != 2) {
+            CloudBVH::TreeletHeader header;
+            header.node_width = nodeWidth;
+            writer->write(reinterpret_cast<const char *>(&header),
+                          sizeof(header));
+        }
+
+        const size_t headerBytes = writer->offset();
 
         writer->write(static_cast<uint32_t>(0));  // numImgParts
         writer->write(static_cast<uint32_t>(0));  // numTexs
@@ -2865,19 +3601,16 @@ vector<uint32_t> TreeletDumpBVH::DumpTreelets(bool root) const {
             triNumRemap;  // mesh -> (triNum -> (newMesh, newTriNum))
         unordered_map<TriangleMesh *, uint32_t> triMeshIDs;
 
-        for (TriangleMesh *instMesh : instanceMeshes) {
-            trianglesInTreelet.emplace(instMesh, vector<uint64_t>{});
-        }
+        uint32_t nextMeshId = firstMeshIds[treeletID];
 
         // Write out rewritten meshes with only triangles in treelet
-        for (auto &kv : trianglesInTreelet) {
-            TriangleMesh *const mesh = kv.first;
-            const vector<size_t> &triNums = kv.second;
+        for (TriangleMesh *const mesh : treeletMeshes[treeletID]) {
+            const vector<size_t> &triNums = trianglesInTreelet[mesh];
 
             vector<shared_ptr<TriangleMesh>> meshesToWrite;
 
             shared_ptr<TriangleMesh> newMesh;
-            const auto newMeshId = _manager.getNextId(ObjectType::TriangleMesh);
+            const auto newMeshId = nextMeshId++;
 
             if (!triNums.empty()) {
                 newMesh = cutMesh(newMeshId, mesh, triNums, triNumRemap[mesh]);
@@ -2890,7 +3623,7 @@ vector<uint32_t> TreeletDumpBVH::DumpTreelets(bool root) const {
                 }
             }
 
-            const uint32_t mtlID = _manager.getMeshMaterialId(mesh);
+            const uint32_t mtlID = getMeshMaterialId(mesh);
 
             // if this is a compound material, we need to cut this mesh too.
             if (_manager.isCompoundMaterial(mtlID)) {
@@ -2902,8 +3635,7 @@ vector<uint32_t> TreeletDumpBVH::DumpTreelets(bool root) const {
                     const auto partTriNums =
                         convertFaceIdsToTriNums(newMesh.get(), faceMap);
 
-                    const auto partMeshId =
-                        _manager.getNextId(ObjectType::TriangleMesh);
+                    const auto partMeshId = nextMeshId++;
 
                     LOG(INFO)
                         << "Making a compound mesh part, id = " << partMeshId;
@@ -2927,7 +3659,7 @@ vector<uint32_t> TreeletDumpBVH::DumpTreelets(bool root) const {
                     }
 
                     triMeshIDs[partMesh.get()] = partMeshId;
-                    _manager.recordMeshMaterialId(partMesh.get(), partMtlId);
+                    recordMeshMaterialId(partMesh.get(), partMtlId);
                     meshesToWrite.push_back(move(partMesh));
                 }
 
@@ -2941,7 +3673,7 @@ vector<uint32_t> TreeletDumpBVH::DumpTreelets(bool root) const {
                 }
             } else {
                 triMeshIDs[newMesh.get()] = newMeshId;
-                _manager.recordMeshMaterialId(newMesh.get(), mtlID);
+                recordMeshMaterialId(newMesh.get(), mtlID);
                 meshesToWrite.push_back(move(newMesh));
             }
 
@@ -2954,11 +3686,9 @@ vector<uint32_t> TreeletDumpBVH::DumpTreelets(bool root) const {
                 numTriMeshes++;
 
                 const auto sMeshID = triMeshIDs.at(m.get());
-                const uint32_t mtlID = _manager.getMeshMaterialId(m.get());
+                const uint32_t mtlID = getMeshMaterialId(m.get());
                 const auto mData = serdes::triangle_mesh::serialize(*m);
 
-                const auto newMatSize = getTotalTextureSize(mtlID);
-
                 MaterialKey mtlKey;
                 mtlKey.treelet = _manager.getMaterialTreeletId(mtlID);
                 mtlKey.id = mtlID;
@@ -2972,7 +3702,7 @@ vector<uint32_t> TreeletDumpBVH::DumpTreelets(bool root) const {
             }
         }
 
-        writer->write_at(sizeof(uint32_t) * 5 * 2, numTriMeshes);
+        writer->write_at(headerBytes + sizeof(uint32_t) * 5 * 2, numTriMeshes);
 
         // Write out nodes for treelet
         /* format:
@@ -3001,105 +3731,59 @@ vector<uint32_t> TreeletDumpBVH::DumpTreelets(bool root) const {
         LOG(INFO) << "Treelet " << sTreeletID << " (" << treeletID << ") has "
                   << node_count << " nodes and " << prim_count << " primitives";
 
-        writer->write(static_cast<uint32_t>(node_count));
-        writer->write(static_cast<uint32_t>(prim_count));
-
-        size_t current_primitive_offset = 0;
-        vector<CloudBVH::TreeletNode> output_nodes;
-        output_nodes.reserve(node_count);
-        memset(&output_nodes[0], 0, sizeof(CloudBVH::TreeletNode) * node_count);
-
         LOG(INFO) << "Total node size for treelet " << sTreeletID << " ("
                   << treeletID << ") is "
                   << format_bytes((sizeof(CloudBVH::TreeletNode) * node_count));
 
-        enum Child { LEFT = 0, RIGHT = 1 };
-
-        stack<pair<uint32_t, Child>> q;
-
-        for (uint64_t nodeIdx : treelet.nodes) {
-            const LinearBVHNode &node = nodes[nodeIdx];
-            output_nodes.emplace_back(node.bounds, node.axis);
-
-            auto &out_node = output_nodes.back();
-
-            if (not q.empty()) {
-                auto parent = q.top();
-                q.pop();
-
-                output_nodes[parent.first].child_treelet[parent.second] =
-                    sTreeletID;
-                output_nodes[parent.first].child_node[parent.second] =
-                    output_nodes.size() - 1;
-            }
-
-            if (node.nPrimitives == 0) {  // it's not a leaf
-                uint32_t r_tid =
-                    treeletAllocations[treelet.dirIdx][node.secondChildOffset];
-                if (r_tid != treeletID) {
-                    out_node.child_treelet[RIGHT] =
-                        _manager.getId(&allTreelets[r_tid]);
-                    out_node.child_node[RIGHT] =
-                        treeletNodeLocations[r_tid].at(node.secondChildOffset);
-                } else {
-                    q.emplace(output_nodes.size() - 1, RIGHT);
-                }
+        /* binary node index -> wide node index, for wide layouts */
+        unordered_map<uint32_t, uint32_t> wideIndex;
 
-                uint32_t l_tid =
-                    treeletAllocations[treelet.dirIdx][nodeIdx + 1];
-                if (l_tid != treeletID) {
-                    out_node.child_treelet[LEFT] =
-                        _manager.getId(&allTreelets[l_tid]);
-                    out_node.child_node[LEFT] =
-                        treeletNodeLocations[l_tid].at(nodeIdx + 1);
-                } else {
-                    q.emplace(output_nodes.size() - 1, LEFT);
-                }
-            } else {  // it is a leaf
-                out_node.leaf_tag = ~0;
-                out_node.primitive_offset = current_primitive_offset;
-                out_node.primitive_count = node.nPrimitives;
-
-                current_primitive_offset += node.nPrimitives;
+        if (nodeWidth == 2) {
+            writer->write(static_cast<uint32_t>(node_count));
+            writer->write(static_cast<uint32_t>(prim_count));
+            writer->write(
+                reinterpret_cast<const char *>(treeletNodes.nodes.data()),
+                sizeof(CloudBVH::TreeletNode) * treeletNodes.nodes.size());
+        } else {
+            auto remoteNode = [&](const uint16_t sID, const uint32_t node) {
+                return wideNodeLocations.at(sID).at(node);
+            };
+
+            vector<CloudBVH::TreeletLeaf> leaves;
+            string wideNodes;
+            uint32_t wideNodeCount;
+
+            if (nodeWidth == 4) {
+                vector<CloudBVH::WideTreeletNode<4>> wide;
+                CollapseTreeletNodes<4>(treeletNodes, sTreeletID, remoteNode,
+                                        wide, leaves, wideIndex);
+                wideNodeCount = wide.size();
+                wideNodes.assign(reinterpret_cast<const char *>(wide.data()),
+                                 sizeof(wide[0]) * wide.size());
+            } else {
+                vector<CloudBVH::WideTreeletNode<8>> wide;
+                CollapseTreeletNodes<8>(treeletNodes, sTreeletID, remoteNode,
+                                        wide, leaves, wideIndex);
+                wideNodeCount = wide.size();
+                wideNodes.assign(reinterpret_cast<const char *>(wide.data()),
+                                 sizeof(wide[0]) * wide.size());
             }
-        }
-
-        for (TreeletDumpBVH *inst : treelet.instances) {
-            CHECK(q.empty());
 
-            for (uint64_t nodeIdx = 0; nodeIdx < inst->nodeCount; nodeIdx++) {
-                const LinearBVHNode &instNode = inst->nodes[nodeIdx];
-                output_nodes.emplace_back(instNode.bounds, instNode.axis);
-
-                auto &out_node = output_nodes.back();
-
-                if (!q.empty()) {
-                    auto parent = q.top();
-                    q.pop();
-
-                    output_nodes[parent.first].child_treelet[parent.second] =
-                        sTreeletID;
-                    output_nodes[parent.first].child_node[parent.second] =
-                        output_nodes.size() - 1;
-                }
+            LOG(INFO) << "Treelet " << sTreeletID << " (" << treeletID
+                      << ") has " << wideNodeCount << " " << nodeWidth
+                      << "-wide nodes (" << format_bytes(wideNodes.size())
+                      << ") and " << leaves.size() << " leaves";
 
-                if (instNode.nPrimitives == 0) {
-                    // every node from the mesh are in the same treelet
-                    q.emplace(output_nodes.size() - 1, RIGHT);
-                    q.emplace(output_nodes.size() - 1, LEFT);
-                } else {
-                    out_node.leaf_tag = ~0;
-                    out_node.primitive_offset = current_primitive_offset;
-                    out_node.primitive_count = instNode.nPrimitives;
-                }
-
-                current_primitive_offset += instNode.nPrimitives;
-            }
+            writer->write(wideNodeCount);
+            writer->write(static_cast<uint32_t>(prim_count));
+            writer->write(static_cast<uint32_t>(leaves.size()));
+            writer->write(wideNodes);
+            writer->write(reinterpret_cast<const char *>(leaves.data()),
+                          sizeof(CloudBVH::TreeletLeaf) * leaves.size());
+            writer->write(static_cast<uint32_t>(node_count));
         }
 
-        writer->write(reinterpret_cast<const char *>(output_nodes.data()),
-                      sizeof(CloudBVH::TreeletNode) * output_nodes.size());
-        output_nodes.clear();
+        treeletNodes = {};
 
         // Writing out the primitives
         /* format:
@@ -3145,20 +3829,13 @@ vector<uint32_t> TreeletDumpBVH::DumpTreelets(bool root) const {
                     if (instance->copyable) {
                         instanceRef = treeletID;
                         instanceRef <<= 32;
-                        instanceRef |=
+                        const uint32_t start =
                             treeletInstanceStarts[treeletID].at(instance.get());
+                        instanceRef |=
+                            nodeWidth == 2 ? start : wideIndex.at(start);
                     } else {
-                        auto iter =
-                            nonCopyableInstanceTreelets.find(instance.get());
-                        if (iter == nonCopyableInstanceTreelets.end()) {
-                            auto instanceIDs = instance->DumpTreelets(false);
-                            auto res = nonCopyableInstanceTreelets.emplace(
-                                instance.get(), move(instanceIDs));
-                            CHECK_EQ(res.second, true);
-                            iter = res.first;
-                        }
-
-                        instanceRef = iter->second[treelet.dirIdx];
+                        instanceRef = nonCopyableInstanceTreelets.at(
+                            instance.get())[treelet.dirIdx];
                         instanceRef <<= 32;
                     }
 
@@ -3236,11 +3913,21 @@ vector<uint32_t> TreeletDumpBVH::DumpTreelets(bool root) const {
 
         writer = nullptr;
 
+        if (treeletCodec != blocked::Codec::None) {
+            const string raw = roost::read_file(treeletPath);
+            roost::atomic_create(
+                blocked::compress(raw.data(), raw.size(), treeletCodec),
+                treeletPath);
+        }
+
+        _manager.commitObject(ObjectType::Treelet, sTreeletID, treeletPath,
+                              inputHash);
+
         LOG(INFO) << "Finished dumping treelet " << sTreeletID << " ("
                   << treeletID << "), size = "
                   << format_bytes(roost::file_size(_manager.getFilePath(
                          ObjectType::Treelet, sTreeletID)));
-    }
+    }, allTreelets.size());
 
     bool multiDir = false;
     for (const TreeletInfo &info : allTreelets) {
@@ -3252,6 +3939,10 @@ vector<uint32_t> TreeletDumpBVH::DumpTreelets(bool root) const {
 
     int numRoots = multiDir ? 8 : 1;
 
+    if (root) {
+        DumpTreeletProbs(numRoots);
+    }
+
     vector<uint32_t> rootTreelets;
     for (int i = 0; i < numRoots; i++) {
         rootTreelets.push_back(_manager.getId(&allTreelets[i]));
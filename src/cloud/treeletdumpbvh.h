@@ -3,14 +3,18 @@
 
 #include <array>
 #include <atomic>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
 #include "accelerators/bvh.h"
 #include "accelerators/cloud.h"
 #include "cloud/manager.h"
+#include "messages/blocked.h"
 #include "pbrt.h"
 #include "primitive.h"
 
@@ -123,7 +127,20 @@ class TreeletDumpBVH : public BVHAccel {
     };
 
     using TreeletMap = std::array<std::vector<uint32_t>, 8>;
-    using RayCountMap = std::vector<std::unordered_map<uint64_t, std::atomic_uint64_t>>;
+    using RayCountMap = std::vector<std::unordered_map<uint64_t, uint64_t>>;
+
+    /* Node-to-node transition counts observed while rendering with this BVH,
+     * kept separately for each ray octant. A profile recorded with
+     * "recordprofile" can be passed back with "profile", so that the
+     * traversal graph is weighted by how rays actually moved through the
+     * tree, instead of by surface area ratios. */
+    struct TransitionProfile {
+        std::array<RayCountMap, 8> counts {};
+        std::array<uint64_t, 8> rays {};
+
+        /* number of times each node was entered; derived from counts */
+        std::array<std::vector<uint64_t>, 8> visits {};
+    };
 
     TreeletDumpBVH(std::vector<std::shared_ptr<Primitive>> &&p,
                    int maxTreeletBytes,
@@ -133,11 +150,24 @@ class TreeletDumpBVH : public BVHAccel {
                    TraversalAlgorithm traversal,
                    PartitionAlgorithm partition,
                    int maxPrimsInNode = 1,
-                   SplitMethod splitMethod = SplitMethod::SAH);
+                   SplitMethod splitMethod = SplitMethod::SAH,
+                   int nodeWidth = 2,
+                   const std::string &profilePath = "",
+                   const std::string &recordProfilePath = "",
+                   blocked::Codec treeletCodec = blocked::Codec::None);
+
+    ~TreeletDumpBVH();
 
     bool Intersect(const Ray &ray, SurfaceInteraction *isect) const;
     bool IntersectP(const Ray &ray) const;
 
+    /* the profile loaded with "profile", and the treelet each node was
+     * assigned to for each octant (only octant 0 if not directional) */
+    const TransitionProfile &GetProfile() const { return profile; }
+    const TreeletMap &GetTreeletAllocations() const {
+        return treeletAllocations;
+    }
+
   private:
     struct TreeletInfo {
         std::list<uint64_t> nodes {};
@@ -166,6 +196,10 @@ class TreeletDumpBVH : public BVHAccel {
 
     TraversalGraph CreateTraversalGraph(const Vector3f &rayDir, int depthReduction) const;
 
+    void LoadProfile(const std::string &path);
+    void WriteProfile(const std::string &path) const;
+    void ApplyProfile(int octant, TraversalGraph &graph) const;
+
     std::vector<uint32_t>
         ComputeTreeletsAgglomerative(const TraversalGraph &graph,
                                      uint64_t maxTreeletBytes) const;
@@ -190,6 +224,27 @@ class TreeletDumpBVH : public BVHAccel {
     void DumpSanityCheck(const std::vector<std::unordered_map<uint64_t, uint32_t>> &treeletNodeLocations) const;
     std::vector<uint32_t> DumpTreelets(bool root) const;
 
+    /* writes the probability of a ray entering each treelet to the TINFO
+     * file, which SceneManager::getTreeletProbs() reads back */
+    void DumpTreeletProbs(const int numRoots) const;
+
+    struct TreeletNodes {
+        std::vector<CloudBVH::TreeletNode> nodes {};
+        std::vector<std::array<Bounds3f, 2>> childBounds {};
+        std::vector<uint32_t> roots {}; // nodes whose parent is elsewhere
+    };
+
+    TreeletNodes BuildTreeletNodes(uint32_t treeletID,
+        const std::vector<std::unordered_map<uint64_t, uint32_t>> &treeletNodeLocations) const;
+
+    template <int N>
+    static void CollapseTreeletNodes(const TreeletNodes &binary,
+                                     uint16_t treeletID,
+                                     const std::function<uint32_t(uint16_t, uint32_t)> &remoteNode,
+                                     std::vector<CloudBVH::WideTreeletNode<N>> &wideNodes,
+                                     std::vector<CloudBVH::TreeletLeaf> &leaves,
+                                     std::unordered_map<uint32_t, uint32_t> &wideIndex);
+
     void DumpMaterials() const;
     void DumpImagePartitions() const;
 
@@ -202,7 +257,17 @@ class TreeletDumpBVH : public BVHAccel {
     bool IntersectCheckSend(const Ray &ray,
                             SurfaceInteraction *isect) const;
     bool IntersectPCheckSend(const Ray &ray) const;
-    std::array<RayCountMap, 8> rayCounts;
+
+    void RecordRay(const Vector3f &dir) const;
+    void UpdateRayCount(const Vector3f &dir, uint64_t src, uint64_t dst) const;
+
+    TransitionProfile profile {};
+
+    std::string recordProfilePath {};
+    mutable std::array<RayCountMap, 8> rayCounts {};
+    mutable std::array<std::atomic_uint64_t, 8> recordedRays {};
+    mutable std::array<std::mutex, 64> rayCountLocks {};
+
     TreeletMap treeletAllocations{};
 
     bool rootBVH;
@@ -213,6 +278,8 @@ class TreeletDumpBVH : public BVHAccel {
     std::vector<uint64_t> subtreeSizes;
 
     const size_t maxTreeletBytes;
+    const int nodeWidth;
+    const blocked::Codec treeletCodec;
 
     std::vector<TreeletInfo> allTreelets;
 
@@ -227,7 +294,8 @@ class TreeletDumpBVH : public BVHAccel {
     int instanceID = 0;
     bool copyable = false;
 
-    std::unordered_map<InstanceMask, uint64_t> instanceSizeCache;
+    mutable std::mutex instanceSizeCacheMutex;
+    mutable std::unordered_map<InstanceMask, uint64_t> instanceSizeCache;
 };
 
 std::shared_ptr<TreeletDumpBVH> CreateTreeletDumpBVH(
@@ -63,6 +63,7 @@
 #include "integrators/path.h"
 #include "integrators/sppm.h"
 #include "integrators/volpath.h"
+#include "integrators/wavefrontpath.h"
 #include "integrators/whitted.h"
 #include "lights/diffuse.h"
 #include "lights/distant.h"
@@ -673,8 +674,11 @@ void dumpTexture(const ObjectType type, const T *tex, const std::string &name,
         const auto newFilename =
             _manager.getFileName(ObjectType::Texture, *textureFileId);
 
-        roost::copy_then_rename(filename,
-                                _manager.getScenePath() + "/" + newFilename);
+        if (!_manager.reuseObject({ObjectType::Texture, *textureFileId},
+                                  SceneManager::hashFile(filename))) {
+            roost::copy_then_rename(
+                filename, _manager.getScenePath() + "/" + newFilename);
+        }
 
         std::unique_ptr<std::string[]> filenameVal(new std::string[1]);
         filenameVal[0] = std::string(newFilename);
@@ -814,6 +818,7 @@ std::shared_ptr<Medium> MakeMedium(const std::string &name,
         int nz = paramSet.FindOneInt("nz", 1);
         Point3f p0 = paramSet.FindOnePoint3f("p0", Point3f(0.f, 0.f, 0.f));
         Point3f p1 = paramSet.FindOnePoint3f("p1", Point3f(1.f, 1.f, 1.f));
+        bool halfDensity = paramSet.FindOneBool("halfdensity", false);
         if (nitems != nx * ny * nz) {
             Error(
                 "GridDensityMedium has %d density values; expected nx*ny*nz = "
@@ -824,7 +829,8 @@ std::shared_ptr<Medium> MakeMedium(const std::string &name,
         Transform data2Medium = Translate(Vector3f(p0)) *
                                 Scale(p1.x - p0.x, p1.y - p0.y, p1.z - p0.z);
         m = new GridDensityMedium(sig_a, sig_s, g, nx, ny, nz,
-                                  medium2world * data2Medium, data);
+                                  medium2world * data2Medium, data,
+                                  halfDensity);
     } else
         Warning("Medium \"%s\" unknown.", name.c_str());
     paramSet.ReportUnused();
@@ -983,6 +989,7 @@ Film *MakeFilm(const std::string &name, const ParamSet &paramSet,
 // API Function Definitions
 void pbrtInit(const Options &opt) {
     PbrtOptions = opt;
+
     // API Initialization
     if (currentApiState != APIState::Uninitialized)
         Error("pbrtInit() has already been called.");
@@ -997,6 +1004,11 @@ void pbrtInit(const Options &opt) {
             Vector3f(opt.translate[0], opt.translate[1], opt.translate[2])));
     }
 
+    // Keep the objects of an earlier dump that don't change
+    if (PbrtOptions.dumpScene && _manager.initialized()) {
+        _manager.loadPreviousHashes();
+    }
+
     // General \pbrt Initialization
     SampledSpectrum::Init();
     ParallelInit();  // Threads must be launched before the profiler is
@@ -1913,6 +1925,7 @@ void pbrtWorldEnd() {
             writer->write(to_protobuf(*scene));
 
             /* dump the manifest file for this render */
+            _manager.removeStaleObjects();
             auto manifestWriter = _manager.GetWriter(ObjectType::Manifest);
             manifestWriter->write(_manager.makeManifest());
         }
@@ -2138,7 +2151,7 @@ Scene *RenderOptions::MakeScene() {
             std::vector<ImagePartition> imagePartitions;
             for (size_t i = 0; i < partitionCount; i++) {
                 imagePartitions.emplace_back(
-                    std::move(_manager.getInMemoryImagePartition(baseId + i)));
+                    std::move(*_manager.getInMemoryImagePartition(baseId + i)));
             }
 
             PartitionedImage pImage{resolution, std::move(imagePartitions),
@@ -2196,6 +2209,9 @@ Integrator *RenderOptions::MakeIntegrator() const {
             CreateDirectLightingIntegrator(IntegratorParams, sampler, camera);
     else if (IntegratorName == "path")
         integrator = CreatePathIntegrator(IntegratorParams, sampler, camera);
+    else if (IntegratorName == "wavefrontpath")
+        integrator =
+            CreateWavefrontPathIntegrator(IntegratorParams, sampler, camera);
     else if (IntegratorName == "volpath")
         integrator = CreateVolPathIntegrator(IntegratorParams, sampler, camera);
     else if (IntegratorName == "bdpt") {
@@ -2213,6 +2229,12 @@ Integrator *RenderOptions::MakeIntegrator() const {
         return nullptr;
     }
 
+    // Integrators that render image tiles can sample adaptively
+    if (SamplerIntegrator *samplerIntegrator =
+            dynamic_cast<SamplerIntegrator *>(integrator))
+        samplerIntegrator->SetAdaptiveSampling(
+            CreateAdaptiveSampling(IntegratorParams, sampler->samplesPerPixel));
+
     if (renderOptions->haveScatteringMedia && IntegratorName != "volpath" &&
         IntegratorName != "bdpt" && IntegratorName != "mlt") {
         Warning(
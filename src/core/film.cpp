@@ -36,6 +36,9 @@
 #include "paramset.h"
 #include "imageio.h"
 #include "stats.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 
 namespace pbrt {
 
@@ -204,6 +207,81 @@ void Film::Deserialize(const std::vector<Float> &bytes) {
     }
 }
 
+// Film Checkpoint Definitions
+struct CheckpointHeader {
+    char magic[8];
+    int32_t floatSize;
+    int32_t bounds[4];
+    int64_t samplesPerPixel;
+    int64_t samplesTaken;
+};
+
+static const char checkpointMagic[8] = {'P', 'B', 'R', 'T',
+                                        'C', 'K', 'P', '1'};
+
+void Film::WriteCheckpoint(const std::string &path, int64_t samplesPerPixel,
+                           int64_t samplesTaken) {
+    CheckpointHeader header;
+    memcpy(header.magic, checkpointMagic, sizeof(checkpointMagic));
+    header.floatSize = sizeof(Float);
+    header.bounds[0] = croppedPixelBounds.pMin.x;
+    header.bounds[1] = croppedPixelBounds.pMin.y;
+    header.bounds[2] = croppedPixelBounds.pMax.x;
+    header.bounds[3] = croppedPixelBounds.pMax.y;
+    header.samplesPerPixel = samplesPerPixel;
+    header.samplesTaken = samplesTaken;
+
+    std::vector<Float> data(croppedPixelBounds.Area() * 4);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Serialize(data);
+    }
+
+    // Write to a temporary file first, so that an interruption while
+    // writing never leaves a broken checkpoint behind
+    std::string tmpPath = path + ".tmp";
+    std::ofstream out(tmpPath, std::ios::binary);
+    out.write((const char *)&header, sizeof(header));
+    out.write((const char *)data.data(), data.size() * sizeof(Float));
+    out.close();
+    if (!out.good() || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        Error("Unable to write checkpoint \"%s\".", path.c_str());
+        return;
+    }
+    LOG(INFO) << "Wrote checkpoint " << path << " at " << samplesTaken
+              << " samples per pixel";
+}
+
+bool Film::ReadCheckpoint(const std::string &path, int64_t samplesPerPixel,
+                          int64_t *samplesTaken) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.good()) return false;
+
+    CheckpointHeader header;
+    std::vector<Float> data(croppedPixelBounds.Area() * 4);
+    in.read((char *)&header, sizeof(header));
+    in.read((char *)data.data(), data.size() * sizeof(Float));
+    if (!in.good() ||
+        memcmp(header.magic, checkpointMagic, sizeof(checkpointMagic)) != 0 ||
+        header.floatSize != sizeof(Float)) {
+        Warning("Ignoring unreadable checkpoint \"%s\".", path.c_str());
+        return false;
+    }
+    if (header.bounds[0] != croppedPixelBounds.pMin.x ||
+        header.bounds[1] != croppedPixelBounds.pMin.y ||
+        header.bounds[2] != croppedPixelBounds.pMax.x ||
+        header.bounds[3] != croppedPixelBounds.pMax.y ||
+        header.samplesPerPixel != samplesPerPixel ||
+        header.samplesTaken > samplesPerPixel) {
+        Warning("Ignoring checkpoint \"%s\", which is of a different "
+                "render.", path.c_str());
+        return false;
+    }
+
+    Deserialize(data);
+    *samplesTaken = header.samplesTaken;
+    return true;
+}
 
 void Film::WriteImage(Float splatScale) {
     // Convert image to RGB and compute final pixel values
@@ -249,6 +327,46 @@ void Film::WriteImage(Float splatScale) {
     pbrt::WriteImage(filename, &rgb[0], croppedPixelBounds, fullResolution);
 }
 
+std::vector<int64_t> AdaptiveSampling::Allocate(
+    const std::vector<PixelVariance> &pixels, int64_t budget) const {
+    // Estimate how many more samples each pixel needs to converge, given
+    // that the relative error falls with the square root of the count
+    std::vector<int64_t> extra(pixels.size(), 0);
+    int64_t needed = 0;
+    for (size_t i = 0; i < pixels.size(); ++i) {
+        const PixelVariance &v = pixels[i];
+        if (Converged(v) || v.n >= maxSamples) continue;
+        Float error = v.RelativeError() / threshold;
+        int64_t n = maxSamples - v.n;
+        if (std::isfinite(error))
+            n = std::min<int64_t>(n, std::ceil(v.n * error * error) - v.n);
+        extra[i] = std::max<int64_t>(1, n);
+        needed += extra[i];
+    }
+
+    // Scale the requests down to the budget if they don't fit
+    if (needed > budget) {
+        Float scale = budget > 0 ? Float(budget) / needed : 0;
+        for (int64_t &n : extra) n = std::floor(n * scale);
+    }
+    return extra;
+}
+
+AdaptiveSampling CreateAdaptiveSampling(const ParamSet &params,
+                                        int64_t samplesPerPixel) {
+    AdaptiveSampling adaptive;
+    adaptive.threshold = params.FindOneFloat("adaptivethreshold", 0.f);
+    adaptive.maxSamples = samplesPerPixel;
+    adaptive.minSamples = Clamp(
+        params.FindOneInt("adaptiveminsamples",
+                          std::max<int64_t>(4, samplesPerPixel / 16)),
+        1, samplesPerPixel);
+    adaptive.samplesPerPixel =
+        Clamp(params.FindOneInt("adaptivespp", samplesPerPixel),
+              adaptive.minSamples, samplesPerPixel);
+    return adaptive;
+}
+
 Film *CreateFilm(const ParamSet &params, std::unique_ptr<Filter> filter) {
     std::string filename;
     if (PbrtOptions.imageFile != "") {
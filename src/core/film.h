@@ -48,6 +48,53 @@
 
 namespace pbrt {
 
+// PixelVariance Declarations
+// Running sums of the luminance of the samples taken in a pixel, from which
+// the variance of the pixel's estimate is computed.
+struct PixelVariance {
+    void Add(Float y) {
+        sum += y;
+        sumSq += (double)y * y;
+        ++n;
+    }
+    Float Mean() const { return n > 0 ? sum / n : 0; }
+    Float Variance() const {
+        if (n < 2) return 0;
+        return std::max(0., (sumSq - sum * sum / n) / (n - 1));
+    }
+    // Returns the standard error of the pixel's mean relative to the mean.
+    // Dark pixels are measured against _minMean_ instead, so that a black
+    // pixel converges as well.
+    Float RelativeError(Float minMean = 1e-3f) const {
+        if (n < 2) return Infinity;
+        return std::sqrt(Variance() / n) / std::max(Mean(), minMean);
+    }
+
+    double sum = 0, sumSq = 0;
+    int64_t n = 0;
+};
+
+// AdaptiveSampling Declarations
+// Every pixel takes at least _minSamples_ samples; past that, a pixel is
+// done once the relative error of its mean is below _threshold_. The
+// samples saved on converged pixels, out of an average of
+// _samplesPerPixel_, go to the pixels that have not converged, up to
+// _maxSamples_ each (the sampler's samples per pixel).
+struct AdaptiveSampling {
+    bool Enabled() const { return threshold > 0; }
+    bool Converged(const PixelVariance &v) const {
+        return v.n >= minSamples && v.RelativeError() <= threshold;
+    }
+    // Splits _budget_ further samples among _pixels_ and returns the number
+    // each one gets; the more samples a pixel is estimated to need to
+    // converge, the more it is given.
+    std::vector<int64_t> Allocate(const std::vector<PixelVariance> &pixels,
+                                  int64_t budget) const;
+
+    Float threshold = 0;
+    int64_t minSamples = 1, samplesPerPixel = 1, maxSamples = 1;
+};
+
 // FilmTilePixel Declarations
 struct FilmTilePixel {
     Spectrum contribSum = 0.f;
@@ -74,8 +121,18 @@ class Film {
     void Serialize(std::vector<Float> &output);
     void Deserialize(const std::vector<Float> &bytes);
 
+    // Saves the pixels accumulated so far, which hold _samplesTaken_ of
+    // _samplesPerPixel_ samples, so that an interrupted render can resume
+    void WriteCheckpoint(const std::string &path, int64_t samplesPerPixel,
+                         int64_t samplesTaken);
+    // Restores the pixels from a checkpoint of a render with the same
+    // pixel bounds and samples per pixel; returns false if there is none
+    bool ReadCheckpoint(const std::string &path, int64_t samplesPerPixel,
+                        int64_t *samplesTaken);
+
     void SetFilename(const std::string &filename) { this->filename = filename; }
     void SetCroppedPixelBounds(const Bounds2i &bounds);
+    Float MaxSampleLuminance() const { return maxSampleLuminance; }
 
     // Film Public Data
     const Point2i fullResolution;
@@ -137,6 +194,12 @@ class FilmTile {
         p0 = Max(p0, pixelBounds.pMin);
         p1 = Min(p1, pixelBounds.pMax);
 
+        // Track the variance of the pixel the sample was taken in
+        Point2i pPixel = (Point2i)Floor(pFilm);
+        if (incrementSum && !variances.empty() &&
+            InsideExclusive(pPixel, pixelBounds))
+            variances[PixelOffset(pPixel)].Add(L.y() * sampleWeight);
+
         // Loop over filter support and add sample to pixel arrays
 
         // Precompute $x$ and $y$ filter table offsets
@@ -168,33 +231,46 @@ class FilmTile {
         }
     }
     FilmTilePixel &GetPixel(const Point2i &p) {
-        CHECK(InsideExclusive(p, pixelBounds));
-        int width = pixelBounds.pMax.x - pixelBounds.pMin.x;
-        int offset =
-            (p.x - pixelBounds.pMin.x) + (p.y - pixelBounds.pMin.y) * width;
-        return pixels[offset];
+        return pixels[PixelOffset(p)];
     }
     const FilmTilePixel &GetPixel(const Point2i &p) const {
-        CHECK(InsideExclusive(p, pixelBounds));
-        int width = pixelBounds.pMax.x - pixelBounds.pMin.x;
-        int offset =
-            (p.x - pixelBounds.pMin.x) + (p.y - pixelBounds.pMin.y) * width;
-        return pixels[offset];
+        return pixels[PixelOffset(p)];
+    }
+    // Only adaptive sampling needs each pixel's variance, so the tile
+    // tracks it only once asked to
+    void TrackVariance() {
+        variances.resize(std::max(0, pixelBounds.Area()));
+    }
+    bool TracksVariance() const { return !variances.empty(); }
+    const PixelVariance &GetVariance(const Point2i &p) const {
+        CHECK(TracksVariance());
+        return variances[PixelOffset(p)];
     }
     Bounds2i GetPixelBounds() const { return pixelBounds; }
 
   private:
+    // FilmTile Private Methods
+    int PixelOffset(const Point2i &p) const {
+        CHECK(InsideExclusive(p, pixelBounds));
+        int width = pixelBounds.pMax.x - pixelBounds.pMin.x;
+        return (p.x - pixelBounds.pMin.x) + (p.y - pixelBounds.pMin.y) * width;
+    }
+
+
     // FilmTile Private Data
     const Bounds2i pixelBounds;
     const Vector2f filterRadius, invFilterRadius;
     const Float *filterTable;
     const int filterTableSize;
     std::vector<FilmTilePixel> pixels;
+    std::vector<PixelVariance> variances;
     const Float maxSampleLuminance;
     friend class Film;
 };
 
 Film *CreateFilm(const ParamSet &params, std::unique_ptr<Filter> filter);
+AdaptiveSampling CreateAdaptiveSampling(const ParamSet &params,
+                                        int64_t samplesPerPixel);
 
 }  // namespace pbrt
 
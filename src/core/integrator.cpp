@@ -42,6 +42,7 @@
 #include "progressreporter.h"
 #include "camera.h"
 #include "stats.h"
+#include <chrono>
 
 namespace pbrt {
 
@@ -224,18 +225,82 @@ std::unique_ptr<Distribution1D> ComputeLightPowerDistribution(
         new Distribution1D(&lightPower[0], lightPower.size()));
 }
 
+// SamplerIntegrator Local Definitions
+static const int tileSize = 16;
+
+static Point2i TileCount(const Bounds2i &sampleBounds) {
+    Vector2i sampleExtent = sampleBounds.Diagonal();
+    return Point2i((sampleExtent.x + tileSize - 1) / tileSize,
+                   (sampleExtent.y + tileSize - 1) / tileSize);
+}
+
 // SamplerIntegrator Method Definitions
 void SamplerIntegrator::Render(const Scene &scene) {
     Preprocess(scene, *sampler);
+    Film *film = camera->film;
+    const int64_t spp = sampler->samplesPerPixel;
+
+    // Render progressively in passes of _passSamples_ samples per pixel if
+    // asked to, or if the render has to be checkpointed
+    const std::string &checkpointFile = PbrtOptions.checkpointFile;
+    int64_t passSamples = PbrtOptions.progressiveSamples;
+    if (passSamples <= 0 && !checkpointFile.empty())
+        passSamples = std::max<int64_t>(1, spp / 16);
+    if (passSamples <= 0 || passSamples > spp) passSamples = spp;
+    if (adaptive.Enabled() && passSamples < spp)
+        Warning("Adaptive sampling is ignored when rendering progressively.");
+
+    // Resume from the checkpoint, if there is one
+    int64_t samplesTaken = 0;
+    if (!checkpointFile.empty() &&
+        film->ReadCheckpoint(checkpointFile, spp, &samplesTaken))
+        LOG(INFO) << "Resuming from checkpoint " << checkpointFile << " at "
+                  << samplesTaken << " samples per pixel";
+
+    // Render the remaining passes, writing the image and the checkpoint at
+    // most every _checkpointInterval_ seconds
+    Point2i nTiles = TileCount(film->GetSampleBounds());
+    int64_t nPasses = (spp - samplesTaken + passSamples - 1) / passSamples;
+    ProgressReporter reporter(nPasses * nTiles.x * nTiles.y, "Rendering");
+    auto lastWrite = std::chrono::steady_clock::now();
+    while (samplesTaken < spp) {
+        int64_t endSample = std::min(spp, samplesTaken + passSamples);
+        RenderPass(scene, samplesTaken, endSample, reporter);
+        samplesTaken = endSample;
+        if (samplesTaken == spp) break;
+
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<Float>(now - lastWrite).count() >=
+            PbrtOptions.checkpointInterval) {
+            LOG(INFO) << "Writing partial image at " << samplesTaken
+                      << " samples per pixel";
+            film->WriteImage();
+            if (!checkpointFile.empty())
+                film->WriteCheckpoint(checkpointFile, spp, samplesTaken);
+            lastWrite = now;
+        }
+    }
+    reporter.Done();
+    LOG(INFO) << "Rendering finished";
+
+    // Save final image after rendering
+    film->WriteImage();
+    if (!checkpointFile.empty())
+        film->WriteCheckpoint(checkpointFile, spp, samplesTaken);
+}
+
+void SamplerIntegrator::RenderPass(const Scene &scene, int64_t firstSample,
+                                   int64_t endSample,
+                                   ProgressReporter &reporter) {
+    // Adaptive sampling needs all of a pixel's samples in one pass
+    const bool adaptivePass = adaptive.Enabled() && firstSample == 0 &&
+                              endSample == sampler->samplesPerPixel;
+
     // Render image tiles in parallel
 
     // Compute number of tiles, _nTiles_, to use for parallel rendering
     Bounds2i sampleBounds = camera->film->GetSampleBounds();
-    Vector2i sampleExtent = sampleBounds.Diagonal();
-    const int tileSize = 16;
-    Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
-                   (sampleExtent.y + tileSize - 1) / tileSize);
-    ProgressReporter reporter(nTiles.x * nTiles.y, "Rendering");
+    Point2i nTiles = TileCount(sampleBounds);
     {
         ParallelFor2D([&](Point2i tile) {
             // Render section of image corresponding to _tile_
@@ -243,8 +308,11 @@ void SamplerIntegrator::Render(const Scene &scene) {
             // Allocate _MemoryArena_ for tile
             MemoryArena arena;
 
-            // Get sampler instance for tile
-            int seed = tile.y * nTiles.x + tile.x;
+            // Get sampler instance for tile; later passes use their own
+            // seeds, or samplers that draw from an RNG would repeat the
+            // samples of the first pass
+            int seed = tile.y * nTiles.x + tile.x +
+                       firstSample * nTiles.x * nTiles.y;
             std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
 
             // Compute sample bounds for tile
@@ -258,8 +326,64 @@ void SamplerIntegrator::Render(const Scene &scene) {
             // Get _FilmTile_ for tile
             std::unique_ptr<FilmTile> filmTile =
                 camera->film->GetFilmTile(tileBounds);
+            if (adaptivePass) filmTile->TrackVariance();
+
+            // Render the current sample of _pixel_ into _filmTile_
+            auto renderSample = [&](const Point2i &pixel) {
+                // Initialize _CameraSample_ for current sample
+                CameraSample cameraSample =
+                    tileSampler->GetCameraSample(pixel);
+
+                // Generate camera ray for current sample
+                RayDifferential ray;
+                Float rayWeight =
+                    camera->GenerateRayDifferential(cameraSample, &ray);
+                ray.ScaleDifferentials(
+                    1 / std::sqrt((Float)tileSampler->samplesPerPixel));
+                ++nCameraRays;
+
+                // Evaluate radiance along camera ray
+                Spectrum L(0.f);
+                if (rayWeight > 0) L = Li(ray, scene, *tileSampler, arena);
+
+                // Issue warning if unexpected radiance value returned
+                if (L.HasNaNs()) {
+                    LOG(ERROR) << StringPrintf(
+                        "Not-a-number radiance value returned "
+                        "for pixel (%d, %d), sample %d. Setting to black.",
+                        pixel.x, pixel.y,
+                        (int)tileSampler->CurrentSampleNumber());
+                    L = Spectrum(0.f);
+                } else if (L.y() < -1e-5) {
+                    LOG(ERROR) << StringPrintf(
+                        "Negative luminance value, %f, returned "
+                        "for pixel (%d, %d), sample %d. Setting to black.",
+                        L.y(), pixel.x, pixel.y,
+                        (int)tileSampler->CurrentSampleNumber());
+                    L = Spectrum(0.f);
+                } else if (std::isinf(L.y())) {
+                      LOG(ERROR) << StringPrintf(
+                        "Infinite luminance value returned "
+                        "for pixel (%d, %d), sample %d. Setting to black.",
+                        pixel.x, pixel.y,
+                        (int)tileSampler->CurrentSampleNumber());
+                    L = Spectrum(0.f);
+                }
+                VLOG(1) << "Camera sample: " << cameraSample << " -> ray: " <<
+                    ray << " -> L = " << L;
+
+                // Add camera ray's contribution to image
+                filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
+
+                // Free _MemoryArena_ memory from computing image sample
+                // value
+                arena.Reset();
+            };
 
             // Loop over pixels in tile to render them
+            std::vector<Point2i> adaptivePixels;
+            std::vector<int64_t> adaptiveCounts;
+            int64_t adaptiveBudget = 0;
             for (Point2i pixel : tileBounds) {
                 {
                     ProfilePhase pp(Prof::StartPixel);
@@ -272,57 +396,48 @@ void SamplerIntegrator::Render(const Scene &scene) {
                 // debugging.
                 if (!InsideExclusive(pixel, pixelBounds))
                     continue;
+                if (firstSample > 0) tileSampler->SetSampleNumber(firstSample);
 
+                // With adaptive sampling, a pixel stops early once it has
+                // converged and leaves the rest of its share to others
+                int64_t nSamples = 0;
                 do {
-                    // Initialize _CameraSample_ for current sample
-                    CameraSample cameraSample =
-                        tileSampler->GetCameraSample(pixel);
-
-                    // Generate camera ray for current sample
-                    RayDifferential ray;
-                    Float rayWeight =
-                        camera->GenerateRayDifferential(cameraSample, &ray);
-                    ray.ScaleDifferentials(
-                        1 / std::sqrt((Float)tileSampler->samplesPerPixel));
-                    ++nCameraRays;
-
-                    // Evaluate radiance along camera ray
-                    Spectrum L(0.f);
-                    if (rayWeight > 0) L = Li(ray, scene, *tileSampler, arena);
-
-                    // Issue warning if unexpected radiance value returned
-                    if (L.HasNaNs()) {
-                        LOG(ERROR) << StringPrintf(
-                            "Not-a-number radiance value returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
-                    } else if (L.y() < -1e-5) {
-                        LOG(ERROR) << StringPrintf(
-                            "Negative luminance value, %f, returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            L.y(), pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
-                    } else if (std::isinf(L.y())) {
-                          LOG(ERROR) << StringPrintf(
-                            "Infinite luminance value returned "
-                            "for pixel (%d, %d), sample %d. Setting to black.",
-                            pixel.x, pixel.y,
-                            (int)tileSampler->CurrentSampleNumber());
-                        L = Spectrum(0.f);
-                    }
-                    VLOG(1) << "Camera sample: " << cameraSample << " -> ray: " <<
-                        ray << " -> L = " << L;
-
-                    // Add camera ray's contribution to image
-                    filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
+                    renderSample(pixel);
+                    ++nSamples;
+                    if (adaptivePass &&
+                        (adaptive.Converged(filmTile->GetVariance(pixel)) ||
+                         nSamples >= adaptive.samplesPerPixel))
+                        break;
+                } while (firstSample + nSamples < endSample &&
+                         tileSampler->StartNextSample());
+
+                if (adaptivePass) {
+                    adaptivePixels.push_back(pixel);
+                    adaptiveCounts.push_back(nSamples);
+                    adaptiveBudget += adaptive.samplesPerPixel - nSamples;
+                }
+            }
 
-                    // Free _MemoryArena_ memory from computing image sample
-                    // value
-                    arena.Reset();
-                } while (tileSampler->StartNextSample());
+            // Spend the samples left over by converged pixels on the pixels
+            // of the tile that are still noisy
+            if (adaptiveBudget > 0) {
+                std::vector<PixelVariance> variances;
+                for (Point2i pixel : adaptivePixels)
+                    variances.push_back(filmTile->GetVariance(pixel));
+                std::vector<int64_t> extra =
+                    adaptive.Allocate(variances, adaptiveBudget);
+                for (size_t i = 0; i < adaptivePixels.size(); ++i) {
+                    if (extra[i] == 0) continue;
+                    {
+                        ProfilePhase pp(Prof::StartPixel);
+                        tileSampler->StartPixel(adaptivePixels[i]);
+                    }
+                    tileSampler->SetSampleNumber(adaptiveCounts[i]);
+                    for (int64_t j = 0; j < extra[i]; ++j) {
+                        if (j > 0) tileSampler->StartNextSample();
+                        renderSample(adaptivePixels[i]);
+                    }
+                }
             }
             LOG(INFO) << "Finished image tile " << tileBounds;
 
@@ -330,12 +445,7 @@ void SamplerIntegrator::Render(const Scene &scene) {
             camera->film->MergeFilmTile(std::move(filmTile));
             reporter.Update();
         }, nTiles);
-        reporter.Done();
     }
-    LOG(INFO) << "Rendering finished";
-
-    // Save final image after rendering
-    camera->film->WriteImage();
 }
 
 Spectrum SamplerIntegrator::SpecularReflect(
@@ -46,6 +46,7 @@
 #include "reflection.h"
 #include "sampler.h"
 #include "material.h"
+#include "film.h"
 
 namespace pbrt {
 
@@ -83,6 +84,9 @@ class SamplerIntegrator : public Integrator {
         : camera(camera), sampler(sampler), pixelBounds(pixelBounds) {}
     virtual void Preprocess(const Scene &scene, Sampler &sampler) {}
     void Render(const Scene &scene);
+    void SetAdaptiveSampling(const AdaptiveSampling &adaptive) {
+        this->adaptive = adaptive;
+    }
     virtual Spectrum Li(const RayDifferential &ray, const Scene &scene,
                         Sampler &sampler, MemoryArena &arena,
                         int depth = 0) const = 0;
@@ -100,9 +104,14 @@ class SamplerIntegrator : public Integrator {
     std::shared_ptr<const Camera> camera;
 
   private:
+    // SamplerIntegrator Private Methods
+    void RenderPass(const Scene &scene, int64_t firstSample,
+                    int64_t endSample, ProgressReporter &reporter);
+
     // SamplerIntegrator Private Data
     std::shared_ptr<Sampler> sampler;
     const Bounds2i pixelBounds;
+    AdaptiveSampling adaptive;
 };
 
 }  // namespace pbrt
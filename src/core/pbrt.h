@@ -189,6 +189,9 @@ struct Options {
     bool compressRays = false;
     bool compressRayBags = true;
     std::string imageFile;
+    int progressiveSamples = 0;
+    std::string checkpointFile;
+    Float checkpointInterval = 0;
     // x0, x1, y0, y1
     Float cropWindow[2][2];
     std::string proxyDir {};
@@ -202,4 +202,40 @@ void GlobalSampler::SetDimension(int dim) {
     dimension = dim;
 }
 
+GlobalSampler::Stream::Stream(const GlobalSampler &sampler,
+                              const Point2i &pixel, int64_t sampleNum,
+                              int dimension)
+    : sampler(sampler),
+      pixel(pixel),
+      intervalSampleIndex(sampler.GetIndexForSample(pixel, sampleNum)),
+      arrayEndDim(arrayStartDim + sampler.samples1DArraySizes.size() +
+                  2 * sampler.samples2DArraySizes.size()),
+      dimension(dimension) {}
+
+Float GlobalSampler::Stream::Get1D() {
+    ProfilePhase _(Prof::GetSample);
+    if (dimension >= arrayStartDim && dimension < arrayEndDim)
+        dimension = arrayEndDim;
+    return sampler.SampleDimension(pixel, intervalSampleIndex, dimension++);
+}
+
+Point2f GlobalSampler::Stream::Get2D() {
+    ProfilePhase _(Prof::GetSample);
+    if (dimension + 1 >= arrayStartDim && dimension < arrayEndDim)
+        dimension = arrayEndDim;
+    Point2f p(sampler.SampleDimension(pixel, intervalSampleIndex, dimension),
+              sampler.SampleDimension(pixel, intervalSampleIndex,
+                                      dimension + 1));
+    dimension += 2;
+    return p;
+}
+
+CameraSample GlobalSampler::Stream::GetCameraSample(const Point2i &pRaster) {
+    CameraSample cs;
+    cs.pFilm = (Point2f)pRaster + Get2D();
+    cs.time = Get1D();
+    cs.pLens = Get2D();
+    return cs;
+}
+
 }  // namespace pbrt
@@ -124,12 +124,46 @@ class GlobalSampler : public Sampler {
     Float Get1D();
     Point2f Get2D();
     GlobalSampler(int64_t samplesPerPixel) : Sampler(samplesPerPixel) {}
-    virtual int64_t GetIndexForSample(int64_t sampleNum) const = 0;
-    virtual Float SampleDimension(int64_t index, int dimension) const = 0;
+    // Samplers may override this to cache per-pixel work for the pixel
+    // given to StartPixel(); each clone has its own copy of that cache.
+    virtual int64_t GetIndexForSample(int64_t sampleNum) const {
+        return GetIndexForSample(currentPixel, sampleNum);
+    }
+    Float SampleDimension(int64_t index, int dimension) const {
+        return SampleDimension(currentPixel, index, dimension);
+    }
+
+    // The sample values only depend on the pixel, the sample index and the
+    // dimension; these must not touch any mutable state of the sampler.
+    virtual int64_t GetIndexForSample(const Point2i &pixel,
+                                      int64_t sampleNum) const = 0;
+    virtual Float SampleDimension(const Point2i &pixel, int64_t index,
+                                  int dimension) const = 0;
 
     int GetCurrentDimension() const;
     void SetDimension(int dim);
 
+    // A Stream draws the values that StartPixel(), SetSampleNumber() and
+    // SetDimension() followed by Get1D()/Get2D() would, but keeps its
+    // position to itself, so that any number of threads can sample from
+    // one GlobalSampler at the same time.
+    class Stream {
+      public:
+        Stream(const GlobalSampler &sampler, const Point2i &pixel,
+               int64_t sampleNum, int dimension = 0);
+        Float Get1D();
+        Point2f Get2D();
+        CameraSample GetCameraSample(const Point2i &pRaster);
+        int GetCurrentDimension() const { return dimension; }
+
+      private:
+        const GlobalSampler &sampler;
+        const Point2i pixel;
+        const int64_t intervalSampleIndex;
+        const int arrayEndDim;
+        int dimension;
+    };
+
   private:
     // GlobalSampler Private Data
     int dimension;
@@ -20,9 +20,10 @@ namespace pbrt {
 class TriangleMesh;
 class GlobalSampler;
 class CloudBVH;
+class FilmAccumulator;
 class Sample;
-class RayState;
-using RayStatePtr = std::unique_ptr<RayState>;
+struct AdaptiveSampling;
+struct SampleRange;
 
 struct ProcessRayOutput {
     uint64_t pathId{0};
@@ -37,11 +38,25 @@ class SceneBase {
     SceneBase(const std::string &path, const int samplesPerPixel);
 
     RayStatePtr GenerateCameraRay(const Point2i &pixel, const uint32_t sample);
+    /* both are safe to call from any number of threads at once */
     void AccumulateImage(const std::vector<Sample> &rays);
     void WriteImage(const std::string &filename = {});
+
+    /* adds the samples in a record file of serialized Samples */
+    size_t AccumulateSampleFile(const std::string &path);
+
+    /* the samples the next pass of an adaptive render should take, given
+     * the samples accumulated so far */
+    std::vector<SampleRange> PlanSamples(const AdaptiveSampling &adaptive);
     void ProcessRay(RayStatePtr &&ray, const CloudBVH &treelet,
                     MemoryArena &arena, ProcessRayOutput &output);
 
+    /* processes rays that are all in the same treelet; rays that still need
+     * to be traced are traced as one batch. outputs[i] belongs to rays[i]. */
+    void ProcessRays(std::vector<RayStatePtr> &rays, const CloudBVH &treelet,
+                     MemoryArena &arena,
+                     std::vector<ProcessRayOutput> &outputs);
+
     std::set<ObjectKey> &TreeletDependencies(const TreeletId treeletId);
     size_t TreeletCount() const { return treeletDependencies.size(); }
     size_t MaxPathDepth() const { return maxPathDepth; }
@@ -56,11 +71,14 @@ class SceneBase {
     SceneBase &operator=(const SceneBase &) = delete;
 
   private:
+    void ProcessTracedRay(RayStatePtr &&tracedRay, ProcessRayOutput &output);
+
     std::vector<std::set<ObjectKey>> treeletDependencies{};
     Transform identityTransform;
 
     std::shared_ptr<pbrt::Camera> camera{};
     std::shared_ptr<GlobalSampler> sampler{};
+    std::shared_ptr<FilmAccumulator> accumulator{};
     std::vector<std::unique_ptr<Transform>> transformCache{};
     std::unique_ptr<Scene> fakeScene{};
 
@@ -2,17 +2,26 @@
 #define PBRT_CLOUD_RAYSTATE_H
 
 #include <memory>
+#include <string>
 
 #include "common.h"
 #include "geometry.h"
 #include "interaction.h"
 #include "spectrum.h"
 #include "transform.h"
+#include "util/small_stack.h"
 
 namespace pbrt {
 
-struct RayState;
-using RayStatePtr = std::unique_ptr<RayState>;
+class RayState;
+
+/* rays are returned to a per-thread pool rather than freed; see
+ * RayState::Create() */
+struct RayStateDeleter {
+    void operator()(RayState *state) const;
+};
+
+using RayStatePtr = std::unique_ptr<RayState, RayStateDeleter>;
 
 class RayState {
   public:
@@ -23,12 +32,30 @@ class RayState {
         bool transformed{false};
     };
 
+    /* what shading needs to know about the closest hit. It is kept out of
+     * line and only allocated for rays that have hit something, as is the
+     * ray's transform, which only rays that enter an instance need. Queues
+     * and serialization still deal with a single kind of RayState, with
+     * `hit` telling whether a HitInfo follows. */
     struct HitInfo {
         MaterialKey material{};
         uint32_t arealight{};
         SurfaceInteraction isect{};
+        Transform transform{};
+    };
+
+    struct HitInfoDeleter {
+        void operator()(HitInfo *hitInfo) const;
     };
 
+    using HitInfoPtr = std::unique_ptr<HitInfo, HitInfoDeleter>;
+
+    struct TransformDeleter {
+        void operator()(Transform *transform) const;
+    };
+
+    using TransformPtr = std::unique_ptr<Transform, TransformDeleter>;
+
     struct LightRayInfo {
         uint32_t sampledLightId{};
         Vector3f sampledDirection{};
@@ -73,16 +100,26 @@ class RayState {
     bool needsImageSampling{false};
     ImageSampleInfo imageSampleInfo{};
 
+    /* hitInfo is only present if the ray has hit something and is not a
+     * shadow ray; see SetHit() */
     bool hit{false};
-    HitInfo hitInfo{};
+    HitInfoPtr hitInfo{};
 
-    Transform hitTransform{};
-    Transform rayTransform{};
+    /* the transform into the instance the ray is in; only valid if the top
+     * of the stack is transformed. See EnsureRayTransform(). */
+    TransformPtr rayTransform{};
 
-    uint8_t toVisitHead{0};
-    TreeletNode toVisit[64];
+    /* a traversal leaves up to width - 1 entries on the stack for every
+     * level of the tree it walks down; only the first few are inline, and
+     * deeper stacks spill over onto the heap. Serialized rays are limited
+     * to MaxToVisit entries, which covers 36 levels of 8-wide nodes, 85
+     * levels of 4-wide ones or 255 levels of binary ones. */
+    SmallStack<TreeletNode, 16> toVisit{};
 
+    static const size_t MaxToVisit;
     static const size_t MaxPackedSize;
+    static const size_t MaxCompactSize;
+    static const size_t MaxBufferSize;
 
     bool IsShadowRay() const { return isShadowRay; }
     bool IsLightRay() const { return isLightRay; }
@@ -91,27 +128,71 @@ class RayState {
     int64_t SampleNum(const uint32_t spp) const;
     Point2i SamplePixel(const Vector2i &extent, const uint32_t spp) const;
 
-    bool toVisitEmpty() const { return toVisitHead == 0; }
-    const TreeletNode &toVisitTop() const { return toVisit[toVisitHead - 1]; }
-    void toVisitPush(TreeletNode &&t) { toVisit[toVisitHead++] = std::move(t); }
-    void toVisitPop() { toVisitHead--; }
+    bool toVisitEmpty() const { return toVisit.empty(); }
+    const TreeletNode &toVisitTop() const { return toVisit.top(); }
+    void toVisitPush(TreeletNode &&t) { toVisit.push(t); }
+    void toVisitPop() { toVisit.pop(); }
 
+    /* the primitive and shape of `isect` belong to the treelet that was
+     * hit, which may be evicted before the ray is shaded. The copy in
+     * hitInfo drops the primitive, and its shape is a stand-in that only
+     * carries the orientation of the real one, which is all shading reads
+     * from it; see OrientationShape(). */
     void SetHit(const TreeletNode &node, const pbrt::SurfaceInteraction &isect,
                 const MaterialKey &material, const uint32_t arealight);
 
+    /* a shape that lives as long as the program and whose normals are
+     * flipped iff `flip` is set */
+    static const Shape *OrientationShape(const bool flip);
+
+    /* allocates the hit information if the ray doesn't have it already */
+    HitInfo &EnsureHitInfo();
+
+    /* same, for the ray transform */
+    Transform &EnsureRayTransform();
+
     void StartTrace();
     uint32_t CurrentTreelet() const;
 
     uint64_t PathID() const { return sample.id; }
 
-    /* serialization */
-    size_t Serialize(char *data);
-    void Deserialize(const char *data, const size_t len);
+    /* serialization. The packed format is a fixed-size header followed by
+     * the optional parts as they are in memory; the compact format is
+     * versioned and quantizes or varint-encodes most fields. Either way, the
+     * reader has to know which one it is given. */
+    enum class Format { Packed, Compact };
+
+    size_t Serialize(char *data, const Format format = Format::Packed);
+    void Deserialize(const char *data, const size_t len,
+                     const Format format = Format::Packed);
+
+    size_t MaxSize(const Format format = Format::Packed) const;
+    size_t MaxCompressedSize(const Format format = Format::Packed) const;
+
+    /* the first record of a file of rays in the compact format */
+    static const std::string CompactStreamHeader;
+
+    /* the compact encoding without the version byte, length prefix or
+     * compression. The sample id and the treelets on the stack are stored
+     * relative to `base`, so that a batch of rays (see RayPacket) only has
+     * to store what they have in common once. UnPackCompact reads at most
+     * `len` bytes, and throws if the record doesn't fit in them. */
+    struct CompactBase {
+        uint64_t sampleId{0};
+        uint32_t treelet{0};
+    };
 
-    size_t MaxSize() const;
-    size_t MaxCompressedSize() const;
+    size_t PackCompact(char *data, const CompactBase &base) const;
+    size_t UnPackCompact(const char *data, const size_t len,
+                         const CompactBase &base);
 
+    /* a RayState is large and rays are created and destroyed at a very high
+     * rate, so their memory is recycled through a free list local to each
+     * thread. A ray freed on a different thread from the one that created it
+     * goes to the freeing thread's pool. */
     static RayStatePtr Create();
+
+    static const size_t PoolCapacity;
 };
 
 class Sample {
@@ -1,5 +1,6 @@
 #include "cloud.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
 #include <deque>
@@ -37,12 +38,84 @@ RayStatePtr CloudIntegrator::Trace(RayStatePtr &&rayState,
     return move(rayState);
 }
 
+void CloudIntegrator::TraceBatch(vector<RayStatePtr> &rayStates,
+                                 const CloudBVH &treelet) {
+    nTraceCalls += rayStates.size();
+    treelet.TraceBatch(rayStates);
+
+    for (const auto &rayState : rayStates) {
+        if (!rayState->isShadowRay && rayState->toVisitEmpty() &&
+            !rayState->hit) {
+            ReportValue(nRemainingBounces, rayState->remainingBounces);
+        }
+    }
+}
+
 tuple<RayStatePtr, RayStatePtr, RayStatePtr> CloudIntegrator::Shade(
     RayStatePtr &&rayStatePtr, const CloudBVH &treelet, const Scene &scene,
-    const Vector2i &sampleExtent, shared_ptr<GlobalSampler> &sampler,
+    const Vector2i &sampleExtent, const GlobalSampler &sampler,
     int maxPathDepth, MemoryArena &arena) {
     nShadeCalls++;
 
+    const Material *material = nullptr;
+    if (rayStatePtr->hitInfo->material.id) {
+        material = treelet.GetMaterial(rayStatePtr->hitInfo->material);
+    }
+
+    return ShadeWithMaterial(move(rayStatePtr), material, scene, sampleExtent,
+                             sampler, maxPathDepth, arena);
+}
+
+void CloudIntegrator::ShadeBatch(
+    vector<RayStatePtr> &rayStates, const CloudBVH &treelet,
+    const Scene &scene, const Vector2i &sampleExtent,
+    const GlobalSampler &sampler, int maxPathDepth, MemoryArena &arena,
+    vector<tuple<RayStatePtr, RayStatePtr, RayStatePtr>> &results) {
+    nShadeCalls += rayStates.size();
+    results.resize(rayStates.size());
+
+    /* the hits are shaded in order of material, and within a material in
+     * order of face, so that the same material code and the same parts of
+     * its textures are used back to back. every ray draws its own samples,
+     * so the order doesn't change the result. */
+    vector<size_t> order(rayStates.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+
+    sort(order.begin(), order.end(), [&rayStates](size_t a, size_t b) {
+        const auto &x = *rayStates[a]->hitInfo;
+        const auto &y = *rayStates[b]->hitInfo;
+
+        if (x.material < y.material) return true;
+        if (y.material < x.material) return false;
+        return x.isect.faceIndex < y.isect.faceIndex;
+    });
+
+    const Material *material = nullptr;
+    MaterialKey materialKey;
+    bool hasMaterial = false;
+
+    for (const size_t i : order) {
+        const MaterialKey &key = rayStates[i]->hitInfo->material;
+
+        if (!hasMaterial || materialKey < key || key < materialKey) {
+            material = key.id ? treelet.GetMaterial(key) : nullptr;
+            materialKey = key;
+            hasMaterial = true;
+        }
+
+        results[i] =
+            ShadeWithMaterial(move(rayStates[i]), material, scene,
+                              sampleExtent, sampler, maxPathDepth, arena);
+    }
+
+    /* none of the rays that come out of shading point into the arena */
+    arena.Reset();
+}
+
+tuple<RayStatePtr, RayStatePtr, RayStatePtr> CloudIntegrator::ShadeWithMaterial(
+    RayStatePtr &&rayStatePtr, const Material *material, const Scene &scene,
+    const Vector2i &sampleExtent, const GlobalSampler &sampler,
+    int maxPathDepth, MemoryArena &arena) {
     static thread_local unique_ptr<LightDistribution> lightDistribution =
         CreateLightSampleDistribution("spatial", scene);
 
@@ -52,11 +125,9 @@ tuple<RayStatePtr, RayStatePtr, RayStatePtr> CloudIntegrator::Shade(
 
     auto &rayState = *rayStatePtr;
 
-    SurfaceInteraction &it = rayState.hitInfo.isect;
-
-    if (rayState.hitInfo.material.id) {
-        const auto material = treelet.GetMaterial(rayState.hitInfo.material.id);
+    SurfaceInteraction &it = rayState.hitInfo->isect;
 
+    if (rayState.hitInfo->material.id) {
         // the next two lines are basically:
         // it.ComputeScatteringFunctions(rayState.ray, arena, true);
         it.ComputeDifferentials(rayState.ray);
@@ -78,11 +149,11 @@ tuple<RayStatePtr, RayStatePtr, RayStatePtr> CloudIntegrator::Shade(
         return {move(bouncePtr), nullptr, nullptr};
     }
 
-    /* setting the sampler */
-    sampler->StartPixel(
-        rayState.SamplePixel(sampleExtent, sampler->samplesPerPixel));
-    sampler->SetSampleNumber(rayState.SampleNum(sampler->samplesPerPixel));
-    sampler->SetDimension(rayState.sample.dim);
+    /* the sampler is shared between threads; each ray draws its samples
+     * from a stream of its own */
+    GlobalSampler::Stream samples{
+        sampler, rayState.SamplePixel(sampleExtent, sampler.samplesPerPixel),
+        rayState.SampleNum(sampler.samplesPerPixel), rayState.sample.dim};
 
     const auto bsdfFlags = BxDFType(BSDF_ALL & ~BSDF_SPECULAR);
 
@@ -92,12 +163,12 @@ tuple<RayStatePtr, RayStatePtr, RayStatePtr> CloudIntegrator::Shade(
         /* Let's pick a light at random */
         Float lightSelectPdf;
         const int lightNum =
-            distrib->SampleDiscrete(sampler->Get1D(), &lightSelectPdf);
+            distrib->SampleDiscrete(samples.Get1D(), &lightSelectPdf);
 
         const shared_ptr<Light> &light = scene.lights[lightNum];
 
-        Point2f uLight = sampler->Get2D();
-        Point2f uScattering = sampler->Get2D();  // For consistency with PBRT
+        Point2f uLight = samples.Get2D();
+        Point2f uScattering = samples.Get2D();  // For consistency with PBRT
         Float scatteringPdf = 0;
         Vector3f wi;
         Float lightPdf;
@@ -216,7 +287,7 @@ tuple<RayStatePtr, RayStatePtr, RayStatePtr> CloudIntegrator::Shade(
         Vector3f wo = -rayState.ray.d, wi;
         Float pdf;
         BxDFType flags;
-        Spectrum f = it.bsdf->Sample_f(wo, &wi, sampler->Get2D(), &pdf,
+        Spectrum f = it.bsdf->Sample_f(wo, &wi, samples.Get2D(), &pdf,
                                        BSDF_ALL, &flags);
 
         if (!f.IsBlack() && pdf > 0.f) {
@@ -238,7 +309,7 @@ tuple<RayStatePtr, RayStatePtr, RayStatePtr> CloudIntegrator::Shade(
             int bounces = maxPathDepth - newRay.remainingBounces - 2;
             if (rrBeta.MaxComponentValue() < rrThreshold && bounces > 3) {
                 Float q = std::max((Float).05, 1 - rrBeta.MaxComponentValue());
-                if (sampler->Get1D() < q) {
+                if (samples.Get1D() < q) {
                     bouncePtr = nullptr;
                 } else {
                     newRay.beta /= 1 - q;
@@ -248,7 +319,7 @@ tuple<RayStatePtr, RayStatePtr, RayStatePtr> CloudIntegrator::Shade(
     }
 
     if (bouncePtr) {
-        bouncePtr->sample.dim = sampler->GetCurrentDimension();
+        bouncePtr->sample.dim = samples.GetCurrentDimension();
         ++nIntersectionTests;
         ++totalRays;
     } else if (shadowRayPtr) {
@@ -341,7 +412,7 @@ void CloudIntegrator::Render(const Scene &scene) {
             }
         } else if (state.hit) {
             auto newRays = Shade(move(statePtr), *bvh, scene, sampleExtent,
-                                 sampler, maxDepth, arena);
+                                 *sampler, maxDepth, arena);
 
             if (get<0>(newRays)) rayQueue.push_back(move(get<0>(newRays)));
             if (get<1>(newRays)) rayQueue.push_back(move(get<1>(newRays)));
@@ -3,6 +3,7 @@
 
 #include <memory>
 #include <tuple>
+#include <vector>
 
 #include "core/camera.h"
 #include "core/integrator.h"
@@ -34,13 +35,32 @@ class CloudIntegrator : public Integrator {
     void Render(const Scene &scene);
 
     static RayStatePtr Trace(RayStatePtr &&rayState, const CloudBVH &treelet);
+    static void TraceBatch(std::vector<RayStatePtr> &rayStates,
+                           const CloudBVH &treelet);
 
     static std::tuple<RayStatePtr, RayStatePtr, RayStatePtr> Shade(
         RayStatePtr &&rayState, const CloudBVH &treelet, const Scene &scene,
-        const Vector2i &sampleExtent, std::shared_ptr<GlobalSampler> &sampler,
+        const Vector2i &sampleExtent, const GlobalSampler &sampler,
         int maxPathDepth, MemoryArena &arena);
 
+    /* shades hits that are all in the same treelet, grouped by material;
+     * results[i] belongs to rayStates[i]. the arena is reset once the whole
+     * batch is shaded. */
+    static void ShadeBatch(
+        std::vector<RayStatePtr> &rayStates, const CloudBVH &treelet,
+        const Scene &scene, const Vector2i &sampleExtent,
+        const GlobalSampler &sampler, int maxPathDepth,
+        MemoryArena &arena,
+        std::vector<std::tuple<RayStatePtr, RayStatePtr, RayStatePtr>>
+            &results);
+
   private:
+    static std::tuple<RayStatePtr, RayStatePtr, RayStatePtr>
+    ShadeWithMaterial(RayStatePtr &&rayState, const Material *material,
+                      const Scene &scene, const Vector2i &sampleExtent,
+                      const GlobalSampler &sampler,
+                      int maxPathDepth, MemoryArena &arena);
+
     const int maxDepth;
     std::shared_ptr<const Camera> camera;
     std::shared_ptr<GlobalSampler> sampler;
@@ -84,9 +84,13 @@ struct SPPMPixel {
     Spectrum tau;
 };
 
-struct SPPMPixelListNode {
+// A visible point's entry in each SPPM grid cell it overlaps. The entries
+// of a cell are contiguous, and hold what the photon pass needs to test a
+// photon against the visible point without touching its _SPPMPixel_.
+struct SPPMGridEntry {
+    Point3f p;
+    Float radius;
     SPPMPixel *pixel;
-    SPPMPixelListNode *next;
 };
 
 static bool ToGrid(const Point3f &p, const Bounds3f &bounds,
@@ -129,6 +133,14 @@ void SPPMIntegrator::Render(const Scene &scene) {
     const int tileSize = 16;
     Point2i nTiles((pixelExtent.x + tileSize - 1) / tileSize,
                    (pixelExtent.y + tileSize - 1) / tileSize);
+    // SPPM grid storage, reused by every iteration: the entries of hash
+    // cell _h_ are _gridEntries[gridCellStart[h]]_ up to (but not including)
+    // _gridEntries[gridCellStart[h + 1]]_
+    const int hashSize = nPixels;
+    std::vector<int> gridCellStart(hashSize + 1);
+    std::vector<std::atomic<int>> gridCellCount(hashSize);
+    std::vector<SPPMGridEntry> gridEntries;
+
     ProgressReporter progress(2 * nIterations, "Rendering");
     for (int iter = 0; iter < nIterations; ++iter) {
         // Generate SPPM visible points
@@ -241,9 +253,6 @@ void SPPMIntegrator::Render(const Scene &scene) {
         // Create grid of all SPPM visible points
         int gridRes[3];
         Bounds3f gridBounds;
-        // Allocate grid for SPPM visible points
-        const int hashSize = nPixels;
-        std::vector<std::atomic<SPPMPixelListNode *>> grid(hashSize);
         {
             ProfilePhase _(Prof::SPPMGridConstruction);
 
@@ -265,38 +274,59 @@ void SPPMIntegrator::Render(const Scene &scene) {
             for (int i = 0; i < 3; ++i)
                 gridRes[i] = std::max((int)(baseGridRes * diag[i] / maxDiag), 1);
 
+            // Find the range of grid cells that a visible point overlaps
+            auto cellRange = [&](const SPPMPixel &pixel, Point3i *pMin,
+                                 Point3i *pMax) {
+                Float radius = pixel.radius;
+                ToGrid(pixel.vp.p - Vector3f(radius, radius, radius),
+                       gridBounds, gridRes, pMin);
+                ToGrid(pixel.vp.p + Vector3f(radius, radius, radius),
+                       gridBounds, gridRes, pMax);
+            };
+
+            // Count the visible points that overlap each grid cell
+            ParallelFor([&](int64_t h) { gridCellCount[h] = 0; }, hashSize,
+                        4096);
+            ParallelFor([&](int pixelIndex) {
+                const SPPMPixel &pixel = pixels[pixelIndex];
+                if (pixel.vp.beta.IsBlack()) return;
+                Point3i pMin, pMax;
+                cellRange(pixel, &pMin, &pMax);
+                for (int z = pMin.z; z <= pMax.z; ++z)
+                    for (int y = pMin.y; y <= pMax.y; ++y)
+                        for (int x = pMin.x; x <= pMax.x; ++x)
+                            gridCellCount[hash(Point3i(x, y, z), hashSize)]
+                                .fetch_add(1, std::memory_order_relaxed);
+                ReportValue(gridCellsPerVisiblePoint,
+                            (1 + pMax.x - pMin.x) * (1 + pMax.y - pMin.y) *
+                                (1 + pMax.z - pMin.z));
+            }, nPixels, 4096);
+
+            // Lay the cells out one after the other; each cell's count
+            // becomes the position its next entry is written to
+            gridCellStart[0] = 0;
+            for (int h = 0; h < hashSize; ++h) {
+                gridCellStart[h + 1] = gridCellStart[h] + gridCellCount[h];
+                gridCellCount[h] = gridCellStart[h];
+            }
+            gridEntries.resize(gridCellStart[hashSize]);
+
             // Add visible points to SPPM grid
             ParallelFor([&](int pixelIndex) {
-                MemoryArena &arena = perThreadArenas[ThreadIndex];
                 SPPMPixel &pixel = pixels[pixelIndex];
-                if (!pixel.vp.beta.IsBlack()) {
-                    // Add pixel's visible point to applicable grid cells
-                    Float radius = pixel.radius;
-                    Point3i pMin, pMax;
-                    ToGrid(pixel.vp.p - Vector3f(radius, radius, radius),
-                           gridBounds, gridRes, &pMin);
-                    ToGrid(pixel.vp.p + Vector3f(radius, radius, radius),
-                           gridBounds, gridRes, &pMax);
-                    for (int z = pMin.z; z <= pMax.z; ++z)
-                        for (int y = pMin.y; y <= pMax.y; ++y)
-                            for (int x = pMin.x; x <= pMax.x; ++x) {
-                                // Add visible point to grid cell $(x, y, z)$
-                                int h = hash(Point3i(x, y, z), hashSize);
-                                SPPMPixelListNode *node =
-                                    arena.Alloc<SPPMPixelListNode>();
-                                node->pixel = &pixel;
-
-                                // Atomically add _node_ to the start of
-                                // _grid[h]_'s linked list
-                                node->next = grid[h];
-                                while (grid[h].compare_exchange_weak(
-                                           node->next, node) == false)
-                                    ;
-                            }
-                    ReportValue(gridCellsPerVisiblePoint,
-                                (1 + pMax.x - pMin.x) * (1 + pMax.y - pMin.y) *
-                                    (1 + pMax.z - pMin.z));
-                }
+                if (pixel.vp.beta.IsBlack()) return;
+                // Add pixel's visible point to applicable grid cells
+                Point3i pMin, pMax;
+                cellRange(pixel, &pMin, &pMax);
+                for (int z = pMin.z; z <= pMax.z; ++z)
+                    for (int y = pMin.y; y <= pMax.y; ++y)
+                        for (int x = pMin.x; x <= pMax.x; ++x) {
+                            int h = hash(Point3i(x, y, z), hashSize);
+                            int entry = gridCellCount[h].fetch_add(
+                                1, std::memory_order_relaxed);
+                            gridEntries[entry] = {pixel.vp.p, pixel.radius,
+                                                  &pixel};
+                        }
             }, nPixels, 4096);
         }
 
@@ -353,16 +383,15 @@ void SPPMIntegrator::Render(const Scene &scene) {
                                    &photonGridIndex)) {
                             int h = hash(photonGridIndex, hashSize);
                             // Add photon contribution to visible points in
-                            // _grid[h]_
-                            for (SPPMPixelListNode *node =
-                                     grid[h].load(std::memory_order_relaxed);
-                                 node != nullptr; node = node->next) {
+                            // grid cell _h_
+                            for (int e = gridCellStart[h];
+                                 e < gridCellStart[h + 1]; ++e) {
                                 ++visiblePointsChecked;
-                                SPPMPixel &pixel = *node->pixel;
-                                Float radius = pixel.radius;
-                                if (DistanceSquared(pixel.vp.p, isect.p) >
-                                    radius * radius)
+                                const SPPMGridEntry &entry = gridEntries[e];
+                                if (DistanceSquared(entry.p, isect.p) >
+                                    entry.radius * entry.radius)
                                     continue;
+                                SPPMPixel &pixel = *entry.pixel;
                                 // Update _pixel_ $\Phi$ and $M$ for nearby
                                 // photon
                                 Vector3f wi = -photonRay.d;
@@ -0,0 +1,437 @@
+// integrators/wavefrontpath.cpp*
+#include "integrators/wavefrontpath.h"
+#include <algorithm>
+#include "camera.h"
+#include "film.h"
+#include "interaction.h"
+#include "light.h"
+#include "paramset.h"
+#include "parallel.h"
+#include "primitive.h"
+#include "progressreporter.h"
+#include "reflection.h"
+#include "sampling.h"
+#include "scene.h"
+#include "stats.h"
+
+namespace pbrt {
+
+STAT_INT_DISTRIBUTION("Integrator/Path length", pathLength);
+STAT_COUNTER("Integrator/Total rays traced", totalRays);
+STAT_COUNTER("Integrator/Camera rays traced", nCameraRays);
+STAT_COUNTER("Integrator/Waves", nWaves);
+
+// WavefrontPathIntegrator Local Declarations
+// The state of every path in a wave, one entry per path. Each stage reads
+// and writes only the entries of the paths it is handed.
+struct WavefrontPathIntegrator::Wave {
+    void Resize(size_t n) {
+        ray.resize(n);
+        isect.resize(n);
+        L.resize(n);
+        beta.resize(n);
+        etaScale.resize(n);
+        rayWeight.resize(n);
+        pFilm.resize(n);
+        pixel.resize(n);
+        sampleNum.resize(n);
+        dimension.resize(n);
+        bounces.resize(n);
+        specularBounce.resize(n);
+        alive.resize(n);
+        hasBSDF.resize(n);
+        shadowRay.resize(n);
+        shadowLd.resize(n);
+        lightRay.resize(n);
+        lightLd.resize(n);
+        light.resize(n);
+    }
+
+    // Path state
+    std::vector<RayDifferential> ray;
+    std::vector<SurfaceInteraction> isect;
+    std::vector<Spectrum> L, beta;
+    std::vector<Float> etaScale, rayWeight;
+    std::vector<Point2f> pFilm;
+    std::vector<Point2i> pixel;
+    std::vector<int64_t> sampleNum;
+    std::vector<int> dimension, bounces;
+    std::vector<uint8_t> specularBounce, alive, hasBSDF;
+
+    // Direct lighting rays, traced after all paths have sampled the lights.
+    // _shadowLd_ is added to the path's radiance if _shadowRay_ is
+    // unoccluded; _lightLd_ is scaled by the emission of _light_ found along
+    // _lightRay_.
+    std::vector<Ray> shadowRay, lightRay;
+    std::vector<Spectrum> shadowLd, lightLd;
+    std::vector<const Light *> light;
+
+    // Indices of the paths still being traced, and of those with a hit
+    std::vector<int> active, hits;
+};
+
+// WavefrontPathIntegrator Method Definitions
+WavefrontPathIntegrator::WavefrontPathIntegrator(
+    int maxDepth, std::shared_ptr<const Camera> camera,
+    std::shared_ptr<GlobalSampler> sampler, const Bounds2i &pixelBounds,
+    Float rrThreshold, const std::string &lightSampleStrategy, int waveSize)
+    : maxDepth(maxDepth),
+      camera(camera),
+      sampler(sampler),
+      pixelBounds(pixelBounds),
+      rrThreshold(rrThreshold),
+      lightSampleStrategy(lightSampleStrategy),
+      waveSize(waveSize) {}
+
+void WavefrontPathIntegrator::Render(const Scene &scene) {
+    lightDistribution =
+        CreateLightSampleDistribution(lightSampleStrategy, scene);
+
+    // Split the image into bands of rows with at most _waveSize_ samples
+    Bounds2i sampleBounds = camera->film->GetSampleBounds();
+    Vector2i sampleExtent = sampleBounds.Diagonal();
+    const int64_t samplesPerRow =
+        int64_t(sampleExtent.x) * sampler->samplesPerPixel;
+    const int bandHeight =
+        std::max<int64_t>(1, waveSize / std::max<int64_t>(1, samplesPerRow));
+    const int nBands = (sampleExtent.y + bandHeight - 1) / bandHeight;
+
+    Wave wave;
+    std::vector<MemoryArena> arenas(MaxThreadIndex());
+    ProgressReporter reporter(nBands, "Rendering");
+    for (int band = 0; band < nBands; ++band) {
+        int y0 = sampleBounds.pMin.y + band * bandHeight;
+        int y1 = std::min(y0 + bandHeight, sampleBounds.pMax.y);
+        Bounds2i bandBounds(Point2i(sampleBounds.pMin.x, y0),
+                            Point2i(sampleBounds.pMax.x, y1));
+        LOG(INFO) << "Starting wave for " << bandBounds;
+        ++nWaves;
+
+        // Take all the paths of the band through the stages together
+        GenerateCameraRays(wave, bandBounds);
+        while (!wave.active.empty()) {
+            Intersect(scene, wave);
+            EvaluateMaterials(wave, arenas);
+            SampleLights(scene, wave);
+            TraceShadowRays(scene, wave);
+            SampleBSDFs(wave);
+            for (MemoryArena &arena : arenas) arena.Reset();
+        }
+
+        // Add the band's samples to the image
+        std::unique_ptr<FilmTile> filmTile =
+            camera->film->GetFilmTile(bandBounds);
+        for (size_t i = 0; i < wave.L.size(); ++i) {
+            Spectrum &L = wave.L[i];
+            if (L.HasNaNs()) {
+                LOG(ERROR) << StringPrintf(
+                    "Not-a-number radiance value returned "
+                    "for pixel (%d, %d), sample %d. Setting to black.",
+                    wave.pixel[i].x, wave.pixel[i].y, (int)wave.sampleNum[i]);
+                L = Spectrum(0.f);
+            } else if (L.y() < -1e-5) {
+                LOG(ERROR) << StringPrintf(
+                    "Negative luminance value, %f, returned "
+                    "for pixel (%d, %d), sample %d. Setting to black.",
+                    L.y(), wave.pixel[i].x, wave.pixel[i].y,
+                    (int)wave.sampleNum[i]);
+                L = Spectrum(0.f);
+            } else if (std::isinf(L.y())) {
+                LOG(ERROR) << StringPrintf(
+                    "Infinite luminance value returned "
+                    "for pixel (%d, %d), sample %d. Setting to black.",
+                    wave.pixel[i].x, wave.pixel[i].y, (int)wave.sampleNum[i]);
+                L = Spectrum(0.f);
+            }
+            filmTile->AddSample(wave.pFilm[i], L, wave.rayWeight[i]);
+        }
+        camera->film->MergeFilmTile(std::move(filmTile));
+        LOG(INFO) << "Finished wave for " << bandBounds;
+        reporter.Update();
+    }
+    reporter.Done();
+    LOG(INFO) << "Rendering finished";
+
+    // Save final image after rendering
+    camera->film->WriteImage();
+}
+
+void WavefrontPathIntegrator::GenerateCameraRays(
+    Wave &wave, const Bounds2i &bounds) const {
+    const int64_t spp = sampler->samplesPerPixel;
+    wave.Resize(0);
+    for (Point2i pixel : bounds) {
+        if (!InsideExclusive(pixel, pixelBounds)) continue;
+        for (int64_t sampleNum = 0; sampleNum < spp; ++sampleNum) {
+            wave.pixel.push_back(pixel);
+            wave.sampleNum.push_back(sampleNum);
+        }
+    }
+
+    const size_t nPaths = wave.pixel.size();
+    wave.Resize(nPaths);
+    ParallelFor([&](int64_t i) {
+        GlobalSampler::Stream stream(*sampler, wave.pixel[i],
+                                     wave.sampleNum[i]);
+        CameraSample cameraSample = stream.GetCameraSample(wave.pixel[i]);
+        wave.pFilm[i] = cameraSample.pFilm;
+        wave.rayWeight[i] =
+            camera->GenerateRayDifferential(cameraSample, &wave.ray[i]);
+        wave.ray[i].ScaleDifferentials(1 / std::sqrt((Float)spp));
+        wave.dimension[i] = stream.GetCurrentDimension();
+        wave.L[i] = Spectrum(0.f);
+        wave.beta[i] = Spectrum(1.f);
+        wave.etaScale[i] = 1;
+        wave.bounces[i] = 0;
+        wave.specularBounce[i] = false;
+        wave.alive[i] = wave.rayWeight[i] > 0;
+        ++nCameraRays;
+    }, nPaths, 4096);
+
+    wave.active.clear();
+    for (size_t i = 0; i < nPaths; ++i)
+        if (wave.alive[i]) wave.active.push_back(i);
+}
+
+void WavefrontPathIntegrator::Intersect(const Scene &scene, Wave &wave) const {
+    ParallelFor([&](int64_t n) {
+        int i = wave.active[n];
+        ++totalRays;
+        // Intersect the path's ray with scene
+        SurfaceInteraction &isect = wave.isect[i];
+        bool foundIntersection = scene.Intersect(wave.ray[i], &isect);
+
+        // Possibly add emitted light at intersection
+        if (wave.bounces[i] == 0 || wave.specularBounce[i]) {
+            if (foundIntersection)
+                wave.L[i] += wave.beta[i] * isect.Le(-wave.ray[i].d);
+            else
+                for (const auto &light : scene.infiniteLights)
+                    wave.L[i] += wave.beta[i] * light->Le(wave.ray[i]);
+        }
+
+        // Terminate path if ray escaped or _maxDepth_ was reached
+        if (!foundIntersection || wave.bounces[i] >= maxDepth) {
+            ReportValue(pathLength, wave.bounces[i]);
+            wave.alive[i] = false;
+        }
+    }, wave.active.size(), 1024);
+
+    // Sort the hits by material, so that they are shaded together
+    wave.hits.clear();
+    for (int i : wave.active)
+        if (wave.alive[i]) wave.hits.push_back(i);
+    std::sort(wave.hits.begin(), wave.hits.end(), [&](int a, int b) {
+        const Material *ma = wave.isect[a].primitive->GetMaterial();
+        const Material *mb = wave.isect[b].primitive->GetMaterial();
+        return ma < mb || (ma == mb && a < b);
+    });
+}
+
+void WavefrontPathIntegrator::EvaluateMaterials(
+    Wave &wave, std::vector<MemoryArena> &arenas) const {
+    ParallelFor([&](int64_t n) {
+        int i = wave.hits[n];
+        // Compute scattering functions and skip over medium boundaries
+        SurfaceInteraction &isect = wave.isect[i];
+        isect.ComputeScatteringFunctions(wave.ray[i], arenas[ThreadIndex],
+                                         true);
+        wave.hasBSDF[i] = isect.bsdf != nullptr;
+        if (!isect.bsdf) wave.ray[i] = isect.SpawnRay(wave.ray[i].d);
+    }, wave.hits.size(), 256);
+}
+
+void WavefrontPathIntegrator::SampleLights(const Scene &scene,
+                                           Wave &wave) const {
+    const int nLights = int(scene.lights.size());
+    ParallelFor([&](int64_t n) {
+        int i = wave.hits[n];
+        wave.light[i] = nullptr;
+        wave.shadowLd[i] = Spectrum(0.f);
+        wave.lightLd[i] = Spectrum(0.f);
+
+        // Skip this for perfectly specular BSDFs, as PathIntegrator does
+        const SurfaceInteraction &isect = wave.isect[i];
+        if (!wave.hasBSDF[i] || nLights == 0 ||
+            isect.bsdf->NumComponents(BxDFType(BSDF_ALL & ~BSDF_SPECULAR)) ==
+                0)
+            return;
+        ++totalRays;
+
+        // Randomly choose a single light to sample, consuming the same
+        // sample dimensions as _UniformSampleOneLight()_
+        GlobalSampler::Stream stream(*sampler, wave.pixel[i],
+                                     wave.sampleNum[i], wave.dimension[i]);
+        const Distribution1D *distrib = lightDistribution->Lookup(isect.p);
+        Float lightSelectPdf;
+        int lightNum = distrib->SampleDiscrete(stream.Get1D(), &lightSelectPdf);
+        Point2f uLight = stream.Get2D();
+        Point2f uScattering = stream.Get2D();
+        wave.dimension[i] = stream.GetCurrentDimension();
+        if (lightSelectPdf == 0) return;
+        const Light &light = *scene.lights[lightNum];
+        Spectrum scale = wave.beta[i] / lightSelectPdf;
+
+        // Sample light source with multiple importance sampling; the
+        // visibility test is left to _TraceShadowRays()_
+        const BxDFType bsdfFlags = BxDFType(BSDF_ALL & ~BSDF_SPECULAR);
+        Vector3f wi;
+        Float lightPdf = 0, scatteringPdf = 0;
+        VisibilityTester visibility;
+        Spectrum Li = light.Sample_Li(isect, uLight, &wi, &lightPdf,
+                                      &visibility);
+        if (lightPdf > 0 && !Li.IsBlack()) {
+            Spectrum f = isect.bsdf->f(isect.wo, wi, bsdfFlags) *
+                         AbsDot(wi, isect.shading.n);
+            scatteringPdf = isect.bsdf->Pdf(isect.wo, wi, bsdfFlags);
+            if (!f.IsBlack()) {
+                Float weight = IsDeltaLight(light.flags)
+                                   ? 1
+                                   : PowerHeuristic(1, lightPdf, 1,
+                                                    scatteringPdf);
+                wave.shadowLd[i] = scale * f * Li * weight / lightPdf;
+                wave.shadowRay[i] = visibility.P0().SpawnRayTo(visibility.P1());
+            }
+        }
+
+        // Sample BSDF with multiple importance sampling; the light is looked
+        // for along the sampled ray in _TraceShadowRays()_
+        if (IsDeltaLight(light.flags)) return;
+        BxDFType sampledType;
+        Spectrum f = isect.bsdf->Sample_f(isect.wo, &wi, uScattering,
+                                          &scatteringPdf, bsdfFlags,
+                                          &sampledType);
+        f *= AbsDot(wi, isect.shading.n);
+        if (f.IsBlack() || scatteringPdf <= 0) return;
+        Float weight = 1;
+        if ((sampledType & BSDF_SPECULAR) == 0) {
+            lightPdf = light.Pdf_Li(isect, wi);
+            if (lightPdf == 0) return;
+            weight = PowerHeuristic(1, scatteringPdf, 1, lightPdf);
+        }
+        wave.light[i] = &light;
+        wave.lightLd[i] = scale * f * weight / scatteringPdf;
+        wave.lightRay[i] = isect.SpawnRay(wi);
+    }, wave.hits.size(), 256);
+}
+
+void WavefrontPathIntegrator::TraceShadowRays(const Scene &scene,
+                                              Wave &wave) const {
+    ParallelFor([&](int64_t n) {
+        int i = wave.hits[n];
+        Spectrum Ld(0.f);
+        if (!wave.shadowLd[i].IsBlack() &&
+            !scene.IntersectP(wave.shadowRay[i]))
+            Ld += wave.shadowLd[i];
+
+        if (wave.light[i]) {
+            // Add light contribution from material sampling
+            SurfaceInteraction lightIsect;
+            const Ray &ray = wave.lightRay[i];
+            Spectrum Li(0.f);
+            if (scene.Intersect(ray, &lightIsect)) {
+                if (lightIsect.primitive->GetAreaLight() == wave.light[i])
+                    Li = lightIsect.Le(-ray.d);
+            } else
+                Li = wave.light[i]->Le(ray);
+            if (!Li.IsBlack()) Ld += wave.lightLd[i] * Li;
+        }
+
+        wave.L[i] += Ld;
+    }, wave.hits.size(), 1024);
+}
+
+void WavefrontPathIntegrator::SampleBSDFs(Wave &wave) const {
+    ParallelFor([&](int64_t n) {
+        int i = wave.hits[n];
+        // Paths that went through a medium boundary continue as they are
+        if (!wave.hasBSDF[i]) return;
+
+        // Sample BSDF to get new path direction
+        const SurfaceInteraction &isect = wave.isect[i];
+        GlobalSampler::Stream stream(*sampler, wave.pixel[i],
+                                     wave.sampleNum[i], wave.dimension[i]);
+        Vector3f wo = -wave.ray[i].d, wi;
+        Float pdf;
+        BxDFType flags;
+        Spectrum f = isect.bsdf->Sample_f(wo, &wi, stream.Get2D(), &pdf,
+                                          BSDF_ALL, &flags);
+        Spectrum &beta = wave.beta[i];
+        bool terminate = f.IsBlack() || pdf == 0.f;
+        if (!terminate) {
+            beta *= f * AbsDot(wi, isect.shading.n) / pdf;
+            wave.specularBounce[i] = (flags & BSDF_SPECULAR) != 0;
+            if ((flags & BSDF_SPECULAR) && (flags & BSDF_TRANSMISSION)) {
+                Float eta = isect.bsdf->eta;
+                wave.etaScale[i] *=
+                    (Dot(wo, isect.n) > 0) ? (eta * eta) : 1 / (eta * eta);
+            }
+            wave.ray[i] = isect.SpawnRay(wi);
+
+            // Possibly terminate the path with Russian roulette
+            Spectrum rrBeta = beta * wave.etaScale[i];
+            if (rrBeta.MaxComponentValue() < rrThreshold &&
+                wave.bounces[i] > 3) {
+                Float q = std::max((Float).05, 1 - rrBeta.MaxComponentValue());
+                if (stream.Get1D() < q)
+                    terminate = true;
+                else
+                    beta /= 1 - q;
+            }
+        }
+
+        wave.dimension[i] = stream.GetCurrentDimension();
+        if (terminate) {
+            ReportValue(pathLength, wave.bounces[i]);
+            wave.alive[i] = false;
+        } else
+            ++wave.bounces[i];
+    }, wave.hits.size(), 1024);
+
+    // The paths that are left make up the next round
+    wave.active.clear();
+    for (int i : wave.hits)
+        if (wave.alive[i]) wave.active.push_back(i);
+    std::sort(wave.active.begin(), wave.active.end());
+}
+
+WavefrontPathIntegrator *CreateWavefrontPathIntegrator(
+    const ParamSet &params, std::shared_ptr<Sampler> sampler,
+    std::shared_ptr<const Camera> camera) {
+    std::shared_ptr<GlobalSampler> globalSampler =
+        std::dynamic_pointer_cast<GlobalSampler>(sampler);
+    if (!globalSampler) {
+        Error("\"wavefrontpath\" integrator requires a \"halton\" or "
+              "\"sobol\" sampler.");
+        return nullptr;
+    }
+    int maxDepth = params.FindOneInt("maxdepth", 5);
+    int np;
+    const int *pb = params.FindInt("pixelbounds", &np);
+    Bounds2i pixelBounds = camera->film->GetSampleBounds();
+    if (pb) {
+        if (np != 4)
+            Error("Expected four values for \"pixelbounds\" parameter. Got %d.",
+                  np);
+        else {
+            pixelBounds = Intersect(pixelBounds,
+                                    Bounds2i{{pb[0], pb[2]}, {pb[1], pb[3]}});
+            if (pixelBounds.Area() == 0)
+                Error("Degenerate \"pixelbounds\" specified.");
+        }
+    }
+    Float rrThreshold = params.FindOneFloat("rrthreshold", 1.);
+    std::string lightStrategy =
+        params.FindOneString("lightsamplestrategy", "spatial");
+    int waveSize = params.FindOneInt(
+        "wavesize", WavefrontPathIntegrator::DefaultWaveSize);
+    if (waveSize <= 0) {
+        Error("\"wavesize\" must be positive. Got %d.", waveSize);
+        waveSize = WavefrontPathIntegrator::DefaultWaveSize;
+    }
+    return new WavefrontPathIntegrator(maxDepth, camera, globalSampler,
+                                       pixelBounds, rrThreshold, lightStrategy,
+                                       waveSize);
+}
+
+}  // namespace pbrt
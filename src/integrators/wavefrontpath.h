@@ -0,0 +1,70 @@
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_INTEGRATORS_WAVEFRONTPATH_H
+#define PBRT_INTEGRATORS_WAVEFRONTPATH_H
+
+// integrators/wavefrontpath.h*
+#include "pbrt.h"
+#include "integrator.h"
+#include "lightdistrib.h"
+#include "sampler.h"
+
+namespace pbrt {
+
+// WavefrontPathIntegrator Declarations
+// Computes the same estimate as PathIntegrator, but rather than following
+// one path at a time, it takes a whole wave of paths through one stage at a
+// time: camera ray generation, intersection, material evaluation, light
+// sampling, shadow rays and BSDF sampling. The hits are sorted by material
+// before they are shaded, so every stage works through a large, coherent
+// batch. Samples are drawn through GlobalSampler::Stream, so this needs a
+// GlobalSampler ("halton" or "sobol"; "02sequence" is a PixelSampler).
+// Subsurface scattering is not supported.
+class WavefrontPathIntegrator : public Integrator {
+  public:
+    // The number of paths in flight at once, unless "wavesize" says
+    // otherwise
+    static constexpr int DefaultWaveSize = 1 << 18;
+
+    // WavefrontPathIntegrator Public Methods
+    WavefrontPathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
+                            std::shared_ptr<GlobalSampler> sampler,
+                            const Bounds2i &pixelBounds,
+                            Float rrThreshold = 1,
+                            const std::string &lightSampleStrategy = "spatial",
+                            int waveSize = DefaultWaveSize);
+    void Render(const Scene &scene);
+
+  private:
+    // WavefrontPathIntegrator Private Declarations
+    struct Wave;
+
+    // WavefrontPathIntegrator Private Methods
+    void GenerateCameraRays(Wave &wave, const Bounds2i &bounds) const;
+    void Intersect(const Scene &scene, Wave &wave) const;
+    void EvaluateMaterials(Wave &wave, std::vector<MemoryArena> &arenas) const;
+    void SampleLights(const Scene &scene, Wave &wave) const;
+    void TraceShadowRays(const Scene &scene, Wave &wave) const;
+    void SampleBSDFs(Wave &wave) const;
+
+    // WavefrontPathIntegrator Private Data
+    const int maxDepth;
+    std::shared_ptr<const Camera> camera;
+    std::shared_ptr<GlobalSampler> sampler;
+    const Bounds2i pixelBounds;
+    const Float rrThreshold;
+    const std::string lightSampleStrategy;
+    const int waveSize;
+    std::unique_ptr<LightDistribution> lightDistribution;
+};
+
+WavefrontPathIntegrator *CreateWavefrontPathIntegrator(
+    const ParamSet &params, std::shared_ptr<Sampler> sampler,
+    std::shared_ptr<const Camera> camera);
+
+}  // namespace pbrt
+
+#endif  // PBRT_INTEGRATORS_WAVEFRONTPATH_H
@@ -55,6 +55,14 @@ Rendering options:
                        render more quickly.
   --quiet              Suppress all text output other than error messages.
 
+Progressive rendering options:
+  --progressive <spp>  Render in passes of <spp> samples per pixel.
+  --checkpoint <file>  Save the render to <file> after passes, and resume
+                       from it if it exists. Renders progressively.
+  --checkpointinterval <seconds>
+                       Write the partial image and checkpoint at most this
+                       often. Default: after every pass.
+
 Logging options:
   --logdir <dir>       Specify directory that log files should be written to.
                        Default: system temp directory (e.g. $TMPDIR or /tmp).
@@ -128,6 +136,27 @@ int main(int argc, char *argv[]) {
             FLAGS_minloglevel = atoi(argv[++i]);
         } else if (!strncmp(argv[i], "--minloglevel=", 14)) {
             FLAGS_minloglevel = atoi(&argv[i][14]);
+        } else if (!strcmp(argv[i], "--progressive") ||
+                   !strcmp(argv[i], "-progressive")) {
+            if (i + 1 == argc)
+                usage("missing value after --progressive argument");
+            options.progressiveSamples = atoi(argv[++i]);
+        } else if (!strncmp(argv[i], "--progressive=", 14)) {
+            options.progressiveSamples = atoi(&argv[i][14]);
+        } else if (!strcmp(argv[i], "--checkpoint") ||
+                   !strcmp(argv[i], "-checkpoint")) {
+            if (i + 1 == argc)
+                usage("missing value after --checkpoint argument");
+            options.checkpointFile = argv[++i];
+        } else if (!strncmp(argv[i], "--checkpoint=", 13)) {
+            options.checkpointFile = &argv[i][13];
+        } else if (!strcmp(argv[i], "--checkpointinterval") ||
+                   !strcmp(argv[i], "-checkpointinterval")) {
+            if (i + 1 == argc)
+                usage("missing value after --checkpointinterval argument");
+            options.checkpointInterval = atof(argv[++i]);
+        } else if (!strncmp(argv[i], "--checkpointinterval=", 21)) {
+            options.checkpointInterval = atof(&argv[i][21]);
         } else if (!strcmp(argv[i], "--quick") || !strcmp(argv[i], "-quick")) {
             options.quickRender = true;
         } else if (!strcmp(argv[i], "--quiet") || !strcmp(argv[i], "-quiet")) {
@@ -41,8 +41,149 @@
 namespace pbrt {
 
 STAT_RATIO("Media/Grid steps per Tr() call", nTrSteps, nTrCalls);
+STAT_PERCENT("Media/Empty grid density bricks", nEmptyBricks, nBricksTotal);
+
+// GridDensityMedium Local Definitions
+// Conversions between floats and IEEE half-precision floats; the
+// conversion to half rounds to the nearest value, ties to even.
+static uint16_t FloatToHalf(float f) {
+    uint32_t bits = FloatToBits(f);
+    uint16_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+    uint16_t h;
+    if (bits >= 0x47800000) {
+        // Overflow to infinity, or NaN
+        h = bits > 0x7f800000 ? 0x7e00 : 0x7c00;
+    } else if (bits < 0x38800000) {
+        // Denormal or zero; let the FPU do the rounding
+        h = FloatToBits(BitsToFloat(bits) + 0.5f) - 0x3f000000;
+    } else {
+        uint32_t mantissaOdd = (bits >> 13) & 1;
+        bits += (uint32_t(15 - 127) << 23) + 0xfff + mantissaOdd;
+        h = bits >> 13;
+    }
+    return sign | h;
+}
+
+static Float HalfToFloat(uint16_t h) {
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+    if (exponent == 0) {
+        // Zero or denormal
+        Float f = std::ldexp((Float)mantissa, -24);
+        return sign ? -f : f;
+    }
+    if (exponent == 31) return BitsToFloat(sign | 0x7f800000 | mantissa << 13);
+    return BitsToFloat(sign | (exponent + 112) << 23 | mantissa << 13);
+}
 
 // GridDensityMedium Method Definitions
+GridDensityMedium::GridDensityMedium(const Spectrum &sigma_a,
+                                     const Spectrum &sigma_s, Float g, int nx,
+                                     int ny, int nz,
+                                     const Transform &mediumToWorld,
+                                     const Float *d, bool halfDensity)
+    : sigma_a(sigma_a),
+      sigma_s(sigma_s),
+      g(g),
+      nx(nx),
+      ny(ny),
+      nz(nz),
+      WorldToMedium(Inverse(mediumToWorld)),
+      halfDensity(halfDensity),
+      nBricks((nx + brickSize - 1) / brickSize,
+              (ny + brickSize - 1) / brickSize,
+              (nz + brickSize - 1) / brickSize) {
+    // Precompute values for Monte Carlo sampling of _GridDensityMedium_
+    sigma_t = (sigma_a + sigma_s)[0];
+    if (Spectrum(sigma_t) != sigma_a + sigma_s)
+        Error(
+            "GridDensityMedium requires a spectrally uniform attenuation "
+            "coefficient!");
+
+    // Copy the bricks of the density grid that aren't all zero
+    int nBrickTotal = nBricks.x * nBricks.y * nBricks.z;
+    brickIndex.resize(nBrickTotal, -1);
+    int nStored = 0;
+    for (int bz = 0; bz < nBricks.z; ++bz)
+        for (int by = 0; by < nBricks.y; ++by)
+            for (int bx = 0; bx < nBricks.x; ++bx) {
+                ++nBricksTotal;
+                Point3i p0(bx * brickSize, by * brickSize, bz * brickSize);
+                Point3i p1(std::min(p0.x + brickSize, nx),
+                           std::min(p0.y + brickSize, ny),
+                           std::min(p0.z + brickSize, nz));
+                bool empty = true;
+                for (int z = p0.z; z < p1.z && empty; ++z)
+                    for (int y = p0.y; y < p1.y && empty; ++y)
+                        for (int x = p0.x; x < p1.x && empty; ++x)
+                            empty = d[(z * ny + y) * nx + x] == 0;
+                if (empty) {
+                    ++nEmptyBricks;
+                    continue;
+                }
+
+                int index = nStored++;
+                brickIndex[(bz * nBricks.y + by) * nBricks.x + bx] = index;
+                if (halfDensity)
+                    brickHalfDensity.resize(nStored * brickVoxels, 0);
+                else
+                    brickDensity.resize(nStored * brickVoxels, 0);
+                for (int z = p0.z; z < p1.z; ++z)
+                    for (int y = p0.y; y < p1.y; ++y)
+                        for (int x = p0.x; x < p1.x; ++x) {
+                            int offset = index * brickVoxels +
+                                         ((z - p0.z) * brickSize + y - p0.y) *
+                                             brickSize +
+                                         x - p0.x;
+                            Float v = d[(z * ny + y) * nx + x];
+                            if (halfDensity)
+                                brickHalfDensity[offset] = FloatToHalf(v);
+                            else
+                                brickDensity[offset] = v;
+                        }
+            }
+
+    // Compute the majorant of each brick from the densities as stored.
+    // _Density()_ interpolates between the voxels on either side of a
+    // lookup, so a brick's majorant also covers the voxels around it.
+    brickMajorant.resize(nBrickTotal, 0);
+    for (int bz = 0; bz < nBricks.z; ++bz)
+        for (int by = 0; by < nBricks.y; ++by)
+            for (int bx = 0; bx < nBricks.x; ++bx) {
+                Point3i p0(bx * brickSize - 1, by * brickSize - 1,
+                           bz * brickSize - 1);
+                Float maxDensity = 0;
+                for (int z = p0.z; z <= p0.z + brickSize + 1; ++z)
+                    for (int y = p0.y; y <= p0.y + brickSize + 1; ++y)
+                        for (int x = p0.x; x <= p0.x + brickSize + 1; ++x)
+                            maxDensity =
+                                std::max(maxDensity, D(Point3i(x, y, z)));
+                brickMajorant[(bz * nBricks.y + by) * nBricks.x + bx] =
+                    maxDensity;
+            }
+
+    densityBytes += brickIndex.size() * sizeof(int) +
+                    brickDensity.size() * sizeof(Float) +
+                    brickHalfDensity.size() * sizeof(uint16_t) +
+                    brickMajorant.size() * sizeof(Float);
+}
+
+Float GridDensityMedium::D(const Point3i &p) const {
+    Bounds3i sampleBounds(Point3i(0, 0, 0), Point3i(nx, ny, nz));
+    if (!InsideExclusive(p, sampleBounds)) return 0;
+    int brick = brickIndex[((p.z / brickSize) * nBricks.y + p.y / brickSize) *
+                               nBricks.x +
+                           p.x / brickSize];
+    if (brick < 0) return 0;
+    int offset = brick * brickVoxels +
+                 ((p.z % brickSize) * brickSize + p.y % brickSize) *
+                     brickSize +
+                 p.x % brickSize;
+    return halfDensity ? HalfToFloat(brickHalfDensity[offset])
+                       : brickDensity[offset];
+}
+
 Float GridDensityMedium::Density(const Point3f &p) const {
     // Compute voxel coordinates and offsets for _p_
     Point3f pSamples(p.x * nx - .5f, p.y * ny - .5f, p.z * nz - .5f);
@@ -59,6 +200,64 @@ Float GridDensityMedium::Density(const Point3f &p) const {
     return Lerp(d.z, d0, d1);
 }
 
+Float GridDensityMedium::MaxDensity(const Point3f &p) const {
+    Point3i brick(Clamp(int(p.x * nx / brickSize), 0, nBricks.x - 1),
+                  Clamp(int(p.y * ny / brickSize), 0, nBricks.y - 1),
+                  Clamp(int(p.z * nz / brickSize), 0, nBricks.z - 1));
+    return brickMajorant[(brick.z * nBricks.y + brick.y) * nBricks.x +
+                         brick.x];
+}
+
+template <typename F>
+void GridDensityMedium::TraverseMajorants(const Ray &ray, Float tMin,
+                                          Float tMax, F callback) const {
+    // Set up 3D DDA through the bricks for the $[\tmin, \tmax]$ segment
+    const Vector3f scale(Float(nx) / brickSize, Float(ny) / brickSize,
+                         Float(nz) / brickSize);
+    Point3f pMin = ray(tMin);
+    Point3f pGrid(pMin.x * scale.x, pMin.y * scale.y, pMin.z * scale.z);
+    Float nextCrossingT[3], deltaT[3];
+    int step[3], out[3];
+    Point3i brick;
+    for (int axis = 0; axis < 3; ++axis) {
+        brick[axis] = Clamp((int)pGrid[axis], 0, nBricks[axis] - 1);
+        Float dGrid = ray.d[axis] * scale[axis];
+        if (dGrid == 0) {
+            nextCrossingT[axis] = Infinity;
+            deltaT[axis] = Infinity;
+            step[axis] = 0;
+            out[axis] = -1;
+        } else if (dGrid > 0) {
+            nextCrossingT[axis] =
+                tMin + (brick[axis] + 1 - pGrid[axis]) / dGrid;
+            deltaT[axis] = 1 / dGrid;
+            step[axis] = 1;
+            out[axis] = nBricks[axis];
+        } else {
+            nextCrossingT[axis] = tMin + (brick[axis] - pGrid[axis]) / dGrid;
+            deltaT[axis] = -1 / dGrid;
+            step[axis] = -1;
+            out[axis] = -1;
+        }
+    }
+
+    // Walk the bricks, handing each one's segment and majorant to _callback_
+    Float t0 = tMin;
+    while (true) {
+        int axis = (nextCrossingT[0] < nextCrossingT[1])
+                       ? (nextCrossingT[0] < nextCrossingT[2] ? 0 : 2)
+                       : (nextCrossingT[1] < nextCrossingT[2] ? 1 : 2);
+        Float t1 = std::min(tMax, nextCrossingT[axis]);
+        int index = (brick.z * nBricks.y + brick.y) * nBricks.x + brick.x;
+        if (t1 > t0 && !callback(t0, t1, brickMajorant[index])) return;
+        if (t1 >= tMax) return;
+        t0 = t1;
+        brick[axis] += step[axis];
+        if (brick[axis] == out[axis]) return;
+        nextCrossingT[axis] += deltaT[axis];
+    }
+}
+
 Spectrum GridDensityMedium::Sample(const Ray &rWorld, Sampler &sampler,
                                    MemoryArena &arena,
                                    MediumInteraction *mi) const {
@@ -70,20 +269,28 @@ Spectrum GridDensityMedium::Sample(const Ray &rWorld, Sampler &sampler,
     Float tMin, tMax;
     if (!b.IntersectP(ray, &tMin, &tMax)) return Spectrum(1.f);
 
-    // Run delta-tracking iterations to sample a medium interaction
-    Float t = tMin;
-    while (true) {
-        t -= std::log(1 - sampler.Get1D()) * invMaxDensity / sigma_t;
-        if (t >= tMax) break;
-        if (Density(ray(t)) * invMaxDensity > sampler.Get1D()) {
-            // Populate _mi_ with medium interaction information and return
-            PhaseFunction *phase = ARENA_ALLOC(arena, HenyeyGreenstein)(g);
-            *mi = MediumInteraction(rWorld(t), -rWorld.d, rWorld.time, this,
-                                    phase);
-            return sigma_s / sigma_t;
+    // Run delta-tracking iterations to sample a medium interaction, brick by
+    // brick; empty bricks are skipped entirely
+    Spectrum weight(1.f);
+    TraverseMajorants(ray, tMin, tMax, [&](Float t0, Float t1,
+                                           Float maxDensity) {
+        if (maxDensity <= 0) return true;
+        Float invMaxDensity = 1 / maxDensity;
+        Float t = t0;
+        while (true) {
+            t -= std::log(1 - sampler.Get1D()) * invMaxDensity / sigma_t;
+            if (t >= t1) return true;
+            if (Density(ray(t)) * invMaxDensity > sampler.Get1D()) {
+                // Populate _mi_ with medium interaction information
+                PhaseFunction *phase = ARENA_ALLOC(arena, HenyeyGreenstein)(g);
+                *mi = MediumInteraction(rWorld(t), -rWorld.d, rWorld.time,
+                                        this, phase);
+                weight = sigma_s / sigma_t;
+                return false;
+            }
         }
-    }
-    return Spectrum(1.f);
+    });
+    return weight;
 }
 
 Spectrum GridDensityMedium::Tr(const Ray &rWorld, Sampler &sampler) const {
@@ -97,23 +304,33 @@ Spectrum GridDensityMedium::Tr(const Ray &rWorld, Sampler &sampler) const {
     Float tMin, tMax;
     if (!b.IntersectP(ray, &tMin, &tMax)) return Spectrum(1.f);
 
-    // Perform ratio tracking to estimate the transmittance value
-    Float Tr = 1, t = tMin;
-    while (true) {
-        ++nTrSteps;
-        t -= std::log(1 - sampler.Get1D()) * invMaxDensity / sigma_t;
-        if (t >= tMax) break;
-        Float density = Density(ray(t));
-        Tr *= 1 - std::max((Float)0, density * invMaxDensity);
-        // Added after book publication: when transmittance gets low,
-        // start applying Russian roulette to terminate sampling.
-        const Float rrThreshold = .1;
-        if (Tr < rrThreshold) {
-            Float q = std::max((Float).05, 1 - Tr);
-            if (sampler.Get1D() < q) return 0;
-            Tr /= 1 - q;
+    // Perform ratio tracking to estimate the transmittance value, brick by
+    // brick; empty bricks are skipped entirely
+    Float Tr = 1;
+    TraverseMajorants(ray, tMin, tMax, [&](Float t0, Float t1,
+                                           Float maxDensity) {
+        if (maxDensity <= 0) return true;
+        Float invMaxDensity = 1 / maxDensity;
+        Float t = t0;
+        while (true) {
+            ++nTrSteps;
+            t -= std::log(1 - sampler.Get1D()) * invMaxDensity / sigma_t;
+            if (t >= t1) return true;
+            Float density = Density(ray(t));
+            Tr *= 1 - std::max((Float)0, density * invMaxDensity);
+            // Added after book publication: when transmittance gets low,
+            // start applying Russian roulette to terminate sampling.
+            const Float rrThreshold = .1;
+            if (Tr < rrThreshold) {
+                Float q = std::max((Float).05, 1 - Tr);
+                if (sampler.Get1D() < q) {
+                    Tr = 0;
+                    return false;
+                }
+                Tr /= 1 - q;
+            }
         }
-    }
+    });
     return Spectrum(Tr);
 }
 
@@ -48,53 +48,50 @@ namespace pbrt {
 STAT_MEMORY_COUNTER("Memory/Volume density grid", densityBytes);
 
 // GridDensityMedium Declarations
+// The density grid is stored in bricks of _brickSize_^3 voxels; bricks
+// whose voxels are all zero are not stored at all, and the voxels can be
+// kept as half-precision floats. Each brick also has a majorant, the
+// largest density that can be looked up inside it, and the tracking
+// methods walk the bricks along the ray so that every step is taken
+// against the majorant of the brick it is in rather than the maximum
+// density of the whole grid.
 class GridDensityMedium : public Medium {
   public:
     // GridDensityMedium Public Methods
     GridDensityMedium(const Spectrum &sigma_a, const Spectrum &sigma_s, Float g,
                       int nx, int ny, int nz, const Transform &mediumToWorld,
-                      const Float *d)
-        : sigma_a(sigma_a),
-          sigma_s(sigma_s),
-          g(g),
-          nx(nx),
-          ny(ny),
-          nz(nz),
-          WorldToMedium(Inverse(mediumToWorld)),
-          density(new Float[nx * ny * nz]) {
-        densityBytes += nx * ny * nz * sizeof(Float);
-        memcpy((Float *)density.get(), d, sizeof(Float) * nx * ny * nz);
-        // Precompute values for Monte Carlo sampling of _GridDensityMedium_
-        sigma_t = (sigma_a + sigma_s)[0];
-        if (Spectrum(sigma_t) != sigma_a + sigma_s)
-            Error(
-                "GridDensityMedium requires a spectrally uniform attenuation "
-                "coefficient!");
-        Float maxDensity = 0;
-        for (int i = 0; i < nx * ny * nz; ++i)
-            maxDensity = std::max(maxDensity, density[i]);
-        invMaxDensity = 1 / maxDensity;
-    }
+                      const Float *d, bool halfDensity = false);
 
     Float Density(const Point3f &p) const;
-    Float D(const Point3i &p) const {
-        Bounds3i sampleBounds(Point3i(0, 0, 0), Point3i(nx, ny, nz));
-        if (!InsideExclusive(p, sampleBounds)) return 0;
-        return density[(p.z * ny + p.y) * nx + p.x];
-    }
+    Float D(const Point3i &p) const;
+    // Returns the majorant of the brick that contains _p_, in medium space
+    Float MaxDensity(const Point3f &p) const;
     Spectrum Sample(const Ray &ray, Sampler &sampler, MemoryArena &arena,
                     MediumInteraction *mi) const;
     Spectrum Tr(const Ray &ray, Sampler &sampler) const;
 
   private:
+    // GridDensityMedium Private Methods
+    template <typename F>
+    void TraverseMajorants(const Ray &ray, Float tMin, Float tMax,
+                           F callback) const;
+
     // GridDensityMedium Private Data
+    static PBRT_CONSTEXPR int brickSize = 8;
+    static PBRT_CONSTEXPR int brickVoxels = brickSize * brickSize * brickSize;
     const Spectrum sigma_a, sigma_s;
     const Float g;
     const int nx, ny, nz;
     const Transform WorldToMedium;
-    std::unique_ptr<Float[]> density;
+    const bool halfDensity;
+    // Number of bricks along each axis, and the index of each brick's
+    // voxels in _brickDensity_ or _brickHalfDensity_ (-1 if it is empty)
+    Point3i nBricks;
+    std::vector<int> brickIndex;
+    std::vector<Float> brickDensity;
+    std::vector<uint16_t> brickHalfDensity;
+    std::vector<Float> brickMajorant;
     Float sigma_t;
-    Float invMaxDensity;
 };
 
 }  // namespace pbrt
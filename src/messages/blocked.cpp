@@ -0,0 +1,451 @@
+#include "blocked.h"
+
+#include <lz4.h>
+
+#ifdef PBRT_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+namespace pbrt {
+
+namespace blocked {
+
+bool codec_available(const Codec codec) {
+    switch (codec) {
+    case Codec::None:
+    case Codec::LZ4:
+        return true;
+
+    case Codec::Zstd:
+#ifdef PBRT_HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    return false;
+}
+
+Codec codec_from_string(const string &name) {
+    if (name == "none") return Codec::None;
+    if (name == "lz4") return Codec::LZ4;
+    if (name == "zstd") return Codec::Zstd;
+
+    throw runtime_error("unknown codec: " + name);
+}
+
+bool is_blocked(const char *buffer, const size_t len) {
+    return len >= sizeof(Header) and
+           reinterpret_cast<const Header *>(buffer)->magic == MAGIC;
+}
+
+static size_t compress_bound(const Codec codec, const size_t len) {
+    switch (codec) {
+    case Codec::None:
+        return len;
+
+    case Codec::LZ4:
+        return LZ4_COMPRESSBOUND(len);
+
+    case Codec::Zstd:
+#ifdef PBRT_HAVE_ZSTD
+        return ZSTD_compressBound(len);
+#else
+        break;
+#endif
+    }
+
+    throw runtime_error("codec is not available");
+}
+
+static size_t compress_block(const Codec codec, const char *src,
+                             const size_t src_len, char *dst,
+                             const size_t dst_len) {
+    switch (codec) {
+    case Codec::None:
+        memcpy(dst, src, src_len);
+        return src_len;
+
+    case Codec::LZ4: {
+        const int len = LZ4_compress_default(src, dst, src_len, dst_len);
+        if (len <= 0) throw runtime_error("lz4 compression failed");
+        return len;
+    }
+
+    case Codec::Zstd:
+#ifdef PBRT_HAVE_ZSTD
+    {
+        const size_t len = ZSTD_compress(dst, dst_len, src, src_len, 3);
+        if (ZSTD_isError(len)) {
+            throw runtime_error("zstd compression failed: "s +
+                                ZSTD_getErrorName(len));
+        }
+        return len;
+    }
+#else
+        break;
+#endif
+    }
+
+    throw runtime_error("codec is not available");
+}
+
+static void decompress_block(const Codec codec, const char *src,
+                             const size_t src_len, char *dst,
+                             const size_t dst_len) {
+    switch (codec) {
+    case Codec::None:
+        if (src_len != dst_len) break;
+        memcpy(dst, src, src_len);
+        return;
+
+    case Codec::LZ4:
+        if (LZ4_decompress_safe(src, dst, src_len, dst_len) != int(dst_len)) {
+            break;
+        }
+        return;
+
+    case Codec::Zstd:
+#ifdef PBRT_HAVE_ZSTD
+        if (ZSTD_decompress(dst, dst_len, src, src_len) != dst_len) break;
+        return;
+#else
+        throw runtime_error("zstd support is not compiled in");
+#endif
+    }
+
+    throw runtime_error("block decompression failed");
+}
+
+/* Blocks are (de)compressed on a pool of threads of their own: the cloud
+ * workers run with nThreads = 1, so pbrt's thread pool isn't there when
+ * they load treelets. The threads are started on first use and shared by
+ * all the callers; a caller works on its own job too, and then waits for
+ * the blocks that the pool's threads are still working on. */
+class CodecPool {
+  public:
+    static CodecPool &get() {
+        static CodecPool pool{max(thread::hardware_concurrency(), 1u) - 1};
+        return pool;
+    }
+
+    ~CodecPool() {
+        {
+            lock_guard<mutex> lock{mutex_};
+            stop_ = true;
+        }
+
+        has_work_.notify_all();
+        for (auto &t : threads_) t.join();
+    }
+
+    /* runs `f(i)` for i in [0, count); the first exception thrown by `f` is
+     * rethrown here */
+    void parallel_for(const size_t count, const function<void(size_t)> &f) {
+        if (count == 0) return;
+
+        Job job{f, count};
+        unique_lock<mutex> lock{mutex_};
+
+        if (count > 1 and not threads_.empty()) {
+            jobs_.push_back(&job);
+            has_work_.notify_all();
+        }
+
+        while (job.next < job.count) {
+            const size_t i = job.next++;
+            if (job.next == job.count) {
+                auto it = find(jobs_.begin(), jobs_.end(), &job);
+                if (it != jobs_.end()) jobs_.erase(it);
+            }
+
+            lock.unlock();
+            run(job, i);
+            lock.lock();
+        }
+
+        job_done_.wait(lock, [&job] { return job.done == job.count; });
+        if (job.error) rethrow_exception(job.error);
+    }
+
+  private:
+    /* `next` and `done` are only touched with `mutex_` held, and the job
+     * leaves `jobs_` once its last item is taken */
+    struct Job {
+        const function<void(size_t)> &f;
+        const size_t count;
+        size_t next{0};
+        size_t done{0};
+        exception_ptr error{};
+    };
+
+    CodecPool(const size_t thread_count) {
+        for (size_t i = 0; i < thread_count; i++) {
+            threads_.emplace_back([this] { work(); });
+        }
+    }
+
+    void work() {
+        unique_lock<mutex> lock{mutex_};
+
+        while (true) {
+            has_work_.wait(lock, [this] { return stop_ or not jobs_.empty(); });
+            if (stop_) return;
+
+            Job &job = *jobs_.front();
+            const size_t i = job.next++;
+            if (job.next == job.count) jobs_.pop_front();
+
+            lock.unlock();
+            run(job, i);
+            lock.lock();
+        }
+    }
+
+    void run(Job &job, const size_t i) {
+        exception_ptr error;
+
+        try {
+            job.f(i);
+        } catch (...) {
+            error = current_exception();
+        }
+
+        lock_guard<mutex> lock{mutex_};
+        if (error and not job.error) job.error = error;
+        if (++job.done == job.count) job_done_.notify_all();
+    }
+
+    mutex mutex_{};
+    condition_variable has_work_{};
+    condition_variable job_done_{};
+    deque<Job *> jobs_{};
+    vector<thread> threads_{};
+    bool stop_{false};
+};
+
+static void parallel_for(const size_t count,
+                         const function<void(size_t)> &f) {
+    CodecPool::get().parallel_for(count, f);
+}
+
+string compress(const char *data, const size_t len, const Codec codec,
+                const size_t block_size) {
+    if (not codec_available(codec)) {
+        throw runtime_error("codec is not available");
+    }
+
+    /* cutting the stream into blocks */
+    vector<BlockInfo> blocks;
+    size_t position = 0;
+    uint32_t record = 0;
+
+    while (position < len) {
+        BlockInfo block{};
+        block.raw_offset = position;
+        block.first_record = record;
+
+        while (position < len and position - block.raw_offset < block_size) {
+            if (position + sizeof(uint32_t) > len) {
+                throw runtime_error("truncated record stream");
+            }
+
+            uint32_t record_len;
+            memcpy(&record_len, data + position, sizeof(uint32_t));
+            position += sizeof(uint32_t) + record_len;
+            record++;
+
+            if (position > len) {
+                throw runtime_error("truncated record stream");
+            }
+        }
+
+        block.raw_size = position - block.raw_offset;
+        blocks.push_back(block);
+    }
+
+    /* compressing the blocks */
+    vector<string> compressed(blocks.size());
+
+    parallel_for(blocks.size(), [&](const size_t i) {
+        auto &block = blocks[i];
+        compressed[i].resize(compress_bound(codec, block.raw_size));
+        block.size = compress_block(codec, data + block.raw_offset,
+                                    block.raw_size, &compressed[i][0],
+                                    compressed[i].size());
+    });
+
+    Header header{};
+    header.magic = MAGIC;
+    header.version = VERSION;
+    header.codec = static_cast<uint8_t>(codec);
+    header.block_count = blocks.size();
+    header.raw_size = len;
+
+    size_t offset = sizeof(Header) + blocks.size() * sizeof(BlockInfo);
+    for (auto &block : blocks) {
+        block.offset = offset;
+        offset += block.size;
+    }
+
+    string output;
+    output.reserve(offset);
+    output.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    output.append(reinterpret_cast<const char *>(blocks.data()),
+                  blocks.size() * sizeof(BlockInfo));
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        output.append(compressed[i].data(), blocks[i].size);
+    }
+
+    return output;
+}
+
+}  // namespace blocked
+
+using namespace blocked;
+
+BlockedReader::BlockedReader(const char *buffer, const size_t len,
+                             const bool eager)
+    : buffer_(buffer), len_(len) {
+    if (not is_blocked(buffer, len)) {
+        throw runtime_error("not a blocked file");
+    }
+
+    memcpy(&header_, buffer, sizeof(Header));
+
+    if (header_.version != VERSION) {
+        throw runtime_error("unsupported blocked file version: " +
+                            to_string(header_.version));
+    }
+
+    if (not codec_available(static_cast<Codec>(header_.codec))) {
+        throw runtime_error("blocked file uses an unavailable codec");
+    }
+
+    if (sizeof(Header) + header_.block_count * sizeof(BlockInfo) > len) {
+        throw runtime_error("blocked file is truncated");
+    }
+
+    blocks_.resize(header_.block_count);
+    memcpy(blocks_.data(), buffer + sizeof(Header),
+           blocks_.size() * sizeof(BlockInfo));
+
+    for (const auto &block : blocks_) {
+        if (block.offset + block.size > len or
+            block.raw_offset + block.raw_size > header_.raw_size) {
+            throw runtime_error("blocked file is corrupted");
+        }
+    }
+
+    raw_ = shared_ptr<char>(new char[header_.raw_size],
+                            default_delete<char[]>());
+    decompressed_.resize(blocks_.size(), 0);
+
+    if (eager) decompress_all();
+}
+
+void BlockedReader::decompress_block(const size_t i) {
+    if (decompressed_[i]) return;
+
+    const auto &block = blocks_[i];
+    blocked::decompress_block(static_cast<Codec>(header_.codec),
+                              buffer_ + block.offset, block.size,
+                              raw_.get() + block.raw_offset, block.raw_size);
+
+    decompressed_[i] = 1;
+}
+
+void BlockedReader::decompress_all() {
+    /* each block goes to its own part of `raw_` and its own flag */
+    parallel_for(blocks_.size(),
+                 [this](const size_t i) { decompress_block(i); });
+}
+
+void BlockedReader::prepare() {
+    while (block_ < blocks_.size() and
+           position_ >= blocks_[block_].raw_offset + blocks_[block_].raw_size) {
+        block_++;
+    }
+
+    if (block_ == blocks_.size()) {
+        throw runtime_error("unexpected end of stream");
+    }
+
+    decompress_block(block_);
+}
+
+uint32_t BlockedReader::next_record_size() {
+    prepare();
+
+    if (position_ + sizeof(uint32_t) > header_.raw_size) {
+        throw runtime_error("unexpected end of stream");
+    }
+
+    uint32_t len;
+    memcpy(&len, raw_.get() + position_, sizeof(uint32_t));
+    return len;
+}
+
+void BlockedReader::read(char *dst, size_t len) {
+    const auto rec_len = next_record_size();
+
+    if (rec_len != len) {
+        throw runtime_error(string("unexpected size: expected ") +
+                            to_string(len) + ", got " + to_string(rec_len));
+    }
+
+    position_ += sizeof(uint32_t);
+
+    if (position_ + rec_len > header_.raw_size) {
+        throw runtime_error("unexpected end of stream");
+    }
+
+    if (dst != nullptr) {
+        memcpy(dst, raw_.get() + position_, rec_len);
+    }
+
+    position_ += rec_len;
+    record_++;
+}
+
+const char *BlockedReader::view(size_t len) {
+    /* records don't cross blocks, so once next_record_size() has made sure
+     * the record's block is decompressed, all of the record is there */
+    next_record_size();
+    const char *record = raw_.get() + position_ + sizeof(uint32_t);
+
+    read(nullptr, len);
+    return record;
+}
+
+void BlockedReader::skip(const size_t n) {
+    const size_t target = record_ + n;
+
+    /* whole blocks are skipped without being decompressed */
+    while (block_ + 1 < blocks_.size() and
+           blocks_[block_ + 1].first_record <= target) {
+        block_++;
+        position_ = blocks_[block_].raw_offset;
+        record_ = blocks_[block_].first_record;
+    }
+
+    while (record_ < target) {
+        read(nullptr, next_record_size());
+    }
+}
+
+}  // namespace pbrt
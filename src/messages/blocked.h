@@ -0,0 +1,103 @@
+#ifndef PBRT_MESSAGES_BLOCKED_H
+#define PBRT_MESSAGES_BLOCKED_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lite.h"
+
+namespace pbrt {
+
+/* A blocked file is a record stream (e.g. a treelet) cut into blocks at
+ * record boundaries, each block compressed on its own, behind an index of
+ * the blocks. The blocks can be decompressed in parallel, and a reader
+ * that skips records doesn't have to decompress the blocks they lie in. A
+ * treelet's sections (image partitions, textures, materials, meshes,
+ * nodes) are each a run of records, so large sections end up in blocks of
+ * their own. */
+namespace blocked {
+
+enum class Codec : uint8_t { None = 0, LZ4 = 1, Zstd = 2 };
+
+struct __attribute__((packed, aligned(1))) Header {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t codec;
+    uint32_t block_count;
+    uint64_t raw_size;
+};
+
+struct __attribute__((packed, aligned(1))) BlockInfo {
+    uint64_t raw_offset; /* where the block starts in the record stream */
+    uint32_t raw_size;
+    uint64_t offset; /* where the compressed block starts in the file */
+    uint32_t size;
+    uint32_t first_record;
+};
+
+constexpr uint32_t MAGIC = 0x4b4c4250; /* "PBLK" */
+constexpr uint8_t VERSION = 1;
+constexpr size_t DEFAULT_BLOCK_SIZE = 1024 * 1024;
+
+/* zstd is optional; it's only there if pbrt was built with it */
+bool codec_available(const Codec codec);
+
+/* "none", "lz4" or "zstd" */
+Codec codec_from_string(const std::string &name);
+
+bool is_blocked(const char *buffer, const size_t len);
+
+/* compresses a record stream; a block is closed once it has at least
+ * `block_size` bytes, so a record larger than that is a block by itself */
+std::string compress(const char *data, const size_t len, const Codec codec,
+                     const size_t block_size = DEFAULT_BLOCK_SIZE);
+
+}  // namespace blocked
+
+class BlockedReader : public RecordReader {
+  public:
+    /* with `eager` set, all the blocks are decompressed right away, in
+     * parallel; otherwise, each block is decompressed when a record in it
+     * is first read */
+    BlockedReader(const char *buffer, const size_t len,
+                  const bool eager = true);
+
+    uint32_t next_record_size() override;
+    void read(char *dst, size_t len) override;
+    void skip(const size_t n) override;
+
+    /* views point into the decompressed record stream, which outlives the
+     * reader for as long as someone holds on to raw_stream(). The stream is
+     * the reader's own copy, so the views may be written to. */
+    const char *view(size_t len) override;
+
+    std::shared_ptr<char> raw_stream() const { return raw_; }
+    size_t raw_size() const { return header_.raw_size; }
+
+    using RecordReader::read;
+
+  private:
+    void decompress_block(const size_t block);
+    void decompress_all();
+
+    /* makes sure the block holding the next record is decompressed */
+    void prepare();
+
+    const char *buffer_{nullptr};
+    size_t len_{0};
+
+    blocked::Header header_{};
+    std::vector<blocked::BlockInfo> blocks_{};
+    std::vector<uint8_t> decompressed_{};
+    std::shared_ptr<char> raw_{};
+
+    size_t position_{0}; /* in the record stream */
+    size_t block_{0};    /* the block that `position_` is in */
+    size_t record_{0};   /* the number of records read or skipped */
+};
+
+}  // namespace pbrt
+
+#endif /* PBRT_MESSAGES_BLOCKED_H */
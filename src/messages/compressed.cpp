@@ -3,6 +3,8 @@
 #include <algorithm>
 #include <stdexcept>
 
+#include "blocked.h"
+
 using namespace std;
 using namespace pbrt;
 
@@ -108,11 +110,16 @@ void CompressedReader::read(char* dst, size_t dst_len) {
 }
 
 unique_ptr<RecordReader> RecordReader::get(const char* buffer,
-                                           const size_t buffer_len) {
+                                           const size_t buffer_len,
+                                           const bool eager) {
     if (buffer_len >= sizeof(uint32_t) &&
         *reinterpret_cast<const uint32_t*>(buffer) == 0x184D2204) {
         return make_unique<CompressedReader>(buffer, buffer_len);
     }
 
+    if (blocked::is_blocked(buffer, buffer_len)) {
+        return make_unique<BlockedReader>(buffer, buffer_len, eager);
+    }
+
     return make_unique<LiteRecordReader>(buffer, buffer_len);
 }
@@ -54,6 +54,17 @@ void LiteRecordReader::read(char* dst, size_t len) {
     buffer_ += rec_len;
 }
 
+const char* LiteRecordReader::view(size_t len) {
+    const char* record = buffer_ + sizeof(uint32_t);
+
+    if (record + len > end_) {
+        throw runtime_error("unexcepted end of stream");
+    }
+
+    read(nullptr, len);
+    return record;
+}
+
 void LiteRecordReader::skip(const size_t n) {
     if (n == 0) return;
     for (size_t i = 0; i < n; i++) {
@@ -13,6 +13,11 @@ class RecordReader {
     virtual uint32_t next_record_size() = 0;
     virtual void skip(const size_t n) { throw std::runtime_error("not impl"); }
 
+    //! returns a pointer to the next record (of exactly `len` bytes) inside
+    //! the underlying buffer and moves past it. readers that cannot hand
+    //! out such a pointer return nullptr and leave the record in place.
+    virtual const char* view(size_t len) { return nullptr; }
+
     template <class T>
     T read();
 
@@ -21,8 +26,12 @@ class RecordReader {
         read(reinterpret_cast<char*>(t), sizeof(T));
     }
 
+    //! picks the reader for the buffer's format. `eager` only matters for
+    //! blocked buffers: readers that skip most of the records should pass
+    //! false, so the blocks they skip over are never decompressed.
     static std::unique_ptr<RecordReader> get(const char* buffer,
-                                             const size_t buffer_len);
+                                             const size_t buffer_len,
+                                             const bool eager = true);
 };
 
 class LiteRecordReader : public RecordReader {
@@ -32,6 +41,7 @@ class LiteRecordReader : public RecordReader {
     uint32_t next_record_size() override;
     void read(char* dst, size_t len) override;
     void skip(const size_t n) override;
+    const char* view(size_t len) override;
 
     using RecordReader::read;
 
@@ -1,5 +1,11 @@
 #include "serdes.h"
 
+#include "cloud/manager.h"
+#include "core/api_makefns.h"
+#include "core/paramset.h"
+#include "messages/utils.h"
+#include "pbrt.pb.h"
+
 using namespace std;
 
 namespace pbrt::serdes {
@@ -80,4 +86,371 @@ string serialize(const TriangleMesh& tm) {
 
 }  // namespace triangle_mesh
 
+namespace flat {
+
+enum class ItemType : uint8_t {
+    Bool,
+    Int,
+    Float,
+    Point2f,
+    Vector2f,
+    Point3f,
+    Vector3f,
+    Normal3f,
+    Spectrum,
+    String,
+    Texture,
+};
+
+bool is_flat(const char* data, const size_t len) {
+    uint32_t magic = 0;
+    if (len >= sizeof(magic)) memcpy(&magic, data, sizeof(magic));
+    return magic == MAGIC;
+}
+
+class Writer {
+  public:
+    Writer() { put(MAGIC); }
+
+    template <class T>
+    void put(const T& value) {
+        output_.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void put(const string& str) {
+        put<uint32_t>(str.length());
+        output_.append(str);
+    }
+
+    template <class Items, class F>
+    void put_items(const ItemType type, const Items& items, F&& put_value) {
+        for (const auto& item : items) {
+            put(type);
+            put(item.name());
+            put<uint32_t>(item.values_size());
+            for (const auto& v : item.values()) put_value(v);
+        }
+    }
+
+    void put(const protobuf::ParamSet& pp) {
+        put<uint32_t>(pp.bools_size() + pp.ints_size() + pp.floats_size() +
+                      pp.point2fs_size() + pp.vector2fs_size() +
+                      pp.point3fs_size() + pp.vector3fs_size() +
+                      pp.normals_size() + pp.spectra_size() +
+                      pp.strings_size() + pp.textures_size());
+
+        auto xy = [this](const auto& v) {
+            put<float>(v.x());
+            put<float>(v.y());
+        };
+
+        auto xyz = [this](const auto& v) {
+            put<float>(v.x());
+            put<float>(v.y());
+            put<float>(v.z());
+        };
+
+        put_items(ItemType::Bool, pp.bools(),
+                  [this](const bool v) { put<uint8_t>(v); });
+        put_items(ItemType::Int, pp.ints(),
+                  [this](const int32_t v) { put(v); });
+        put_items(ItemType::Float, pp.floats(),
+                  [this](const float v) { put(v); });
+        put_items(ItemType::Point2f, pp.point2fs(), xy);
+        put_items(ItemType::Vector2f, pp.vector2fs(), xy);
+        put_items(ItemType::Point3f, pp.point3fs(), xyz);
+        put_items(ItemType::Vector3f, pp.vector3fs(), xyz);
+        put_items(ItemType::Normal3f, pp.normals(), xyz);
+        put_items(ItemType::Spectrum, pp.spectra(),
+                  [this](const protobuf::RGBSpectrum& v) {
+                      for (int i = 0; i < 3; i++) put<float>(v.c(i));
+                  });
+        put_items(ItemType::String, pp.strings(),
+                  [this](const string& v) { put(v); });
+        put_items(ItemType::Texture, pp.textures(),
+                  [this](const string& v) { put(v); });
+    }
+
+    /* a map from texture names to ids. Protobuf maps are iterated in an
+     * unspecified order, so the entries are sorted by name; otherwise, the
+     * same material could be written differently every time. */
+    template <class Map>
+    void put_textures(const Map& textures) {
+        const map<string, uint64_t> sorted{textures.begin(), textures.end()};
+        put<uint32_t>(sorted.size());
+        for (const auto& tex : sorted) {
+            put(tex.first);
+            put<uint64_t>(tex.second);
+        }
+    }
+
+    void put(const protobuf::Matrix& matrix) {
+        if (matrix.m_size() != 16) {
+            throw runtime_error("a matrix must have 16 elements");
+        }
+
+        for (const float m : matrix.m()) put(m);
+    }
+
+    string finish() { return move(output_); }
+
+  private:
+    string output_{};
+};
+
+class Reader {
+  public:
+    Reader(const char* data, const size_t len)
+        : data_(data), end_(data + len) {
+        if (get<uint32_t>() != MAGIC) {
+            throw runtime_error("not a flat record");
+        }
+    }
+
+    template <class T>
+    T get() {
+        T value;
+        check(sizeof(T));
+        memcpy(&value, data_, sizeof(T));
+        data_ += sizeof(T);
+        return value;
+    }
+
+    string get_string() {
+        const uint32_t len = get<uint32_t>();
+        check(len);
+        string str{data_, len};
+        data_ += len;
+        return str;
+    }
+
+    template <class T, size_t N>
+    unique_ptr<T[]> get_vectors(const uint32_t count) {
+        auto values = make_unique<T[]>(count);
+        for (uint32_t i = 0; i < count; i++) {
+            for (size_t c = 0; c < N; c++) values[i][c] = get<float>();
+        }
+        return values;
+    }
+
+    ParamSet get_params() {
+        ParamSet ps;
+
+        for (uint32_t items = get<uint32_t>(); items > 0; items--) {
+            const auto type = get<ItemType>();
+            const string name = get_string();
+            const uint32_t n = get<uint32_t>();
+
+            switch (type) {
+            case ItemType::Bool: {
+                auto values = make_unique<bool[]>(n);
+                for (uint32_t i = 0; i < n; i++) values[i] = get<uint8_t>();
+                ps.AddBool(name, move(values), n);
+                break;
+            }
+
+            case ItemType::Int: {
+                auto values = make_unique<int[]>(n);
+                for (uint32_t i = 0; i < n; i++) values[i] = get<int32_t>();
+                ps.AddInt(name, move(values), n);
+                break;
+            }
+
+            case ItemType::Float: {
+                auto values = make_unique<Float[]>(n);
+                for (uint32_t i = 0; i < n; i++) values[i] = get<float>();
+                ps.AddFloat(name, move(values), n);
+                break;
+            }
+
+            case ItemType::Point2f:
+                ps.AddPoint2f(name, get_vectors<Point2f, 2>(n), n);
+                break;
+
+            case ItemType::Vector2f:
+                ps.AddVector2f(name, get_vectors<Vector2f, 2>(n), n);
+                break;
+
+            case ItemType::Point3f:
+                ps.AddPoint3f(name, get_vectors<Point3f, 3>(n), n);
+                break;
+
+            case ItemType::Vector3f:
+                ps.AddVector3f(name, get_vectors<Vector3f, 3>(n), n);
+                break;
+
+            case ItemType::Normal3f:
+                ps.AddNormal3f(name, get_vectors<Normal3f, 3>(n), n);
+                break;
+
+            case ItemType::Spectrum: {
+                auto values = make_unique<Spectrum[]>(n);
+                for (uint32_t i = 0; i < n; i++) {
+                    Float rgb[3];
+                    for (int c = 0; c < 3; c++) rgb[c] = get<float>();
+                    values[i] = Spectrum::FromRGB(rgb);
+                }
+                ps.AddSpectrum(name, move(values), n);
+                break;
+            }
+
+            case ItemType::String: {
+                auto values = make_unique<string[]>(n);
+                for (uint32_t i = 0; i < n; i++) values[i] = get_string();
+                ps.AddString(name, move(values), n);
+                break;
+            }
+
+            case ItemType::Texture:
+                /* only one value for texture */
+                for (uint32_t i = 0; i < n; i++) {
+                    const string value = get_string();
+                    if (i == 0) ps.AddTexture(name, value);
+                }
+                break;
+
+            default:
+                throw runtime_error("unknown parameter type");
+            }
+        }
+
+        return ps;
+    }
+
+    Transform get_transform() {
+        Float m[4][4];
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) m[i][j] = get<float>();
+        }
+        return Transform(m);
+    }
+
+  private:
+    void check(const size_t len) const {
+        if (data_ + len > end_) {
+            throw runtime_error("flat record is truncated");
+        }
+    }
+
+    const char* data_;
+    const char* end_;
+};
+
+}  // namespace flat
+
+namespace material {
+
+string serialize(const protobuf::Material& mtl) {
+    flat::Writer writer;
+    writer.put(mtl.name());
+
+    writer.put_textures(mtl.float_textures());
+    writer.put_textures(mtl.spectrum_textures());
+
+    writer.put(mtl.geom_params());
+    writer.put(mtl.material_params());
+    return writer.finish();
+}
+
+shared_ptr<Material> deserialize(
+    const char* data, const size_t len,
+    map<uint64_t, shared_ptr<Texture<Float>>>& loaded_ftex,
+    map<uint64_t, shared_ptr<Texture<Spectrum>>>& loaded_stex) {
+    flat::Reader reader{data, len};
+    const string name = reader.get_string();
+
+    map<string, shared_ptr<Texture<Float>>> ftex;
+    map<string, shared_ptr<Texture<Spectrum>>> stex;
+
+    for (uint32_t n = reader.get<uint32_t>(); n > 0; n--) {
+        const string tex_name = reader.get_string();
+        const uint64_t id = reader.get<uint64_t>();
+
+        // let's load the texture if it's not loaded
+        if (not loaded_ftex.count(id)) {
+            protobuf::FloatTexture proto;
+            global::manager.GetReader(ObjectType::FloatTexture, id)
+                ->read(&proto);
+            loaded_ftex.emplace(id, pbrt::float_texture::from_protobuf(proto));
+        }
+
+        ftex.emplace(tex_name, loaded_ftex.at(id));
+    }
+
+    for (uint32_t n = reader.get<uint32_t>(); n > 0; n--) {
+        const string tex_name = reader.get_string();
+        const uint64_t id = reader.get<uint64_t>();
+
+        if (not loaded_stex.count(id)) {
+            protobuf::SpectrumTexture proto;
+            global::manager.GetReader(ObjectType::SpectrumTexture, id)
+                ->read(&proto);
+            loaded_stex.emplace(id,
+                                pbrt::spectrum_texture::from_protobuf(proto));
+        }
+
+        stex.emplace(tex_name, loaded_stex.at(id));
+    }
+
+    ParamSet geom_params = reader.get_params();
+    ParamSet material_params = reader.get_params();
+
+    TextureParams tp{geom_params, material_params, ftex, stex};
+    tp.FindString("type", "");  // to avoid unused warning
+
+    return MakeMaterial(name, tp);
+}
+
+}  // namespace material
+
+namespace float_texture {
+
+string serialize(const protobuf::FloatTexture& texture) {
+    flat::Writer writer;
+    writer.put(texture.name());
+    writer.put(texture.tex2world());
+    writer.put(texture.params());
+    return writer.finish();
+}
+
+shared_ptr<Texture<Float>> deserialize(const char* data, const size_t len) {
+    flat::Reader reader{data, len};
+    const string name = reader.get_string();
+    const Transform tex2world = reader.get_transform();
+    ParamSet params = reader.get_params();
+
+    map<string, shared_ptr<Texture<Float>>> fTex;
+    map<string, shared_ptr<Texture<Spectrum>>> sTex;
+
+    TextureParams tp{params, params, fTex, sTex};
+    return MakeFloatTexture(name, tex2world, tp);
+}
+
+}  // namespace float_texture
+
+namespace spectrum_texture {
+
+string serialize(const protobuf::SpectrumTexture& texture) {
+    flat::Writer writer;
+    writer.put(texture.name());
+    writer.put(texture.tex2world());
+    writer.put(texture.params());
+    return writer.finish();
+}
+
+shared_ptr<Texture<Spectrum>> deserialize(const char* data, const size_t len) {
+    flat::Reader reader{data, len};
+    const string name = reader.get_string();
+    const Transform tex2world = reader.get_transform();
+    ParamSet params = reader.get_params();
+
+    map<string, shared_ptr<Texture<Float>>> fTex;
+    map<string, shared_ptr<Texture<Spectrum>>> sTex;
+
+    TextureParams tp{params, params, fTex, sTex};
+    return MakeSpectrumTexture(name, tex2world, tp);
+}
+
+}  // namespace spectrum_texture
+
 }  // namespace pbrt::serdes
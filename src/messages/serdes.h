@@ -1,12 +1,21 @@
 #ifndef PBRT_MESSAGES_NEW_UTILS_H
 #define PBRT_MESSAGES_NEW_UTILS_H
 
+#include <map>
 #include <memory>
 #include <string>
 
 #include "accelerators/cloud.h"
 #include "shapes/triangle.h"
 
+namespace pbrt::protobuf {
+
+class Material;
+class FloatTexture;
+class SpectrumTexture;
+
+}  // namespace pbrt::protobuf
+
 namespace pbrt::serdes {
 
 namespace triangle_mesh {
@@ -35,6 +44,48 @@ struct __attribute__((packed, aligned(1))) Triangle {
 
 }  // namespace cloudbvh
 
+/* Treelets carry their materials and textures in a flat binary form that is
+ * turned into a ParamSet without any protobuf parsing: the name, the
+ * texture references (materials) or the transform (textures), and the
+ * parameters as a table of typed arrays. Records in this form start with
+ * MAGIC; serialized protobufs of these types never do, so the loader can
+ * tell them apart from those in older dumps. */
+namespace flat {
+
+constexpr uint32_t MAGIC = 0x4f464250; /* "PBFO" */
+
+bool is_flat(const char* data, const size_t len);
+
+}  // namespace flat
+
+namespace material {
+
+std::string serialize(const protobuf::Material& material);
+
+/* textures that are not in the maps are read from the scene and added */
+std::shared_ptr<Material> deserialize(
+    const char* data, const size_t len,
+    std::map<uint64_t, std::shared_ptr<Texture<Float>>>& ftex,
+    std::map<uint64_t, std::shared_ptr<Texture<Spectrum>>>& stex);
+
+}  // namespace material
+
+namespace float_texture {
+
+std::string serialize(const protobuf::FloatTexture& texture);
+std::shared_ptr<Texture<Float>> deserialize(const char* data,
+                                            const size_t len);
+
+}  // namespace float_texture
+
+namespace spectrum_texture {
+
+std::string serialize(const protobuf::SpectrumTexture& texture);
+std::shared_ptr<Texture<Spectrum>> deserialize(const char* data,
+                                               const size_t len);
+
+}  // namespace spectrum_texture
+
 }  // namespace pbrt::serdes
 
 #endif /* PBRT_MESSAGES_NEW_UTILS_H */
@@ -635,8 +635,7 @@ shared_ptr<GlobalSampler> sampler::from_protobuf(const protobuf::Sampler& ps,
     }
 
     if (name == "lowdiscrepancy" || name == "02sequence") {
-        // sampler = CreateZeroTwoSequenceSampler(paramSet);
-        throw runtime_error("Unsupported sampler");
+        sampler = CreateCloudZeroTwoSequenceSampler(paramSet);
     } else if (name == "maxmindist") {
         // sampler = CreateMaxMinDistSampler(paramSet);
         throw runtime_error("Unsupported sampler");
@@ -95,27 +95,39 @@ HaltonSampler::HaltonSampler(int samplesPerPixel, const Bounds2i &sampleBounds,
 std::vector<uint16_t> HaltonSampler::radicalInversePermutations;
 int64_t HaltonSampler::GetIndexForSample(int64_t sampleNum) const {
     if (currentPixel != pixelForOffset) {
-        // Compute Halton sample offset for _currentPixel_
-        offsetForCurrentPixel = 0;
-        if (sampleStride > 1) {
-            Point2i pm(Mod(currentPixel[0], kMaxResolution),
-                       Mod(currentPixel[1], kMaxResolution));
-            for (int i = 0; i < 2; ++i) {
-                uint64_t dimOffset =
-                    (i == 0)
-                        ? InverseRadicalInverse<2>(pm[i], baseExponents[i])
-                        : InverseRadicalInverse<3>(pm[i], baseExponents[i]);
-                offsetForCurrentPixel +=
-                    dimOffset * (sampleStride / baseScales[i]) * multInverse[i];
-            }
-            offsetForCurrentPixel %= sampleStride;
-        }
+        offsetForCurrentPixel = OffsetForPixel(currentPixel);
         pixelForOffset = currentPixel;
     }
     return offsetForCurrentPixel + sampleNum * sampleStride;
 }
 
-Float HaltonSampler::SampleDimension(int64_t index, int dim) const {
+int64_t HaltonSampler::GetIndexForSample(const Point2i &pixel,
+                                         int64_t sampleNum) const {
+    // Not cached, so that streams on several threads can share the sampler
+    return OffsetForPixel(pixel) + sampleNum * sampleStride;
+}
+
+int64_t HaltonSampler::OffsetForPixel(const Point2i &pixel) const {
+    // Compute Halton sample offset for _pixel_
+    int64_t offsetForPixel = 0;
+    if (sampleStride > 1) {
+        Point2i pm(Mod(pixel[0], kMaxResolution),
+                   Mod(pixel[1], kMaxResolution));
+        for (int i = 0; i < 2; ++i) {
+            uint64_t dimOffset =
+                (i == 0)
+                    ? InverseRadicalInverse<2>(pm[i], baseExponents[i])
+                    : InverseRadicalInverse<3>(pm[i], baseExponents[i]);
+            offsetForPixel +=
+                dimOffset * (sampleStride / baseScales[i]) * multInverse[i];
+        }
+        offsetForPixel %= sampleStride;
+    }
+    return offsetForPixel;
+}
+
+Float HaltonSampler::SampleDimension(const Point2i &pixel, int64_t index,
+                                     int dim) const {
     if (sampleAtPixelCenter && (dim == 0 || dim == 1)) return 0.5f;
     if (dim == 0)
         return RadicalInverse(dim, index >> baseExponents[0]);
@@ -52,7 +52,9 @@ class HaltonSampler : public GlobalSampler {
     HaltonSampler(int nsamp, const Bounds2i &sampleBounds,
                   bool sampleAtCenter = false);
     int64_t GetIndexForSample(int64_t sampleNum) const;
-    Float SampleDimension(int64_t index, int dimension) const;
+    int64_t GetIndexForSample(const Point2i &pixel, int64_t sampleNum) const;
+    Float SampleDimension(const Point2i &pixel, int64_t index,
+                          int dimension) const;
     std::unique_ptr<Sampler> Clone(int seed);
 
     SamplerType GetType() const { return SamplerType::Halton; }
@@ -71,6 +73,7 @@ class HaltonSampler : public GlobalSampler {
     bool sampleAtPixelCenter;
 
     // HaltonSampler Private Methods
+    int64_t OffsetForPixel(const Point2i &pixel) const;
     const uint16_t *PermutationForDimension(int dim) const {
         if (dim >= PrimeTableSize)
             LOG(FATAL) << StringPrintf("HaltonSampler can only sample %d "
@@ -39,12 +39,14 @@
 namespace pbrt {
 
 // SobolSampler Method Definitions
-int64_t SobolSampler::GetIndexForSample(int64_t sampleNum) const {
+int64_t SobolSampler::GetIndexForSample(const Point2i &pixel,
+                                        int64_t sampleNum) const {
     return SobolIntervalToIndex(log2Resolution, sampleNum,
-                                Point2i(currentPixel - sampleBounds.pMin));
+                                Point2i(pixel - sampleBounds.pMin));
 }
 
-Float SobolSampler::SampleDimension(int64_t index, int dim) const {
+Float SobolSampler::SampleDimension(const Point2i &pixel, int64_t index,
+                                    int dim) const {
     if (dim >= NumSobolDimensions)
         LOG(FATAL) << StringPrintf("SobolSampler can only sample up to %d "
                                    "dimensions! Exiting.",
@@ -53,7 +55,7 @@ Float SobolSampler::SampleDimension(int64_t index, int dim) const {
     // Remap Sobol$'$ dimensions used for pixel samples
     if (dim == 0 || dim == 1) {
         s = s * resolution + sampleBounds.pMin[dim];
-        s = Clamp(s - currentPixel[dim], (Float)0, OneMinusEpsilon);
+        s = Clamp(s - pixel[dim], (Float)0, OneMinusEpsilon);
     }
     return s;
 }
@@ -60,8 +60,9 @@ class SobolSampler : public GlobalSampler {
         log2Resolution = Log2Int(resolution);
         if (resolution > 0) CHECK_EQ(1 << log2Resolution, resolution);
     }
-    int64_t GetIndexForSample(int64_t sampleNum) const;
-    Float SampleDimension(int64_t index, int dimension) const;
+    int64_t GetIndexForSample(const Point2i &pixel, int64_t sampleNum) const;
+    Float SampleDimension(const Point2i &pixel, int64_t index,
+                          int dimension) const;
 
     SamplerType GetType() const { return SamplerType::Sobol; }
 
@@ -81,4 +81,53 @@ ZeroTwoSequenceSampler *CreateZeroTwoSequenceSampler(const ParamSet &params) {
     return new ZeroTwoSequenceSampler(nsamp, sd);
 }
 
+// CloudZeroTwoSequenceSampler Method Definitions
+static uint64_t MixBits(uint64_t v) {
+    v ^= (v >> 31);
+    v *= 0x7fb5d329728ea185;
+    v ^= (v >> 27);
+    v *= 0x81dadef4bc2dd44d;
+    v ^= (v >> 33);
+    return v;
+}
+
+CloudZeroTwoSequenceSampler::CloudZeroTwoSequenceSampler(
+    int64_t samplesPerPixel)
+    : GlobalSampler(RoundUpPow2(samplesPerPixel)) {
+    if (!IsPowerOf2(samplesPerPixel))
+        Warning(
+            "Pixel samples being rounded up to power of 2 "
+            "(from %" PRId64 " to %" PRId64 ").",
+            samplesPerPixel, RoundUpPow2(samplesPerPixel));
+}
+
+Float CloudZeroTwoSequenceSampler::SampleDimension(const Point2i &pixel,
+                                                   int64_t index,
+                                                   int dim) const {
+    // Dimensions $2k$ and $2k+1$ are the two components of the same
+    // $(0,2)$-sequence, i.e. the first two Sobol$'$ dimensions
+    const uint64_t pixelBits =
+        (uint64_t(uint32_t(pixel.x)) << 32) | uint32_t(pixel.y);
+    const uint64_t hash = MixBits(pixelBits ^ MixBits(dim / 2 + 1));
+
+    // XOR-ing the low bits of the index permutes the pixel's samples, the
+    // same way for both components
+    const int64_t permutedIndex = index ^ (hash & (samplesPerPixel - 1));
+    const uint32_t scramble =
+        (dim % 2 == 0) ? uint32_t(hash >> 32) : uint32_t(MixBits(hash));
+
+    return SobolSample(permutedIndex, dim % 2, scramble);
+}
+
+std::unique_ptr<Sampler> CloudZeroTwoSequenceSampler::Clone(int seed) {
+    return std::unique_ptr<Sampler>(new CloudZeroTwoSequenceSampler(*this));
+}
+
+CloudZeroTwoSequenceSampler *CreateCloudZeroTwoSequenceSampler(
+    const ParamSet &params) {
+    int nsamp = params.FindOneInt("pixelsamples", 16);
+    if (PbrtOptions.quickRender) nsamp = 1;
+    return new CloudZeroTwoSequenceSampler(nsamp);
+}
+
 }  // namespace pbrt
@@ -57,6 +57,29 @@ class ZeroTwoSequenceSampler : public PixelSampler {
 
 ZeroTwoSequenceSampler *CreateZeroTwoSequenceSampler(const ParamSet &params);
 
+// CloudZeroTwoSequenceSampler Declarations
+// A $(0,2)$-sequence sampler whose samples are computed one at a time, for
+// the cloud renderer, which draws the samples of a path wherever its rays
+// happen to be shaded. Rather than shuffling each pixel's samples with an
+// RNG, every pair of dimensions is scrambled and has its sample order
+// permuted with bits hashed from the pixel and the dimension.
+class CloudZeroTwoSequenceSampler : public GlobalSampler {
+  public:
+    // CloudZeroTwoSequenceSampler Public Methods
+    CloudZeroTwoSequenceSampler(int64_t samplesPerPixel);
+    int64_t GetIndexForSample(const Point2i &pixel, int64_t sampleNum) const {
+        return sampleNum;
+    }
+    Float SampleDimension(const Point2i &pixel, int64_t index,
+                          int dimension) const;
+    std::unique_ptr<Sampler> Clone(int seed);
+
+    SamplerType GetType() const { return SamplerType::ZeroTwoSequence; }
+};
+
+CloudZeroTwoSequenceSampler *CreateCloudZeroTwoSequenceSampler(
+    const ParamSet &params);
+
 }  // namespace pbrt
 
 #endif  // PBRT_SAMPLERS_ZEROTWOSEQUENCE_H
@@ -12,9 +12,9 @@ extern Transform fakeShapeIdentityTransform;
 class FakeShape : public Shape {
   public:
     // Cone Public Methods
-    FakeShape(const Bounds3f &worldBound)
+    FakeShape(const Bounds3f &worldBound, bool reverseOrientation = false)
         : Shape(&fakeShapeIdentityTransform, &fakeShapeIdentityTransform,
-                false),
+                reverseOrientation),
           worldBound(worldBound) {}
     ~FakeShape() {}
 
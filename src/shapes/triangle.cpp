@@ -122,8 +122,13 @@ TriangleMesh::TriangleMesh(
 }
 
 TriangleMesh::TriangleMesh(std::unique_ptr<char[]> &&b, const size_t tm_offset)
-    : buffer(move(b)),
-      storage(buffer.get() + tm_offset),
+    : TriangleMesh(b.get() + tm_offset, nullptr) {
+    buffer = move(b);
+}
+
+TriangleMesh::TriangleMesh(const char *data, std::shared_ptr<void> b)
+    : backing(move(b)),
+      storage(data),
       nTriangles(*reinterpret_cast<const int *>(storage)),
       nVertices(*reinterpret_cast<const int *>(storage + sizeof(int))),
       alphaMask(),
@@ -55,6 +55,7 @@ class VanillaBVHAccel;
 struct TriangleMesh {
   private:
     std::unique_ptr<char[]> buffer{nullptr};
+    std::shared_ptr<void> backing{nullptr};
     const char *storage;
 
   public:
@@ -68,6 +69,10 @@ struct TriangleMesh {
 
     TriangleMesh(std::unique_ptr<char[]> &&buffer, const size_t offset);
 
+    // Builds a mesh on top of serialized data it doesn't own (e.g. a mapped
+    // treelet file); `backing` keeps that data alive.
+    TriangleMesh(const char *storage, std::shared_ptr<void> backing);
+
     // TriangleMesh Data
     const int nTriangles, nVertices;
 
@@ -83,6 +88,7 @@ struct TriangleMesh {
 
 class TreeletDumpBVH;
 class ProxyDumpBVH;
+class CloudBVH;
 
 class Triangle : public Shape {
   public:
@@ -133,6 +139,7 @@ class Triangle : public Shape {
     friend BVHAccel;
     friend VanillaBVHAccel;
     friend TreeletDumpBVH;
+    friend CloudBVH;
     friend ProxyDumpBVH;
     friend void pbrtShape(const std::string &name, const ParamSet &params);
 };
@@ -0,0 +1,172 @@
+#include "tests/gtest/gtest.h"
+#include <cstring>
+#include "pbrt.h"
+#include "rng.h"
+#include "messages/blocked.h"
+
+using namespace pbrt;
+
+// Builds a record stream of `count` records; every 16th record is larger
+// than the block size used below, so it ends up in a block of its own.
+static std::string MakeStream(int count, std::vector<std::string> *records) {
+    RNG rng(count);
+    std::string stream;
+    for (int i = 0; i < count; ++i) {
+        const uint32_t len = (i % 16 == 15) ? 1000 : rng.UniformUInt32(64);
+        std::string record(len, '\0');
+        for (char &c : record) c = 'a' + rng.UniformUInt32(4);
+        records->push_back(record);
+
+        stream.append(reinterpret_cast<const char *>(&len), sizeof(len));
+        stream.append(record);
+    }
+    return stream;
+}
+
+static std::string ReadRecord(RecordReader &reader) {
+    std::string record(reader.next_record_size(), '\0');
+    reader.read(&record[0], record.size());
+    return record;
+}
+
+TEST(Blocked, RoundTrip) {
+    std::vector<std::string> records;
+    const std::string stream = MakeStream(300, &records);
+
+    for (blocked::Codec codec : {blocked::Codec::None, blocked::Codec::LZ4,
+                                 blocked::Codec::Zstd}) {
+        if (!blocked::codec_available(codec)) continue;
+
+        const std::string data =
+            blocked::compress(stream.data(), stream.size(), codec, 256);
+        ASSERT_TRUE(blocked::is_blocked(data.data(), data.size()));
+
+        for (bool eager : {true, false}) {
+            auto reader = RecordReader::get(data.data(), data.size(), eager);
+            ASSERT_TRUE(dynamic_cast<BlockedReader *>(reader.get()));
+
+            for (const std::string &record : records)
+                EXPECT_EQ(record, ReadRecord(*reader));
+
+            EXPECT_THROW(reader->next_record_size(), std::runtime_error);
+        }
+    }
+
+    // An empty stream has no blocks at all
+    const std::string empty =
+        blocked::compress(nullptr, 0, blocked::Codec::LZ4);
+    EXPECT_THROW(BlockedReader(empty.data(), empty.size()).next_record_size(),
+                 std::runtime_error);
+}
+
+TEST(Blocked, SkipAcrossBlocks) {
+    std::vector<std::string> records;
+    const std::string stream = MakeStream(500, &records);
+    const std::string data = blocked::compress(stream.data(), stream.size(),
+                                               blocked::Codec::LZ4, 256);
+
+    // Skip distances that stay within a block, land right on a block
+    // boundary and jump over several blocks
+    for (size_t stride : {0, 1, 7, 15, 16, 61, 200}) {
+        BlockedReader reader(data.data(), data.size(), false);
+        size_t next = 0;
+        while (next + stride < records.size()) {
+            reader.skip(stride);
+            next += stride;
+            EXPECT_EQ(records[next], ReadRecord(reader)) << "stride " << stride;
+            ++next;
+        }
+
+        EXPECT_THROW(reader.skip(records.size() - next + 1),
+                     std::runtime_error);
+    }
+}
+
+TEST(Blocked, RejectsCorruptedHeader) {
+    std::vector<std::string> records;
+    const std::string stream = MakeStream(100, &records);
+    const std::string data = blocked::compress(stream.data(), stream.size(),
+                                               blocked::Codec::LZ4, 256);
+
+    blocked::Header header;
+    memcpy(&header, data.data(), sizeof(header));
+    const uint32_t blockCount = header.block_count;
+    ASSERT_GT(blockCount, 1);
+
+    // Rewrite the header or the first entry of the block index
+    auto corruptHeader = [&data](void (*edit)(blocked::Header &)) {
+        std::string bad = data;
+        blocked::Header h;
+        memcpy(&h, &bad[0], sizeof(h));
+        edit(h);
+        memcpy(&bad[0], &h, sizeof(h));
+        return bad;
+    };
+    auto corruptBlock = [&data](void (*edit)(blocked::BlockInfo &)) {
+        std::string bad = data;
+        blocked::BlockInfo b;
+        memcpy(&b, &bad[sizeof(blocked::Header)], sizeof(b));
+        edit(b);
+        memcpy(&bad[sizeof(blocked::Header)], &b, sizeof(b));
+        return bad;
+    };
+
+    std::string bad = corruptHeader([](blocked::Header &h) { h.magic ^= 1; });
+    EXPECT_FALSE(blocked::is_blocked(bad.data(), bad.size()));
+    EXPECT_THROW(BlockedReader(bad.data(), bad.size()), std::runtime_error);
+
+    bad = corruptHeader([](blocked::Header &h) { h.version++; });
+    EXPECT_THROW(BlockedReader(bad.data(), bad.size()), std::runtime_error);
+
+    bad = corruptHeader([](blocked::Header &h) { h.codec = 42; });
+    EXPECT_THROW(BlockedReader(bad.data(), bad.size()), std::runtime_error);
+
+    bad = corruptHeader([](blocked::Header &h) { h.block_count = 1u << 30; });
+    EXPECT_THROW(BlockedReader(bad.data(), bad.size()), std::runtime_error);
+
+    bad = corruptHeader([](blocked::Header &h) { h.raw_size /= 2; });
+    EXPECT_THROW(BlockedReader(bad.data(), bad.size()), std::runtime_error);
+
+    bad = corruptBlock([](blocked::BlockInfo &b) { b.offset = 1ull << 40; });
+    EXPECT_THROW(BlockedReader(bad.data(), bad.size()), std::runtime_error);
+
+    // A block that doesn't decompress to its raw size is only noticed once
+    // it's read; eager readers fail right away.
+    bad = corruptBlock([](blocked::BlockInfo &b) { b.size /= 2; });
+    EXPECT_THROW(BlockedReader(bad.data(), bad.size()), std::runtime_error);
+
+    BlockedReader lazy(bad.data(), bad.size(), false);
+    EXPECT_THROW(lazy.next_record_size(), std::runtime_error);
+
+    // A buffer cut short within the block index
+    EXPECT_THROW(BlockedReader(data.data(), sizeof(blocked::Header) + 10),
+                 std::runtime_error);
+}
+
+TEST(Blocked, ViewsOutliveReader) {
+    std::vector<std::string> records;
+    const std::string stream = MakeStream(200, &records);
+    const std::string data = blocked::compress(stream.data(), stream.size(),
+                                               blocked::Codec::LZ4, 256);
+
+    std::vector<const char *> views;
+    std::shared_ptr<char> raw;
+    {
+        BlockedReader reader(data.data(), data.size(), false);
+        for (const std::string &record : records) {
+            ASSERT_EQ(record.size(), reader.next_record_size());
+            views.push_back(reader.view(record.size()));
+            ASSERT_NE(nullptr, views.back());
+        }
+
+        EXPECT_EQ(stream.size(), reader.raw_size());
+        raw = reader.raw_stream();
+    }
+
+    for (size_t i = 0; i < records.size(); i++) {
+        EXPECT_EQ(records[i], std::string(views[i], records[i].size()));
+    }
+
+    BlockedReader reader(data.data(), data.size());
+    EXPECT_THROW(reader.view(records[0].size() + 1), std::runtime_error);
+}
@@ -0,0 +1,414 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "rng.h"
+#include "accelerators/cloud.h"
+#include "cloud/manager.h"
+#include "messages/blocked.h"
+#include "messages/lite.h"
+#include "messages/serdes.h"
+#include "messages/serialization.h"
+#include "messages/utils.h"
+#include "pbrt.pb.h"
+#include "shapes/triangle.h"
+#include "util/path.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace pbrt;
+
+template <int N>
+static void TestQuantizedBoundsAreConservative() {
+    RNG rng;
+    for (int trial = 0; trial < 1000; ++trial) {
+        Bounds3f children[N];
+        Bounds3f bounds;
+        Float scale = std::pow(10.f, Lerp(rng.UniformFloat(), -4.f, 4.f));
+        for (int i = 0; i < N; ++i) {
+            Point3f p0, p1;
+            for (int a = 0; a < 3; ++a) {
+                p0[a] = scale * (rng.UniformFloat() - .5f);
+                p1[a] = scale * (rng.UniformFloat() - .5f);
+            }
+            children[i] = Bounds3f(p0, p1);
+            bounds = Union(bounds, children[i]);
+        }
+
+        CloudBVH::WideTreeletNode<N> node;
+        node.SetBounds(bounds);
+        for (int i = 0; i < N; ++i) node.AddChild(children[i], 0, i);
+
+        EXPECT_EQ(N, node.child_count);
+        for (int i = 0; i < N; ++i) {
+            Bounds3f q = node.ChildBounds(i);
+            for (int a = 0; a < 3; ++a) {
+                EXPECT_LE(q.pMin[a], children[i].pMin[a]);
+                EXPECT_GE(q.pMax[a], children[i].pMax[a]);
+            }
+            EXPECT_EQ(i, node.child_node[i]);
+        }
+    }
+}
+
+TEST(CloudBVH, WideNodeBounds4) { TestQuantizedBoundsAreConservative<4>(); }
+
+TEST(CloudBVH, WideNodeBounds8) { TestQuantizedBoundsAreConservative<8>(); }
+
+TEST(CloudBVH, WideNodeDegenerateBounds) {
+    // A flat child (e.g. an axis-aligned quad) must stay representable.
+    Bounds3f child(Point3f(1, 2, 3), Point3f(4, 2, 6));
+
+    CloudBVH::WideTreeletNode<4> node;
+    node.SetBounds(child);
+    node.AddChild(child, 0, CloudBVH::LEAF_FLAG);
+
+    Bounds3f q = node.ChildBounds(0);
+    EXPECT_EQ(2, q.pMin.y);
+    EXPECT_EQ(2, q.pMax.y);
+    EXPECT_LE(q.pMin.x, 1);
+    EXPECT_GE(q.pMax.z, 6);
+}
+
+TEST(CloudBVH, TreeletTriangleMatchesTriangle) {
+    RNG rng;
+    Transform identity;
+    int hits = 0;
+
+    for (int trial = 0; trial < 10000; ++trial) {
+        Point3f p[3];
+        for (int v = 0; v < 3; ++v)
+            for (int a = 0; a < 3; ++a) p[v][a] = 2 * rng.UniformFloat() - 1;
+
+        const int indices[3] = {0, 1, 2};
+        auto mesh = std::make_shared<TriangleMesh>(
+            identity, 1, indices, 3, p, nullptr, nullptr, nullptr, nullptr,
+            nullptr, nullptr);
+        Triangle triangle(&identity, &identity, false, mesh, 0);
+
+        CloudBVH::TreeletTriangle flat;
+        flat.p0 = mesh->p[0];
+        flat.p1 = mesh->p[1];
+        flat.p2 = mesh->p[2];
+        flat.mesh_index = 0;
+
+        for (int r = 0; r < 10; ++r) {
+            Point3f o;
+            Vector3f d;
+            for (int a = 0; a < 3; ++a) {
+                o[a] = 4 * rng.UniformFloat() - 2;
+                d[a] = rng.UniformFloat() - .5f;
+            }
+
+            Ray ray(o, d, 5 * rng.UniformFloat());
+            const bool expected = triangle.IntersectP(ray);
+            EXPECT_EQ(expected, flat.Intersect(ray));
+            hits += expected;
+        }
+    }
+
+    // Make sure the test exercised both outcomes.
+    EXPECT_GT(hits, 0);
+}
+
+// A treelet with nothing in it but an image partition.
+static void WriteTreelet(const std::string &path, uint32_t partitionId) {
+    LiteRecordWriter writer{path};
+
+    writer.write<uint32_t>(1);
+    writer.write<uint32_t>(partitionId);
+
+    // A 2x2 image in a single partition, with a texel of padding around it.
+    const int header[4] = {2, 2, 0, 1};
+    std::string partition(sizeof(header) + 16 * sizeof(RGBSpectrum), 0);
+    memcpy(&partition[0], header, sizeof(header));
+    writer.write(partition);
+
+    // No textures, materials, meshes or nodes.
+    for (int i = 0; i < 7; ++i) writer.write<uint32_t>(0);
+}
+
+TEST(CloudBVH, EvictionReleasesImagePartitions) {
+    char dir[] = "/tmp/pbrt-cloudbvh-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    SceneManager &manager = global::manager;
+    manager.init(dir);
+
+    // Two treelets that both include partition 7.
+    protobuf::Manifest manifest;
+    for (uint32_t id = 0; id < 2; ++id) {
+        *manifest.add_objects()->mutable_id() =
+            to_protobuf(ObjectKey{ObjectType::Treelet, id});
+        WriteTreelet(manager.getFilePath(ObjectType::Treelet, id), 7);
+    }
+    manager.GetWriter(ObjectType::Manifest)->write(manifest);
+    manager.GetWriter(ObjectType::AreaLights);
+
+    std::weak_ptr<ImagePartition> partition;
+    {
+        CloudBVH bvh{0, false};
+        bvh.SetCacheBudget(1);
+
+        {
+            CloudBVH::TreeletPin first{bvh, 0};
+            CloudBVH::TreeletPin second{bvh, 1};
+            EXPECT_GT(bvh.CacheFootprint(), 0);
+            EXPECT_TRUE(bvh.IsLoaded(0));
+            EXPECT_TRUE(bvh.IsLoaded(1));
+
+            // Evicting one treelet leaves the other's copy.
+            first.Reset();
+            partition = manager.getInMemoryImagePartition(7);
+            EXPECT_EQ(RGBSpectrum(0.f),
+                      partition.lock()->Lookup(Point2f(.5f, .5f)));
+        }
+
+        // Unpinned, both are over the budget and get evicted.
+        EXPECT_EQ(0, bvh.CacheFootprint());
+        EXPECT_FALSE(bvh.IsLoaded(0));
+        EXPECT_FALSE(bvh.IsLoaded(1));
+        EXPECT_THROW(manager.getInMemoryImagePartition(7), std::out_of_range);
+        EXPECT_TRUE(partition.expired());
+    }
+
+    for (const auto type : {ObjectType::Manifest, ObjectType::AreaLights})
+        EXPECT_EQ(0, unlink(manager.getFilePath(type, 0).c_str()));
+    for (uint32_t id = 0; id < 2; ++id)
+        EXPECT_EQ(
+            0, unlink(manager.getFilePath(ObjectType::Treelet, id).c_str()));
+    EXPECT_EQ(0, rmdir(dir));
+}
+
+// What comes before the nodes of a treelet whose only mesh is a single
+// triangle in the z = 0 plane.
+static void WriteTriangleMesh(LiteRecordWriter &writer) {
+    // No image partitions, textures or materials.
+    for (int i = 0; i < 5; ++i) writer.write<uint32_t>(0);
+
+    writer.write<uint32_t>(1);
+    writer.write<uint64_t>(1);
+    writer.write(MaterialKey{0, 0});
+    writer.write<uint32_t>(0);
+
+    // Counts, indices, positions, and no normals, tangents, uvs or faces.
+    const int counts[2] = {1, 3}, indices[3] = {0, 1, 2};
+    const Point3f p[3] = {Point3f(-1, -1, 0), Point3f(1, -1, 0),
+                          Point3f(0, 1, 0)};
+    std::string mesh(sizeof(counts) + sizeof(indices) + sizeof(p) + 4, 0);
+    memcpy(&mesh[0], counts, sizeof(counts));
+    memcpy(&mesh[sizeof(counts)], indices, sizeof(indices));
+    memcpy(&mesh[sizeof(counts) + sizeof(indices)], p, sizeof(p));
+    writer.write(mesh);
+}
+
+// The primitives of the treelets below: a group with just the triangle.
+static void WriteTriangleGroup(LiteRecordWriter &writer) {
+    writer.write<uint32_t>(0);
+    writer.write<uint32_t>(1);
+    serdes::cloudbvh::Triangle triangle;
+    triangle.mesh_id = 1;
+    triangle.tri_number = 0;
+    writer.write(triangle);
+}
+
+// A treelet with the triangle in one leaf.
+static void WriteTriangleTreelet(const std::string &path) {
+    LiteRecordWriter writer{path};
+    WriteTriangleMesh(writer);
+
+    writer.write<uint32_t>(1);
+    writer.write<uint32_t>(1);
+
+    CloudBVH::TreeletNode leaf(
+        Bounds3f(Point3f(-1, -1, 0), Point3f(1, 1, 0)), 0);
+    leaf.leaf_tag = ~0;
+    leaf.primitive_offset = 0;
+    leaf.primitive_count = 1;
+    writer.write(leaf);
+    WriteTriangleGroup(writer);
+}
+
+// A treelet of 8-wide nodes that is `depth` levels deep. Each node has the
+// next one as its nearest child and seven empty leaves further away, which
+// all stay on the stack, so that a traversal needs 7 * depth + 1 entries.
+// The last node has the triangle in its nearest leaf instead.
+static void WriteDeepTreelet(const std::string &path, const int depth) {
+    LiteRecordWriter writer{path};
+
+    CloudBVH::TreeletHeader header;
+    header.node_width = 8;
+    writer.write(header);
+    WriteTriangleMesh(writer);
+
+    const Bounds3f column(Point3f(-1, -1, -1), Point3f(1, 1, 1));
+    const Bounds3f triangle(Point3f(-1, -1, -.1f), Point3f(1, 1, .1f));
+    const Bounds3f below(Point3f(-1, -1, -1), Point3f(1, 1, -.5f));
+
+    std::vector<CloudBVH::WideTreeletNode<8>> nodes(depth);
+    for (int i = 0; i < depth; i++) {
+        nodes[i].SetBounds(column);
+        if (i + 1 < depth) {
+            nodes[i].AddChild(column, 0, i + 1);
+        } else {
+            nodes[i].AddChild(triangle, 0, CloudBVH::LEAF_FLAG | 0);
+        }
+
+        for (int j = 0; j < 7; j++)
+            nodes[i].AddChild(below, 0, CloudBVH::LEAF_FLAG | 1);
+    }
+
+    const CloudBVH::TreeletLeaf leaves[2] = {{0, 1}, {0, 0}};
+
+    writer.write<uint32_t>(depth);
+    writer.write<uint32_t>(1);
+    writer.write<uint32_t>(2);
+    writer.write(reinterpret_cast<const char *>(nodes.data()),
+                 nodes.size() * sizeof(nodes[0]));
+    writer.write(reinterpret_cast<const char *>(leaves), sizeof(leaves));
+    writer.write<uint32_t>(1);
+    WriteTriangleGroup(writer);
+}
+
+TEST(CloudBVH, DeepWideTree) {
+    char dir[] = "/tmp/pbrt-cloudbvh-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    SceneManager &manager = global::manager;
+    manager.init(dir);
+
+    // Deeper than what a serialized ray can hold: the stacks in memory
+    // aren't limited.
+    const int depth = 40;
+
+    protobuf::Manifest manifest;
+    *manifest.add_objects()->mutable_id() =
+        to_protobuf(ObjectKey{ObjectType::Treelet, 0});
+    WriteDeepTreelet(manager.getFilePath(ObjectType::Treelet, 0), depth);
+    manager.GetWriter(ObjectType::Manifest)->write(manifest);
+    manager.GetWriter(ObjectType::AreaLights);
+
+    {
+        CloudBVH bvh{0, false};
+        bvh.LoadTreelet(0);
+
+        RayStatePtr ray = RayState::Create();
+        ray->ray = RayDifferential(Point3f(0, 0, 2), Vector3f(0, 0, -1));
+        ray->toVisitPush(RayState::TreeletNode{});
+        bvh.Trace(*ray);
+        EXPECT_TRUE(ray->HasHit());
+        EXPECT_TRUE(ray->toVisitEmpty());
+        EXPECT_FLOAT_EQ(2, ray->ray.tMax);
+
+        Ray r(Point3f(0, 0, 2), Vector3f(0, 0, -1));
+        SurfaceInteraction isect;
+        EXPECT_TRUE(bvh.IntersectP(r));
+        ASSERT_TRUE(bvh.Intersect(r, &isect));
+        EXPECT_FLOAT_EQ(2, r.tMax);
+
+        Ray miss(Point3f(.9f, .9f, 2), Vector3f(0, 0, -1));
+        EXPECT_FALSE(bvh.IntersectP(miss));
+        EXPECT_FALSE(bvh.Intersect(miss, &isect));
+    }
+
+    for (const auto type : {ObjectType::Manifest, ObjectType::AreaLights})
+        EXPECT_EQ(0, unlink(manager.getFilePath(type, 0).c_str()));
+    EXPECT_EQ(0, unlink(manager.getFilePath(ObjectType::Treelet, 0).c_str()));
+    EXPECT_EQ(0, rmdir(dir));
+}
+
+TEST(CloudBVH, HitOutlivesTreelet) {
+    char dir[] = "/tmp/pbrt-cloudbvh-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    SceneManager &manager = global::manager;
+    manager.init(dir);
+
+    protobuf::Manifest manifest;
+    *manifest.add_objects()->mutable_id() =
+        to_protobuf(ObjectKey{ObjectType::Treelet, 0});
+    WriteTriangleTreelet(manager.getFilePath(ObjectType::Treelet, 0));
+    manager.GetWriter(ObjectType::Manifest)->write(manifest);
+    manager.GetWriter(ObjectType::AreaLights);
+
+    {
+        CloudBVH bvh{0, false};
+        bvh.SetCacheBudget(1);
+
+        RayStatePtr ray = RayState::Create();
+        ray->ray = RayDifferential(Point3f(0, 0, 1), Vector3f(0, 0, -1));
+        ray->toVisitPush(RayState::TreeletNode{});
+        bvh.Trace(*ray);
+        ASSERT_TRUE(ray->HasHit());
+
+        // Nothing pins the treelet anymore, and it's over the budget.
+        EXPECT_EQ(0, bvh.CacheFootprint());
+
+        // Shading only gets to see what doesn't belong to the treelet.
+        SurfaceInteraction &isect = ray->hitInfo->isect;
+        EXPECT_EQ(nullptr, isect.primitive);
+        EXPECT_EQ(RayState::OrientationShape(false), isect.shape);
+
+        isect.SetShadingGeometry(isect.dpdu, isect.dpdv, isect.dndu,
+                                 isect.dndv, false);
+        EXPECT_EQ(1, std::abs(isect.shading.n.z));
+
+        // Intersect() keeps the treelet around until the next call.
+        Ray r(Point3f(0, 0, 1), Vector3f(0, 0, -1));
+        SurfaceInteraction hit;
+        ASSERT_TRUE(bvh.Intersect(r, &hit));
+        EXPECT_GT(bvh.CacheFootprint(), 0);
+        EXPECT_FALSE(hit.shape->reverseOrientation);
+
+        Ray miss(Point3f(5, 5, 1), Vector3f(0, 0, -1));
+        EXPECT_FALSE(bvh.Intersect(miss, &hit));
+        EXPECT_EQ(0, bvh.CacheFootprint());
+    }
+
+    for (const auto type : {ObjectType::Manifest, ObjectType::AreaLights})
+        EXPECT_EQ(0, unlink(manager.getFilePath(type, 0).c_str()));
+    EXPECT_EQ(0, unlink(manager.getFilePath(ObjectType::Treelet, 0).c_str()));
+    EXPECT_EQ(0, rmdir(dir));
+}
+
+TEST(CloudBVH, CompressedTreelet) {
+    char dir[] = "/tmp/pbrt-cloudbvh-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    SceneManager &manager = global::manager;
+    manager.init(dir);
+
+    protobuf::Manifest manifest;
+    *manifest.add_objects()->mutable_id() =
+        to_protobuf(ObjectKey{ObjectType::Treelet, 0});
+    const std::string path = manager.getFilePath(ObjectType::Treelet, 0);
+    WriteTriangleTreelet(path);
+    manager.GetWriter(ObjectType::Manifest)->write(manifest);
+    manager.GetWriter(ObjectType::AreaLights);
+
+    auto loadAndTrace = [] {
+        CloudBVH bvh{0, false};
+        bvh.SetCacheBudget(1 << 20);
+
+        Ray r(Point3f(0, 0, 1), Vector3f(0, 0, -1));
+        SurfaceInteraction hit;
+        EXPECT_TRUE(bvh.Intersect(r, &hit));
+
+        Ray miss(Point3f(5, 5, 1), Vector3f(0, 0, -1));
+        EXPECT_FALSE(bvh.IntersectP(miss));
+
+        return bvh.CacheFootprint();
+    };
+
+    const size_t mappedFootprint = loadAndTrace();
+
+    const std::string raw = roost::read_file(path);
+    roost::atomic_create(
+        blocked::compress(raw.data(), raw.size(), blocked::Codec::LZ4), path);
+
+    // The records are used in place in the decompressed stream, which is
+    // all that the treelet keeps, just like a mapped one: nothing is copied
+    // out of it.
+    EXPECT_EQ(mappedFootprint, loadAndTrace());
+
+    for (const auto type : {ObjectType::Manifest, ObjectType::AreaLights})
+        EXPECT_EQ(0, unlink(manager.getFilePath(type, 0).c_str()));
+    EXPECT_EQ(0, unlink(path.c_str()));
+    EXPECT_EQ(0, rmdir(dir));
+}
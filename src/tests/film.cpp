@@ -0,0 +1,158 @@
+#include "tests/gtest/gtest.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include "pbrt.h"
+#include "film.h"
+#include "rng.h"
+#include "filters/box.h"
+
+using namespace pbrt;
+
+TEST(PixelVariance, MatchesTwoPass) {
+    RNG rng;
+    std::vector<Float> values;
+    PixelVariance v;
+    for (int i = 0; i < 1000; ++i) {
+        values.push_back(10 + rng.UniformFloat());
+        v.Add(values.back());
+    }
+
+    double mean = 0, variance = 0;
+    for (Float x : values) mean += x;
+    mean /= values.size();
+    for (Float x : values) variance += (x - mean) * (x - mean);
+    variance /= values.size() - 1;
+
+    EXPECT_EQ(1000, v.n);
+    EXPECT_NEAR(mean, v.Mean(), 1e-4);
+    EXPECT_NEAR(variance, v.Variance(), 1e-3 * variance);
+    EXPECT_NEAR(std::sqrt(variance / 1000) / mean, v.RelativeError(), 1e-5);
+}
+
+TEST(AdaptiveSampling, Converged) {
+    AdaptiveSampling adaptive;
+    adaptive.threshold = .01f;
+    adaptive.minSamples = 8;
+
+    // A constant pixel converges once it has its minimum samples
+    PixelVariance flat;
+    for (int i = 0; i < 7; ++i) flat.Add(.5f);
+    EXPECT_FALSE(adaptive.Converged(flat));
+    flat.Add(.5f);
+    EXPECT_TRUE(adaptive.Converged(flat));
+
+    // So does a black one
+    PixelVariance black;
+    for (int i = 0; i < 8; ++i) black.Add(0);
+    EXPECT_TRUE(adaptive.Converged(black));
+
+    PixelVariance noisy;
+    for (int i = 0; i < 8; ++i) noisy.Add(i & 1);
+    EXPECT_FALSE(adaptive.Converged(noisy));
+}
+
+TEST(AdaptiveSampling, Allocate) {
+    AdaptiveSampling adaptive;
+    adaptive.threshold = .01f;
+    adaptive.minSamples = 4;
+    adaptive.samplesPerPixel = 16;
+    adaptive.maxSamples = 64;
+
+    RNG rng;
+    std::vector<PixelVariance> pixels(100);
+    for (size_t i = 0; i < pixels.size(); ++i) {
+        // Every other pixel is flat and has converged
+        for (int j = 0; j < 8; ++j)
+            pixels[i].Add((i & 1) ? rng.UniformFloat() : Float(1));
+    }
+
+    for (int64_t budget : {0, 10, 500, 100000}) {
+        std::vector<int64_t> extra = adaptive.Allocate(pixels, budget);
+        ASSERT_EQ(pixels.size(), extra.size());
+        int64_t total = 0;
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            if (!(i & 1)) EXPECT_EQ(0, extra[i]);
+            EXPECT_GE(extra[i], 0);
+            EXPECT_LE(pixels[i].n + extra[i], adaptive.maxSamples);
+            total += extra[i];
+        }
+        EXPECT_LE(total, budget);
+        // With room to spare, the noisy pixels go up to the maximum
+        if (budget == 100000) EXPECT_EQ(50 * (64 - 8), total);
+    }
+}
+
+static std::unique_ptr<Film> MakeFilm() {
+    std::unique_ptr<Filter> filter(new BoxFilter(Vector2f(.5f, .5f)));
+    return std::unique_ptr<Film>(new Film(Point2i(8, 4),
+                                          Bounds2f({0, 0}, {1, 1}),
+                                          std::move(filter), 35., "test.exr",
+                                          1.));
+}
+
+TEST(Film, CheckpointRoundTrip) {
+    char dir[] = "/tmp/pbrt-film-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    const std::string checkpoint = std::string(dir) + "/checkpoint.bin";
+    const char *path = checkpoint.c_str();
+    std::unique_ptr<Film> film = MakeFilm();
+    std::unique_ptr<FilmTile> tile =
+        film->GetFilmTile(film->GetSampleBounds());
+    RNG rng;
+    for (int i = 0; i < 200; ++i) {
+        Point2f p(8 * rng.UniformFloat(), 4 * rng.UniformFloat());
+        tile->AddSample(p, Spectrum(rng.UniformFloat()));
+    }
+    film->MergeFilmTile(std::move(tile));
+    film->WriteCheckpoint(path, 16, 4);
+
+    std::unique_ptr<Film> resumed = MakeFilm();
+    int64_t samplesTaken = 0;
+    ASSERT_TRUE(resumed->ReadCheckpoint(path, 16, &samplesTaken));
+    EXPECT_EQ(4, samplesTaken);
+
+    std::vector<Float> expected(8 * 4 * 4), actual(8 * 4 * 4);
+    film->Serialize(expected);
+    resumed->Serialize(actual);
+    EXPECT_EQ(expected, actual);
+
+    // A checkpoint of a render with a different sample count is ignored
+    EXPECT_FALSE(resumed->ReadCheckpoint(path, 32, &samplesTaken));
+
+    EXPECT_EQ(0, remove(path));
+    EXPECT_FALSE(resumed->ReadCheckpoint(path, 16, &samplesTaken));
+    rmdir(dir);
+}
+
+TEST(Film, TileTracksVarianceOnRequest) {
+    std::unique_ptr<Film> film = MakeFilm();
+    std::unique_ptr<FilmTile> plain =
+        film->GetFilmTile(film->GetSampleBounds());
+    std::unique_ptr<FilmTile> tracked =
+        film->GetFilmTile(film->GetSampleBounds());
+    tracked->TrackVariance();
+    EXPECT_FALSE(plain->TracksVariance());
+    EXPECT_TRUE(tracked->TracksVariance());
+
+    RNG rng;
+    PixelVariance expected;
+    for (int i = 0; i < 100; ++i) {
+        Point2f p(3 + rng.UniformFloat(), 2 + rng.UniformFloat());
+        Spectrum L(rng.UniformFloat());
+        plain->AddSample(p, L);
+        tracked->AddSample(p, L);
+        expected.Add(L.y());
+    }
+
+    // Tracking the variance leaves the pixels themselves unchanged
+    for (Point2i p : plain->GetPixelBounds()) {
+        EXPECT_EQ(plain->GetPixel(p).contribSum,
+                  tracked->GetPixel(p).contribSum);
+        EXPECT_EQ(plain->GetPixel(p).filterWeightSum,
+                  tracked->GetPixel(p).filterWeightSum);
+    }
+    const PixelVariance &v = tracked->GetVariance(Point2i(3, 2));
+    EXPECT_EQ(expected.n, v.n);
+    EXPECT_FLOAT_EQ(expected.Mean(), v.Mean());
+    EXPECT_EQ(0, tracked->GetVariance(Point2i(4, 2)).n);
+}
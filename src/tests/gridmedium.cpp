@@ -0,0 +1,115 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "rng.h"
+#include "media/grid.h"
+
+using namespace pbrt;
+
+namespace {
+
+// A grid that doesn't divide evenly into bricks, with the first brick along
+// x and the voxels next to it all zero
+const int nx = 28, ny = 17, nz = 9;
+
+std::vector<Float> MakeDensity() {
+    RNG rng;
+    std::vector<Float> d(nx * ny * nz);
+    for (int z = 0; z < nz; ++z)
+        for (int y = 0; y < ny; ++y)
+            for (int x = 0; x < nx; ++x)
+                d[(z * ny + y) * nx + x] =
+                    x < 9 ? 0 : 4 * rng.UniformFloat();
+    return d;
+}
+
+GridDensityMedium MakeMedium(const std::vector<Float> &d, bool half) {
+    return GridDensityMedium(Spectrum(.5f), Spectrum(.5f), 0, nx, ny, nz,
+                             Transform(), d.data(), half);
+}
+
+// The trilinear lookup of the dense grid that the bricks replaced
+Float DenseDensity(const std::vector<Float> &d, const Point3f &p) {
+    auto D = [&](const Point3i &p) -> Float {
+        if (p.x < 0 || p.x >= nx || p.y < 0 || p.y >= ny || p.z < 0 ||
+            p.z >= nz)
+            return 0;
+        return d[(p.z * ny + p.y) * nx + p.x];
+    };
+    Point3f pSamples(p.x * nx - .5f, p.y * ny - .5f, p.z * nz - .5f);
+    Point3i pi = (Point3i)Floor(pSamples);
+    Vector3f o = pSamples - (Point3f)pi;
+    Float d00 = Lerp(o.x, D(pi), D(pi + Vector3i(1, 0, 0)));
+    Float d10 = Lerp(o.x, D(pi + Vector3i(0, 1, 0)), D(pi + Vector3i(1, 1, 0)));
+    Float d01 = Lerp(o.x, D(pi + Vector3i(0, 0, 1)), D(pi + Vector3i(1, 0, 1)));
+    Float d11 = Lerp(o.x, D(pi + Vector3i(0, 1, 1)), D(pi + Vector3i(1, 1, 1)));
+    return Lerp(o.z, Lerp(o.y, d00, d10), Lerp(o.y, d01, d11));
+}
+
+// Random points, half of them within half a voxel of a brick boundary
+std::vector<Point3f> LookupPoints() {
+    RNG rng;
+    std::vector<Point3f> points;
+    for (int i = 0; i < 2000; ++i) {
+        Point3f p(rng.UniformFloat(), rng.UniformFloat(), rng.UniformFloat());
+        if (i % 2 == 0) {
+            int axis = i % 3;
+            int n = axis == 0 ? nx : (axis == 1 ? ny : nz);
+            int boundary = 8 * (1 + (i / 3) % ((n - 1) / 8));
+            p[axis] = (boundary + rng.UniformFloat() - .5f) / n;
+        }
+        points.push_back(p);
+    }
+    return points;
+}
+
+}  // namespace
+
+TEST(GridDensityMedium, MatchesDenseGrid) {
+    std::vector<Float> d = MakeDensity();
+    GridDensityMedium medium = MakeMedium(d, false);
+    for (int z = -1; z <= nz; ++z)
+        for (int y = -1; y <= ny; ++y)
+            for (int x = -1; x <= nx; ++x) {
+                bool inside = x >= 0 && x < nx && y >= 0 && y < ny &&
+                              z >= 0 && z < nz;
+                EXPECT_EQ(inside ? d[(z * ny + y) * nx + x] : 0,
+                          medium.D(Point3i(x, y, z)));
+            }
+    for (const Point3f &p : LookupPoints())
+        EXPECT_FLOAT_EQ(DenseDensity(d, p), medium.Density(p)) << p;
+}
+
+TEST(GridDensityMedium, MajorantBoundsDensity) {
+    std::vector<Float> d = MakeDensity();
+    for (bool half : {false, true}) {
+        GridDensityMedium medium = MakeMedium(d, half);
+        for (const Point3f &p : LookupPoints())
+            EXPECT_LE(medium.Density(p), medium.MaxDensity(p))
+                << p << (half ? " (half)" : "");
+        // Nothing can be looked up in the first brick, so it's skipped
+        EXPECT_EQ(0, medium.MaxDensity(Point3f(.1f, .5f, .5f)));
+    }
+}
+
+TEST(GridDensityMedium, HalfDensityRoundTrip) {
+    std::vector<Float> d = MakeDensity();
+    // Denormals, tiny values that round to zero, and values past the
+    // largest half
+    d[nx - 1] = 1e-6f;
+    d[nx - 2] = 1e-9f;
+    d[nx - 3] = 1e5f;
+    GridDensityMedium medium = MakeMedium(d, true);
+    for (int z = 0; z < nz; ++z)
+        for (int y = 0; y < ny; ++y)
+            for (int x = 0; x < nx; ++x) {
+                Float v = d[(z * ny + y) * nx + x];
+                Float h = medium.D(Point3i(x, y, z));
+                if (v > 65504)
+                    EXPECT_EQ(Infinity, h);
+                else
+                    // Halves have 11 significant bits; below the smallest
+                    // normal half, the spacing is fixed at 2^-24
+                    EXPECT_NEAR(v, h, std::max(v / 2048, 1.f / (1 << 25)))
+                        << "voxel " << x << " " << y << " " << z;
+            }
+}
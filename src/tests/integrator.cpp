@@ -0,0 +1,80 @@
+#include "tests/gtest/gtest.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include "pbrt.h"
+#include "integrator.h"
+#include "parallel.h"
+#include "scene.h"
+#include "accelerators/bvh.h"
+#include "cameras/orthographic.h"
+#include "filters/box.h"
+#include "samplers/random.h"
+
+using namespace pbrt;
+
+namespace {
+
+// Records the first 2D sample of every camera ray it's given
+class RecordingIntegrator : public SamplerIntegrator {
+  public:
+    RecordingIntegrator(std::shared_ptr<const Camera> camera,
+                        std::shared_ptr<Sampler> sampler,
+                        const Bounds2i &pixelBounds)
+        : SamplerIntegrator(camera, sampler, pixelBounds) {}
+    Spectrum Li(const RayDifferential &ray, const Scene &scene,
+                Sampler &sampler, MemoryArena &arena, int depth) const {
+        Point2f u = sampler.Get2D();
+        std::lock_guard<std::mutex> lock(mutex);
+        samples.push_back({u.x, u.y});
+        return Spectrum(0.f);
+    }
+
+    mutable std::mutex mutex;
+    mutable std::vector<std::pair<Float, Float>> samples;
+};
+
+}  // namespace
+
+TEST(SamplerIntegrator, PassesDrawNewSamples) {
+    char dir[] = "/tmp/pbrt-integrator-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    const std::string image = std::string(dir) + "/test.pfm";
+
+    ParallelInit();
+    PbrtOptions.quiet = true;
+    PbrtOptions.progressiveSamples = 2;
+
+    const Point2i resolution(20, 20);
+    const int spp = 4;
+    Film *film = new Film(resolution, Bounds2f(Point2f(0, 0), Point2f(1, 1)),
+                          std::unique_ptr<Filter>(
+                              new BoxFilter(Vector2f(0.5, 0.5))),
+                          35., image, 1.);
+    Transform identity;
+    AnimatedTransform cameraToWorld(&identity, 0, &identity, 1);
+    std::shared_ptr<Camera> camera = std::make_shared<OrthographicCamera>(
+        cameraToWorld, Bounds2f(Point2f(-1, -1), Point2f(1, 1)), 0., 1., 0.,
+        10., film, nullptr);
+    std::shared_ptr<Sampler> sampler = std::make_shared<RandomSampler>(spp);
+    RecordingIntegrator integrator(camera, sampler, film->croppedPixelBounds);
+
+    Scene scene(std::make_shared<BVHAccel>(
+                    std::vector<std::shared_ptr<Primitive>>()),
+                {});
+    integrator.Render(scene);
+
+    // Two passes of two samples for every pixel, none of them repeated
+    std::vector<std::pair<Float, Float>> &samples = integrator.samples;
+    EXPECT_EQ(resolution.x * resolution.y * spp, samples.size());
+    std::sort(samples.begin(), samples.end());
+    EXPECT_TRUE(std::adjacent_find(samples.begin(), samples.end()) ==
+                samples.end());
+
+    PbrtOptions.progressiveSamples = 0;
+    PbrtOptions.quiet = false;
+    ParallelCleanup();
+    unlink(image.c_str());
+    rmdir(dir);
+}
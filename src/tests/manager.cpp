@@ -0,0 +1,85 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "cloud/manager.h"
+#include "messages/utils.h"
+#include "pbrt.pb.h"
+#include "util/path.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace pbrt;
+
+TEST(SceneManager, InputHash) {
+    auto hashOf = [](const uint32_t a, const float b) {
+        SceneManager::InputHash hash;
+        hash.add(a);
+        hash.add(b);
+        return hash.value();
+    };
+
+    EXPECT_EQ(hashOf(1, 2.f), hashOf(1, 2.f));
+    EXPECT_NE(hashOf(1, 2.f), hashOf(2, 2.f));
+    EXPECT_NE(hashOf(1, 2.f), hashOf(1, 2.5f));
+    EXPECT_NE(0, SceneManager::InputHash().value());
+}
+
+TEST(SceneManager, IncrementalDump) {
+    char dir[] = "/tmp/pbrt-manager-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+
+    // The previous dump had two treelets.
+    uint64_t oldHashes[2];
+    {
+        SceneManager manager;
+        manager.init(dir);
+
+        protobuf::Manifest manifest;
+        for (uint32_t id = 0; id < 2; id++) {
+            const std::string path =
+                manager.getFilePath(ObjectType::Treelet, id);
+            roost::atomic_create("treelet " + std::to_string(id), path);
+            oldHashes[id] = SceneManager::hashFile(path);
+
+            protobuf::Manifest::Object *obj = manifest.add_objects();
+            *obj->mutable_id() =
+                to_protobuf(ObjectKey{ObjectType::Treelet, id});
+            obj->set_hash(oldHashes[id]);
+            obj->set_input_hash(100 + id);
+        }
+
+        manager.GetWriter(ObjectType::Manifest)->write(manifest);
+    }
+
+    // The new one has only one, built from the same inputs.
+    SceneManager manager;
+    manager.init(dir);
+    manager.loadPreviousHashes();
+    EXPECT_EQ(0, manager.getNextId(ObjectType::Treelet));
+
+    EXPECT_FALSE(manager.reuseBuiltObject({ObjectType::Treelet, 0}, 101));
+    EXPECT_TRUE(manager.reuseBuiltObject({ObjectType::Treelet, 0}, 100));
+
+    manager.removeStaleObjects();
+    EXPECT_TRUE(roost::exists(manager.getFilePath(ObjectType::Treelet, 0)));
+    EXPECT_FALSE(roost::exists(manager.getFilePath(ObjectType::Treelet, 1)));
+
+    protobuf::Manifest manifest = manager.makeManifest();
+    ASSERT_EQ(1, manifest.objects_size());
+    EXPECT_EQ(oldHashes[0], manifest.objects(0).hash());
+    EXPECT_EQ(100, manifest.objects(0).input_hash());
+
+    // A treelet that had to be built again records its new input hash.
+    const std::string path = manager.getFilePath(ObjectType::Treelet, 0);
+    roost::atomic_create("treelet 0, changed", path + ".new");
+    manager.commitObject(ObjectType::Treelet, 0, path + ".new", 102);
+
+    manifest = manager.makeManifest();
+    EXPECT_EQ(SceneManager::hashFile(path), manifest.objects(0).hash());
+    EXPECT_EQ(102, manifest.objects(0).input_hash());
+
+    roost::remove(path);
+    roost::remove(manager.getFilePath(ObjectType::Manifest, 0));
+    rmdir(dir);
+}
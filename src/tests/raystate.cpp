@@ -0,0 +1,362 @@
+
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "rng.h"
+#include "pbrt/raystate.h"
+#include "cloud/raypacket.h"
+#include "primitive.h"
+#include "shapes/triangle.h"
+
+#include <thread>
+
+using namespace pbrt;
+
+static Vector3f RandomVector(RNG &rng, Float scale) {
+    return scale * Vector3f(rng.UniformFloat() - .5f, rng.UniformFloat() - .5f,
+                            rng.UniformFloat() - .5f);
+}
+
+static Point3f RandomPoint(RNG &rng, Float scale) {
+    return Point3f(0, 0, 0) + RandomVector(rng, scale);
+}
+
+static void ExpectNear(const Vector3f &expected, const Vector3f &actual,
+                       Float tolerance) {
+    EXPECT_NEAR(expected.x, actual.x, tolerance);
+    EXPECT_NEAR(expected.y, actual.y, tolerance);
+    EXPECT_NEAR(expected.z, actual.z, tolerance);
+}
+
+static RayState RandomRay(RNG &rng, int trial) {
+    RayState state;
+    state.trackRay = false;
+    state.isShadowRay = (trial % 3) == 1;
+    state.isLightRay = (trial % 5) == 2;
+    state.hit = (trial % 3) == 2;
+    state.remainingBounces = trial % 7;
+    state.hop = trial % 11;
+    state.pathHop = trial % 13;
+    state.beta = (trial % 2) ? Spectrum(rng.UniformFloat()) : Spectrum(1.f);
+    state.Ld = (trial % 4) ? Spectrum(0.f) : Spectrum(rng.UniformFloat());
+
+    state.sample.id = uint64_t(trial) * 7919;
+    state.sample.dim = trial % 32;
+    state.sample.pFilm = Point2f(rng.UniformFloat(), rng.UniformFloat());
+    state.sample.weight = rng.UniformFloat();
+
+    Vector3f d = Normalize(RandomVector(rng, 1));
+    if (state.isShadowRay) d *= 10 * rng.UniformFloat();
+
+    state.ray = RayDifferential(RandomPoint(rng, 100), d,
+                                1000 * rng.UniformFloat());
+    state.ray.hasDifferentials = (trial % 2) == 0;
+    if (state.ray.hasDifferentials) {
+        state.ray.rxOrigin = RandomPoint(rng, 100);
+        state.ray.ryOrigin = RandomPoint(rng, 100);
+        state.ray.rxDirection = RandomVector(rng, 1);
+        state.ray.ryDirection = RandomVector(rng, 1);
+    }
+
+    if (state.isLightRay) {
+        state.lightRayInfo.sampledLightId = trial;
+        state.lightRayInfo.sampledDirection = Normalize(RandomVector(rng, 1));
+    }
+
+    if (state.hit && !state.isShadowRay) {
+        state.EnsureHitInfo();
+        state.hitInfo->material.treelet = trial;
+        state.hitInfo->material.id = trial * 3;
+        state.hitInfo->arealight = trial % 2;
+        state.hitInfo->isect.p = RandomPoint(rng, 100);
+        state.hitInfo->isect.n = Normal3f(Normalize(RandomVector(rng, 1)));
+        state.hitInfo->isect.shading.n = state.hitInfo->isect.n;
+        state.hitInfo->isect.uv = Point2f(rng.UniformFloat(), .5f);
+        state.hitInfo->isect.faceIndex = trial;
+        state.hitInfo->isect.shape =
+            RayState::OrientationShape((trial % 4) == 2);
+    }
+
+    /* now and then a stack that spills over onto the heap */
+    state.toVisit.resize(trial % 50 == 49 ? 200 : trial % 20);
+    for (size_t i = 0; i < state.toVisit.size(); i++) {
+        state.toVisit[i].treelet = rng.UniformUInt32(1000);
+        state.toVisit[i].node = rng.UniformUInt32(1 << 20);
+        state.toVisit[i].primitive = rng.UniformUInt32(256);
+        state.toVisit[i].transformed = (trial % 4) == 3;
+    }
+
+    if (!state.toVisitEmpty() && state.toVisitTop().transformed) {
+        state.EnsureRayTransform() = Translate(RandomVector(rng, 10)) *
+                                     RotateY(360 * rng.UniformFloat()) *
+                                     Scale(2, 3, 4);
+    }
+
+    return state;
+}
+
+TEST(RayState, CompactRoundTrip) {
+    RNG rng;
+    std::unique_ptr<char[]> buffer{new char[RayState::MaxBufferSize + 4]};
+
+    for (int trial = 0; trial < 1000; ++trial) {
+        RayState expected = RandomRay(rng, trial);
+        const size_t len =
+            expected.Serialize(buffer.get(), RayState::Format::Compact);
+        EXPECT_LE(len, expected.MaxCompressedSize(RayState::Format::Compact));
+
+        RayState actual;
+        actual.Deserialize(buffer.get() + 4, len - 4,
+                           RayState::Format::Compact);
+
+        EXPECT_EQ(expected.isShadowRay, actual.isShadowRay);
+        EXPECT_EQ(expected.isLightRay, actual.isLightRay);
+        EXPECT_EQ(expected.hit, actual.hit);
+        EXPECT_EQ(expected.remainingBounces, actual.remainingBounces);
+        EXPECT_EQ(expected.hop, actual.hop);
+        EXPECT_EQ(expected.pathHop, actual.pathHop);
+        EXPECT_TRUE(expected.beta == actual.beta);
+        EXPECT_TRUE(expected.Ld == actual.Ld);
+        EXPECT_EQ(expected.sample.id, actual.sample.id);
+        EXPECT_EQ(expected.sample.dim, actual.sample.dim);
+        EXPECT_EQ(expected.sample.pFilm, actual.sample.pFilm);
+
+        EXPECT_EQ(expected.ray.o, actual.ray.o);
+        EXPECT_EQ(expected.ray.tMax, actual.ray.tMax);
+        ExpectNear(expected.ray.d, actual.ray.d,
+                   1e-5f * expected.ray.d.Length());
+        EXPECT_EQ(expected.ray.hasDifferentials, actual.ray.hasDifferentials);
+        if (expected.ray.hasDifferentials) {
+            EXPECT_EQ(expected.ray.ryOrigin, actual.ray.ryOrigin);
+            EXPECT_EQ(expected.ray.ryDirection, actual.ray.ryDirection);
+        }
+
+        if (expected.isLightRay) {
+            ExpectNear(expected.lightRayInfo.sampledDirection,
+                       actual.lightRayInfo.sampledDirection, 1e-5f);
+        }
+
+        if (expected.hit && !expected.isShadowRay) {
+            EXPECT_EQ(expected.hitInfo->material.id,
+                      actual.hitInfo->material.id);
+            EXPECT_EQ(expected.hitInfo->isect.p, actual.hitInfo->isect.p);
+            EXPECT_EQ(expected.hitInfo->isect.faceIndex,
+                      actual.hitInfo->isect.faceIndex);
+            EXPECT_EQ(expected.hitInfo->isect.shape,
+                      actual.hitInfo->isect.shape);
+            EXPECT_EQ(nullptr, actual.hitInfo->isect.primitive);
+            ExpectNear(Vector3f(expected.hitInfo->isect.n),
+                       Vector3f(actual.hitInfo->isect.n), 1e-5f);
+        }
+
+        ASSERT_EQ(expected.toVisit.size(), actual.toVisit.size());
+        for (size_t i = 0; i < expected.toVisit.size(); i++) {
+            EXPECT_EQ(expected.toVisit[i].treelet, actual.toVisit[i].treelet);
+            EXPECT_EQ(expected.toVisit[i].node, actual.toVisit[i].node);
+            EXPECT_EQ(expected.toVisit[i].primitive,
+                      actual.toVisit[i].primitive);
+            EXPECT_EQ(expected.toVisit[i].transformed,
+                      actual.toVisit[i].transformed);
+        }
+
+        if (!expected.toVisitEmpty() && expected.toVisitTop().transformed) {
+            EXPECT_TRUE(expected.rayTransform->GetMatrix() ==
+                        actual.rayTransform->GetMatrix());
+        }
+    }
+}
+
+TEST(RayState, HitKeepsOnlyOrientation) {
+    Transform identity;
+    const int indices[3] = {0, 1, 2};
+    const Point3f p[3] = {Point3f(0, 0, 0), Point3f(1, 0, 0),
+                          Point3f(0, 1, 0)};
+    auto mesh = std::make_shared<TriangleMesh>(identity, 1, indices, 3, p,
+                                               nullptr, nullptr, nullptr,
+                                               nullptr, nullptr, nullptr);
+    std::unique_ptr<char[]> buffer{new char[RayState::MaxBufferSize + 4]};
+
+    for (bool reverse : {false, true}) {
+        Triangle triangle(&identity, &identity, reverse, mesh, 0);
+        GeometricPrimitive primitive(
+            std::shared_ptr<Shape>(&triangle, [](Shape *) {}), nullptr,
+            nullptr, MediumInterface());
+
+        SurfaceInteraction isect;
+        isect.shape = &triangle;
+        isect.primitive = &primitive;
+
+        RayState state;
+        state.SetHit(RayState::TreeletNode{}, isect, MaterialKey{}, 0);
+
+        // Nothing of the hit treelet is left for shading to read
+        EXPECT_EQ(nullptr, state.hitInfo->isect.primitive);
+        EXPECT_EQ(RayState::OrientationShape(reverse),
+                  state.hitInfo->isect.shape);
+        EXPECT_EQ(reverse, state.hitInfo->isect.shape->reverseOrientation);
+
+        for (auto format : {RayState::Format::Packed,
+                            RayState::Format::Compact}) {
+            const size_t len = state.Serialize(buffer.get(), format);
+            RayState actual;
+            actual.Deserialize(buffer.get() + 4, len - 4, format);
+            ASSERT_TRUE(actual.hitInfo != nullptr);
+            EXPECT_EQ(RayState::OrientationShape(reverse),
+                      actual.hitInfo->isect.shape);
+        }
+    }
+}
+
+TEST(RayState, CompactIsSmaller) {
+    RNG rng;
+    std::unique_ptr<char[]> buffer{new char[RayState::MaxBufferSize + 4]};
+
+    for (int trial = 0; trial < 100; ++trial) {
+        RayState state = RandomRay(rng, trial);
+        EXPECT_LT(state.Serialize(buffer.get(), RayState::Format::Compact),
+                  state.Serialize(buffer.get(), RayState::Format::Packed));
+    }
+}
+
+TEST(RayState, CompactRejectsUnknownVersion) {
+    RNG rng;
+    std::unique_ptr<char[]> buffer{new char[RayState::MaxBufferSize + 4]};
+
+    RayState state = RandomRay(rng, 0);
+    const size_t len = state.Serialize(buffer.get(), RayState::Format::Compact);
+    buffer[4] = 1;
+    EXPECT_THROW(state.Deserialize(buffer.get() + 4, len - 4,
+                                   RayState::Format::Compact),
+                 std::runtime_error);
+}
+
+TEST(RayState, CompactRejectsTruncated) {
+    RNG rng;
+    std::unique_ptr<char[]> buffer{new char[RayState::MaxBufferSize + 4]};
+
+    for (int trial = 0; trial < 12; ++trial) {
+        RayState state = RandomRay(rng, trial);
+        const size_t len =
+            state.Serialize(buffer.get(), RayState::Format::Compact);
+
+        RayState actual;
+        for (size_t cut = 4; cut < len; ++cut) {
+            EXPECT_THROW(actual.Deserialize(buffer.get() + 4, cut - 4,
+                                            RayState::Format::Compact),
+                         std::runtime_error);
+        }
+    }
+}
+
+TEST(RayState, DeepStacks) {
+    std::unique_ptr<char[]> buffer{new char[RayState::MaxBufferSize + 4]};
+
+    RayState state;
+    for (size_t i = 0; i < RayState::MaxToVisit; i++) {
+        state.toVisitPush({uint32_t(i % 3), uint32_t(i), 0, false});
+    }
+
+    for (const auto format :
+         {RayState::Format::Packed, RayState::Format::Compact}) {
+        const size_t len = state.Serialize(buffer.get(), format);
+        EXPECT_LE(len, RayState::MaxBufferSize + 4);
+
+        RayState actual;
+        actual.Deserialize(buffer.get() + 4, len - 4, format);
+        ASSERT_EQ(RayState::MaxToVisit, actual.toVisit.size());
+        for (size_t i = 0; i < RayState::MaxToVisit; i++) {
+            EXPECT_EQ(i % 3, actual.toVisit[i].treelet);
+            EXPECT_EQ(i, actual.toVisit[i].node);
+        }
+    }
+
+    /* one entry more doesn't fit in a serialized ray */
+    state.toVisitPush({});
+    for (const auto format :
+         {RayState::Format::Packed, RayState::Format::Compact}) {
+        EXPECT_THROW(state.Serialize(buffer.get(), format),
+                     std::runtime_error);
+    }
+}
+
+TEST(RayState, PacketRoundTrip) {
+    RNG rng;
+    std::vector<RayState> rays;
+    RayPacket::Writer writer;
+
+    for (int trial = 0; trial < 300; ++trial) {
+        rays.push_back(RandomRay(rng, trial));
+        writer.Add(rays.back());
+    }
+
+    EXPECT_EQ(300, writer.Count());
+    const std::string packet = writer.Finish();
+    EXPECT_TRUE(writer.Empty());
+
+    RayPacket::Reader reader{packet};
+    EXPECT_EQ(rays.size(), reader.Count());
+    EXPECT_EQ(rays[0].CurrentTreelet(), reader.Treelet());
+
+    RayState actual;
+    for (const RayState &expected : rays) {
+        ASSERT_TRUE(reader.Next(actual));
+        EXPECT_EQ(expected.sample.id, actual.sample.id);
+        EXPECT_EQ(expected.ray.o, actual.ray.o);
+        EXPECT_EQ(expected.hit, actual.hit);
+        EXPECT_EQ(expected.hitInfo != nullptr, actual.hitInfo != nullptr);
+        ASSERT_EQ(expected.toVisit.size(), actual.toVisit.size());
+        for (size_t i = 0; i < expected.toVisit.size(); i++) {
+            EXPECT_EQ(expected.toVisit[i].treelet, actual.toVisit[i].treelet);
+            EXPECT_EQ(expected.toVisit[i].node, actual.toVisit[i].node);
+        }
+    }
+
+    EXPECT_FALSE(reader.Next(actual));
+}
+
+TEST(RayState, PoolRecyclesRays) {
+    RayStatePtr first = RayState::Create();
+    first->hit = true;
+    first->sample.id = 42;
+    first->toVisitPush({});
+    const RayState *address = first.get();
+    first.reset();
+
+    RayStatePtr second = RayState::Create();
+    EXPECT_EQ(address, second.get());
+
+    // A recycled ray must look like a new one.
+    EXPECT_FALSE(second->hit);
+    EXPECT_TRUE(second->toVisitEmpty());
+    EXPECT_EQ(0, second->sample.id);
+}
+
+TEST(RayState, FreedAfterThreadExit) {
+    std::thread([] {
+        // Constructed before the thread's pools, so destroyed after them
+        static thread_local std::vector<RayStatePtr> held;
+
+        RayState::Create().reset();
+        held.push_back(RayState::Create());
+        held.back()->EnsureHitInfo();
+        held.back()->EnsureRayTransform();
+        held.push_back(RayState::Create());
+    }).join();
+}
+
+TEST(RayState, PacketRejectsMissingRays) {
+    RNG rng;
+    RayPacket::Writer writer;
+    for (int trial = 0; trial < 3; ++trial) writer.Add(RandomRay(rng, trial));
+    std::string packet = writer.Finish();
+
+    // A packet that claims more rays than it holds.
+    RayPacket::Header header;
+    memcpy(&header, &packet[0], sizeof(header));
+    header.count++;
+    memcpy(&packet[0], &header, sizeof(header));
+
+    RayPacket::Reader reader{packet};
+    RayState actual;
+    for (int i = 0; i < 3; ++i) ASSERT_TRUE(reader.Next(actual));
+    EXPECT_THROW(reader.Next(actual), std::runtime_error);
+}
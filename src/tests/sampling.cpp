@@ -6,6 +6,7 @@
 #include "rng.h"
 #include "sampling.h"
 #include "lowdiscrepancy.h"
+#include "samplers/halton.h"
 #include "samplers/maxmin.h"
 #include "samplers/sobol.h"
 #include "samplers/zerotwosequence.h"
@@ -184,9 +185,49 @@ TEST(LowDiscrepancy, ElementaryIntervals) {
                                   1 << logSamples,
                                   Bounds2i(Point2i(0, 0), Point2i(10, 10)))),
                      logSamples);
+        checkSampler("CloudZeroTwoSequenceSampler",
+                     std::unique_ptr<Sampler>(
+                         new CloudZeroTwoSequenceSampler(1 << logSamples)),
+                     logSamples);
     }
 }
 
+TEST(GlobalSampler, StreamMatchesSampler) {
+    const Bounds2i bounds(Point2i(0, 0), Point2i(20, 12));
+
+    auto check = [&bounds](const char *name, GlobalSampler &sampler) {
+        for (Point2i pixel : bounds) {
+            for (int64_t sampleNum = 0; sampleNum < sampler.samplesPerPixel;
+                 ++sampleNum) {
+                sampler.StartPixel(pixel);
+                sampler.SetSampleNumber(sampleNum);
+                sampler.SetDimension(3);
+
+                // The stream starts where a ray would pick its path up
+                GlobalSampler::Stream stream(sampler, pixel, sampleNum, 3);
+
+                for (int i = 0; i < 6; ++i) {
+                    EXPECT_EQ(sampler.Get1D(), stream.Get1D())
+                        << "Sampler " << name;
+                    EXPECT_EQ(sampler.Get2D(), stream.Get2D())
+                        << "Sampler " << name;
+                }
+
+                EXPECT_EQ(sampler.GetCurrentDimension(),
+                          stream.GetCurrentDimension());
+            }
+        }
+    };
+
+    HaltonSampler halton(8, bounds);
+    SobolSampler sobol(8, bounds);
+    CloudZeroTwoSequenceSampler zeroTwo(8);
+
+    check("Halton", halton);
+    check("Sobol", sobol);
+    check("CloudZeroTwoSequenceSampler", zeroTwo);
+}
+
 TEST(MaxMinDist, MinDist) {
     // We use a silly O(n^2) distance check below, so don't go all the way up
     // to 2^16 samples.
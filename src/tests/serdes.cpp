@@ -0,0 +1,111 @@
+#include "tests/gtest/gtest.h"
+#include <algorithm>
+#include "pbrt.h"
+#include "interaction.h"
+#include "material.h"
+#include "memory.h"
+#include "paramset.h"
+#include "reflection.h"
+#include "textures/constant.h"
+#include "messages/serdes.h"
+#include "messages/utils.h"
+#include "pbrt.pb.h"
+
+using namespace pbrt;
+
+static SurfaceInteraction MakeInteraction() {
+    return SurfaceInteraction(Point3f(0, 0, 0), Vector3f(0, 0, 0),
+                              Point2f(.5f, .5f), Vector3f(0, 0, 1),
+                              Vector3f(1, 0, 0), Vector3f(0, 1, 0),
+                              Normal3f(0, 0, 0), Normal3f(0, 0, 0), 0, nullptr);
+}
+
+static protobuf::Material MakeMatte(const std::vector<std::string> &order) {
+    ParamSet params;
+    params.AddTexture("Kd", "red");
+    params.AddTexture("sigma", "rough");
+
+    protobuf::Material material;
+    material.set_name("matte");
+    *material.mutable_material_params() = to_protobuf(params);
+
+    auto &floats = *material.mutable_float_textures();
+    auto &spectra = *material.mutable_spectrum_textures();
+    for (const std::string &name : order) {
+        if (name == "red")
+            spectra[name] = 1;
+        else
+            floats[name] = name == "rough" ? 2 : 3;
+    }
+    return material;
+}
+
+TEST(Serdes, MaterialIsDeterministic) {
+    std::vector<std::string> names{"red", "rough"};
+    for (int i = 0; i < 20; ++i) names.push_back("unused" + std::to_string(i));
+
+    const std::string expected = serdes::material::serialize(MakeMatte(names));
+    std::reverse(names.begin(), names.end());
+    EXPECT_EQ(expected, serdes::material::serialize(MakeMatte(names)));
+}
+
+TEST(Serdes, MaterialRoundTrip) {
+    const std::string data =
+        serdes::material::serialize(MakeMatte({"red", "rough"}));
+    ASSERT_TRUE(serdes::flat::is_flat(data.data(), data.size()));
+
+    std::map<uint64_t, std::shared_ptr<Texture<Float>>> ftex{
+        {2, std::make_shared<ConstantTexture<Float>>(20.f)}};
+    std::map<uint64_t, std::shared_ptr<Texture<Spectrum>>> stex{
+        {1, std::make_shared<ConstantTexture<Spectrum>>(Spectrum(.5f))}};
+
+    std::shared_ptr<Material> material =
+        serdes::material::deserialize(data.data(), data.size(), ftex, stex);
+    ASSERT_TRUE(material != nullptr);
+    EXPECT_EQ(MaterialType::Matte, material->GetType());
+
+    // At normal incidence, Oren-Nayar is Lambertian scaled by A(sigma).
+    MemoryArena arena;
+    SurfaceInteraction si = MakeInteraction();
+    material->ComputeScatteringFunctions(&si, arena, TransportMode::Radiance,
+                                         true);
+    ASSERT_TRUE(si.bsdf != nullptr);
+
+    const Float sigma2 = Radians(20.f) * Radians(20.f);
+    const Float A = 1 - sigma2 / (2 * (sigma2 + .33f));
+    const Spectrum f = si.bsdf->f(Vector3f(0, 0, 1), Vector3f(0, 0, 1));
+    EXPECT_NEAR(.5f * InvPi * A, f[0], 1e-5f);
+}
+
+TEST(Serdes, TextureRoundTrip) {
+    SurfaceInteraction si = MakeInteraction();
+
+    ParamSet floatParams;
+    std::unique_ptr<Float[]> value(new Float[1]{.25f});
+    floatParams.AddFloat("value", std::move(value), 1);
+    const std::string floatData = serdes::float_texture::serialize(
+        float_texture::to_protobuf("constant", Transform(), floatParams));
+    ASSERT_TRUE(serdes::flat::is_flat(floatData.data(), floatData.size()));
+    EXPECT_EQ(.25f, serdes::float_texture::deserialize(floatData.data(),
+                                                       floatData.size())
+                        ->Evaluate(si));
+
+    ParamSet spectrumParams;
+    std::unique_ptr<Float[]> rgb(new Float[3]{.1f, .2f, .3f});
+    spectrumParams.AddRGBSpectrum("value", std::move(rgb), 3);
+    const std::string spectrumData = serdes::spectrum_texture::serialize(
+        spectrum_texture::to_protobuf("constant", Transform(), spectrumParams));
+    const Spectrum s = serdes::spectrum_texture::deserialize(
+                           spectrumData.data(), spectrumData.size())
+                           ->Evaluate(si);
+    Float actual[3];
+    s.ToRGB(actual);
+    EXPECT_NEAR(.1f, actual[0], 1e-6f);
+    EXPECT_NEAR(.2f, actual[1], 1e-6f);
+    EXPECT_NEAR(.3f, actual[2], 1e-6f);
+
+    // A truncated record is rejected.
+    EXPECT_THROW(serdes::float_texture::deserialize(floatData.data(),
+                                                    floatData.size() - 1),
+                 std::runtime_error);
+}
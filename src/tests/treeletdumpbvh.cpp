@@ -0,0 +1,200 @@
+#include "tests/gtest/gtest.h"
+#include "pbrt.h"
+#include "rng.h"
+#include "parallel.h"
+#include "primitive.h"
+#include "accelerators/cloud.h"
+#include "cloud/treeletdumpbvh.h"
+#include "shapes/triangle.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace pbrt;
+
+namespace {
+
+// Two clusters of small random triangles, one on either side of x = 0
+std::vector<std::shared_ptr<Primitive>> MakeClusters(int trisPerCluster) {
+    static Transform identity;
+    RNG rng;
+    int nTris = 2 * trisPerCluster;
+    std::vector<int> indices(3 * nTris);
+    std::vector<Point3f> P(3 * nTris);
+    for (int t = 0; t < nTris; ++t) {
+        Float x0 = t < trisPerCluster ? -10 : 8;
+        Point3f o(x0 + 2 * rng.UniformFloat(), 2 * rng.UniformFloat(),
+                  2 * rng.UniformFloat());
+        for (int v = 0; v < 3; ++v) {
+            indices[3 * t + v] = 3 * t + v;
+            P[3 * t + v] = o + Vector3f(.2f * rng.UniformFloat(),
+                                        .2f * rng.UniformFloat(),
+                                        .2f * rng.UniformFloat());
+        }
+    }
+
+    std::vector<std::shared_ptr<Primitive>> prims;
+    for (const std::shared_ptr<Shape> &shape :
+         CreateTriangleMesh(&identity, &identity, false, nTris,
+                            indices.data(), P.size(), P.data(), nullptr,
+                            nullptr, nullptr, nullptr, nullptr)) {
+        prims.push_back(std::make_shared<GeometricPrimitive>(
+            shape, nullptr, nullptr, MediumInterface()));
+    }
+    return prims;
+}
+
+std::unique_ptr<TreeletDumpBVH> MakeBVH(int trisPerCluster,
+                                        int maxTreeletBytes,
+                                        const std::string &profile,
+                                        const std::string &recordProfile) {
+    return std::unique_ptr<TreeletDumpBVH>(new TreeletDumpBVH(
+        MakeClusters(trisPerCluster), maxTreeletBytes, 0, true, false,
+        TreeletDumpBVH::TraversalAlgorithm::SendCheck,
+        TreeletDumpBVH::PartitionAlgorithm::OneByOne, 1,
+        BVHAccel::SplitMethod::SAH, 2, profile, recordProfile));
+}
+
+// Rays towards +z, all in the same octant, through the corner of the
+// cluster at _x0_
+void TraceCorner(const TreeletDumpBVH &bvh, Float x0, int nRays) {
+    RNG rng;
+    for (int i = 0; i < nRays; ++i) {
+        Ray ray(Point3f(x0 + .1f * rng.UniformFloat(),
+                        .1f * rng.UniformFloat(), -5),
+                Vector3f(0, 0, 1));
+        SurfaceInteraction isect;
+        bvh.Intersect(ray, &isect);
+    }
+}
+
+bool SameProfile(const TreeletDumpBVH::TransitionProfile &a,
+                 const TreeletDumpBVH::TransitionProfile &b) {
+    return a.rays == b.rays && a.counts == b.counts && a.visits == b.visits;
+}
+
+}  // namespace
+
+TEST(TreeletDumpBVH, ProfileRoundTrip) {
+    char dir[] = "/tmp/pbrt-treeletdumpbvh-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    const std::string first = std::string(dir) + "/first";
+    const std::string second = std::string(dir) + "/second";
+    ParallelInit();
+
+    // Record rays in every octant
+    auto trace = [](const TreeletDumpBVH &bvh) {
+        RNG rng;
+        for (int i = 0; i < 800; ++i) {
+            Vector3f d(rng.UniformFloat() - .5f, rng.UniformFloat() - .5f,
+                       rng.UniformFloat() - .5f);
+            d[i % 3] = (i / 3) % 2 ? -1 : 1;
+            Ray ray(Point3f(0, 1, 1) - 20 * d, d);
+            SurfaceInteraction isect;
+            bvh.Intersect(ray, &isect);
+        }
+    };
+    {
+        std::unique_ptr<TreeletDumpBVH> bvh = MakeBVH(32, 1 << 20, "", first);
+        trace(*bvh);
+    }
+
+    // Loading a profile and recording the same rays again reproduces it
+    std::unique_ptr<TreeletDumpBVH> loaded =
+        MakeBVH(32, 1 << 20, first, second);
+    const TreeletDumpBVH::TransitionProfile &profile = loaded->GetProfile();
+    uint64_t totalRays = 0;
+    for (int octant = 0; octant < 8; ++octant) {
+        EXPECT_GT(profile.rays[octant], 0) << octant;
+        EXPECT_EQ(profile.rays[octant], profile.visits[octant][0]);
+        totalRays += profile.rays[octant];
+    }
+    EXPECT_EQ(800, totalRays);
+    trace(*loaded);
+    TreeletDumpBVH::TransitionProfile expected = loaded->GetProfile();
+    loaded.reset();
+
+    std::unique_ptr<TreeletDumpBVH> reloaded = MakeBVH(32, 1 << 20, second, "");
+    EXPECT_TRUE(SameProfile(expected, reloaded->GetProfile()));
+
+    // A profile of a different BVH is ignored
+    std::unique_ptr<TreeletDumpBVH> other = MakeBVH(16, 1 << 20, first, "");
+    for (int octant = 0; octant < 8; ++octant)
+        EXPECT_EQ(0, other->GetProfile().rays[octant]);
+
+    ParallelCleanup();
+    EXPECT_EQ(0, unlink(first.c_str()));
+    EXPECT_EQ(0, unlink(second.c_str()));
+    rmdir(dir);
+}
+
+TEST(TreeletDumpBVH, ApplyProfileAssignsTreelets) {
+    char dir[] = "/tmp/pbrt-treeletdumpbvh-XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    ParallelInit();
+
+    // Treelets too small to hold both clusters
+    const int maxTreeletBytes = 4096;
+    const int octant = RayOctant(Vector3f(0, 0, 1));
+    std::unique_ptr<TreeletDumpBVH> estimated =
+        MakeBVH(32, maxTreeletBytes, "", "");
+    const std::vector<uint32_t> &estimatedTreelets =
+        estimated->GetTreeletAllocations()[octant];
+
+    bool changed = false;
+    for (Float x0 : {-10.f, 9.9f}) {
+        const std::string path = std::string(dir) + "/profile";
+        {
+            std::unique_ptr<TreeletDumpBVH> bvh =
+                MakeBVH(32, maxTreeletBytes, "", path);
+            TraceCorner(*bvh, x0, 100);
+        }
+
+        // Every node the rays visited is put in the root treelet
+        std::unique_ptr<TreeletDumpBVH> profiled =
+            MakeBVH(32, maxTreeletBytes, path, "");
+        const std::vector<uint64_t> &visits =
+            profiled->GetProfile().visits[octant];
+        const std::vector<uint32_t> &treelets =
+            profiled->GetTreeletAllocations()[octant];
+        ASSERT_EQ(visits.size(), treelets.size());
+        for (size_t node = 0; node < visits.size(); ++node) {
+            if (visits[node] == 0) continue;
+            EXPECT_EQ(treelets[0], treelets[node]) << "node " << node;
+            if (estimatedTreelets[node] != estimatedTreelets[0])
+                changed = true;
+        }
+        EXPECT_EQ(0, unlink(path.c_str()));
+    }
+
+    // Surface area alone can't favor both clusters at once
+    EXPECT_TRUE(changed);
+
+    ParallelCleanup();
+    rmdir(dir);
+}
+
+TEST(TreeletDumpBVH, RayOctantMatchesComputeIdx) {
+    RNG rng;
+    PbrtOptions.directionalTreelets = true;
+    for (unsigned idx = 0; idx < 8; ++idx) {
+        EXPECT_EQ(idx, RayOctant(ComputeRayDir(idx)));
+        EXPECT_EQ(idx, ComputeIdx(ComputeRayDir(idx)));
+    }
+
+    // The dumped BVH picks octants by the inverse direction, the cloud BVH
+    // by the direction itself; both have to agree, signed zeros included
+    const Float values[] = {-1, -0.f, 0.f, 1};
+    for (int i = 0; i < 1000; ++i) {
+        Vector3f d(rng.UniformFloat() - .5f, rng.UniformFloat() - .5f,
+                   rng.UniformFloat() - .5f);
+        if (i < 64)
+            d = Vector3f(values[i % 4], values[i / 4 % 4], values[i / 16]);
+        Vector3f invDir(1 / d.x, 1 / d.y, 1 / d.z);
+        EXPECT_EQ(RayOctant(invDir), ComputeIdx(d)) << d;
+        EXPECT_EQ(RayOctant(d), ComputeIdx(d)) << d;
+    }
+
+    PbrtOptions.directionalTreelets = false;
+    EXPECT_EQ(0, ComputeIdx(Vector3f(1, 1, 1)));
+}
@@ -71,7 +71,8 @@ class : public PtexInputHandler {
   public:
     Handle open(const char *path) override {
         auto t = global::manager.getInMemoryTexture(path);
-        return reinterpret_cast<Handle>(new OpenedTexture(t.first, t.second));
+        return reinterpret_cast<Handle>(
+            new OpenedTexture(std::move(t.first), t.second));
     }
 
     void seek(Handle handle, int64_t pos) override {
@@ -80,7 +81,7 @@ class : public PtexInputHandler {
 
     size_t read(void *buffer, size_t size, Handle handle) override {
         auto h = reinterpret_cast<OpenedTexture *>(handle);
-        const auto ptr = h->data + h->pos;
+        const auto ptr = h->data.get() + h->pos;
         const size_t len =
             (h->pos + size > h->length) ? (h->length - h->pos) : size;
         if (len > 0) {
@@ -104,10 +105,12 @@ class : public PtexInputHandler {
 
   private:
     struct OpenedTexture {
-        OpenedTexture(const char *data, const size_t length)
-            : data(data), length(length) {}
+        OpenedTexture(std::shared_ptr<const char> data, const size_t length)
+            : data(std::move(data)), length(length) {}
 
-        const char *data;
+        /* keeps the texture alive even if its treelet is evicted while the
+         * file is open */
+        std::shared_ptr<const char> data;
         size_t length;
         int64_t pos{0};
     };
@@ -0,0 +1,50 @@
+#include "mmap.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <iostream>
+
+#include "exception.h"
+#include "file_descriptor.h"
+
+using namespace std;
+using namespace pbrt;
+
+MMap_Region::MMap_Region(char* const addr, const size_t length, const int prot,
+                         const int flags, const int fd, const off_t offset)
+    : addr_(static_cast<char*>(mmap(addr, length, prot, flags, fd, offset))),
+      length_(length) {
+    if (addr_ == MAP_FAILED) {
+        throw unix_error("mmap");
+    }
+}
+
+MMap_Region::~MMap_Region() {
+    if (addr_) {
+        try {
+            CheckSystemCall("munmap", munmap(addr_, length_));
+        } catch (const exception& e) {
+            cerr << "Exception destructing MMap_Region: " << e.what() << endl;
+        }
+    }
+}
+
+MappedFile::MappedFile(const string& path)
+    : region_([&] {
+          FileDescriptor fd{
+              CheckSystemCall("open " + path, open(path.c_str(), O_RDONLY))};
+
+          struct stat info;
+          CheckSystemCall("fstat " + path, fstat(fd.fd_num(), &info));
+
+          if (info.st_size == 0) {
+              throw runtime_error("cannot map empty file: " + path);
+          }
+
+          /* the mapping outlives the descriptor */
+          return MMap_Region{nullptr, static_cast<size_t>(info.st_size),
+                             PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                             fd.fd_num()};
+      }()) {}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <string>
+
+namespace pbrt {
+
+class MMap_Region {
+    char* addr_;
+    size_t length_;
+
+  public:
+    MMap_Region(char* const addr, const size_t length, const int prot,
+                const int flags, const int fd, const off_t offset = 0);
+
+    ~MMap_Region();
+
+    MMap_Region(MMap_Region&& other)
+        : addr_(other.addr_), length_(other.length_) {
+        other.addr_ = nullptr;
+        other.length_ = 0;
+    }
+
+    MMap_Region& operator=(MMap_Region&& other) {
+        addr_ = other.addr_;
+        length_ = other.length_;
+
+        other.addr_ = nullptr;
+        other.length_ = 0;
+
+        return *this;
+    }
+
+    /* Disallow copying */
+    MMap_Region(const MMap_Region& other) = delete;
+    MMap_Region& operator=(const MMap_Region& other) = delete;
+
+    char* addr() const { return addr_; }
+    size_t length() const { return length_; }
+};
+
+/* A whole file, mapped copy-on-write: pages are read in lazily on first
+ * access, and writes (if any) stay private to this process. */
+class MappedFile {
+    MMap_Region region_;
+
+  public:
+    explicit MappedFile(const std::string& path);
+
+    char* data() const { return region_.addr(); }
+    size_t size() const { return region_.length(); }
+};
+
+}  // namespace pbrt
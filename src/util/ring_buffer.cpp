@@ -11,25 +11,6 @@
 using namespace std;
 using namespace pbrt;
 
-MMap_Region::MMap_Region(char* const addr, const size_t length, const int prot,
-                         const int flags, const int fd, const off_t offset)
-    : addr_(static_cast<char*>(mmap(addr, length, prot, flags, fd, offset))),
-      length_(length) {
-    if (addr_ == MAP_FAILED) {
-        throw unix_error("mmap");
-    }
-}
-
-MMap_Region::~MMap_Region() {
-    if (addr_) {
-        try {
-            CheckSystemCall("munmap", munmap(addr_, length_));
-        } catch (const exception& e) {
-            cerr << "Exception destructing MMap_Region: " << e.what() << endl;
-        }
-    }
-}
-
 RingBuffer::RingBuffer(const size_t capacity)
     : fd_([&] {
           if (capacity % sysconf(_SC_PAGESIZE)) {
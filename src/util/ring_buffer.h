@@ -3,44 +3,11 @@
 #include <vector>
 
 #include "file_descriptor.h"
+#include "mmap.h"
 #include "simple_string_span.h"
 
 namespace pbrt {
 
-class MMap_Region {
-    char* addr_;
-    size_t length_;
-
-  public:
-    MMap_Region(char* const addr, const size_t length, const int prot,
-                const int flags, const int fd, const off_t offset = 0);
-
-    ~MMap_Region();
-
-    MMap_Region(MMap_Region&& other)
-        : addr_(other.addr_), length_(other.length_) {
-        other.addr_ = nullptr;
-        other.length_ = 0;
-    }
-
-    MMap_Region& operator=(MMap_Region&& other) {
-        addr_ = other.addr_;
-        length_ = other.length_;
-
-        other.addr_ = nullptr;
-        other.length_ = 0;
-
-        return *this;
-    }
-
-    /* Disallow copying */
-    MMap_Region(const MMap_Region& other) = delete;
-    MMap_Region& operator=(const MMap_Region& other) = delete;
-
-    char* addr() const { return addr_; }
-    size_t length() const { return length_; }
-};
-
 class RingBuffer {
     size_t next_index_to_write_ = 0;
     size_t bytes_stored_ = 0;
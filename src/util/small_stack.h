@@ -0,0 +1,67 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+#ifndef PBRT_UTIL_SMALL_STACK_H
+#define PBRT_UTIL_SMALL_STACK_H
+
+#include <cstddef>
+#include <vector>
+
+namespace pbrt {
+
+/* a stack that keeps its first N entries inline and spills the rest onto
+ * the heap, so that it never overflows but only allocates when it gets
+ * deeper than usual */
+template <class T, size_t N>
+class SmallStack {
+  private:
+    T inline_[N];
+    std::vector<T> spilled_{};
+    size_t size_{0};
+
+  public:
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    T &operator[](const size_t i) {
+        return i < N ? inline_[i] : spilled_[i - N];
+    }
+
+    const T &operator[](const size_t i) const {
+        return i < N ? inline_[i] : spilled_[i - N];
+    }
+
+    T &top() { return (*this)[size_ - 1]; }
+    const T &top() const { return (*this)[size_ - 1]; }
+
+    void push(const T &value) {
+        if (size_ < N) {
+            inline_[size_] = value;
+        } else {
+            spilled_.push_back(value);
+        }
+
+        size_++;
+    }
+
+    T pop() {
+        size_--;
+        if (size_ < N) return inline_[size_];
+
+        T value = spilled_.back();
+        spilled_.pop_back();
+        return value;
+    }
+
+    /* new entries are value-initialized */
+    void resize(const size_t size) {
+        for (size_t i = size_; i < size && i < N; i++) inline_[i] = T();
+        spilled_.resize(size > N ? size - N : 0);
+        size_ = size;
+    }
+
+    void clear() { resize(0); }
+};
+
+}  // namespace pbrt
+
+#endif /* PBRT_UTIL_SMALL_STACK_H */